@@ -46,6 +46,32 @@
 //    [1]       : Evaluation context (more precisely, the Scope for it)
 //    [2..N]    : Local variables, temporaries, output slots
 //    [-1..-M]  : Input arguments, captured values (closure)
+//
+//   Once generated, the graph of 'Op' is also encoded as a flat array of
+//   'Instr' in the owning 'Code', where 'success' and 'fail' are indexes
+//   in the array. 'Code::Execute' runs that array with a threaded dispatch
+//   loop, avoiding a virtual call and a pointer chase for each instruction.
+//   The 'bytecode_threaded' tweak selects between the two representations.
+//
+//   Before encoding, 'Code::Optimize' runs a few passes on the graph of
+//   'Op', each of which can be disabled with a 'bytecode_opt_...' tweak.
+//
+//   The frames of procedure calls are carved from a per-thread 'FrameStack'
+//   rather than the heap. Input arguments and closure data are owned by
+//   the caller for the duration of the call, and are not reference counted.
+//
+//   A call site that is run repeatedly asks its 'Procedure' for a variant
+//   specialized for the kinds of the inputs it passes, e.g. naturals.
+//   The variant is only run if a guard checking these kinds passes.
+//
+//   With -tbytecode_profile, each 'Op' counts how many times it ran and
+//   the cycles spent in it, excluding the code it calls. The listing of
+//   the procedures that ran shows these counts next to each instruction,
+//   and -bytecode_profile_csv exports them for other tools.
+//
+//   Once a program ran, the procedures compiled for it are written to a
+//   per-user 'CodeCache', and the next run of the same program loads them
+//   instead of compiling again, as long as no source file changed.
 
 #include "tree.h"
 #include "context.h"
@@ -58,14 +84,17 @@
 XL_BEGIN
 
 struct Op;                     // An individual operation
+struct Instr;                  // Compact encoding of an operation
 struct Code;                   // A sequence of operations
 struct Procedure;              // Internal representation of functions
 struct CallOp;                 // A call operation
 struct CodeBuilder;            // Code generator
 typedef std::vector<Op *> Ops; // Sequence of operations
+typedef std::vector<Instr> Instrs; // Flat encoding of a sequence
 typedef std::map<Tree *, int>  TreeIDs;
 typedef std::map<Tree *, Op *> TreeOps;
 typedef std::vector<int>       ParmOrder;
+typedef std::vector<kind>      Kinds;
 typedef Tree_p *               Data;
 
 
@@ -101,6 +130,39 @@ public:
 //
 // ============================================================================
 
+struct Instr
+// ----------------------------------------------------------------------------
+//   Compact encoding of an operation in a flat instruction array
+// ----------------------------------------------------------------------------
+//   'success', 'fail' and 'other' index the same array, END to return.
+//   'op' is the operation this was encoded from. It owns 'value', and
+//   runs the instructions that have no compact encoding (GENERIC).
+{
+    enum opcode_t
+    {
+#define INSTR(Name, Descr)              Name,
+#define NATURAL(Name, Opcode, Result)   Name, Name##_CONST, Name##_CONST_LEFT,
+#include "bytecode.tbl"
+        INSTR_COUNT
+    };
+    enum { END = ~0U };
+
+    Instr(Op *op)
+        : opcode(GENERIC), a(0), b(0),
+          success(END), fail(END), other(END), value(nullptr), op(op) {}
+
+    opcode_t            opcode;         // Instruction to execute
+    int                 a, b;           // Operands (indexes in data)
+    uint                success;        // Next instruction on success
+    uint                fail;           // Next instruction on failure
+    uint                other;          // Third exit, e.g. on a mismatch
+    Tree *              value;          // Constant operand
+    Op *                op;             // Original operation
+
+    static kstring      name[INSTR_COUNT];
+};
+
+
 struct Op
 // ----------------------------------------------------------------------------
 //   An individual operation
@@ -108,16 +170,19 @@ struct Op
 {
 public:
     Op *                success;
+    ulonglong           runs;           // Executions, with -tbytecode_profile
+    ulonglong           cycles;         // Time spent in this op, idem
 public:
     // The action to perform
     virtual Op *        Run(Data data XL_UNUSED) { return success; }
 
 public:
-                        Op()                    : success(nullptr) {}
+                        Op(): success(nullptr), runs(0), cycles(0) {}
     virtual             ~Op()                   {}
     virtual Op *        Fail()                  { return nullptr; }
     virtual void        Dump(std::ostream &out) { out << OpID(); }
     virtual kstring     OpID()                  { return "op"; }
+    virtual void        Encode(Instr &instr XL_UNUSED) {}
 };
 
 
@@ -130,6 +195,10 @@ struct Code : public Op, Info
     Tree_p              self;
     Op *                ops;
     Ops                 instrs;
+    Instrs              bytecode;
+    uint                entry;
+    enum pass_t         { FOLD, CHECKS, JUMPS, DEAD, FUSE, KINDS, PASSES };
+    uint                optimized[PASSES];      // Changes made by each pass
 public:
     Code(Context *, Tree *self);
     Code(Context *, Tree *self, Op *instr);
@@ -137,12 +206,28 @@ public:
 
     virtual Op *        Run(Data data);
 
-    void                SetOps(Op **ops, Ops *instr, uint outId);
+    void                SetOps(Op **ops, Ops *instr, uint outId,
+                               bool optimize = true);
+    void                Optimize();
+    void                Encode();
+    void                Execute(Data data, uint pc);
+    template <bool profile>
+    void                Dispatch(Data data, uint pc);
+    static void         RunOps(Op *op, Data data);
+    static uint         Index(Op *op);
+    static ulonglong    executed;
+    static ulonglong    optimizations[PASSES];  // Total changes by each pass
+    static kstring      passNames[PASSES];
     virtual void        Dump(std::ostream &out);
-    static void         Dump(std::ostream &out, Op *ops, Ops &instrs);
+    void                DumpProfile(std::ostream &out);
+    static void         Dump(std::ostream &out, Op *ops, Ops &instrs,
+                             Instrs *encoded = nullptr);
+    static void         ShowProfile(std::ostream &out);
+    static void         ExportProfile(std::ostream &out);
     static text         Ref(Op *op, text sep, text set, text null);
     virtual uint        Inputs()        { return 0; }
     virtual uint        Locals()        { return 0; }
+    virtual Kinds *     InputKinds()    { return nullptr; }
     virtual kstring     OpID()          { return "code"; }
 };
 
@@ -154,6 +239,11 @@ struct Procedure : Code
 {
     uint                nInputs, nLocals;
     TreeList            captured;
+    TreeIDs             inputIDs;       // Parameters, to compile variants
+    Tree_p              type;           // Result type, to compile variants
+    Procedure *         generic;        // For a variant, the generic code
+    Kinds               guard;          // For a variant, the input kinds
+    std::vector<Procedure *> variants;  // Variants specialized by kinds
 public:
     Procedure(Context *context, Tree *self, uint nInputs, uint nLocals);
     Procedure(Procedure *original, Data data, ParmOrder &capture);
@@ -163,8 +253,14 @@ public:
     virtual void        Dump(std::ostream &out);
     virtual uint        Inputs()        { return nInputs; }
     virtual uint        Locals()        { return nLocals; }
+    virtual Kinds *     InputKinds()    { return generic ? &guard : nullptr; }
     virtual kstring     OpID()          { return "function"; }
 
+    int                 Specialize(Data args);  // Index in 'variants'
+    bool                Guard(Data args);
+    static ulonglong    variantsBuilt, guardHits, guardFailures;
+    static ulonglong    sitesRespecialized;
+
     uint                Closures()      { return captured.size(); }
     Tree_p *            ClosureData()   { return &captured[0]; }
     uint                OffsetSize()    { return Inputs() + Closures(); }
@@ -172,6 +268,85 @@ public:
 };
 
 
+struct FrameStack
+// ----------------------------------------------------------------------------
+//   Per-thread segmented stack holding the frames of procedure calls
+// ----------------------------------------------------------------------------
+//   Frames are carved and released in LIFO order. Slots are kept null
+//   while unused, so allocating a frame only moves the top of stack.
+//   The first 'borrowed' slots of a frame hold values owned by the caller,
+//   which outlive the call. They are not reference counted.
+{
+    FrameStack();
+    ~FrameStack();
+
+    Data                Allocate(uint size);
+    void                Borrow(Data slot, Tree *value);
+    void                Release(Data frame, uint size, uint borrowed);
+    static FrameStack & Current();
+
+    static ulonglong    peak;           // Peak number of slots in use
+
+private:
+    struct Segment
+    {
+        Tree_p *        base;
+        uint            size;
+        uint            used;
+    };
+    std::vector<Segment> segments;
+    uint                top;            // Index of current segment
+    ulonglong           depth;          // Total slots in use
+};
+
+
+struct Frame
+// ----------------------------------------------------------------------------
+//   A frame on the current thread's stack, released when going out of scope
+// ----------------------------------------------------------------------------
+{
+    Frame(uint size, uint borrowed)
+        : stack(FrameStack::Current()),
+          data(stack.Allocate(size)), size(size), borrowed(borrowed) {}
+    ~Frame()    { if (data) stack.Release(data, size, borrowed); }
+
+    FrameStack &        stack;
+    Data                data;
+    uint                size;
+    uint                borrowed;
+};
+
+
+
+struct CodeCache
+// ----------------------------------------------------------------------------
+//   On-disk cache of the procedures compiled for a program
+// ----------------------------------------------------------------------------
+//   The cache file is named after the paths of the loaded source files and
+//   the index of the program, so that it is overwritten when they change.
+//   It holds a key that identifies both the program and the global context
+//   it was compiled in, i.e. the contents of all loaded source files, the
+//   opcodes of this build and the tweaks that change the generated code.
+{
+    CodeCache(Tree *program);
+
+    Procedure *         Load(Context *context);
+    bool                Save(Procedure *proc);
+    static text         Directory();
+    static bool         MakeDirectory(text dir);
+    static text         FullPath(text file);
+    static text         TemporaryPath(text file);
+
+    static ulonglong    loaded, saved, rejected, stale;
+
+private:
+    Tree_p              program;
+    uint                index;          // Index of program in source files
+    ulonglong           key;            // Program and context version
+    text                path;           // Cache file, empty if disabled
+};
+
+
 
 // ============================================================================
 //
@@ -190,6 +365,8 @@ public:
 
 public:
     Procedure * Compile(Context *context,Tree *tree,TreeIDs &parms,Tree *type);
+    Procedure * Specialize(Procedure *generic, Kinds &kinds);
+    bool        Build(Procedure *proc, TreeIDs &parms, Tree *type);
     Op *        CompileInternal(Context *context, Tree *what, bool defer);
     bool        Instructions(Context *context, Tree *tree);
 
@@ -214,7 +391,7 @@ public:
     int         Evaluate(Context *, Tree *, bool deferEval = false);
     int         EvaluationTemporary(Tree *);
     void        Enclose(Context *context, Scope *old, Tree *what);
-    int         Bind(Name *name, Tree *value, Tree *type=nullptr);
+    int         Bind(Name *name, Tree *value, int valueID, Tree *type=nullptr);
     CallOp *    Call(Context *context, Tree *value, Tree *type,
                      TreeIDs &inputs, ParmOrder &parms);
 
@@ -225,7 +402,7 @@ public:
     // Adding an opcode
     void        Add(Op *op);
     void        AddEval(int id, Op *op);
-    void        AddTypeCheck(Context *, Tree *value, Tree *type);
+    void        AddTypeCheck(Context *, Tree *value, Tree *type, int id = 0);
 
     // Success at end of declaration
     void        Success();
@@ -312,7 +489,7 @@ inline Tree *DataArg(Data data, uint index)
 //    Return the Nth input argument
 // ----------------------------------------------------------------------------
 {
-    return data[~index];
+    return data[~int(index)];
 }
 
 
@@ -99,6 +99,7 @@ struct Errors
     Errors(kstring m, Tree *a);
     Errors(kstring m, Tree *a, Tree *b);
     Errors(kstring m, Tree *a, Tree *b, Tree *c);
+    explicit Errors(Errors *parent);
     ~Errors();
 
     void                Clear();
@@ -115,6 +116,7 @@ struct Errors
     Errors *            parent;
     ulong               count;
     ulong               context;
+    bool                current;        // Was set as MAIN->errors
     static Tree_p       aborting;
 };
 
@@ -50,6 +50,9 @@ public:
 
     virtual Tree *      Evaluate(Scope *, Tree *source) = 0;
     virtual Tree *      TypeCheck(Scope *, Tree *type, Tree *value) = 0;
+
+    // Check if declarations updated while running take effect on calls
+    virtual bool        Reloadable()    { return false; }
 };
 
 XL_END
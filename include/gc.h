@@ -324,6 +324,7 @@ struct GarbageCollector
     static bool                 Running()       { return gc->running; }
     static bool                 SafePoint();
     static bool                 Sweep();
+    static void                 Serialize(bool serialize);
 
     static void *               DebugPointer(void *ptr);
 
@@ -408,8 +409,11 @@ inline bool TypeAllocator::IsGarbageCollected(void *ptr)
 // ----------------------------------------------------------------------------
 //   Tell if a pointer is managed by the garbage collector
 // ----------------------------------------------------------------------------
+//   The range only grows, and a thread only tests pointers that it allocated
+//   or received after they were allocated, so a stale value is still right.
 {
-    return ptr >= lowestAddress && ptr <= highestAddress;
+    return ptr >= __atomic_load_n(&lowestAddress, __ATOMIC_RELAXED)
+        && ptr <= __atomic_load_n(&highestAddress, __ATOMIC_RELAXED);
 }
 
 
@@ -56,6 +56,7 @@ public:
 
     Tree *              Evaluate(Scope *, Tree *source) override;
     Tree *              TypeCheck(Scope *, Tree *type, Tree *value) override;
+    bool                Reloadable() override   { return true; }
 
 public:
     static Tree *       EvaluateClosure(Context *context, Tree *code);
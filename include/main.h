@@ -61,6 +61,7 @@ XL_BEGIN
 struct Serializer;
 struct Deserializer;
 struct Compiler;
+struct ParsedFile;
 
 
 struct SourceFile
@@ -79,9 +80,12 @@ struct SourceFile
     uint64      hash;
     bool        changed;
     bool        readOnly;
+    TreeList    retired;        // Replaced by a refresh, may still be running
 };
 typedef std::map<text, SourceFile> source_files;
+typedef std::map<int, text> watch_list;
 typedef std::vector<text> source_names, path_list;
+typedef std::map<text, ParsedFile *> parsed_files;
 
 
 struct Main
@@ -110,8 +114,12 @@ struct Main
     Errors *            InitMAIN();
     int                 ParseOptions();
     int                 LoadFiles();
+    int                 ParseFiles();
     virtual int         LoadFile(text file, text modname="");
     int                 Run();
+    Tree *              Stream(SourceFile &sf);
+    bool                Reload(SourceFile &sf);
+    void                Watch();
 
     // Error checking
     void                Log(Error &e)   { errors->Log(e); }
@@ -144,6 +152,10 @@ public:
     Renderer            renderer;
     source_files        files;
     source_names        file_names;
+    parsed_files        parsed;
+    int                 watcher;
+    watch_list          watched;
+    double              refreshed;
     Deserializer *      reader;
     Serializer   *      writer;
     Evaluator *         evaluator;
@@ -157,12 +169,15 @@ extern NaturalOption    optimize;
 extern NaturalOption    remoteForks;
 extern TextOption       stylesheet;
 extern BooleanOption    emitIR;
+extern TextOption       emitObject;
+extern BooleanOption    stream;
 }
 
 XL_END
 
 RECORDER_DECLARE(fileload);
 RECORDER_DECLARE(main);
+RECORDER_DECLARE(refresh);
 RECORDER_TWEAK_DECLARE(gc_statistics);
 RECORDER_TWEAK_DECLARE(dump_on_exit);
 
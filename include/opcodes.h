@@ -141,6 +141,8 @@ public:
     virtual Opcode *            Clone() = 0;
     virtual Op *                Run(Data data) = 0;
     virtual void                SetParms(ParmOrder &parms XL_UNUSED)  { }
+    virtual bool                GetParms(ParmOrder &parms XL_UNUSED) { return false; }
+    virtual bool                Pure(ParmOrder &reads XL_UNUSED) { return false; }
 
 public:
     static void                 Enter(Context *context);
@@ -236,6 +238,11 @@ struct InfixOpcode : Opcode
         out << "infix\t" << infix;
     }
 
+    // Run on the given operands rather than data slots (superinstructions)
+    virtual Op *        Compute(Data data, Tree *left, Tree *right) = 0;
+    virtual void        Operands(int &left, int &right) = 0;
+    virtual void        Encode(Instr &instr);   // See bytecode.tbl
+
     kstring     infix;
     Name_p &    leftTy;
     Name_p &    rightTy;
@@ -572,6 +579,16 @@ XL_END
         {                                                               \
             XL_ASSERT(parms.size() == 1);                               \
             argID = parms[0];                                           \
+        }                                                               \
+        virtual bool GetParms(ParmOrder &parms)                         \
+        {                                                               \
+            parms.push_back(argID);                                     \
+            return true;                                                \
+        }                                                               \
+        virtual bool Pure(ParmOrder &reads)                             \
+        {                                                               \
+            reads.push_back(argID);                                     \
+            return true;                                                \
         }                                                               \
                                                                         \
         int argID;                                                      \
@@ -590,13 +607,26 @@ XL_END
             : InfixOpcode(#BName,                                       \
                           LeftTy##_type, RightTy##_type, ResTy##_type), \
               leftID(leftID), rightID(rightID) {}                       \
-        virtual Op *Run(Data data)                                      \
+        Op *Apply(Data data, Tree *leftArg, Tree *rightArg)             \
         {                                                               \
-            ARG(left, LeftTy, data[leftID]);                            \
-            ARG(right, RightTy, data[rightID]);                         \
+            ARG(left, LeftTy, leftArg);                                 \
+            ARG(right, RightTy, rightArg);                              \
             Code;                                                       \
             return success;                                             \
         }                                                               \
+        virtual Op *Run(Data data)                                      \
+        {                                                               \
+            return Apply(data, data[leftID], data[rightID]);            \
+        }                                                               \
+        virtual Op *Compute(Data data, Tree *leftArg, Tree *rightArg)   \
+        {                                                               \
+            return Apply(data, leftArg, rightArg);                      \
+        }                                                               \
+        virtual void Operands(int &leftOp, int &rightOp)                \
+        {                                                               \
+            leftOp = leftID;                                            \
+            rightOp = rightID;                                          \
+        }                                                               \
         virtual kstring OpID()  { return #BName; }                      \
         virtual void Dump(std::ostream &out)                            \
         {                                                               \
@@ -612,6 +642,18 @@ XL_END
             leftID = parms[0];                                          \
             rightID = parms[1];                                         \
         }                                                               \
+        virtual bool GetParms(ParmOrder &parms)                         \
+        {                                                               \
+            parms.push_back(leftID);                                    \
+            parms.push_back(rightID);                                   \
+            return true;                                                \
+        }                                                               \
+        virtual bool Pure(ParmOrder &reads)                             \
+        {                                                               \
+            reads.push_back(leftID);                                    \
+            reads.push_back(rightID);                                   \
+            return true;                                                \
+        }                                                               \
         int leftID, rightID;                                            \
     };                                                                  \
                                                                         \
@@ -628,13 +670,26 @@ XL_END
             : InfixOpcode(Symbol,                                       \
                           LeftTy##_type, RightTy##_type, ResTy##_type), \
               leftID(leftID), rightID(rightID) {}                       \
-        virtual Op *Run(Data data)                                      \
+        Op *Apply(Data data, Tree *leftArg, Tree *rightArg)             \
         {                                                               \
-            ARG(left, LeftTy, data[leftID]);                            \
-            ARG(right, RightTy, data[rightID]);                         \
+            ARG(left, LeftTy, leftArg);                                 \
+            ARG(right, RightTy, rightArg);                              \
             Code;                                                       \
             return success;                                             \
         }                                                               \
+        virtual Op *Run(Data data)                                      \
+        {                                                               \
+            return Apply(data, data[leftID], data[rightID]);            \
+        }                                                               \
+        virtual Op *Compute(Data data, Tree *leftArg, Tree *rightArg)   \
+        {                                                               \
+            return Apply(data, leftArg, rightArg);                      \
+        }                                                               \
+        virtual void Operands(int &leftOp, int &rightOp)                \
+        {                                                               \
+            leftOp = leftID;                                            \
+            rightOp = rightID;                                          \
+        }                                                               \
         virtual kstring OpID()  { return #IName; }                      \
         virtual void Dump(std::ostream &out)                            \
         {                                                               \
@@ -650,6 +705,12 @@ XL_END
             leftID = parms[0];                                          \
             rightID = parms[1];                                         \
         }                                                               \
+        virtual bool GetParms(ParmOrder &parms)                         \
+        {                                                               \
+            parms.push_back(leftID);                                    \
+            parms.push_back(rightID);                                   \
+            return true;                                                \
+        }                                                               \
         int leftID, rightID;                                            \
     };                                                                  \
                                                                         \
@@ -694,6 +755,11 @@ XL_END
             XL_ASSERT(parms.size() == 1);                               \
             argID = parms[0];                                           \
         }                                                               \
+        virtual bool GetParms(ParmOrder &parms)                         \
+        {                                                               \
+            parms.push_back(argID);                                     \
+            return true;                                                \
+        }                                                               \
         int argID;                                                      \
     };                                                                  \
                                                                         \
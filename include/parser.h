@@ -111,31 +111,54 @@ public:
         : scanner(name, stx, pos, err),
           syntax(stx), errors(err), pending(tokNONE),
           openquote(), closequote(), comments(), commented(nullptr),
-          hadSpaceBefore(false), hadSpaceAfter(false), beginningLine(true) {}
+          hadSpaceBefore(false), hadSpaceAfter(false), beginningLine(true),
+          fixedSyntax(false), syntaxChanged(false),
+          streaming(false), ended(false), nodes(0), parsing(0.0) {}
     Parser(std::istream &input, Syntax &stx, Positions &pos, Errors &err,
            kstring name="<stream>")
         : scanner(input, stx, pos, err, name),
           syntax(stx), errors(err), pending(tokNONE),
           openquote(), closequote(), comments(), commented(nullptr),
-          hadSpaceBefore(false), hadSpaceAfter(false), beginningLine(true) {}
+          hadSpaceBefore(false), hadSpaceAfter(false), beginningLine(true),
+          fixedSyntax(false), syntaxChanged(false),
+          streaming(false), ended(false), nodes(0), parsing(0.0) {}
+    Parser(SourceBuffer &source, Syntax &stx, Positions &pos, Errors &err,
+           kstring name="<buffer>")
+        : scanner(source, stx, pos, err, name),
+          syntax(stx), errors(err), pending(tokNONE),
+          openquote(), closequote(), comments(), commented(nullptr),
+          hadSpaceBefore(false), hadSpaceAfter(false), beginningLine(true),
+          fixedSyntax(false), syntaxChanged(false),
+          streaming(false), ended(false), nodes(0), parsing(0.0) {}
     Parser(Scanner &scanner, Syntax *stx)
         : scanner(scanner),
           syntax(stx ? *stx : scanner.InputSyntax()),
           errors(scanner.InputErrors()),
           pending(tokNONE),
           openquote(), closequote(), comments(), commented(nullptr),
-          hadSpaceBefore(false), hadSpaceAfter(false), beginningLine(true) {}
+          hadSpaceBefore(false), hadSpaceAfter(false), beginningLine(true),
+          fixedSyntax(false), syntaxChanged(false),
+          streaming(false), ended(false), nodes(0), parsing(0.0) {}
+
+    ~Parser();
 
 public:
     Tree *              Parse(text closing_paren = "",
                               text opening_paren = "",
                               ulong opening_pos = 0);
+    Tree *              NextStatement();
     Scanner *           ParserScanner()         { return &scanner; }
     token_t             NextToken();
     void                AddComment(text c)      { comments.push_back(c); }
     void                AddComments(Tree *, bool before);
 
+    // Stop at the first syntax statement instead of changing the syntax
+    void                FixedSyntax(bool f)     { fixedSyntax = f; }
+    bool                SyntaxChanged()         { return syntaxChanged; }
+
 private:
+    void                Statistics();
+
     Scanner             scanner;
     Syntax &            syntax;
     Errors &            errors;
@@ -144,6 +167,10 @@ private:
     CommentsList        comments;
     Tree *              commented;
     bool                hadSpaceBefore, hadSpaceAfter, beginningLine;
+    bool                fixedSyntax, syntaxChanged;
+    bool                streaming, ended;
+    ulong               nodes;          // Nodes parsed, for statistics
+    double              parsing;        // Time spent parsing, in seconds
 };
 
 
@@ -42,6 +42,9 @@
 #include "tree.h"
 #include <recorder/recorder.h>
 #include <ostream>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 
 
 RECORDER_TWEAK_DECLARE(recorder_dump_symbolic);
@@ -55,6 +58,56 @@ typedef std::pair<std::streampos, std::streampos>  stream_range;
 typedef std::vector<stream_range>                  stream_ranges;
 typedef std::map<text, stream_ranges>              highlight_result;
 
+struct StyleSheet
+// ----------------------------------------------------------------------------
+//   A style sheet compiled for rendering
+// ----------------------------------------------------------------------------
+//   Each format is compiled into a flat program, where references to other
+//   formats are resolved ahead of time. The formats for each kind of node
+//   are indexed by operator name or delimiters, and those for characters
+//   by character, so that rendering does not build keys to find them.
+{
+    enum Opcode
+    {
+        opVERBATIM, opTEXT, opINDENT, opUNINDENT, opINDENTS,
+        opSELF, opQUOTED_SELF, opUNINDENTED_SELF,
+        opLEFT, opRIGHT, opOPENING, opCLOSING,
+        opSPACE, opSEPARATOR, opNEWLINE, opCALL, opUNDECLARED, opUNKNOWN
+    };
+    struct Op
+    {
+        Op(Opcode opcode, text value = "", int format = NONE)
+            : opcode(opcode), value(value), format(format) {}
+        Opcode          opcode;
+        text            value;          // Text to render or directive name
+        int             format;         // Format called by opCALL
+    };
+    typedef std::vector<Op>                     Program;
+    typedef std::unordered_map<text, int>       Index;
+    enum { NONE = -1 };
+
+    StyleSheet(formats_table &formats);
+
+    int                 Find(const text &key) const;
+    int                 Find(const Index &index, const text &key) const;
+    void                Compile(Tree *format, Program &program);
+
+    std::vector<Program> programs;
+    Index               all;            // All formats by name
+    Index               infix;          // "infix X" by operator X
+    Index               prefix;         // "prefix X" by name X
+    Index               postfix;        // "postfix X" by name X
+    Index               block;          // "block O C" by "O C"
+    Index               texts[2];       // "text O C" and "longtext O C"
+    int                 chars[256];     // Format for each character
+    int                 quoted[256];    // Format for quoted characters
+    int                 cr, space, indents;
+    int                 infixDefault, prefixDefault, postfixDefault;
+    int                 blockDefault, textDefault[2];
+};
+typedef std::shared_ptr<StyleSheet> StyleSheet_p;
+
+
 struct Renderer
 // ----------------------------------------------------------------------------
 //   Render a tree to some ostream
@@ -75,6 +128,8 @@ struct Renderer
     void                RenderText(text format);
     void                RenderIndents();
     void                RenderFormat(Tree *format);
+    void                RenderFormat(const StyleSheet::Program &program);
+    void                RenderFormat(int format);
     void                RenderFormat(text self, text format);
     void                RenderFormat(text self, text format, text generic);
     void                RenderFormat(text self, text f, text g1, text g2);
@@ -86,7 +141,7 @@ struct Renderer
 protected:
     std::ostream &      output;
     Syntax &            syntax;
-    formats_table       formats;
+    StyleSheet_p        style;
     uint                indent;
     text                self;
     Tree_p              left;
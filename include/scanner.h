@@ -103,12 +103,25 @@
   under-utilized, since an end-of-comment is always an end of line.
   XL doesn't in the current definition feature multi-line comment. Because
   multi-line comments are evil, that's why. See this comment for example.
+
+
+  INPUT:
+
+  Files are normally memory-mapped, and text given as a contiguous buffer
+  is scanned in place. In that case, the scanner works with pointers in
+  the source, and the text of most names, numbers and texts is copied once
+  from the source when the token is complete. Runs of spaces, names,
+  texts and comments are delimited using vector instructions when the
+  target has them. Other input, such as the standard input or sockets,
+  is read through a std::istream.
 */
 
 #include "base.h"
 #include <recorder/recorder.h>
 #include <string>
 #include <vector>
+#include <cstdio>
+#include <mutex>
 #include <iostream>
 #include <fstream>
 
@@ -157,7 +170,7 @@ struct Positions
                         Positions(): positions(), current_position(0) {}
                         ~Positions() {}
 
-    ulong               OpenFile(text name);
+    ulong               OpenFile(text name, ulong size = 0);
     void                CloseFile (ulong pos);
 
     void                GetFile(ulong pos, text *file, ulong *offset);
@@ -167,12 +180,82 @@ struct Positions
 private:
     struct Range
     {
-        Range(ulong s, text f): start(s), file(f) {}
+        Range(ulong s, text f): start(s), file(f), loaded(false) {}
+        void    Load();
         ulong   start;
         text    file;
+        text    source;         // Contents of the file, read on first query
+        std::vector<ulong> lines; // Offset of the start of each line
+        bool    loaded;
     };
+    Range *             Find(ulong pos);
     std::vector<Range>  positions;
     ulong               current_position;
+    std::mutex          lock;
+};
+
+
+struct SourceBuffer
+// ----------------------------------------------------------------------------
+//   Contiguous source input, either memory-mapped or owned by the caller
+// ----------------------------------------------------------------------------
+//   The Get, Unget, Peek, Good and Eof functions behave like the
+//   corresponding std::istream functions reading from a file
+{
+    enum state_t { GOOD, END, BAD };
+
+                        SourceBuffer();
+                        SourceBuffer(const char *data, size_t size);
+                        ~SourceBuffer();
+
+    bool                Map(kstring fileName);
+    void                Unmap();
+
+    int                 Get()
+    {
+        if (cursor < end)
+            return (unsigned char) *cursor++;
+        state = END;
+        return EOF;
+    }
+    void                Unget()
+    {
+        if (state == END)
+            state = BAD;
+        else if (cursor > start)
+            cursor--;
+    }
+    int                 Peek()
+    {
+        if (cursor < end)
+            return (unsigned char) *cursor;
+        state = END;
+        return EOF;
+    }
+    bool                Good()          { return state == GOOD; }
+    bool                Eof()           { return state == END; }
+
+    // Direct access for scanning slices of the source
+    size_t              Size()          { return end - start; }
+    const char *        Cursor()        { return cursor; }
+    const char *        End()           { return end; }
+    void                Seek(const char *to)    { cursor = to; }
+    int                 Skip(const char *to)
+    {
+        // Move to 'to' as if reading up to it and putting back what follows
+        cursor = to;
+        if (to < end)
+            return (unsigned char) *to;
+        state = BAD;
+        return EOF;
+    }
+
+private:
+    const char *        start;
+    const char *        end;
+    const char *        cursor;
+    state_t             state;
+    size_t              mapped;
 };
 
 
@@ -185,6 +268,8 @@ public:
     Scanner(kstring fileName, Syntax &stx, Positions &pos, Errors &err);
     Scanner(std::istream &input, Syntax &stx, Positions &pos, Errors &err,
             kstring fileName = "<stream>");
+    Scanner(SourceBuffer &source, Syntax &stx, Positions &pos, Errors &err,
+            kstring fileName = "<buffer>");
     Scanner(const Scanner &parent);
     ~Scanner();
 
@@ -207,22 +292,40 @@ public:
     uint        Indent()                { return indent; }
     void        SetPosition(ulong pos)  { position = pos; }
     ulong       Position()              { return position; }
+    ulong       Tokens()                { return tokens; }
     bool        HadSpaceBefore()        { return hadSpaceBefore; }
     bool        HadSpaceAfter()         { return hadSpaceAfter; }
 
+    // Time in seconds, used for scanning and parsing statistics
+    static double Now();
+
     // Indent management
     uint        OpenParen();
     void        CloseParen(uint old);
 
     // Get input of the scanner
-    std::istream & Input()              { return input; }
     Positions    & InputPositions()     { return positions; }
     Errors       & InputErrors()        { return errors; }
     Syntax       & InputSyntax()        { return syntax; }
 
+private:
+    // Read characters from the stream or from the source buffer
+    int         Get()   { return source ? source->Get()  : input->get(); }
+    void        Unget() { if (source) source->Unget(); else input->unget(); }
+    int         Peek()  { return source ? source->Peek() : input->peek(); }
+    bool        Good()  { return source ? source->Good() : input->good(); }
+    bool        Eof()   { return source ? source->Eof()  : input->eof(); }
+
+    // Scanning slices of a source buffer
+    void        ScanNameSlice(int &c);
+    bool        ScanNumberSlice(int &c);
+    bool        ScanTextSlice(int &c);
+    void        Statistics();
+
 private:
     Syntax &       syntax;
-    std::istream & input;
+    std::istream * input;
+    SourceBuffer * source;
     text           tokenText;
     text           textValue;
     double         realValue;
@@ -241,6 +344,8 @@ private:
     bool           hadSpaceBefore;
     bool           hadSpaceAfter;
     bool           mustDeleteInput;
+    double         started;
+    ulong          tokens;
 };
 
 XL_END
@@ -41,6 +41,8 @@
 #include "tree.h"
 #include "action.h"
 #include <iostream>
+#include <vector>
+#include <unordered_map>
 
 
 XL_BEGIN
@@ -56,13 +58,14 @@ enum SerializationTag
     serialBLOCK, serialPREFIX, serialPOSTFIX, serialINFIX,
     serialINVALID,
 
-    serialVERSION = 0x0101,
-    serialMAGIC   = 0x05121968
+    serialVERSION   = 0x0101,
+    serialPOSITIONS = 0x0102,   // Version with positions after each tag
+    serialMAGIC     = 0x05121968
 };
 
 
-typedef std::map<text, longlong>        text_map;
-typedef std::map<longlong, text>        text_ids;
+typedef std::unordered_map<text, longlong> text_map;
+typedef std::vector<text>               text_ids;
 
 
 struct Serializer
@@ -72,7 +75,7 @@ struct Serializer
 {
     typedef Tree *value_type;
 
-    Serializer(std::ostream &out);
+    Serializer(std::ostream &out, TreePosition base = Tree::NOWHERE);
     ~Serializer() {}
 
     // Serialization of the canonical nodes
@@ -100,11 +103,14 @@ public:
     void        WriteSigned(longlong);
     void        WriteUnsigned(ulonglong);
     void        WriteReal(double);
-    void        WriteText(text);
+    void        WriteText(const text &);
     void        WriteChild(Tree *child);
+    void        WritePosition(Tree *what);
 
 protected:
     std::ostream &      out;
+    TreePosition        base;           // NOWHERE if not writing positions
+    longlong            last;           // Last position written
     text_map            texts;
 };
 
@@ -133,10 +139,13 @@ public:
     ulonglong   ReadUnsigned();
     double      ReadReal();
     text        ReadText();
+    TreePosition ReadPosition();
 
 protected:
     std::istream &      in;
     TreePosition        pos;
+    bool                positions;      // Positions relative to pos follow
+    longlong            last;           // Last position read
     text_ids            texts;
 };
 
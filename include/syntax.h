@@ -39,6 +39,7 @@
 
 #include <map>
 #include <set>
+#include <vector>
 #include "base.h"
 
 XL_BEGIN
@@ -61,16 +62,19 @@ struct Syntax
 public:
     Syntax():
         priority(0), default_priority(0),
-        statement_priority(100), function_priority(200) {}
+        statement_priority(100), function_priority(200),
+        entries(), mask(0), compiled(false) {}
     Syntax(Scanner &scanner):
         priority(0), default_priority(0),
-        statement_priority(100), function_priority(200)
+        statement_priority(100), function_priority(200),
+        entries(), mask(0), compiled(false)
     {
         ReadSyntaxFile(scanner);
     }
     Syntax(kstring name):
         priority(0), default_priority(0),
-        statement_priority(100), function_priority(200)
+        statement_priority(100), function_priority(200),
+        entries(), mask(0), compiled(false)
     {
         ReadSyntaxFile(name);
     }
@@ -79,15 +83,15 @@ public:
 
 public:
     // Managing priorities
-    int                 InfixPriority(text n);
+    int                 InfixPriority(const text &n);
     void                SetInfixPriority(text n, int p);
-    int                 PrefixPriority(text n);
+    int                 PrefixPriority(const text &n);
     void                SetPrefixPriority(text n, int p);
-    int                 PostfixPriority(text n);
+    int                 PostfixPriority(const text &n);
     void                SetPostfixPriority(text n, int p);
-    bool                KnownToken(text n);
-    bool                KnownPrefix(text n);
-    bool                KnownBinary(text n);
+    bool                KnownToken(const text &n);
+    bool                KnownPrefix(const text &n);
+    bool                KnownBinary(const text &n);
 
     // Read a complete syntax file (xl.syntax)
     void                ReadSyntaxFile (Scanner &scanner, uint indents = 1);
@@ -98,11 +102,40 @@ public:
     void                TextDelimiter(text Begin, text End);
     void                BlockDelimiter(text Begin, text End);
 
-    bool                IsComment(text Begin, text &end);
-    bool                IsTextDelimiter(text Begin, text &end);
-    bool                IsBlock(text Begin, text &end);
+    bool                IsComment(const text &Begin, text &end);
+    bool                IsTextDelimiter(const text &Begin, text &end);
+    bool                IsBlock(const text &Begin, text &end);
     bool                IsBlock(char Begin, text &end);
-    Syntax *            HasSpecialSyntax(text Begin, text &end);
+    Syntax *            HasSpecialSyntax(const text &Begin, text &end);
+
+    // Identify the syntax trees are parsed with, e.g. for cached trees
+    ulonglong           Fingerprint();
+
+private:
+    // The tables below, compiled in a flat hash table for the scanner
+    enum
+    {
+        KNOWN_TOKEN     = 1,
+        KNOWN_PREFIX    = 2,
+        KNOWN_BINARY    = 4,
+        COMMENT         = 8,
+        TEXT_DELIMITER  = 16,
+        BLOCK           = 32,
+        SPECIAL         = 64
+    };
+    struct Entry
+    {
+        Entry(): name(), infix(0), prefix(0), postfix(0), flags(0),
+                 used(false), comment(), textEnd(), block() {}
+        text            name;
+        int             infix, prefix, postfix;
+        uint            flags;
+        bool            used;
+        text            comment, textEnd, block;
+    };
+    void                Compile();
+    Entry *             Insert(const text &n);
+    const Entry *       Find(const text &n);
 
 public:
     priority_table      infix_priority;
@@ -122,6 +155,12 @@ public:
     int                 statement_priority;
     int                 function_priority;
 
+private:
+    std::vector<Entry>  entries;
+    uint                mask;
+    bool                compiled;
+
+public:
     static Syntax *     syntax;
 };
 
@@ -0,0 +1,127 @@
+#ifndef TIERED_H
+#define TIERED_H
+// *****************************************************************************
+// tiered.h                                                           XL project
+// *****************************************************************************
+//
+// File description:
+//
+//     Tiered evaluation, where rewrites start in the interpreter and
+//     are promoted to bytecode, then to machine code, as they get hot
+//
+//
+//
+//
+//
+//
+//
+// *****************************************************************************
+// This software is licensed under the GNU General Public License v3+
+// (C) 2020, Christophe de Dinechin <christophe@dinechin.org>
+// *****************************************************************************
+// This file is part of XL
+//
+// XL is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License,
+// or (at your option) any later version.
+//
+// XL is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with XL, in a file named COPYING.
+// If not, see <https://www.gnu.org/licenses/>.
+// *****************************************************************************
+//
+//  The interpreter counts how many times each rewrite is called, and how
+//  many of these calls come from the body of the rewrite itself, which is
+//  how loops are written in XL. Past the 'tier_bytecode' threshold, the
+//  body of the rewrite is compiled to bytecode, and the next call runs it.
+//  Since a loop iterates by calling itself again, a hot loop switches to
+//  the bytecode at its next iteration, which is our on-stack replacement.
+//  Past the 'tier_native' threshold, calls are compiled to machine code
+//  by the fast compiler, if XL was built with LLVM. The machine code is
+//  generated by background threads, and calls keep running the bytecode
+//  until it is ready, at which point they switch to the machine code.
+//
+//  Only calls whose arguments the interpreter evaluated to naturals leave
+//  the interpreter, and rewrites that read variables or declare local
+//  rewrites are not promoted. A rewrite that fails to compile at some
+//  tier stays at the tier below.
+
+#include "interpreter.h"
+#include "bytecode.h"
+
+
+XL_BEGIN
+
+struct TierInfo;
+#ifndef INTERPRETER_ONLY
+struct FastCompiler;
+#endif // INTERPRETER_ONLY
+
+class Tiered : public Evaluator
+// ----------------------------------------------------------------------------
+//   Evaluate in the interpreter, and promote hot rewrites to faster tiers
+// ----------------------------------------------------------------------------
+{
+public:
+    Tiered(kstring compilerName, int argc, char **argv);
+    virtual ~Tiered();
+
+    Tree *              Evaluate(Scope *, Tree *source) override;
+    Tree *              TypeCheck(Scope *, Tree *type, Tree *value) override;
+    bool                Reloadable() override   { return true; }
+
+public:
+    enum tier_t { INTERPRETED, BYTECODE, NATIVE };
+
+    // Called by the interpreter once the arguments are bound to 'parms'
+    Tree *              Call(Scope *evalScope, Scope *declScope,
+                             Tree *self, Infix *decl, Context *locals,
+                             TreeList &args, TreeList &parms, Tree *type);
+
+    // Start again from the interpreter after the body of 'decl' changed
+    static void         Invalidate(Infix *decl);
+
+    static kstring      TierName(tier_t tier);
+    static Tiered *     tiered;
+
+private:
+    bool                Promote(TierInfo *info, Scope *declScope,
+                                Context *locals,
+                                TreeList &args, TreeList &parms, Tree *type);
+    Tree *              RunBytecode(TierInfo *info, Scope *evalScope,
+                                    Tree *self, TreeList &args);
+#ifndef INTERPRETER_ONLY
+    Tree *              RunNative(TierInfo *info, Scope *declScope,
+                                  TreeList &args);
+    void                Patch(TierInfo *info, Scope *declScope,
+                              TreeList &args, bool loop);
+#endif // INTERPRETER_ONLY
+
+private:
+    Interpreter         interpreter;
+    Bytecode            bytecode;
+#ifndef INTERPRETER_ONLY
+    text                compilerName;
+    int                 argc;
+    char **             argv;
+    FastCompiler *      compiler;       // Created on first native promotion
+#endif // INTERPRETER_ONLY
+
+public:
+    static ulonglong    promoted[NATIVE+1];
+    static ulonglong    replaced;       // Promotions at a loop head
+    static ulonglong    failed;         // Promotions that did not compile
+    static ulonglong    background;     // Machine code generated later
+};
+
+XL_END
+
+RECORDER_DECLARE(tiered);
+
+#endif // TIERED_H
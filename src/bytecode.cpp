@@ -40,23 +40,183 @@
 #include "errors.h"
 #include "basics.h"
 #include "runtime.h"
+#include "serializer.h"
 
 #include <algorithm>
+#include <cerrno>
+#include <fstream>
 #include <sstream>
+#include <set>
+#include <tuple>
+#include <typeinfo>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+#ifdef CONFIG_MINGW
+#include <direct.h>
+#include <process.h>
+#endif // CONFIG_MINGW
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 
 RECORDER(bytecode_output, 64, "Output of the bytecode generator");
 RECORDER(bytecode, 64, "Byte code generation");
+RECORDER(bytecode_stats, 16, "Bytecode execution statistics");
+RECORDER(bytecode_profile, 16, "Profile of each bytecode instruction");
+RECORDER_TWEAK_DEFINE(bytecode_threaded, 1,
+                      "Run the flat bytecode encoding with threaded dispatch");
+RECORDER(bytecode_stack, 16, "Bytecode frame stack");
+RECORDER(bytecode_optimize, 64, "Bytecode optimization passes");
+RECORDER_TWEAK_DEFINE(bytecode_opt_fold, 1,
+                      "Fold bytecode opcodes and matches with constant inputs");
+RECORDER_TWEAK_DEFINE(bytecode_opt_checks, 1,
+                      "Remove bytecode type checks already done on the path");
+RECORDER_TWEAK_DEFINE(bytecode_opt_jumps, 1,
+                      "Thread bytecode jumps over evaluations already done");
+RECORDER_TWEAK_DEFINE(bytecode_opt_dead, 1,
+                      "Remove bytecode stores and values that are never used");
+RECORDER_TWEAK_DEFINE(bytecode_opt_fuse, 1,
+                      "Fuse bytecode argument loads, constants and matches");
+RECORDER_TWEAK_DEFINE(bytecode_stack_segment, 16384,
+                      "Number of slots in each segment of the frame stack");
+RECORDER(bytecode_variants, 32, "Bytecode variants specialized by kinds");
+RECORDER_TWEAK_DEFINE(bytecode_specialize, 2,
+                      "Calls or guard failures at a call site before "
+                      "specializing, 0 to disable");
+RECORDER_TWEAK_DEFINE(bytecode_max_variants, 4,
+                      "Maximum number of specialized variants per procedure");
+RECORDER(bytecode_cache, 32, "Persistent cache of compiled bytecode");
+RECORDER(bytecode_cache_stats, 16, "Persistent bytecode cache statistics");
+RECORDER_TWEAK_DEFINE(bytecode_persist, 0,
+                      "Keep compiled bytecode across runs in $XL_CACHE, "
+                      "or else $XDG_CACHE_HOME/xl or ~/.cache/xl");
 
 
 XL_BEGIN
 
+// ============================================================================
+//
+//   Options
+//
+// ============================================================================
+
+namespace Opt
+{
+TextOption      bytecodeProfile("bytecode_profile_csv",
+                                "Write the bytecode profile to a CSV file");
+}
+
+
+
 // ============================================================================
 //
 //    Main entry point
 //
 // ============================================================================
 
+struct CodeProfile
+// ----------------------------------------------------------------------------
+//   Attribute the cycles spent between two profiled ops to the first one
+// ----------------------------------------------------------------------------
+//   'current' is the op running on this thread. When code called by an op
+//   returns, the op becomes current again, so that its cycles exclude
+//   the cycles of the code it called.
+{
+    static ulonglong Clock()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+    }
+
+    static void Enter(Op *op)
+    {
+        Leave(op);
+        if (op)
+            op->runs++;
+    }
+
+    static void Leave(Op *op)
+    {
+        ulonglong now = Clock();
+        if (current)
+            current->cycles += now - last;
+        current = op;
+        last = now;
+    }
+
+    static bool                 enabled;
+    static std::set<Code *>     codes;  // Code that ran while profiling
+    static thread_local Op *    current;
+    static thread_local ulonglong last;
+};
+
+bool                    CodeProfile::enabled = false;
+std::set<Code *>        CodeProfile::codes;
+thread_local Op *       CodeProfile::current = nullptr;
+thread_local ulonglong  CodeProfile::last = 0;
+
+
+Bytecode::Bytecode()
+// ----------------------------------------------------------------------------
+//   Constructor for the bytecode evaluator
+// ----------------------------------------------------------------------------
+{
+    record(bytecode, "Created bytecode evaluator %p", this);
+    if (RECORDER_TRACE(bytecode_profile) || !Opt::bytecodeProfile.value.empty())
+        CodeProfile::enabled = true;
+}
+
+
+Bytecode::~Bytecode()
+// ----------------------------------------------------------------------------
+//   Destructor for the bytecode evaluator, show statistics if requested
+// ----------------------------------------------------------------------------
+{
+    IFTRACE(bytecode_stats)
+    {
+        std::cerr << "Bytecode instructions executed: "
+                  << Code::executed << "\n";
+        std::cerr << "Bytecode frame stack peak: "
+                  << FrameStack::peak << " slots\n";
+        std::cerr << "Bytecode variants: "
+                  << Procedure::variantsBuilt << " built, "
+                  << Procedure::guardHits << " guard hits, "
+                  << Procedure::guardFailures << " guard failures, "
+                  << Procedure::sitesRespecialized << " sites respecialized\n";
+        std::cerr << "Bytecode optimizations:";
+        for (uint p = 0; p < Code::PASSES; p++)
+            std::cerr << (p ? ", " : " ") << Code::passNames[p]
+                      << " " << Code::optimizations[p];
+        std::cerr << "\n";
+    }
+    IFTRACE(bytecode_cache_stats)
+        std::cerr << "Bytecode cache: "
+                  << CodeCache::loaded << " loaded, "
+                  << CodeCache::saved << " saved, "
+                  << CodeCache::rejected << " not cacheable, "
+                  << CodeCache::stale << " stale\n";
+    IFTRACE(bytecode_profile)
+        Code::ShowProfile(std::cerr);
+    text &csv = Opt::bytecodeProfile.value;
+    if (!csv.empty())
+    {
+        std::ofstream out(csv.c_str());
+        Code::ExportProfile(out);
+        if (!out.good())
+            std::cerr << "Unable to write bytecode profile " << csv << "\n";
+    }
+    record(bytecode, "Destroyed bytecode evaluator %p", this);
+}
+
+
 Tree *Bytecode::Evaluate(Scope *scope, Tree *what)
 // ----------------------------------------------------------------------------
 //   Compile bytecode and then evaluate it
@@ -66,7 +226,18 @@ Tree *Bytecode::Evaluate(Scope *scope, Tree *what)
     TreeList captured;
     Context_p context = new Context(scope);
 
-    Procedure *proc = Compile(context, what, nullptr, noParms, captured);
+    // Reuse the code of a previous run of the same program if we can
+    CodeCache cache(what);
+    Procedure *proc = cache.Load(context);
+    bool cacheable = false;
+    if (!proc)
+    {
+        Errors *errors = MAIN->errors;
+        uint errCount = errors->Count();
+        proc = Compile(context, what, nullptr, noParms, captured);
+        cacheable = proc && errCount == errors->Count();
+    }
+
     Tree_p result = what;
     if (proc)
     {
@@ -79,6 +250,10 @@ Tree *Bytecode::Evaluate(Scope *scope, Tree *what)
         while(op)
             op = op->Run(data);
         result = DataResult(data);
+
+        // Save after running, so that the cache has the variants we built
+        if (cacheable)
+            cache.Save(proc);
     }
     return result;
 }
@@ -88,8 +263,10 @@ Tree * Bytecode::TypeCheck(Scope *scope, Tree *type, Tree *val)
 // ----------------------------------------------------------------------------
 //   Perform a type check for the given value
 // ----------------------------------------------------------------------------
+//   Type checks are not compiled yet, so share the interpreter's
 {
-    return val;
+    Interpreter interpreter;
+    return interpreter.TypeCheck(scope, type, val);
 }
 
 
@@ -131,6 +308,7 @@ struct LabelOp : Op
 {
     LabelOp(kstring name): name(name) {}
     virtual kstring     OpID()  { return name; }
+    virtual void        Encode(Instr &instr) { instr.opcode = Instr::NOP; }
     virtual void        Dump(std::ostream &out)
     {
         out << OpID() << "\t" << (void *) this;
@@ -153,6 +331,11 @@ struct ConstOp : Op
         return success;
     }
     virtual kstring     OpID()  { return "const"; }
+    virtual void        Encode(Instr &instr)
+    {
+        instr.opcode = Instr::CONST;
+        instr.value = value;
+    }
     virtual void        Dump(std::ostream &out)
     {
         kstring kinds[] = { "natural", "real", "text", "name",
@@ -168,6 +351,7 @@ struct SelfOp : Op
 // ----------------------------------------------------------------------------
 {
     virtual kstring     OpID()  { return "self"; }
+    virtual void        Encode(Instr &instr) { instr.opcode = Instr::NOP; }
 };
 
 
@@ -191,9 +375,7 @@ struct EvalOp : FailOp
         }
 
         // Complete evaluation of the bytecode we were given
-        Op *op = ops;
-        while (op)
-            op = op->Run(data);
+        Code::RunOps(ops, data);
 
         // Save the result if evaluation was successful
         if (Tree *result = DataResult(data))
@@ -212,6 +394,16 @@ struct EvalOp : FailOp
         out << OpID() << "\t" << id << "\t"
             << Code::Ref(ops, "\t", "code", "null");
     }
+    virtual void        Encode(Instr &instr)
+    {
+        // Code from another tree or a cloned opcode runs as GENERIC
+        uint code = Code::Index(ops);
+        if (ops && code == Instr::END)
+            return;
+        instr.opcode = Instr::EVAL;
+        instr.a = id;
+        instr.b = code;
+    }
 };
 
 
@@ -263,6 +455,39 @@ struct ArgEvalOp : FailOp
 };
 
 
+struct ArgValueOp : Op
+// ----------------------------------------------------------------------------
+//    Bind an input argument known to evaluate to itself, e.g. a natural
+// ----------------------------------------------------------------------------
+//   This replaces an 'ArgEvalOp' in variants specialized by input kinds,
+//   and like it, only sets the result if the argument was already bound
+{
+    ArgValueOp(int argId, int id): argId(argId), id(id) {}
+    int argId, id;
+
+    virtual Op *        Run(Data data)
+    {
+        if (Tree *result = data[id])
+            DataResult(data, result);
+        else
+            data[id] = data[argId];
+        return success;
+    }
+
+    virtual kstring     OpID()          { return "argval"; }
+    virtual void        Dump(std::ostream &out)
+    {
+        out << OpID() << "\t" << id << "=" << argId;
+    }
+    virtual void        Encode(Instr &instr)
+    {
+        instr.opcode = Instr::ARG_VALUE;
+        instr.a = id;
+        instr.b = argId;
+    }
+};
+
+
 struct ClearOp : Op
 // ----------------------------------------------------------------------------
 //    Clear a range of eval entries after a complete evaluation
@@ -283,6 +508,12 @@ struct ClearOp : Op
     {
         out << OpID() << "\t" << lo << ".." << hi;
     }
+    virtual void        Encode(Instr &instr)
+    {
+        instr.opcode = Instr::CLEAR;
+        instr.a = lo;
+        instr.b = hi;
+    }
 };
 
 
@@ -327,6 +558,11 @@ struct ValueOp : Op
     {
         out << OpID() << "\t" << id;
     }
+    virtual void        Encode(Instr &instr)
+    {
+        instr.opcode = Instr::VALUE;
+        instr.a = id;
+    }
 };
 
 
@@ -347,6 +583,11 @@ struct StoreOp : Op
     {
         out << OpID() << "\t" << id;
     }
+    virtual void        Encode(Instr &instr)
+    {
+        instr.opcode = Instr::STORE;
+        instr.a = id;
+    }
 };
 
 
@@ -356,10 +597,14 @@ struct CallOp : Op
 // ----------------------------------------------------------------------------
 {
     CallOp(Code *target, uint outId, ParmOrder &parms)
-        : target(target), outId(outId), parms(parms) {}
+        : target(target), outId(outId), parms(parms),
+          variant(-1), calls(0), failures(0) {}
     Code  *     target;
     int         outId;
     ParmOrder   parms;
+    int         variant;        // Index in target variants, -1 if none
+    uint        calls;          // Calls before we try to specialize
+    uint        failures;       // Guard failures since we specialized
 
     virtual Op *Run(Data data)
     {
@@ -374,9 +619,41 @@ struct CallOp : Op
         for (uint p = 0; p < sz; p++)
         {
             int parmId = parms[p];
-            out[~p] = data[parmId];
+            out[~int(p)] = data[parmId];
+        }
+
+        // Run the specialized variant if the input kinds match
+        // The variants of the target are only deleted with the target,
+        // and only a procedure has variants, so the index stays valid.
+        Code *callee = target;
+        uint  threshold = RECORDER_TWEAK(bytecode_specialize);
+        if (variant >= 0)
+        {
+            Procedure *proc = (Procedure *) target;
+            Procedure *selected = proc->variants[variant];
+            if (selected->Guard(out))
+            {
+                callee = selected;
+            }
+            else if (++failures >= threshold)
+            {
+                // The kinds at this site changed, specialize again
+                record(bytecode_variants,
+                       "Call site %p of %t failed guard %u times",
+                       this, proc->self, failures);
+                Procedure::sitesRespecialized++;
+                variant = -1;
+                calls = failures = 0;
+            }
         }
-        Op *remaining = target->Run(out);
+        else if (calls < threshold && ++calls == threshold)
+        {
+            if (Procedure *proc = dynamic_cast<Procedure *>(target))
+                variant = proc->Specialize(out);
+            if (variant >= 0)
+                callee = ((Procedure *) target)->variants[variant];
+        }
+        Op *remaining = callee->Run(out);
         XL_ASSERT(!remaining);
         if (remaining)
             return remaining;
@@ -393,6 +670,10 @@ struct CallOp : Op
         for (uint a = 0; a < parms.size(); a++)
             out << (a ? "," : "") << parms[a];
         out << ") @ " << outId;
+        if (variant >= 0)
+            out << "\tvariant\t" << variant;
+        if (failures)
+            out << "\tfailed\t" << failures;
     }
 };
 
@@ -401,16 +682,22 @@ struct TypeCheckOp : FailOp
 // ----------------------------------------------------------------------------
 //   Check if a type matches the given type
 // ----------------------------------------------------------------------------
+//   Built-in types like 'natural' are known at compile time. In that case,
+//   'constant' holds the type, and we don't need to evaluate it in a slot.
 {
     TypeCheckOp(int value, int type, Op *fail)
-        : FailOp(fail), value(value), type(type) {}
+        : FailOp(fail), value(value), type(type), constant() {}
+    TypeCheckOp(int value, Tree *constant, Op *fail)
+        : FailOp(fail), value(value), type(0), constant(constant) {}
     int value;
     int type;
+    Tree_p constant;
 
     virtual Op *        Run(Data data)
     {
         Scope *scope = DataScope(data);
-        Tree *cast = xl_typecheck(scope, data[type], data[value]);
+        Tree *typeValue = constant ? (Tree *) constant : (Tree *) data[type];
+        Tree *cast = xl_typecheck(scope, typeValue, data[value]);
         if (!cast)
             return fail;
         DataResult(data, cast);
@@ -420,7 +707,18 @@ struct TypeCheckOp : FailOp
     virtual kstring     OpID()  { return "typechk"; }
     virtual void        Dump(std::ostream &out)
     {
-        out << OpID() << "\t" << value << ":" << type;
+        out << OpID() << "\t" << value << ":";
+        if (constant)
+            out << constant;
+        else
+            out << type;
+    }
+    virtual void        Encode(Instr &instr)
+    {
+        instr.opcode = constant ? Instr::TYPECHECK_CONST : Instr::TYPECHECK;
+        instr.a = value;
+        instr.b = type;
+        instr.value = constant;
     }
 };
 
@@ -571,7 +869,8 @@ Code::Code(Context *ctx, Tree *self)
 // ----------------------------------------------------------------------------
 //    Create a new code from the given ops
 // ----------------------------------------------------------------------------
-    : context(ctx), self(self), ops(nullptr), instrs()
+    : context(ctx), self(self), ops(nullptr), instrs(),
+      bytecode(), entry(Instr::END), optimized()
 {}
 
 
@@ -579,10 +878,12 @@ Code::Code(Context *context, Tree *self, Op *ops)
 // ----------------------------------------------------------------------------
 //    Create a new code from the given ops
 // ----------------------------------------------------------------------------
-    : context(context), self(self), ops(ops), instrs()
+    : context(context), self(self), ops(ops), instrs(),
+      bytecode(), entry(Instr::END), optimized()
 {
     for (Op *op = ops; op; op = op->success)
         instrs.push_back(op);
+    Encode();
 }
 
 
@@ -594,10 +895,13 @@ Code::~Code()
     for (Ops::iterator o = instrs.begin(); o != instrs.end(); o++)
         delete *o;
     instrs.clear();
+    if (CodeProfile::enabled)
+        CodeProfile::codes.erase(this);
 }
 
 
-void Code::SetOps(Op **newOps, Ops *instrsToTakeOver, uint outId)
+void Code::SetOps(Op **newOps, Ops *instrsToTakeOver, uint outId,
+                  bool optimize)
 // ----------------------------------------------------------------------------
 //    Take over the given code
 // ----------------------------------------------------------------------------
@@ -608,6 +912,7 @@ void Code::SetOps(Op **newOps, Ops *instrsToTakeOver, uint outId)
     std::swap(instrs, *instrsToTakeOver);
 
     // A few post-generation optimizations:
+    std::set<Op *> owned(instrs.begin(), instrs.end());
     uint max = instrs.size();
     for (uint i = 0; i < max; i++)
     {
@@ -623,7 +928,22 @@ void Code::SetOps(Op **newOps, Ops *instrsToTakeOver, uint outId)
         if (FailOp *fop = dynamic_cast<FailOp *>(op))
             while (LabelOp *label = dynamic_cast<LabelOp *>(fop->fail))
                 fop->fail = label->success;
+
+        // Evaluations may start with a label, but may also refer to
+        // code in other trees, which we must not look at here
+        if (EvalOp *eval = dynamic_cast<EvalOp *>(op))
+        {
+            while (eval->ops && owned.count(eval->ops))
+            {
+                if (LabelOp *label = dynamic_cast<LabelOp *>(eval->ops))
+                    eval->ops = label->success;
+                else
+                    break;
+            }
+        }
     }
+    while (LabelOp *label = dynamic_cast<LabelOp *>(ops))
+        ops = label->success;
     for (uint i = 0; i < max; i++)
     {
         Op *op = instrs[i];
@@ -635,1505 +955,5226 @@ void Code::SetOps(Op **newOps, Ops *instrsToTakeOver, uint outId)
             delete label;
         }
     }
-}
 
-
-Op *Code::Run(Data data)
-// ----------------------------------------------------------------------------
-//   Run all instructions in the sequence
-// ----------------------------------------------------------------------------
-{
-    // Running in-place in the same context
-    Scope *scope = context->Symbols();
-    data[0] = self;
-    data[1] = scope;
-
-    // Run all instructions we have in that code
-    Op *op = ops;
-    while (op)
-        op = op->Run(data);
-
-    // We were successful
-    return success;
+    // Run the optimization passes, then build the flat encoding
+    if (optimize)
+        Optimize();
+    Encode();
 }
 
 
-void Code::Dump(std::ostream &out)
+static std::map<Op *, uint> *currentIndex = nullptr;
+
+uint Code::Index(Op *op)
 // ----------------------------------------------------------------------------
-//   Dump all the instructions
+//   Return the index of an op in the code being encoded, or END
 // ----------------------------------------------------------------------------
 {
-    out << OpID() << "\t" << (void *) (Op *) this
-        << "\tentry\t" << (void *) ops
-        << "\t" << self << "\n";
-    out << "\talloc"
-        << "\tI" << Inputs() << " L" << Locals() << "\n";
-    Dump(out, ops, instrs);
+    if (op && currentIndex)
+    {
+        std::map<Op *, uint>::iterator found = currentIndex->find(op);
+        if (found != currentIndex->end())
+            return (*found).second;
+    }
+    return Instr::END;
 }
 
 
-static Ops *currentDump = nullptr;
-
-void Code::Dump(std::ostream &out, Op *ops, Ops &instrs)
+void Code::Encode()
 // ----------------------------------------------------------------------------
-//   Dump an instruction list
+//   Encode the instructions as a flat array for Execute
 // ----------------------------------------------------------------------------
 {
-    Save<Ops *> saveCurrentDump(currentDump, &instrs);
+    std::map<Op *, uint> index;
+    Save<std::map<Op *, uint> *> saveIndex(currentIndex, &index);
 
     uint max = instrs.size();
+    bytecode.clear();
+    bytecode.reserve(max);
     for (uint i = 0; i < max; i++)
     {
-        Op *op = instrs[i];
-        Op *fail = op->Fail();
-        if (op == ops)
-            out << i << "=>\t" << op;
-        else
-            out << i << "\t" << op;
-        if (fail)
-            out << Ref(fail, "\t", "fail", "nofail");
-        if (i + 1 < max)
-        {
-            Op *next = instrs[i]->success;
-            if (next != instrs[i+1])
-                out << Ref(next, "\n\t", "goto", "return");
-        }
-        out << "\n";
+        index[instrs[i]] = i;
+        bytecode.push_back(Instr(instrs[i]));
+    }
+
+    for (uint i = 0; i < max; i++)
+    {
+        Instr &instr = bytecode[i];
+        Op    *op    = instr.op;
+        Op    *fail  = op->Fail();
+        instr.success = Index(op->success);
+        instr.fail = Index(fail);
+        op->Encode(instr);
+
+        // Jumps outside of this code must go through the Op graph
+        if ((op->success && instr.success == Instr::END) ||
+            (fail && instr.fail == Instr::END))
+            instr.opcode = Instr::GENERIC;
     }
+    entry = Index(ops);
 }
 
 
-text Code::Ref(Op *op, text sep, text set, text null)
+ulonglong Code::executed = 0;
+ulonglong Code::optimizations[Code::PASSES] = { 0 };
+kstring   Code::passNames[Code::PASSES] =
+    { "fold", "checks", "jumps", "dead", "fuse", "kinds" };
+
+kstring Instr::name[INSTR_COUNT] =
 // ----------------------------------------------------------------------------
-//   Return the reference for an op in the current list
+//   Names of the instructions in the compact encoding
 // ----------------------------------------------------------------------------
 {
-    std::ostringstream out;
-
-    bool found = false;
-    uint max = currentDump ? currentDump->size() : 0;
+#define INSTR(Name, Descr)              #Name,
+#define NATURAL(Name, Opcode, Result)   #Name, #Name "_CONST", #Name "_CONST_LEFT",
+#include "bytecode.tbl"
+};
 
-    if (op == nullptr)
-        found = bool(out << sep << null);
-    for (uint o = 0; o < max; o++)
-        if ((*currentDump)[o] == op)
-            found = bool(out << sep << set << "\t#" << o);
-    if (!found)
-        out << sep << set << "\t" << (void *) op;
-    return out.str();
-}
 
+#if defined(__GNUC__) && !defined(XL_BYTECODE_SWITCH)
+#define XL_THREADED_DISPATCH    1
+#else
+#define XL_THREADED_DISPATCH    0
+#endif
 
-Procedure::Procedure(Context *context, Tree *self, uint nInputs, uint nLocals)
+void Code::Execute(Data data, uint pc)
 // ----------------------------------------------------------------------------
-//   Create a proc
+//   Run the flat encoding starting at 'pc' until it returns
 // ----------------------------------------------------------------------------
-    : Code(context, self), nInputs(nInputs), nLocals(nLocals)
-{}
+{
+    if (CodeProfile::enabled)
+        Dispatch<true>(data, pc);
+    else
+        Dispatch<false>(data, pc);
+}
 
 
-Procedure::Procedure(Procedure *original, Data data, ParmOrder &capture)
+template <bool profile>
+void Code::Dispatch(Data data, uint pc)
 // ----------------------------------------------------------------------------
-//    Copy constructor used for closures
+//   Run the flat encoding, counting each instruction if 'profile' is set
 // ----------------------------------------------------------------------------
-    : Code(original->context, original->self),
-      nInputs(original->nInputs), nLocals(original->nLocals),
-      captured()
+//   With GCC or clang, this uses computed gotos, so that each instruction
+//   has its own indirect branch. Otherwise, it uses a switch in a loop.
 {
-    // We have no instrs, so we don't "own" the instructions
-    ops = original->ops;
+    Instr     *code  = bytecode.data();
+    ulonglong  count = 0;
+    Op        *caller = profile ? CodeProfile::current : nullptr;
 
-    // Copy data in the closure from current data
-    uint max = capture.size();
-    captured.reserve(max);
-    for (uint p = 0; p < max; p++)
+#if XL_THREADED_DISPATCH
+    static void *dispatch[Instr::INSTR_COUNT] =
     {
-        int id = capture[p];
-        Tree *arg = data[id];
-        captured.push_back(arg);
+#define INSTR(Name, Descr)              &&do_##Name,
+#define NATURAL(Name, Opcode, Result)   &&do_##Name, &&do_##Name##_CONST,  \
+                                        &&do_##Name##_CONST_LEFT,
+#include "bytecode.tbl"
+    };
+
+#define INSTR_CASE(Name)        do_##Name:
+#define DISPATCH(Next)                                  \
+    {                                                   \
+        pc = (Next);                                    \
+        if (pc == Instr::END)                           \
+            goto done;                                  \
+        count++;                                        \
+        if (profile)                                    \
+            CodeProfile::Enter(code[pc].op);            \
+        goto *dispatch[code[pc].opcode];                \
     }
-}
 
+    DISPATCH(pc);
+#else
+#define INSTR_CASE(Name)        case Instr::Name:
+#define DISPATCH(Next)                                  \
+    {                                                   \
+        pc = (Next);                                    \
+        break;                                          \
+    }
 
-Procedure::~Procedure()
-// ----------------------------------------------------------------------------
-//    Destructor for procs
-// ----------------------------------------------------------------------------
-{}
-
+    for (; pc != Instr::END; count++)
+    {
+        if (profile)
+            CodeProfile::Enter(code[pc].op);
+        switch(code[pc].opcode)
+        {
+#endif // XL_THREADED_DISPATCH
 
-Op *Procedure::Run(Data data)
-// ----------------------------------------------------------------------------
-//   Create a new scope and run all instructions in the sequence
-// ----------------------------------------------------------------------------
-{
-    Scope *scope     = context->Symbols();
-    uint   frameSize = FrameSize();
-    uint   offset    = OffsetSize();
-    Data   frame     = new Tree_p[frameSize];
-    Data   newData   = frame + offset;
+    INSTR_CASE(GENERIC)
+    {
+        Instr &i    = code[pc];
+        Op    *op   = i.op;
+        Op    *next = op->Run(data);
+        if (!next)
+            DISPATCH(Instr::END);
+        if (next == op->success && i.success != Instr::END)
+            DISPATCH(i.success);
+        if (next == op->Fail() && i.fail != Instr::END)
+            DISPATCH(i.fail);
+
+        // Escaped from the encoded code, finish in the Op graph
+        RunOps(next, data);
+        DISPATCH(Instr::END);
+    }
 
-    // Initialize self and scope
-    newData[0] = self;
-    newData[1] = scope;
+    INSTR_CASE(NOP)
+    {
+        DISPATCH(code[pc].success);
+    }
 
-    // Copy input arguments
-    uint inputs   = Inputs();
-    Data oarg = &newData[-1];
-    Data iarg = &data[-1];
-    for (uint a = 0; a < inputs; a++)
-        *oarg-- = *iarg--;
+    INSTR_CASE(CONST)
+    {
+        Instr &i = code[pc];
+        DataResult(data, i.value);
+        DISPATCH(i.success);
+    }
 
-    // Copy closure data if any
-    uint closures = Closures();
-    if (closures)
+    INSTR_CASE(VALUE)
     {
-        Data carg = ClosureData();
-        for (uint c = 0; c < closures; c++)
-            *oarg-- = *carg++;
+        Instr &i = code[pc];
+        DataResult(data, data[i.a]);
+        DISPATCH(i.success);
     }
 
-    // Execute the following instructions in the newly created data context
-    Op *op = ops;
-    while (op)
-        op = op->Run(newData);
+    INSTR_CASE(STORE)
+    {
+        Instr &i = code[pc];
+        data[i.a] = DataResult(data);
+        DISPATCH(i.success);
+    }
 
-    // Copy result and current context to the old data
-    Tree *result = DataResult(newData);
-    DataResult(data, result);
+    INSTR_CASE(CLEAR)
+    {
+        Instr &i = code[pc];
+        for (int v = i.a; v <= i.b; v++)
+            data[v] = nullptr;
+        DISPATCH(i.success);
+    }
 
-    // Destroy the frame, we no longer need it
-    delete[] frame;
+    INSTR_CASE(EVAL)
+    {
+        Instr &i = code[pc];
+        if (Tree *cached = data[i.a])
+        {
+            DataResult(data, cached);
+            DISPATCH(i.success);
+        }
+        Dispatch<profile>(data, (uint) i.b);
+        if (Tree *result = DataResult(data))
+        {
+            data[i.a] = result;
+            DISPATCH(i.success);
+        }
+        DISPATCH(i.fail);
+    }
 
-    // Evaluate next instruction
-    return success;
-}
+    INSTR_CASE(ARG_VALUE)
+    {
+        Instr &i = code[pc];
+        if (Tree *result = data[i.a])
+            DataResult(data, result);
+        else
+            data[i.a] = data[i.b];
+        DISPATCH(i.success);
+    }
 
+    INSTR_CASE(TYPECHECK)
+    {
+        Instr &i = code[pc];
+        Tree *cast = xl_typecheck(DataScope(data), data[i.b], data[i.a]);
+        if (!cast)
+            DISPATCH(i.fail);
+        DataResult(data, cast);
+        DISPATCH(i.success);
+    }
 
-void Procedure::Dump(std::ostream &out)
-// ----------------------------------------------------------------------------
-//   Dump all the instructions
-// ----------------------------------------------------------------------------
-{
-    out << OpID() << "\t" << (void *) (Op *) this
-        << "\tentry\t" << (void *) ops
-        << "\t" << self << "\n";
-    out << "\talloc"
-        << "\tI" << Inputs() << " L" << Locals() << " C" << Closures() << "\n";
-    Code::Dump(out, ops, instrs);
-}
+    INSTR_CASE(TYPECHECK_CONST)
+    {
+        Instr &i = code[pc];
+        Tree *cast = xl_typecheck(DataScope(data), i.value, data[i.a]);
+        if (!cast)
+            DISPATCH(i.fail);
+        DataResult(data, cast);
+        DISPATCH(i.success);
+    }
 
+    INSTR_CASE(MATCH_NATURAL)
+    {
+        Instr &i = code[pc];
+        Natural *test = DataResult(data)->AsNatural();
+        if (test && test->value == ((Natural *) i.value)->value)
+            DISPATCH(i.success);
+        DISPATCH(i.fail);
+    }
 
+    INSTR_CASE(WHEN)
+    {
+        Instr &i = code[pc];
+        if (data[i.a] != xl_true)
+            DISPATCH(i.fail);
+        DISPATCH(i.success);
+    }
 
-// ============================================================================
-//
-//   Building a code sequence and variants
-//
-// ============================================================================
+    INSTR_CASE(NAME_MATCH)
+    {
+        Instr &i = code[pc];
+        if (Tree::Equal(data[i.b], data[i.a]))
+            DISPATCH(i.success);
+        DISPATCH(i.fail);
+    }
 
-CodeBuilder::CodeBuilder(TreeList &captured)
-// ----------------------------------------------------------------------------
-//   Create a code builder
-// ----------------------------------------------------------------------------
-    : ops(nullptr), lastOp(&ops),
-      inputs(), values(), captured(captured),
-      nEvals(0), nParms(0), candidates(0),
-      test(nullptr), resultType(nullptr),
-      context(nullptr), parmsCtx(nullptr), argsCtx(nullptr),
-      failOp(nullptr), successOp(nullptr),
-      instrs(), subexprs(), parms(), defer(false)
-{}
+    INSTR_CASE(EVAL_MATCH_NATURAL)
+    {
+        Instr &i = code[pc];
+        Tree *result = data[i.a];
+        if (!result)
+        {
+            Dispatch<profile>(data, (uint) i.b);
+            result = DataResult(data);
+            if (!result)
+                DISPATCH(i.fail);
+            data[i.a] = result;
+        }
+        DataResult(data, result);
+        Natural *test = result->AsNatural();
+        if (test && test->value == ((Natural *) i.value)->value)
+            DISPATCH(i.success);
+        DISPATCH(i.other);
+    }
 
+#define NATURAL_APPLY(LeftArg, RightArg, Result)                        \
+    {                                                                   \
+        Natural *leftPtr = (LeftArg)->AsNatural();                      \
+        Natural *rightPtr = (RightArg)->AsNatural();                    \
+        if (!leftPtr || !rightPtr)                                      \
+            DISPATCH(i.op->Run(data) ? i.success : Instr::END);         \
+        Natural &left = *leftPtr, &right = *rightPtr;                   \
+        DataResult(data, Result);                                       \
+        DISPATCH(i.success);                                            \
+    }
 
-CodeBuilder::~CodeBuilder()
+#define NATURAL(Name, Opcode, Result)                                   \
+    INSTR_CASE(Name)                                                    \
+    {                                                                   \
+        Instr &i = code[pc];                                            \
+        NATURAL_APPLY(data[i.a], data[i.b], Result);                    \
+    }                                                                   \
+    INSTR_CASE(Name##_CONST)                                            \
+    {                                                                   \
+        Instr &i = code[pc];                                            \
+        if (i.b)                                                        \
+            data[i.b] = i.value;                                        \
+        NATURAL_APPLY(data[i.a], i.value, Result);                      \
+    }                                                                   \
+    INSTR_CASE(Name##_CONST_LEFT)                                       \
+    {                                                                   \
+        Instr &i = code[pc];                                            \
+        if (i.b)                                                        \
+            data[i.b] = i.value;                                        \
+        NATURAL_APPLY(i.value, data[i.a], Result);                      \
+    }
+#define INSTR(Name, Descr)
+#include "bytecode.tbl"
+#undef NATURAL_APPLY
+
+#if XL_THREADED_DISPATCH
+done:
+#else
+        case Instr::INSTR_COUNT:
+            break;
+        } // switch
+    } // for
+#endif // XL_THREADED_DISPATCH
+
+#undef INSTR_CASE
+#undef DISPATCH
+
+    if (profile)
+        CodeProfile::Leave(caller);
+    executed += count;
+}
+
+
+void Code::RunOps(Op *op, Data data)
 // ----------------------------------------------------------------------------
-//    Delete all instructions if the list was not transferred
+//   Run ops in the graph, following the links returned by each op
 // ----------------------------------------------------------------------------
 {
-    for (Ops::iterator o = instrs.begin(); o != instrs.end(); o++)
-        delete *o;
-    instrs.clear();
+    ulonglong count = 0;
+    if (CodeProfile::enabled)
+    {
+        Op *caller = CodeProfile::current;
+        for (; op; count++)
+        {
+            CodeProfile::Enter(op);
+            op = op->Run(data);
+        }
+        CodeProfile::Leave(caller);
+    }
+    else
+    {
+        for (; op; count++)
+            op = op->Run(data);
+    }
+    executed += count;
 }
 
 
-CodeBuilder::depth CodeBuilder::ScopeDepth(Scope *scope)
+Op *Code::Run(Data data)
 // ----------------------------------------------------------------------------
-//   Return true if the given scope is local to the current proc
+//   Run all instructions in the sequence
 // ----------------------------------------------------------------------------
 {
-    Scope *parmsScope = parmsCtx->Symbols();
-    Scope *globalScope = MAIN->context.Symbols();
-    uint count = 0;
-
-    // Loop on scope, looking for either current parm scope or global scope
-    while (scope)
+    // Running in-place in the same context
+    Scope *scope = context->Symbols();
+    data[0] = self;
+    data[1] = scope;
+    if (CodeProfile::enabled)
     {
-        if (scope == parmsScope)
-            return count ? LOCAL : PARAMETER;
-        if (scope == globalScope)
-            return count ? ENCLOSING : GLOBAL;
-        scope = Enclosing(scope);
-        count++;
+        CodeProfile::codes.insert(this);
+        runs++;
     }
 
-    // If we reached the end without seeing the current global scope,
-    // this means this is a global scope (probably some other file)
-    return GLOBAL;
+    // Run all instructions we have in that code
+    if (entry != Instr::END && RECORDER_TWEAK(bytecode_threaded))
+        Execute(data, entry);
+    else
+        RunOps(ops, data);
+
+    // We were successful
+    return success;
 }
 
 
-void CodeBuilder::Add(Op *op)
+static void DumpOptimized(std::ostream &out, uint *optimized)
 // ----------------------------------------------------------------------------
-//    Add an instruction in the generated code
+//   Show what the optimization passes did, if anything
 // ----------------------------------------------------------------------------
 {
-    XL_ASSERT(count(instrs.begin(), instrs.end(), op) == 0);
-    instrs.push_back(op);
-    *lastOp = op;
-    lastOp = &op->success;
-    XL_ASSERT(!op->success && "Adding an instruction that has kids");
+    kstring *passes = Code::passNames;
+    uint total = 0;
+    for (uint p = 0; p < Code::PASSES; p++)
+        total += optimized[p];
+    if (!total)
+        return;
+    out << "\toptimized";
+    for (uint p = 0; p < Code::PASSES; p++)
+        out << (p ? " " : "\t") << passes[p] << " " << optimized[p];
+    out << "\n";
 }
 
 
-void CodeBuilder::AddEval(int id, Op *op)
+void Code::Dump(std::ostream &out)
 // ----------------------------------------------------------------------------
-//    Add an evaluation in the generated code, simplify if 'Quick'
+//   Dump all the instructions
 // ----------------------------------------------------------------------------
 {
-    Add(new EvalOp(id, op, failOp));
+    out << OpID() << "\t" << (void *) (Op *) this
+        << "\tentry\t" << (void *) ops
+        << "\t" << self << "\n";
+    out << "\talloc"
+        << "\tI" << Inputs() << " L" << Locals() << "\n";
+    DumpOptimized(out, optimized);
+    if (CodeProfile::enabled)
+        DumpProfile(out);
+    Dump(out, ops, instrs, &bytecode);
 }
 
 
-void CodeBuilder::AddTypeCheck(Context *context, Tree *what, Tree *type)
+void Code::DumpProfile(std::ostream &out)
 // ----------------------------------------------------------------------------
-//   Add type check if necessary
+//   Show the totals of the profile for this code
 // ----------------------------------------------------------------------------
 {
-    if (type)
-        if (Name *name = type->AsName())
-            if (Tree *original = context->Bound(name))
-                type = original;
-    if (resultType)
-        if (Name *name = resultType->AsName())
-            if (Tree *original = context->Bound(name))
-                resultType = original;
-
-    // Unify form for 'catch-all' type
-    if (!type)
-        type = tree_type;
-    if (!resultType)
-        resultType = tree_type;
-    if (resultType == tree_type)
-        return;
-
-    // Check if we have some static match
-    if (what->IsConstant())
-        if (xl_typecheck(context->Symbols(), type, what))
-            return;
+    ulonglong count = 0, cycles = 0;
+    for (Op *op : instrs)
+    {
+        count += op->runs;
+        cycles += op->cycles;
+    }
+    out << "\tprofile\tcalls " << runs
+        << " instructions " << count
+        << " cycles " << cycles << "\n";
+}
 
-    // Check if types match statically
-    if (type == resultType)
-        return;
 
-    // Otherwise, we need to generate a dynamic match
-    int valueID = ValueID(what);
-    int typeID = Evaluate(context, type);
-    Add(new TypeCheckOp(valueID, typeID, failOp));
+static ulonglong ProfileCycles(Code *code)
+// ----------------------------------------------------------------------------
+//   Total cycles spent in the instructions of some code
+// ----------------------------------------------------------------------------
+{
+    ulonglong cycles = 0;
+    for (Op *op : code->instrs)
+        cycles += op->cycles;
+    return cycles;
 }
 
 
-void CodeBuilder::Success()
+static std::vector<Code *> ProfiledCode()
 // ----------------------------------------------------------------------------
-//    Success at the end of a declaration
+//   Return the code that ran while profiling, most expensive first
 // ----------------------------------------------------------------------------
 {
-    XL_ASSERT(successOp && failOp);
-    XL_ASSERT(count(instrs.begin(), instrs.end(), failOp) == 0);
+    std::vector<std::pair<ulonglong, Code *>> sorted;
+    for (Code *code : CodeProfile::codes)
+        sorted.push_back(std::make_pair(ProfileCycles(code), code));
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [](const std::pair<ulonglong, Code *> &a,
+                        const std::pair<ulonglong, Code *> &b)
+                     { return a.first > b.first; });
+    std::vector<Code *> result;
+    for (auto &entry : sorted)
+        result.push_back(entry.second);
+    return result;
+}
 
-    record(bytecode, "SUCCESS: %O FAIL: %O", successOp, failOp);
 
-    // End current stream to the success exit, restart code gen at failure exit
-    *lastOp = successOp;
-    XL_ASSERT(failOp && "Success without a failure exit");
+void Code::ShowProfile(std::ostream &out)
+// ----------------------------------------------------------------------------
+//   Dump the code that ran while profiling, with per-instruction counts
+// ----------------------------------------------------------------------------
+{
+    std::vector<Code *> codes = ProfiledCode();
+    ulonglong cycles = 0;
+    for (Code *code : codes)
+        cycles += ProfileCycles(code);
+    out << "Bytecode profile: " << codes.size() << " procedures, "
+        << executed << " instructions, " << cycles << " cycles\n";
+    for (Code *code : codes)
+        code->Dump(out);
+}
 
-    lastOp = &failOp->success;
-    instrs.push_back(failOp);
-    failOp = nullptr;
 
-    XL_ASSERT(!*lastOp);
+static text CSVQuote(text value)
+// ----------------------------------------------------------------------------
+//   Quote a value for a CSV file
+// ----------------------------------------------------------------------------
+{
+    text result = "\"";
+    for (char c : value)
+    {
+        if (c == '"')
+            result += "\"\"";
+        else if (c == '\n' || c == '\t')
+            result += ' ';
+        else
+            result += c;
+    }
+    return result + "\"";
 }
 
 
-void CodeBuilder::InstructionsSuccess(uint neOld)
+void Code::ExportProfile(std::ostream &out)
 // ----------------------------------------------------------------------------
-//    At end of an instruction, mark success by recording number of evals
+//   Export the per-instruction profile as CSV, one line per instruction
 // ----------------------------------------------------------------------------
 {
-    uint ne = values.size();
-    if (nEvals < ne)
-        nEvals = ne;
-    if (ne > neOld)
-        Add(new ClearOp(neOld+2, ne+1));
-    if (defer)
-        Add(new ClosureOp(context));
+    out << "procedure,position,self,index,instr,op,runs,cycles\n";
+    uint id = 0;
+    for (Code *code : ProfiledCode())
+    {
+        Tree *source = code->self;
+        text position = source ? Error("", source).Position() : text();
+        text self = CSVQuote(source ? text(*source) : text());
+        bool encoded = code->bytecode.size() == code->instrs.size();
+        uint max = code->instrs.size();
+        for (uint i = 0; i < max; i++)
+        {
+            Op *op = code->instrs[i];
+            std::ostringstream name;
+            name << op;
+            out << id << ","
+                << CSVQuote(position) << ","
+                << self << ","
+                << i << ","
+                << (encoded ? Instr::name[code->bytecode[i].opcode] : "") << ","
+                << CSVQuote(name.str()) << ","
+                << op->runs << ","
+                << op->cycles << "\n";
+        }
+        id++;
+    }
 }
 
 
+static Ops *currentDump = nullptr;
 
-// ============================================================================
-//
-//    Compilation of the tree
-//
-// ============================================================================
-//
-//  The 'Instructions' function evaluates candidates in the symbol table.
-//  Each specific declaration causes an invokation of compileLookup.
-//
-//  Consider the following code:
-//
-//      foo X:natural, Y:natural -> foo1
-//      foo A:natural, B         -> foo2
-//      foo U, V
-//      write "Toto"
-//
-//  The generated code will look like this
-//      ;; Evaluate foo1 candidate
-//
-//      ;; Match U against X:natural
-//      Evaluate U              or goto fail1.1         (EvalOp)
-//      Evaluate natural        or goto fail1.1         (EvalOp)
-//      TypeCheck U : natural   or goto fail1.1         (TypeCheckOp)
-//
-//      ;; Match V against Y:natural
-//      Evaluate V              or goto fail1.1         (EvalOp)
-//      Evaluate natural        or goto fail1.1         (EvalOp - SaveLeft)
-//      TypeCheck V : natural   or goto fail1.1         (TypeCheckOp)
-//
-//      ;; Call foo1
-//      Call foo1 (id(U), id(V)) @ parmSize             (CallOp)
-//
-//      ;; Done, successful evaluation, goto is in 'success' field
-//      goto success1
-//
-//    fail1.1:                                          (LabelOp)
-//      Evaluate U              or goto fail1.2         (EvalOp)
-//      Evaluate natural        or goto fail1.2         (EvalOp)
-//      ...
-//      Call foo2                                       (CallOp)
-//      goto success1
-//
-//    fail1.2:                                          (LabelOp)
-//      FormError                                       (FormErrorOp)
-//
-//    success1:                                         (LabelOp)
-//      ;; Same thing for write "Toto"
-//
-//  The 'goto' in the above are implicit, marked by 'success' or 'fail' in Op.
-
-static Tree *compileLookup(Scope *evalScope, Scope *declScope,
-                           Tree *self, Infix *decl, void *cb)
+void Code::Dump(std::ostream &out, Op *ops, Ops &instrs, Instrs *encoded)
 // ----------------------------------------------------------------------------
-//    Lookup a given declaration and generate code for it
+//   Dump an instruction list, with its flat encoding if given
 // ----------------------------------------------------------------------------
 {
-    static uint  depth = 0;
-    Save<uint>   saveDepth(depth, depth+1);
+    Save<Ops *> saveCurrentDump(currentDump, &instrs);
 
-    CodeBuilder *builder = (CodeBuilder *) cb;
-    uint         cindex = builder->candidates++;
+    uint max = instrs.size();
+    if (encoded && encoded->size() != max)
+        encoded = nullptr;
+    for (uint i = 0; i < max; i++)
+    {
+        Op *op = instrs[i];
+        Op *fail = op->Fail();
+        if (CodeProfile::enabled)
+            out << op->runs << "\t" << op->cycles << "\t";
+        if (encoded)
+            out << "[" << Instr::name[(*encoded)[i].opcode] << "]\t";
+        if (op == ops)
+            out << i << "=>\t" << op;
+        else
+            out << i << "\t" << op;
+        if (fail)
+            out << Ref(fail, "\t", "fail", "nofail");
+        if (i + 1 < max)
+        {
+            Op *next = instrs[i]->success;
+            if (next != instrs[i+1])
+                out << Ref(next, "\n\t", "goto", "return");
+        }
+        out << "\n";
+    }
+}
 
-    record(bytecode,
-           "Compile %d:%d (%t) from %t",
-           depth, cindex, self, decl->left);
 
-    // Create the scope for evaluation
-    Context_p    context = new Context(evalScope);
-    Context_p    argsCtx = nullptr;
+text Code::Ref(Op *op, text sep, text set, text null)
+// ----------------------------------------------------------------------------
+//   Return the reference for an op in the current list
+// ----------------------------------------------------------------------------
+{
+    std::ostringstream out;
 
-    // Save current state of the builder
-    Save<Tree_p>    saveSelf(builder->test, self);
-    Save<Context_p> saveContext(builder->context, context);
-    Save<Context_p> saveArgsCtx(builder->argsCtx, argsCtx);
+    bool found = false;
+    uint max = currentDump ? currentDump->size() : 0;
 
-    // Create the exit point for failed evaluation
-    Op *         oldFailOp = builder->failOp;
-    Op *         failOp = new LabelOp("fail");
-    builder->failOp = failOp;
-    builder->resultType = nullptr;
+    if (op == nullptr)
+        found = bool(out << sep << null);
+    for (uint o = 0; o < max; o++)
+        if ((*currentDump)[o] == op)
+            found = bool(out << sep << set << "\t#" << o);
+    if (!found)
+        out << sep << set << "\t" << (void *) op;
+    return out.str();
+}
 
-    // We start with new parameters for each candidate
-    ParmOrder           noParms;
-    TreeIDs             empty;
-    Save<ParmOrder>     saveParmOrder(builder->parms, noParms);
-    Save<TreeIDs>       saveOutputs(builder->outputs, empty);
 
-    // If we lookup a name or a number, just return it
-    Tree *defined = PatternBase(decl->left);
-    bool isLeaf = defined->IsLeaf();
-    CodeBuilder::strength strength = CodeBuilder::ALWAYS;
-    if (isLeaf)
+Procedure::Procedure(Context *context, Tree *self, uint nInputs, uint nLocals)
+// ----------------------------------------------------------------------------
+//   Create a proc
+// ----------------------------------------------------------------------------
+    : Code(context, self), nInputs(nInputs), nLocals(nLocals),
+      captured(), inputIDs(), type(), generic(nullptr), guard(), variants()
+{}
+
+
+Procedure::Procedure(Procedure *original, Data data, ParmOrder &capture)
+// ----------------------------------------------------------------------------
+//    Copy constructor used for closures
+// ----------------------------------------------------------------------------
+    : Code(original->context, original->self),
+      nInputs(original->nInputs), nLocals(original->nLocals),
+      captured(), inputIDs(), type(), generic(nullptr), guard(), variants()
+{
+    // We have no instrs, so we don't "own" the instructions
+    ops = original->ops;
+    bytecode = original->bytecode;
+    entry = original->entry;
+    std::copy(original->optimized, original->optimized + PASSES, optimized);
+
+    // Copy data in the closure from current data
+    uint max = capture.size();
+    captured.reserve(max);
+    for (uint p = 0; p < max; p++)
     {
-        if (defined != xl_self && !Tree::Equal(defined, self))
-        {
-            record(bytecode,
-                   "Compile %d:%d (%t) from constant %t - MISMATCH",
-                   depth, cindex, self, decl->left);
-            builder->failOp = oldFailOp;
-            delete failOp;
-            return nullptr;
-        }
-        argsCtx = context;
+        int id = capture[p];
+        Tree *arg = data[id];
+        captured.push_back(arg);
     }
-    else
-    {
-        // Create the scope for binding the parameters
-        argsCtx = new Context(declScope);
-        argsCtx->CreateScope();
-        builder->argsCtx = argsCtx;
+}
 
-        // Remember the old end in case we did not generate code
-        Op **lastOp = builder->lastOp;
-        uint lastInstrSize = builder->instrs.size();
 
-        // Check bindings of arguments to declaration, exit if fails
-        strength = decl->left->Do(builder);
-        if (strength == CodeBuilder::NEVER)
-        {
-            record(bytecode, "Compile %d:%d (%t) from %t - MISMATCH",
-                   depth, cindex, self, decl->left);
+Procedure::~Procedure()
+// ----------------------------------------------------------------------------
+//    Destructor for procs
+// ----------------------------------------------------------------------------
+{
+    for (Procedure *variant : variants)
+        delete variant;
+}
 
-            // Remove the instructions that were added and the failed exit
-            *lastOp = nullptr;
-            uint lastNow = builder->instrs.size();
-            for (uint i = lastInstrSize; i < lastNow; i++)
-                delete builder->instrs[i];
-            builder->instrs.resize(lastInstrSize);
-            builder->failOp = oldFailOp;
-            builder->lastOp = lastOp;
-            delete failOp;
-            return nullptr;
-        }
-        if (builder->resultType == tree_type)
-            builder->resultType = nullptr;
-    }
 
-    // Check if we have builtins (opcode or C bindings)
-    if (decl->right == xl_self)
-    {
-        // If the right is "self", just return the input
-        record(bytecode,
-               "Compile %d:%d (%t) from %t SELF",
-               depth, cindex, self, decl->left);
-        builder->Add(new SelfOp);
-    }
-    else if (Opcode *opcode = Interpreter::OpcodeInfo(decl))
+ulonglong Procedure::variantsBuilt = 0;
+ulonglong Procedure::guardHits = 0;
+ulonglong Procedure::guardFailures = 0;
+ulonglong Procedure::sitesRespecialized = 0;
+
+
+int Procedure::Specialize(Data args)
+// ----------------------------------------------------------------------------
+//   Return the index of a variant specialized for the kinds of the inputs
+// ----------------------------------------------------------------------------
+//   Only procedures we generated and that do not capture values are
+//   specialized, and only if some input is a natural, real or text.
+//   Variants that the optimizer could not improve are kept to remember
+//   that it's not worth trying again, but they are never returned.
+//   Returns -1 if there is no variant to run.
+{
+    if (generic || instrs.empty() || Closures())
+        return -1;
+
+    Kinds kinds;
+    bool  constant = false;
+    for (uint p = 0; p < nInputs; p++)
     {
-        // Cached callback - Make a copy
-        XL_ASSERT(!opcode->success);
-        Opcode *clone = opcode->Clone();
-        clone->SetParms(builder->parms);
-        builder->Add(clone);
-        record(bytecode,
-               "Compile %d:%d (%t) OPCODE %O SELF",
-               depth, cindex, self, (Op *) opcode);
+        Tree *arg = args[~int(p)];
+        if (!arg)
+            return -1;
+        kind k = arg->Kind();
+        kinds.push_back(k);
+        if (k <= TEXT)
+            constant = true;
     }
-    else if (isLeaf)
+    if (!constant)
+        return -1;
+
+    for (uint v = 0; v < variants.size(); v++)
+        if (variants[v]->guard == kinds)
+            return variants[v]->optimized[KINDS] ? int(v) : -1;
+
+    // Procedures loaded from the cache can't compile new variants
+    if (inputIDs.size() != nInputs)
+        return -1;
+
+    if (variants.size() >= (uint) RECORDER_TWEAK(bytecode_max_variants))
     {
-        // Assign an ID for names
-        builder->Evaluate(context, defined);
+        record(bytecode_variants, "No variant of %t, %u already",
+               self, variants.size());
+        return -1;
     }
-    else
+
+    // Errors were reported when compiling the generic code, if at all
+    TreeList    noCaptures;
+    CodeBuilder builder(noCaptures);
+    Errors      errors;
+    Procedure  *variant = builder.Specialize(this, kinds);
+    if (errors.Swallowed())
     {
-        // Normal case: evaluate body of the declaration in the new context
-        CallOp *call = builder->Call(argsCtx, decl->right,
-                                     builder->resultType,
-                                     builder->outputs, builder->parms);
-        builder->Add(call);
+        delete variant;
+        variant = nullptr;
     }
+    if (!variant)
+        return -1;
+    variants.push_back(variant);
+    variantsBuilt++;
+    record(bytecode_variants, "Variant %u of %t: %O",
+           variants.size(), self, (Op *) variant);
+    return variant->optimized[KINDS] ? int(variants.size() - 1) : -1;
+}
 
-    // Successful evaluation
-    builder->Success();
-
-    // Keep looking for other declarations
-    record(bytecode, "Compile %d:%d (%t) SUCCESS",
-           depth, cindex, self);
 
-    if (strength == CodeBuilder::ALWAYS)
-        return decl;
-    return nullptr;
+bool Procedure::Guard(Data args)
+// ----------------------------------------------------------------------------
+//   Check if the inputs have the kinds this variant was specialized for
+// ----------------------------------------------------------------------------
+{
+    uint max = guard.size();
+    for (uint p = 0; p < max; p++)
+    {
+        Tree *arg = args[~int(p)];
+        if (!arg || arg->Kind() != guard[p])
+        {
+            guardFailures++;
+            return false;
+        }
+    }
+    guardHits++;
+    return true;
 }
 
 
-Procedure *CodeBuilder::Compile(Context *ctx, Tree *what,
-                               TreeIDs &callArgs, Tree *type)
+Op *Procedure::Run(Data data)
 // ----------------------------------------------------------------------------
-//    Compile the tree
+//   Create a new scope and run all instructions in the sequence
 // ----------------------------------------------------------------------------
 {
-    // Check if we already compiled this particular tree (possibly recursive)
-    Procedure *proc = what->GetInfo<Procedure>();
-    if (proc)
+    Scope *scope     = context->Symbols();
+    uint   offset    = OffsetSize();
+    Frame  frame(FrameSize(), offset);
+    if (!frame.data)
     {
-        captured = proc->captured;
-        return proc;
+        DataResult(data, Ooops("Out of memory calling $1", self));
+        return nullptr;
     }
+    Data   newData   = frame.data + offset;
 
-    // Does not exist yet, set it up
-    Save<Context_p> saveParmsCtx(parmsCtx, ctx);
-    uint nArgs = callArgs.size();
-    Save<TreeIDs> saveInputs(inputs, callArgs);
-    proc = new Procedure(ctx, what, nArgs, 0);
-    what->SetInfo<Code>(proc);
+    // Initialize self and scope
+    newData[0] = self;
+    newData[1] = scope;
 
-    // Evaluate the input code
-    bool result = true;
-    Errors *errors = MAIN->errors;
-    uint errCount = errors->Count();
-    if (ctx->ProcessDeclarations(what) && errCount == errors->Count())
-        result = Instructions(ctx, what);
+    // Borrow input arguments, they remain in the caller's frame
+    uint inputs   = Inputs();
+    Data oarg = &newData[-1];
+    Data iarg = &data[-1];
+    for (uint a = 0; a < inputs; a++)
+        frame.stack.Borrow(oarg--, *iarg--);
 
-    // Check if there is a result type, if so add a type check
-    if (type)
-        AddTypeCheck(ctx, what, type);
+    // Borrow closure data if any, it is held by this procedure
+    uint closures = Closures();
+    if (closures)
+    {
+        Data carg = ClosureData();
+        for (uint c = 0; c < closures; c++)
+            frame.stack.Borrow(oarg--, *carg++);
+    }
 
-    // The generated code takes over the instructions in all cases
-    proc->SetOps(&ops, &instrs, nEvals + nParms);
-    if (result)
+    if (CodeProfile::enabled)
     {
-        // Successful compilation - Return the code we created
-        proc->nInputs = nArgs + captured.size();
-        proc->nLocals = nEvals + nParms + 2;
-        proc->captured = captured;
+        CodeProfile::codes.insert(this);
+        runs++;
+    }
 
-        record(bytecode_output, "Code %t: %O", what, (Op *) proc);
+    // Execute the following instructions in the newly created data context
+    if (entry != Instr::END && RECORDER_TWEAK(bytecode_threaded))
+        Execute(newData, entry);
+    else
+        RunOps(ops, newData);
 
-        return proc;
-    }
+    // Copy result and current context to the old data
+    Tree *result = DataResult(newData);
+    DataResult(data, result);
 
-    // We failed, delete the result and return
-    what->Purge<Code>();
-    return nullptr;
+    // Evaluate next instruction (the frame is released on return)
+    return success;
 }
 
 
-Op *CodeBuilder::CompileInternal(Context *ctx, Tree *what, bool deferEval)
+void Procedure::Dump(std::ostream &out)
 // ----------------------------------------------------------------------------
-//   Compile an internal code sequence
+//   Dump all the instructions
 // ----------------------------------------------------------------------------
 {
-    // Check if we already have translated expression in this builder
-    Op *result = subexprs[what];
-    if (result)
-        return result;
+    out << OpID() << "\t" << (void *) (Op *) this
+        << "\tentry\t" << (void *) ops
+        << "\t" << self << "\n";
+    out << "\talloc"
+        << "\tI" << Inputs() << " L" << Locals() << " C" << Closures() << "\n";
+    if (generic)
+    {
+        kstring kinds[] = { "natural", "real", "text", "name",
+                            "block", "prefix", "postfix", "infix" };
+        out << "\tguard";
+        for (uint p = 0; p < guard.size(); p++)
+            out << (p ? "," : "\t") << kinds[guard[p]];
+        out << "\n";
+    }
+    DumpOptimized(out, optimized);
+    if (CodeProfile::enabled)
+        DumpProfile(out);
+    Code::Dump(out, ops, instrs, &bytecode);
+}
 
-    // Save the place where we insert instructions
-    Save<Op *>      saveOps(ops, nullptr);
-    Save<Op **>     saveLastOp(lastOp, &ops);
-    ParmOrder       noParms;
-    Save<ParmOrder> saveParms(parms, noParms);
-    Save<bool>      saveDefer(defer, deferEval);
 
-    Errors *errors = MAIN->errors;
-    uint errCount = errors->Count();
-    if (ctx->ProcessDeclarations(what) && errCount == errors->Count())
-        Instructions(ctx, what);
-    result = ops;
-    subexprs[what] = result;
 
-    // Evals and parms are the max number for all subexpressions
-    uint np = parms.size() + 2;
-    if (nParms < np)
-        nParms = np;
+// ============================================================================
+//
+//   Stack of frames for procedure calls
+//
+// ============================================================================
 
-    return result;
-}
+ulonglong FrameStack::peak = 0;
 
 
-bool CodeBuilder::Instructions(Context *ctx, Tree *what)
+FrameStack::FrameStack()
 // ----------------------------------------------------------------------------
-//    Compile an instruction or a sequence of instructions
+//   Create an empty stack, segments are allocated on demand
 // ----------------------------------------------------------------------------
-{
-    Save<Op *> saveSuccessOp(successOp, nullptr);
-    Save<Op *> saveFailOp(failOp, nullptr);
-    Scope_p    originalScope = ctx->Symbols();
+    : segments(), top(0), depth(0)
+{}
+
+
+FrameStack::~FrameStack()
+// ----------------------------------------------------------------------------
+//   Free all segments, which must be unused at that point
+// ----------------------------------------------------------------------------
+{
+    for (Segment &s : segments)
+    {
+        XL_ASSERT(s.used == 0 && "Destroying frame stack with live frames");
+        free(s.base);
+    }
+}
+
+
+Data FrameStack::Allocate(uint size)
+// ----------------------------------------------------------------------------
+//   Carve a frame of 'size' null slots at the top of the stack, null if no memory
+// ----------------------------------------------------------------------------
+{
+    // Move to the next segment if the current one is full
+    if (segments.empty() || segments[top].used + size > segments[top].size)
+    {
+        if (!segments.empty() && segments[top].used)
+            top++;
+        while (top < segments.size() && segments[top].size < size)
+        {
+            free(segments[top].base);
+            segments.erase(segments.begin() + top);
+        }
+        if (top >= segments.size())
+        {
+            uint slots = RECORDER_TWEAK(bytecode_stack_segment);
+            if (slots < size)
+                slots = size;
+
+            // A null Tree_p is all zero bits, see Borrow below
+            Tree_p *base = (Tree_p *) calloc(slots, sizeof(Tree_p));
+            if (!base)
+            {
+                // Leave the stack as it was, Procedure::Run reports it
+                if (top)
+                    top--;
+                return nullptr;
+            }
+            segments.push_back(Segment { base, slots, 0 });
+            record(bytecode_stack, "Segment %u with %u slots at %p",
+                   top, slots, base);
+        }
+    }
+
+    Segment &segment = segments[top];
+    Data frame = segment.base + segment.used;
+    segment.used += size;
+    depth += size;
+    if (peak < depth)
+        peak = depth;
+    return frame;
+}
+
+
+void FrameStack::Borrow(Data slot, Tree *value)
+// ----------------------------------------------------------------------------
+//   Store a value owned by the caller in a slot without taking a reference
+// ----------------------------------------------------------------------------
+{
+    static_assert(sizeof(Tree_p) == sizeof(Tree *),
+                  "Borrowed slots require Tree_p to be a plain pointer");
+    XL_ASSERT(!slot->Pointer() && "Borrowing into a live slot");
+    memcpy((void *) slot, (void *) &value, sizeof(value));
+}
+
+
+void FrameStack::Release(Data frame, uint size, uint borrowed)
+// ----------------------------------------------------------------------------
+//   Release the frame at top of stack, dropping references it owns
+// ----------------------------------------------------------------------------
+{
+    Segment &segment = segments[top];
+    XL_ASSERT(frame + size == segment.base + segment.used &&
+              "Frames must be released in LIFO order");
+
+    // Borrowed slots are simply forgotten, owned slots are released
+    memset((void *) frame, 0, borrowed * sizeof(Tree_p));
+    for (uint s = borrowed; s < size; s++)
+        frame[s] = nullptr;
+
+    segment.used -= size;
+    depth -= size;
+    if (segment.used == 0 && top > 0)
+        top--;
+}
+
+
+FrameStack &FrameStack::Current()
+// ----------------------------------------------------------------------------
+//   Return the frame stack for the current thread
+// ----------------------------------------------------------------------------
+{
+    static thread_local FrameStack stack;
+    return stack;
+}
+
+
+
+// ============================================================================
+//
+//   Building a code sequence and variants
+//
+// ============================================================================
+
+CodeBuilder::CodeBuilder(TreeList &captured)
+// ----------------------------------------------------------------------------
+//   Create a code builder
+// ----------------------------------------------------------------------------
+    : ops(nullptr), lastOp(&ops),
+      inputs(), values(), captured(captured),
+      nEvals(0), nParms(0), candidates(0),
+      test(nullptr), resultType(nullptr),
+      context(nullptr), parmsCtx(nullptr), argsCtx(nullptr),
+      failOp(nullptr), successOp(nullptr),
+      instrs(), subexprs(), parms(), defer(false)
+{}
+
+
+CodeBuilder::~CodeBuilder()
+// ----------------------------------------------------------------------------
+//    Delete all instructions if the list was not transferred
+// ----------------------------------------------------------------------------
+{
+    for (Ops::iterator o = instrs.begin(); o != instrs.end(); o++)
+        delete *o;
+    instrs.clear();
+}
+
+
+CodeBuilder::depth CodeBuilder::ScopeDepth(Scope *scope)
+// ----------------------------------------------------------------------------
+//   Return true if the given scope is local to the current proc
+// ----------------------------------------------------------------------------
+{
+    Scope *parmsScope = parmsCtx->Symbols();
+    Scope *globalScope = MAIN->context.Symbols();
+    uint count = 0;
+
+    // Loop on scope, looking for either current parm scope or global scope
+    while (scope)
+    {
+        if (scope == parmsScope)
+            return count ? LOCAL : PARAMETER;
+        if (scope == globalScope)
+            return count ? ENCLOSING : GLOBAL;
+        scope = Enclosing(scope);
+        count++;
+    }
+
+    // If we reached the end without seeing the current global scope,
+    // this means this is a global scope (probably some other file)
+    return GLOBAL;
+}
+
+
+void CodeBuilder::Add(Op *op)
+// ----------------------------------------------------------------------------
+//    Add an instruction in the generated code
+// ----------------------------------------------------------------------------
+{
+    XL_ASSERT(count(instrs.begin(), instrs.end(), op) == 0);
+    instrs.push_back(op);
+    *lastOp = op;
+    lastOp = &op->success;
+    XL_ASSERT(!op->success && "Adding an instruction that has kids");
+}
+
+
+void CodeBuilder::AddEval(int id, Op *op)
+// ----------------------------------------------------------------------------
+//    Add an evaluation in the generated code, simplify if 'Quick'
+// ----------------------------------------------------------------------------
+{
+    Add(new EvalOp(id, op, failOp));
+}
+
+
+void CodeBuilder::AddTypeCheck(Context *context, Tree *what, Tree *type,
+                               int valueID)
+// ----------------------------------------------------------------------------
+//   Add type check if necessary
+// ----------------------------------------------------------------------------
+//   If 'valueID' is 0, the value is the local slot for 'what'
+{
+    if (type)
+        if (Name *name = type->AsName())
+            if (Tree *original = context->Bound(name))
+                type = original;
+    if (resultType)
+        if (Name *name = resultType->AsName())
+            if (Tree *original = context->Bound(name))
+                resultType = original;
+
+    // Unify form for 'catch-all' type
+    if (!type)
+        type = tree_type;
+    if (!resultType)
+        resultType = tree_type;
+    if (resultType == tree_type)
+        return;
+
+    // Check if we have some static match
+    if (what->IsConstant())
+        if (xl_typecheck(context->Symbols(), type, what))
+            return;
+
+    // Check if types match statically
+    if (type == resultType)
+        return;
+
+    // Otherwise, we need to generate a dynamic match
+    if (!valueID)
+        valueID = ValueID(what);
+
+    // Built-in types evaluate to themselves, check against them directly
+    Opcode *opcode = type->GetInfo<Opcode>();
+    if (NameOpcode *builtin = dynamic_cast<NameOpcode *>(opcode))
+    {
+        Add(new TypeCheckOp(valueID, builtin->Shape(), failOp));
+        return;
+    }
+    int typeID = Evaluate(context, type);
+    Add(new TypeCheckOp(valueID, typeID, failOp));
+}
+
+
+void CodeBuilder::Success()
+// ----------------------------------------------------------------------------
+//    Success at the end of a declaration
+// ----------------------------------------------------------------------------
+{
+    XL_ASSERT(successOp && failOp);
+    XL_ASSERT(count(instrs.begin(), instrs.end(), failOp) == 0);
+
+    record(bytecode, "SUCCESS: %O FAIL: %O", successOp, failOp);
+
+    // End current stream to the success exit, restart code gen at failure exit
+    *lastOp = successOp;
+    XL_ASSERT(failOp && "Success without a failure exit");
+
+    lastOp = &failOp->success;
+    instrs.push_back(failOp);
+    failOp = nullptr;
+
+    XL_ASSERT(!*lastOp);
+}
+
+
+void CodeBuilder::InstructionsSuccess(uint neOld)
+// ----------------------------------------------------------------------------
+//    At end of an instruction, mark success by recording number of evals
+// ----------------------------------------------------------------------------
+{
+    uint ne = values.size();
+    if (nEvals < ne)
+        nEvals = ne;
+    if (ne > neOld)
+        Add(new ClearOp(neOld+2, ne+1));
+    if (defer)
+        Add(new ClosureOp(context));
+}
+
+
+
+// ============================================================================
+//
+//    Compilation of the tree
+//
+// ============================================================================
+//
+//  The 'Instructions' function evaluates candidates in the symbol table.
+//  Each specific declaration causes an invokation of compileLookup.
+//
+//  Consider the following code:
+//
+//      foo X:natural, Y:natural -> foo1
+//      foo A:natural, B         -> foo2
+//      foo U, V
+//      write "Toto"
+//
+//  The generated code will look like this
+//      ;; Evaluate foo1 candidate
+//
+//      ;; Match U against X:natural
+//      Evaluate U              or goto fail1.1         (EvalOp)
+//      Evaluate natural        or goto fail1.1         (EvalOp)
+//      TypeCheck U : natural   or goto fail1.1         (TypeCheckOp)
+//
+//      ;; Match V against Y:natural
+//      Evaluate V              or goto fail1.1         (EvalOp)
+//      Evaluate natural        or goto fail1.1         (EvalOp - SaveLeft)
+//      TypeCheck V : natural   or goto fail1.1         (TypeCheckOp)
+//
+//      ;; Call foo1
+//      Call foo1 (id(U), id(V)) @ parmSize             (CallOp)
+//
+//      ;; Done, successful evaluation, goto is in 'success' field
+//      goto success1
+//
+//    fail1.1:                                          (LabelOp)
+//      Evaluate U              or goto fail1.2         (EvalOp)
+//      Evaluate natural        or goto fail1.2         (EvalOp)
+//      ...
+//      Call foo2                                       (CallOp)
+//      goto success1
+//
+//    fail1.2:                                          (LabelOp)
+//      FormError                                       (FormErrorOp)
+//
+//    success1:                                         (LabelOp)
+//      ;; Same thing for write "Toto"
+//
+//  The 'goto' in the above are implicit, marked by 'success' or 'fail' in Op.
+
+static Tree *compileLookup(Scope *evalScope, Scope *declScope,
+                           Tree *self, Infix *decl, void *cb)
+// ----------------------------------------------------------------------------
+//    Lookup a given declaration and generate code for it
+// ----------------------------------------------------------------------------
+{
+    static uint  depth = 0;
+    Save<uint>   saveDepth(depth, depth+1);
+
+    CodeBuilder *builder = (CodeBuilder *) cb;
+    uint         cindex = builder->candidates++;
+
+    record(bytecode,
+           "Compile %d:%d (%t) from %t",
+           depth, cindex, self, decl->left);
+
+    // Create the scope for evaluation
+    Context_p    context = new Context(evalScope);
+    Context_p    argsCtx = nullptr;
+
+    // Save current state of the builder
+    Save<Tree_p>    saveSelf(builder->test, self);
+    Save<Context_p> saveContext(builder->context, context);
+    Save<Context_p> saveArgsCtx(builder->argsCtx, argsCtx);
+
+    // Create the exit point for failed evaluation
+    Op *         oldFailOp = builder->failOp;
+    Op *         failOp = new LabelOp("fail");
+    builder->failOp = failOp;
+    builder->resultType = nullptr;
+
+    // We start with new parameters for each candidate
+    ParmOrder           noParms;
+    TreeIDs             empty;
+    Save<ParmOrder>     saveParmOrder(builder->parms, noParms);
+    Save<TreeIDs>       saveOutputs(builder->outputs, empty);
+
+    // If we lookup a name or a number, just return it
+    Tree *defined = PatternBase(decl->left);
+    bool isLeaf = defined->IsLeaf();
+    CodeBuilder::strength strength = CodeBuilder::ALWAYS;
+    if (isLeaf)
+    {
+        if (defined != xl_self && !Tree::Equal(defined, self))
+        {
+            record(bytecode,
+                   "Compile %d:%d (%t) from constant %t - MISMATCH",
+                   depth, cindex, self, decl->left);
+            builder->failOp = oldFailOp;
+            delete failOp;
+            return nullptr;
+        }
+        argsCtx = context;
+    }
+    else
+    {
+        // Create the scope for binding the parameters
+        argsCtx = new Context(declScope);
+        argsCtx->CreateScope();
+        builder->argsCtx = argsCtx;
+
+        // Remember the old end in case we did not generate code
+        Op **lastOp = builder->lastOp;
+        uint lastInstrSize = builder->instrs.size();
+
+        // Check bindings of arguments to declaration, exit if fails
+        strength = decl->left->Do(builder);
+        if (strength == CodeBuilder::NEVER)
+        {
+            record(bytecode, "Compile %d:%d (%t) from %t - MISMATCH",
+                   depth, cindex, self, decl->left);
+
+            // Remove the instructions that were added and the failed exit
+            *lastOp = nullptr;
+            uint lastNow = builder->instrs.size();
+            for (uint i = lastInstrSize; i < lastNow; i++)
+                delete builder->instrs[i];
+            builder->instrs.resize(lastInstrSize);
+            builder->failOp = oldFailOp;
+            builder->lastOp = lastOp;
+            delete failOp;
+            return nullptr;
+        }
+        if (builder->resultType == tree_type)
+            builder->resultType = nullptr;
+    }
+
+    // Check if we have builtins (opcode or C bindings)
+    if (decl->right == xl_self)
+    {
+        // If the right is "self", just return the input
+        record(bytecode,
+               "Compile %d:%d (%t) from %t SELF",
+               depth, cindex, self, decl->left);
+        builder->Add(new SelfOp);
+    }
+    else if (Opcode *opcode = Interpreter::OpcodeInfo(decl))
+    {
+        // Cached callback - Make a copy
+        XL_ASSERT(!opcode->success);
+        Opcode *clone = opcode->Clone();
+        clone->SetParms(builder->parms);
+        builder->Add(clone);
+        record(bytecode,
+               "Compile %d:%d (%t) OPCODE %O SELF",
+               depth, cindex, self, (Op *) opcode);
+    }
+    else if (isLeaf)
+    {
+        // Assign an ID for names, and return the value it holds, since
+        // evaluating an input or a captured value does not set the result
+        int id = builder->Evaluate(context, defined);
+        builder->Add(new ValueOp(id));
+    }
+    else
+    {
+        // Normal case: evaluate body of the declaration in the new context
+        CallOp *call = builder->Call(argsCtx, decl->right,
+                                     builder->resultType,
+                                     builder->outputs, builder->parms);
+        builder->Add(call);
+    }
+
+    // Successful evaluation
+    builder->Success();
+
+    // Keep looking for other declarations
+    record(bytecode, "Compile %d:%d (%t) SUCCESS",
+           depth, cindex, self);
+
+    if (strength == CodeBuilder::ALWAYS)
+        return decl;
+    return nullptr;
+}
+
+
+Procedure *CodeBuilder::Compile(Context *ctx, Tree *what,
+                               TreeIDs &callArgs, Tree *type)
+// ----------------------------------------------------------------------------
+//    Compile the tree
+// ----------------------------------------------------------------------------
+{
+    // Check if we already compiled this particular tree (possibly recursive)
+    Procedure *proc = what->GetInfo<Procedure>();
+    if (proc)
+    {
+        captured = proc->captured;
+        return proc;
+    }
+
+    // Does not exist yet, set it up
+    proc = new Procedure(ctx, what, callArgs.size(), 0);
+    what->SetInfo<Code>(proc);
+    if (Build(proc, callArgs, type))
+        return proc;
+
+    // We failed, delete the result and return
+    what->Purge<Code>();
+    return nullptr;
+}
+
+
+Procedure *CodeBuilder::Specialize(Procedure *generic, Kinds &kinds)
+// ----------------------------------------------------------------------------
+//    Compile a variant of a procedure for the given kinds of inputs
+// ----------------------------------------------------------------------------
+//    The variant is compiled again from the source, and the optimizer uses
+//    the input kinds to remove evaluations and type checks that the guard
+//    makes redundant. It is not attached to the tree, so recursive calls
+//    go through the generic procedure, and may then select a variant.
+{
+    Procedure *variant = new Procedure(generic->context, generic->self,
+                                       generic->inputIDs.size(), 0);
+    variant->generic = generic;
+    variant->guard = kinds;
+    if (Build(variant, generic->inputIDs, generic->type) &&
+        variant->nInputs == generic->nInputs)
+        return variant;
+
+    record(bytecode_variants, "Failed to specialize %t", generic->self);
+    delete variant;
+    return nullptr;
+}
+
+
+bool CodeBuilder::Build(Procedure *proc, TreeIDs &callArgs, Tree *type)
+// ----------------------------------------------------------------------------
+//    Generate the code for a procedure
+// ----------------------------------------------------------------------------
+{
+    Context *ctx = proc->context;
+    Tree *what = proc->self;
+    Save<Context_p> saveParmsCtx(parmsCtx, ctx);
+    uint nArgs = callArgs.size();
+    Save<TreeIDs> saveInputs(inputs, callArgs);
+    proc->inputIDs = callArgs;
+    proc->type = type;
+
+    // Evaluate the input code
+    // Declarations were already processed when compiling a variant
+    bool result = true;
+    Errors *errors = MAIN->errors;
+    uint errCount = errors->Count();
+    if (proc->generic)
+        result = Instructions(ctx, what);
+    else if (ctx->ProcessDeclarations(what) && errCount == errors->Count())
+        result = Instructions(ctx, what);
+
+    // Check if there is a result type, if so add a type check
+    if (type)
+        AddTypeCheck(ctx, what, type);
+
+    // The generated code takes over the instructions in all cases
+    // Only optimize it if it compiled cleanly, since after an error,
+    // it may still refer to code that is about to be purged
+    bool clean = result && errCount == errors->Count();
+    proc->SetOps(&ops, &instrs, nEvals + nParms, clean);
+    if (proc->generic && !clean)
+        return false;
+    if (result)
+    {
+        // Successful compilation - Return the code we created
+        proc->nInputs = nArgs + captured.size();
+        proc->nLocals = nEvals + nParms + 2;
+        proc->captured = captured;
+
+        record(bytecode_output, "Code %t: %O", what, (Op *) proc);
+    }
+    return result;
+}
+
+
+Op *CodeBuilder::CompileInternal(Context *ctx, Tree *what, bool deferEval)
+// ----------------------------------------------------------------------------
+//   Compile an internal code sequence
+// ----------------------------------------------------------------------------
+{
+    // Check if we already have translated expression in this builder
+    Op *result = subexprs[what];
+    if (result)
+        return result;
+
+    // Save the place where we insert instructions
+    Save<Op *>      saveOps(ops, nullptr);
+    Save<Op **>     saveLastOp(lastOp, &ops);
+    ParmOrder       noParms;
+    Save<ParmOrder> saveParms(parms, noParms);
+    Save<bool>      saveDefer(defer, deferEval);
+
+    Errors *errors = MAIN->errors;
+    uint errCount = errors->Count();
+    if (ctx->ProcessDeclarations(what) && errCount == errors->Count())
+        Instructions(ctx, what);
+    result = ops;
+    subexprs[what] = result;
+
+    // Evals and parms are the max number for all subexpressions
+    uint np = parms.size() + 2;
+    if (nParms < np)
+        nParms = np;
+
+    return result;
+}
+
+
+bool CodeBuilder::Instructions(Context *ctx, Tree *what)
+// ----------------------------------------------------------------------------
+//    Compile an instruction or a sequence of instructions
+// ----------------------------------------------------------------------------
+{
+    Save<Op *> saveSuccessOp(successOp, nullptr);
+    Save<Op *> saveFailOp(failOp, nullptr);
+    Scope_p    originalScope = ctx->Symbols();
     Context_p  gcContext     = ctx;
     TreeIDs    empty;
 
-    while (what)
+    while (what)
+    {
+        Save<TreeIDs> saveEvals(values, values);
+
+        // Create new success exit for this expression
+        Op *success = new LabelOp("success");
+        successOp = success;
+
+        // Lookup candidates (and count them)
+        Save<uint> saveCandidates(candidates, 0);
+        ctx->Lookup(what, compileLookup, this);
+
+        if (candidates)
+        {
+            // We found candidates. Join the failOp to the successOp
+            XL_ASSERT(!*lastOp && "Built code that is not NULL-terminated");
+
+            Add(new FormErrorOp(what));
+            *lastOp = success;
+
+            lastOp = &success->success;
+            instrs.push_back(success);
+
+            InstructionsSuccess(saveEvals.saved.size());
+            return true;
+        }
+
+        // In that case, the 'success' label was not used
+        delete success;
+        successOp = nullptr;
+
+        // Forms that we recognize directly and deal with here
+        kind whatK = what->Kind();
+        switch (whatK)
+        {
+        case NATURAL:
+        case REAL:
+        case TEXT:
+        case NAME:
+            // If not looked up, return the original
+            Add(new ConstOp(what));
+            InstructionsSuccess(saveEvals.saved.size());
+            return true;
+
+        case BLOCK:
+        {
+            // Evaluate child in a new context
+            ctx->CreateScope();
+            what = ((Block *) (Tree *) what)->child;
+            bool hasInstructions = ctx->ProcessDeclarations(what);
+            bool hasDecls = !ctx->IsEmpty();
+            if (!hasDecls)
+                ctx->PopScope();
+            if (hasInstructions)
+                continue;
+            if (hasDecls)
+                what = Interpreter::MakeClosure(ctx, what);
+            Add(new ConstOp(what));
+            if (hasDecls)
+                ctx->PopScope();
+            InstructionsSuccess(saveEvals.saved.size());
+            return true;
+        }
+
+        case PREFIX:
+        {
+            // If we have a prefix on the left, check if it's a closure
+            if (Tree *closed = Interpreter::IsClosure(what, &gcContext))
+            {
+                ctx = gcContext;
+                what = closed;
+                continue;
+            }
+
+            // If we have a name on the left, lookup name and start again
+            Prefix *pfx = (Prefix *) (Tree *) what;
+            Tree   *callee = pfx->left;
+            Tree   *arg = pfx->right;
+
+            while (Block *block = callee->AsBlock())
+                callee = block->child;
+
+            if (Name *name = callee->AsName())
+            {
+                // A few cases where we don't interpret the result
+                if (name->value == "type"   ||
+                    name->value == "extern" ||
+                    name->value == "data")
+                {
+                    InstructionsSuccess(saveEvals.saved.size());
+                    return true;
+                }
+            }
+
+            // Create a call for forms like (X -> X+1) 31
+            if (Infix *lifx = callee->AsInfix())
+            {
+                if (IsDefinition(lifx))
+                {
+                    TreeIDs   outs;
+                    ParmOrder parms;
+
+                    // If we have a single name on the left, like (X->X+1)
+                    // interpret that as a lambda function
+                    int argID = Evaluate(ctx, arg);
+                    parms.push_back(argID);
+
+                    // Context to declare the arguments of the lambda function
+                    ctx = new Context(ctx);
+
+                    if (Name *lfname = lifx->left->AsName())
+                    {
+                        // Case like '(X->X+1) Arg':
+                        // Bind arg in new context and evaluate body
+                        Rewrite *rw = ctx->Define(lfname, arg);
+                        outs[rw->left] = -1;
+                        CallOp *call = Call(ctx, lifx->right, nullptr,
+                                            outs, parms);
+                        Add(call);
+                        return true;
+                    }
+                    else
+                    {
+                        // Otherwise, map argument to declaration, e.g.
+                        // '(X,Y->X+Y) (2,3)' should evaluate as 5
+                        success = new LabelOp("lambda_s");
+                        successOp = success;
+                        Save<uint> saveCand(candidates, 0);
+                        compileLookup(originalScope, originalScope,
+                                      arg, lifx, this);
+                        if (candidates)
+                        {
+                            Add(new FormErrorOp(what));
+                            *lastOp = success;
+                            lastOp = &success->success;
+                            instrs.push_back(success);
+                            InstructionsSuccess(saveEvals.saved.size());
+                            return true;
+                        }
+                        delete success;
+                        successOp = nullptr;
+                        Add(new FormErrorOp(what));
+                        return true;
+                    }
+                }
+            }
+
+            // Evaluate callee
+            int calleeID = Evaluate(ctx, callee);
+            int argID = Evaluate(ctx, arg);
+
+            // Lookup the argument in the callee's context
+            if (!failOp)
+            {
+                failOp = new PrefixFormErrorOp(what);
+                instrs.push_back(failOp);
+            }
+            Add (new IndexOp(calleeID, argID, failOp));
+            InstructionsSuccess(saveEvals.saved.size());
+            return true;
+        }
+
+        case POSTFIX:
+        {
+            // Check if there is a pattern that matches
+            Ooops("No postfix matches $1", what);
+            return false;
+        }
+
+        case INFIX:
+        {
+            Infix *infix = (Infix *) (Tree *) what;
+            text name = infix->name;
+
+            // Check sequences
+            if (name == ";" || name == "\n")
+            {
+                // Sequences: evaluate left, then right
+                if (!Instructions(ctx, infix->left))
+                    return false;
+                what = infix->right;
+                continue;
+            }
+
+            // Check declarations
+            if (name == "is")
+            {
+                // Declarations evaluate last non-declaration result, or self
+                InstructionsSuccess(saveEvals.saved.size());
+                return true;
+            }
+
+            // Check scoped reference
+            if (name == ".")
+            {
+                if (!Instructions(ctx, infix->left))
+                    return false;
+                what = infix->right;
+                continue;
+            }
+
+            // All other cases: return the input as is
+            Add(new ConstOp(what));
+            InstructionsSuccess(saveEvals.saved.size());
+            return true;
+        }
+        }
+    }
+    return false;
+}
+
+
+int CodeBuilder::ValueID(Tree *self)
+// ----------------------------------------------------------------------------
+//    Return the evaluation ID for a given expression
+// ----------------------------------------------------------------------------
+{
+    int id;
+
+    // For names, use the rewrite as a unique ID
+    Rewrite_p rw;
+    if (context)
+        if (Name *name = self->AsName())
+            if (context->Bound(name, true, &rw, nullptr))
+                self = rw;
+
+    TreeIDs::iterator found = values.find(self);
+    if (found == values.end())
+    {
+        id = values.size() + 2;
+        values[self] = id;
+    }
+    else
+    {
+        id = (*found).second;
+    }
+    return id;
+}
+
+
+int CodeBuilder::CaptureID(Tree *self)
+// ----------------------------------------------------------------------------
+//    Return the capture ID for a given expression
+// ----------------------------------------------------------------------------
+{
+    int id;
+    TreeIDs::iterator found = inputs.find(self);
+    if (found == inputs.end())
+    {
+        id = ~inputs.size();
+        outputs[self] = id;
+    }
+    else
+    {
+        id = (*found).second;
+    }
+    return id;
+}
+
+
+int CodeBuilder::Evaluate(Context *ctx, Tree *self, bool deferEval)
+// ----------------------------------------------------------------------------
+//   Evaluate the tree, and return its ID in the evals array
+// ----------------------------------------------------------------------------
+{
+    int id = 0;
+
+    // For constants, we can simply store it whenever we need it
+    if (self->IsConstant())
+    {
+        Instructions(ctx, self);
+        id = ValueID(self);
+        Add(new StoreOp(id));
+        return id;
+    }
+
+    // For names, look them up to check if we have them somewhere
+    if (Name *name = self->AsName())
+    {
+        bool      evaluate = true;
+        Rewrite_p rw;
+        Scope_p   scope;
+
+        if (Tree *value = ctx->Bound(name, true, &rw, &scope))
+        {
+            // Check if this is one of the input parameters
+            depth d = ScopeDepth(scope);
+            switch (d)
+            {
+            case PARAMETER:
+            {
+                TreeIDs::iterator found = inputs.find(rw);
+                if (found == inputs.end())
+                {
+                    // Closure body compiled in its parameters scope: capture
+                    id = CaptureID(rw);
+                    if (count(captured.begin(), captured.end(), rw) == 0)
+                        captured.push_back(rw);
+                    evaluate = false;
+                    break;
+                }
+                int inputId = (*found).second;
+
+                // Don't evaluate if already evaluated during argument passing
+                Tree *type = AnnotatedType(rw->left);
+                evaluate = false;
+                if (!type || type == tree_type)
+                {
+                    id = ValueID(rw);
+                    Add(new ArgEvalOp(ctx, inputId, id, failOp));
+                }
+                else
+                {
+                    id = inputId;
+                }
+                break;
+            }
+
+            // Check if this is a local variable or function
+            case LOCAL:
+            {
+                id = ValueID(rw);
+                Op *code = CompileInternal(context, value, false);
+                AddEval(id, code);
+                break;
+            }
+
+            // Global entities can be evaluated directly in place
+            case GLOBAL:
+            {
+                id = ValueID(rw);
+                break;
+            }
+
+            // All other values are 'captured' from surrounding context
+            case ENCLOSING:
+            {
+                id = CaptureID(rw);
+                if (count(captured.begin(), captured.end(), rw) == 0)
+                    captured.push_back(rw);
+                evaluate = false;
+                break;
+            }
+            } // switch
+
+            // Evaluate code associated to name if we need to
+            if (evaluate)
+            {
+                if (Opcode *opcode = value->GetInfo<Opcode>())
+                {
+                    Op *code = opcode->Clone();
+                    AddEval(id, code);
+                }
+                else if (Code *code = value->GetInfo<Code>())
+                {
+                    AddEval(id, code);
+                }
+                else
+                {
+                    // No code yet: generate it
+                    ParmOrder noParms;
+                    TreeIDs   noParmIDs;
+                    Tree *type = AnnotatedType(rw->left);
+                    CallOp *call = Call(ctx, value, type, noParmIDs, noParms);
+                    instrs.push_back(call);
+                    AddEval(id, call);
+                }
+            }
+
+            return id;
+        }
+    }
+
+    // Other cases: generate code for the value, and evaluate it
+    id = ValueID(self);
+    Op *ops = CompileInternal(ctx, self, deferEval);
+    AddEval(id, ops);
+
+    // Return the allocated ID
+    return id;
+}
+
+
+int CodeBuilder::EvaluationTemporary(Tree *self)
+// ----------------------------------------------------------------------------
+//    Create an evaluation temporary
+// ----------------------------------------------------------------------------
+{
+    uint id = ValueID(self);
+    Code *code = new Code(context, self, new ValueOp(id));
+    self->SetInfo<Code>(code);
+    return id;
+}
+
+
+CallOp *CodeBuilder::Call(Context *ctx, Tree *value, Tree *type,
+                          TreeIDs &parmIDs, ParmOrder &parms)
+// ----------------------------------------------------------------------------
+//   Generate the code sequence for a call
+// ----------------------------------------------------------------------------
+{
+    TreeList captured;
+    Procedure *fn = Bytecode::Compile(ctx, value, type, parmIDs, captured);
+
+    // Check if we captured values from the surrounding contexts
+    if (uint csize = captured.size())
+    {
+        for (uint c = 0; c < csize; c++)
+        {
+            Tree *cap = captured[c];
+            int id = ValueID(cap);
+            parms.insert(parms.begin(), id);
+        }
+    }
+
+    // Record the maximum parameter size
+    uint np = parms.size() + 2;
+    if (nParms < np)
+        nParms = np;
+
+    // Output slot where we will pass paramters and generate call
+    CallOp *call = new CallOp(fn, ~0U, parms);
+    return call;
+}
+
+
+
+// ============================================================================
+//
+//     Ops used during argument / parameter binding
+//
+// ============================================================================
+
+template<class T>
+struct MatchOp : FailOp
+// ----------------------------------------------------------------------------
+//   Check if the current result matches the natural/real/text value
+// ----------------------------------------------------------------------------
+{
+    MatchOp(typename T::value_t ref, Op *fail): FailOp(fail), ref(ref) {}
+    typename T::value_t ref;
+
+    virtual Op *        Run(Data data)
+    {
+        Tree *test = DataResult(data);
+        if (T *tval = test->As<T>())
+            if (tval->value == ref)
+                return success;
+        return fail;
+    }
+
+    virtual kstring     OpID()  { return "match"; }
+    virtual void        Dump(std::ostream &out)
+    {
+        out << OpID() << "\t" << ref;
+    }
+};
+
+template<> kstring MatchOp<Natural>::OpID()     { return "match\tnatural"; }
+template<> kstring MatchOp<Real>   ::OpID()     { return "match\treal"; }
+template<> kstring MatchOp<Text>   ::OpID()     { return "match\ttext"; }
+
+
+struct NaturalMatchOp : MatchOp<Natural>
+// ----------------------------------------------------------------------------
+//   Natural match with a compact encoding, e.g. for 'fib 0' vs. 'fib N'
+// ----------------------------------------------------------------------------
+{
+    NaturalMatchOp(Natural *pattern, Op *fail)
+        : MatchOp<Natural>(pattern->value, fail), pattern(pattern) {}
+    Natural_p pattern;
+
+    virtual void        Encode(Instr &instr)
+    {
+        instr.opcode = Instr::MATCH_NATURAL;
+        instr.value = pattern;
+    }
+};
+
+
+struct EvalMatchOp : EvalOp
+// ----------------------------------------------------------------------------
+//   Compare an evaluated natural with a constant and branch, e.g. 'fib 0'
+// ----------------------------------------------------------------------------
+//   This replaces an 'eval' followed by a natural 'match' of its result.
+//   The 'fail' exit is taken if evaluation fails, 'mismatch' if the value
+//   is not the expected natural.
+{
+    EvalMatchOp(int id, Op *ops, Op *fail, Natural *pattern, Op *mismatch)
+        : EvalOp(id, ops, fail), pattern(pattern), mismatch(mismatch) {}
+    Natural_p pattern;
+    Op *      mismatch;
+
+    virtual Op *        Run(Data data)
+    {
+        EvalOp::Run(data);
+        if (!data[id])
+            return fail;
+        Natural *test = DataResult(data)->AsNatural();
+        if (test && test->value == pattern->value)
+            return success;
+        return mismatch;
+    }
+
+    virtual kstring     OpID()  { return "evalmatch"; }
+    virtual void        Dump(std::ostream &out)
+    {
+        EvalOp::Dump(out);
+        out << "\t" << (Tree *) pattern
+            << Code::Ref(mismatch, "\t", "else", "return");
+    }
+    virtual void        Encode(Instr &instr)
+    {
+        // A mismatch that leaves the encoded code runs as GENERIC
+        uint other = Code::Index(mismatch);
+        if (mismatch && other == Instr::END)
+            return;
+        EvalOp::Encode(instr);
+        if (instr.opcode != Instr::EVAL)
+            return;
+        instr.opcode = Instr::EVAL_MATCH_NATURAL;
+        instr.value = pattern;
+        instr.other = other;
+    }
+};
+
+
+static Instr::opcode_t NaturalInstr(Opcode *opcode, uint form)
+// ----------------------------------------------------------------------------
+//   Return the compact encoding for a natural opcode, GENERIC if none
+// ----------------------------------------------------------------------------
+//   'form' is 0 with both operands in slots, 1 for a constant on the right,
+//   and 2 for a constant on the left, in the order of bytecode.tbl.
+{
+    static const struct { kstring name; Instr::opcode_t instr; } naturals[] =
+    {
+#define INSTR(Name, Descr)
+#define NATURAL(Name, Opcode, Result)   { #Opcode, Instr::Name },
+#include "bytecode.tbl"
+    };
+
+    // Only opcodes defined by BINARY_OP are pure, not those from INFIX
+    ParmOrder reads;
+    if (opcode->Pure(reads))
+        for (auto &natural : naturals)
+            if (strcmp(opcode->OpID(), natural.name) == 0)
+                return Instr::opcode_t(natural.instr + form);
+    return Instr::GENERIC;
+}
+
+
+void InfixOpcode::Encode(Instr &instr)
+// ----------------------------------------------------------------------------
+//   Natural arithmetic and comparisons read their two slots directly
+// ----------------------------------------------------------------------------
+{
+    Instr::opcode_t natural = NaturalInstr(this, 0);
+    if (natural == Instr::GENERIC)
+        return;
+    instr.opcode = natural;
+    Operands(instr.a, instr.b);
+}
+
+
+struct BinaryConstOp : Op
+// ----------------------------------------------------------------------------
+//   A binary opcode with a constant operand, e.g. 'N-1' or 'N < 2'
+// ----------------------------------------------------------------------------
+//   This replaces a 'const', 'store', opcode sequence. The constant is only
+//   stored in its slot if that slot is read later. We own the opcode, and
+//   its 'success' points to itself to tell success from an error (null).
+{
+    BinaryConstOp(InfixOpcode *opcode, Tree *value, int id, bool constLeft,
+                  int store)
+        : opcode(opcode), value(value), id(id), store(store),
+          constLeft(constLeft)
+    {
+        opcode->success = opcode;
+    }
+    ~BinaryConstOp()
+    {
+        delete opcode;
+    }
+    InfixOpcode *opcode;
+    Tree_p       value;
+    int          id;
+    int          store;
+    bool         constLeft;
+
+    virtual Op *        Run(Data data)
+    {
+        if (store)
+            data[store] = value;
+        Tree *other = data[id];
+        Op *next = constLeft
+            ? opcode->Compute(data, value, other)
+            : opcode->Compute(data, other, value);
+        if (next)
+            return success;
+
+        // On error, the result is the constant, as with the original ops
+        DataResult(data, value);
+        return nullptr;
+    }
+
+    virtual kstring     OpID()  { return opcode->OpID(); }
+    virtual void        Encode(Instr &instr)
+    {
+        Instr::opcode_t natural = NaturalInstr(opcode, constLeft ? 2 : 1);
+        if (natural == Instr::GENERIC)
+            return;
+        instr.opcode = natural;
+        instr.a = id;
+        instr.b = store;
+        instr.value = value;
+    }
+    virtual void        Dump(std::ostream &out)
+    {
+        out << OpID() << "\t";
+        if (constLeft)
+            out << "[" << value << "]," << id;
+        else
+            out << id << ",[" << value << "]";
+        if (store)
+            out << "\tstore\t" << store;
+    }
+};
+
+
+struct NameMatchOp : FailOp
+// ----------------------------------------------------------------------------
+//   Check if the current top of stack matches the name
+// ----------------------------------------------------------------------------
+{
+    NameMatchOp(int testID, int nameID, Op *fail)
+        : FailOp(fail), testID(testID), nameID(nameID) {}
+    int testID;
+    int nameID;
+
+    virtual Op *        Run(Data data)
+    {
+        Tree *test = data[testID];
+        Tree *ref  = data[nameID];
+        if (Tree::Equal(ref, test))
+            return success;
+        return fail;
+    }
+    virtual kstring     OpID()  { return "match\tname"; }
+    virtual void        Dump(std::ostream &out)
+    {
+        out << OpID() << "\t" << testID << "," << nameID;
+    }
+    virtual void        Encode(Instr &instr)
+    {
+        instr.opcode = Instr::NAME_MATCH;
+        instr.a = testID;
+        instr.b = nameID;
+    }
+};
+
+
+struct WhenClauseOp : FailOp
+// ----------------------------------------------------------------------------
+//   Check if the condition in a when clause is verified
+// ----------------------------------------------------------------------------
+{
+    WhenClauseOp(int whenID, Op *fail): FailOp(fail), whenID(whenID) {}
+    int whenID;
+
+    virtual Op *        Run(Data data)
+    {
+        if (data[whenID] != xl_true)
+            return fail;
+        return success;
+    }
+    virtual kstring     OpID()  { return "when"; };
+    virtual void        Dump(std::ostream &out)
+    {
+        out << OpID() << "\t" << whenID;
+    }
+    virtual void        Encode(Instr &instr)
+    {
+        instr.opcode = Instr::WHEN;
+        instr.a = whenID;
+    }
+};
+
+
+struct InfixMatchOp : FailOp
+// ----------------------------------------------------------------------------
+//   Check if the result is an infix
+// ----------------------------------------------------------------------------
+{
+    InfixMatchOp(text symbol, Op *fail, uint lid, uint rid)
+        : FailOp(fail), symbol(symbol),
+          lid(lid), rid(rid) {}
+    text        symbol;
+    uint        lid;
+    uint        rid;
+
+    virtual Op *        Run(Data data)
+    {
+        Tree *test = DataResult(data);
+        Context_p ctx = nullptr;
+        if (Tree *inside = Interpreter::IsClosure(test, &ctx))
+            test = inside;
+        if (Infix *ifx = test->AsInfix())
+        {
+            if (ifx->name == symbol)
+            {
+                if (ctx)
+                {
+                    data[lid] = Interpreter::MakeClosure(ctx, ifx->left);
+                    data[rid] = Interpreter::MakeClosure(ctx, ifx->right);
+                }
+                else
+                {
+                    data[lid] = ifx->left;
+                    data[rid] = ifx->right;
+                }
+                return success;
+            }
+        }
+        return fail;
+    }
+
+    virtual kstring     OpID()  { return "infix"; }
+    virtual void        Dump(std::ostream &out)
+    {
+        out << OpID() << "\t" << lid << " " << symbol << " " << rid;
+    }
+};
+
+
+
+// ============================================================================
+//
+//    Argument match
+//
+// ============================================================================
+
+CodeBuilder::strength CodeBuilder::Do(Natural *what)
+// ----------------------------------------------------------------------------
+//   The pattern contains an natural: check we have the same
+// ----------------------------------------------------------------------------
+{
+    if (Natural *ival = test->AsNatural())
+        return ival->value == what->value ? ALWAYS : NEVER;
+    if (test->IsConstant())
+        return NEVER;
+    Evaluate(context, test);
+    Add(new NaturalMatchOp(what, failOp));
+    return SOMETIMES;
+}
+
+
+CodeBuilder::strength CodeBuilder::Do(Real *what)
+// ----------------------------------------------------------------------------
+//   The pattern contains a real: check we have the same
+// ----------------------------------------------------------------------------
+{
+    if (Real *rval = test->AsReal())
+        return rval->value != what->value ? ALWAYS : NEVER;
+    if (Natural *rval = test->AsNatural())
+        return rval->value != what->value ? ALWAYS : NEVER;
+    if (test->IsConstant())
+        return NEVER;
+    Evaluate(context, test);
+    Add(new MatchOp<Real>(what->value, failOp));
+    return SOMETIMES;
+}
+
+
+CodeBuilder::strength CodeBuilder::Do(Text *what)
+// ----------------------------------------------------------------------------
+//   The pattern contains a real: check we have the same
+// ----------------------------------------------------------------------------
+{
+    if (Text *tval = test->AsText())
+        return tval->value != what->value ? ALWAYS : NEVER;
+    if (test->IsConstant())
+        return NEVER;
+    Evaluate(context, test);
+    Add(new MatchOp<Text>(what->value, failOp));
+    return SOMETIMES;
+}
+
+
+CodeBuilder::strength CodeBuilder::Do(Name *what)
+// ----------------------------------------------------------------------------
+//   The pattern contains a name: bind it as a closure, no evaluation
+// ----------------------------------------------------------------------------
+{
+    // If there is already a binding for that name, value must match
+    // This covers both a pattern with 'pi' in it and things like 'X+X'
+    if (Tree *bound = argsCtx->Bound(what))
+    {
+        if (bound->GetInfo<Opcode>())
+        {
+            // If this is some built-in name, we can do a static test
+            if (Tree::Equal(bound, test))
+                return ALWAYS;
+            if (test->IsConstant())
+                return NEVER;
+        }
+
+        // Do a dynamic test to check if the name value is the same
+        int testID = Evaluate(context, test);
+        int nameID = Evaluate(argsCtx, bound);
+        Add(new NameMatchOp(testID, nameID, failOp));
+        return SOMETIMES;
+    }
+
+    int id = Evaluate(context, test, true);
+    Bind(what, test, id);
+    return ALWAYS;
+}
+
+
+CodeBuilder::strength CodeBuilder::Do(Block *what)
+// ----------------------------------------------------------------------------
+//   The pattern contains a block: look inside
+// ----------------------------------------------------------------------------
+{
+    if (Block *testBlock = test->AsBlock())
+        if (testBlock->opening == what->opening &&
+            testBlock->closing == what->closing)
+            test = testBlock->child;
+
+    return what->child->Do(this);
+}
+
+
+
+CodeBuilder::strength CodeBuilder::Do(Prefix *what)
+// ----------------------------------------------------------------------------
+//   The pattern contains prefix: check that the left part matches
+// ----------------------------------------------------------------------------
+{
+    // The test itself should be a prefix
+    if (Prefix *pfx = test->AsPrefix())
+    {
+        // If we call 'sin X' and match 'sin 3', check if names match
+        if (Name *name = what->left->AsName())
+        {
+            if (Name *testName = pfx->left->AsName())
+            {
+                if (name->value == testName->value)
+                {
+                    test = pfx->right;
+                    return what->right->Do(this);
+                }
+                else
+                {
+                    Ooops("Prefix name $1 does not match $2", name, testName);
+                    return NEVER;
+                }
+            }
+        }
+
+        // For other cases, we must go deep inside each prefix to check
+        return DoLeftRight(what->left, what->right, pfx->left, pfx->right);
+    }
+
+    // All other cases are a mismatch
+    Ooops("Prefix $1 does not match $2", what, test);
+    return NEVER;
+}
+
+
+CodeBuilder::strength CodeBuilder::Do(Postfix *what)
+// ----------------------------------------------------------------------------
+//   The pattern contains posfix: check that the right part matches
+// ----------------------------------------------------------------------------
+{
+    // The test itself should be a postfix
+    if (Postfix *pfx = test->AsPostfix())
+    {
+        // If we call 'X!' and match '3!', check if names match
+        if (Name *name = what->right->AsName())
+        {
+            if (Name *testName = pfx->right->AsName())
+            {
+                if (name->value == testName->value)
+                {
+                    test = pfx->left;
+                    return what->left->Do(this);
+                }
+                else
+                {
+                    Ooops("Postfix name $1 does not match $2", name, testName);
+                    return NEVER;
+                }
+            }
+        }
+
+        // For other cases, we must go deep inside each prefix to check
+        return DoLeftRight(what->right, what->left, pfx->right, pfx->left);
+    }
+
+    // All other cases are a mismatch
+    Ooops("Postfix $1 does not match $2", what, test);
+    return NEVER;
+}
+
+
+CodeBuilder::strength CodeBuilder::Do(Infix *what)
+// ----------------------------------------------------------------------------
+//   The complicated case: various declarations
+// ----------------------------------------------------------------------------
+{
+    Save<Context_p> saveContext(context, context);
+
+    // Check if we have typed arguments, e.g. X:natural
+    if (what->name == ":")
+    {
+        Name *name = what->left->AsName();
+        if (!name)
+        {
+            Ooops("Invalid declaration, $1 is not a name", what->left);
+            return NEVER;
+        }
+
+        // Typed name: evaluate type and check match
+        Tree *namedType = nullptr;
+        Tree *type = what->right;
+        if (Name *typeName = type->AsName())
+            if (Tree *found = context->Bound(typeName))
+                namedType = found;
+
+        if (namedType)
+        {
+            if (namedType == tree_type)
+            {
+                int id = Evaluate(context, test, true);
+                Bind(name, test, id);
+                return ALWAYS;
+            }
+            Scope *scope = context->Symbols();
+            if (Tree *cast = xl_typecheck(scope, namedType, test))
+            {
+                test = cast;
+                int id = Evaluate(context, test);
+                Bind(name, test, id, namedType);
+                return ALWAYS;
+            }
+
+            // Check if this is a builtin type vs. a constant
+            if (test->IsConstant())
+                return NEVER;
+        }
+
+        // In all other cases, we need do perform dynamic evaluation to check
+        int id = Evaluate(context, test);
+        AddTypeCheck(context, test, type, id);
+        Bind(name, test, id, type);
+        return SOMETIMES;
+    }
+
+    // Check if we have typed declarations, e.g. X+Y as natural
+    if (what->name == "as")
+    {
+        if (resultType)
+        {
+            Ooops("Duplicate return type declaration $1", what);
+            Ooops("Previously declared type was $1", resultType);
+        }
+        resultType = what->right;
+        return what->left->Do(this);
+    }
+
+    // Check if we have a guard clause
+    if (what->name == "when")
+    {
+        // It must pass the rest (need to bind values first)
+        if (what->left->Do(this) == NEVER)
+            return NEVER;
+
+        // Here, we need to evaluate in the local context, not eval one
+        int whenID = Evaluate(argsCtx, what->right);
+        Add(new WhenClauseOp(whenID, failOp));
+        return SOMETIMES;
+    }
+
+    // In all other cases, we need an infix with matching name
+    Infix_p ifx = test->AsInfix();
+    strength str = ALWAYS;
+    if (!ifx || ifx->name != what->name)
+    {
+        if (test->IsConstant())
+            return NEVER;
+        TreePosition pos = test->Position();
+        Name *l = new Name("left", pos);
+        Name *r = new Name("right", pos);
+        ifx = new Infix(what->name, l, r, pos);
+        uint lid = EvaluationTemporary(l);
+        uint rid = EvaluationTemporary(r);
+
+        // Try to get an infix by evaluating what we have
+        Evaluate(context, test);
+        Add(new InfixMatchOp(what->name, failOp, lid, rid));
+        str = SOMETIMES;
+    }
+
+    if (ifx && ifx->name == what->name)
+    {
+        strength st2 = DoLeftRight(what->left,what->right,ifx->left,ifx->right);
+        if (st2 < str)
+            return st2;
+        return str;
+    }
+
+    // Mismatch
+    Ooops("Infix $1 does not match $2", what, test);
+    return NEVER;
+}
+
+
+CodeBuilder::strength CodeBuilder::DoLeftRight(Tree *wl, Tree *wr,
+                                               Tree *l, Tree *r)
+// ----------------------------------------------------------------------------
+//    Combine left and right to get best result
+// ----------------------------------------------------------------------------
+{
+    test = l;
+    strength onLeft = wl->Do(this);
+    if (onLeft == NEVER)
+        return NEVER;
+    test = r;
+    strength onRight = wr->Do(this);
+    if (onRight < onLeft)
+        return onRight;
+    return onLeft;
+}
+
+
+int CodeBuilder::Bind(Name *name, Tree *value, int valueID, Tree *type)
+// ----------------------------------------------------------------------------
+//   Enter a new binding in the current context
+// ----------------------------------------------------------------------------
+//   The 'valueID' is where 'Evaluate' left the value, which is not always
+//   a local, e.g. an input parameter that was type-checked by the caller
+{
+    XL_ASSERT(inputs.find(name) == inputs.end() && "Binding name twice");
+
+    Tree *defined = name;
+    if (type)
+        defined = new Infix(":", defined, type, name->Position());
+
+    // Define the name in the parameters
+    Rewrite *rw = argsCtx->Define(defined, value);
+
+    // Generate the (negative) parameter ID for the given parameter
+    int parmId = ~outputs.size();
+    outputs[rw->left] = parmId;
+
+    // Record parameter order for calls
+    parms.push_back(valueID);
+
+    return parmId;
+}
+
+
+
+// ============================================================================
+//
+//    Optimization passes on the generated code
+//
+// ============================================================================
+//
+//  The code builder emits ops straight from the tree walk, so the same
+//  value is often evaluated or type-checked on several consecutive paths.
+//  Once the code is complete, Code::Optimize runs the following passes,
+//  each controlled by its own tweak:
+//
+//  - fold:    Run pure opcodes whose inputs are constant, and decide
+//             matches against a constant result at compile time
+//  - checks:  Remove type checks already done on the same path
+//  - jumps:   Thread jumps over evaluations that are already cached
+//  - dead:    Remove stores to slots that are overwritten before being
+//             read, and constants or values whose result is never used
+//
+//  What is known about the data is only propagated along straight-line
+//  paths, i.e. to ops that have a single predecessor. Any op that is not
+//  understood here makes us forget everything.
+
+struct Optimizer
+// ----------------------------------------------------------------------------
+//   Analysis and transformation of the graph of ops in a code
+// ----------------------------------------------------------------------------
+{
+    typedef std::tuple<int, int, Tree *> Check; // Value, type or constant
+    typedef std::map<Op *, bool>        Liveness;
+    typedef std::map<Op *, uint>        References;
+
+    struct Facts
+    // ------------------------------------------------------------------------
+    //   What is known on entry to an op
+    // ------------------------------------------------------------------------
     {
-        Save<TreeIDs> saveEvals(values, values);
+        Facts(): result(nullptr), resultId(NONE) {}
+        std::map<int, Tree *>   constants;      // Slots with a known value
+        std::set<int>           evaluated;      // Slots that are non-null
+        std::set<int>           cleared;        // Slots that are null
+        std::set<Check>         checked;        // Successful type checks
+        Tree *                  result;         // Known constant result
+        int                     resultId;       // Slot equal to result
+
+        void                    Forget()        { *this = Facts(); }
+        void                    Write(int id);
+        void                    Transfer(Op *op, bool failed);
+    };
+    typedef std::map<Op *, Facts>       FactsMap;
+    enum { NONE = INT_MIN };
+
+public:
+    Optimizer(Code *code)
+        : code(code), ops(code->ops), instrs(code->instrs),
+          owned(instrs.begin(), instrs.end()) {}
+
+    uint                Fold();
+    uint                Checks();
+    uint                Jumps();
+    uint                DeadTemporaries();
+    uint                Fuse();
+    uint                Specialize(Kinds &kinds);
+
+private:
+    uint                FuseArguments();
+    uint                FuseConstants();
+    uint                FuseMatches();
+    bool                Owned(Op *op);
+    void                CountReferences(References &refs);
+    void                Analyze(FactsMap &facts);
+    bool                Live(Op *op, Liveness &live);
+    bool                LiveSlot(Op *op, int id, Liveness &live);
+    bool                SlotReads(Op *op, std::set<int> &reads,
+                                  std::set<Op *> &visited);
+    bool                SlotWrites(Op *op, std::set<int> &writes);
+    Tree *              ConstantCode(Op *op);
+    void                Redirect(Op *from, Op *to);
+    void                Replace(Op *op, Op *first, Op *last);
+    void                Remove(Op *op, Op *next);
+    uint                RemoveUnreachable();
+
+private:
+    Code *              code;
+    Op *&               ops;
+    Ops &               instrs;
+    std::set<Op *>      owned;
+};
 
-        // Create new success exit for this expression
-        Op *success = new LabelOp("success");
-        successOp = success;
 
-        // Lookup candidates (and count them)
-        Save<uint> saveCandidates(candidates, 0);
-        ctx->Lookup(what, compileLookup, this);
+void Optimizer::Facts::Write(int id)
+// ----------------------------------------------------------------------------
+//   Forget what we knew about a slot that is overwritten
+// ----------------------------------------------------------------------------
+{
+    constants.erase(id);
+    evaluated.erase(id);
+    cleared.erase(id);
+    for (auto c = checked.begin(); c != checked.end(); )
+    {
+        bool constant = std::get<2>(*c) != nullptr;
+        if (std::get<0>(*c) == id || (!constant && std::get<1>(*c) == id))
+            c = checked.erase(c);
+        else
+            c++;
+    }
+    if (resultId == id)
+        resultId = NONE;
+}
 
-        if (candidates)
+
+void Optimizer::Facts::Transfer(Op *op, bool failed)
+// ----------------------------------------------------------------------------
+//   Update facts after running the given op, along success or fail exit
+// ----------------------------------------------------------------------------
+{
+    if (ConstOp *cst = dynamic_cast<ConstOp *>(op))
+    {
+        result = cst->value;
+        resultId = NONE;
+    }
+    else if (ValueOp *value = dynamic_cast<ValueOp *>(op))
+    {
+        auto found = constants.find(value->id);
+        result = found != constants.end() ? found->second : nullptr;
+        resultId = value->id;
+    }
+    else if (StoreOp *store = dynamic_cast<StoreOp *>(op))
+    {
+        Write(store->id);
+        if (result)
         {
-            // We found candidates. Join the failOp to the successOp
-            XL_ASSERT(!*lastOp && "Built code that is not NULL-terminated");
+            constants[store->id] = result;
+            evaluated.insert(store->id);
+        }
+        resultId = store->id;
+    }
+    else if (ClearOp *clear = dynamic_cast<ClearOp *>(op))
+    {
+        for (int v = clear->lo; v <= clear->hi; v++)
+        {
+            Write(v);
+            cleared.insert(v);
+        }
+    }
+    else if (EvalOp *eval = dynamic_cast<EvalOp *>(op))
+    {
+        // Unless cached, evaluation runs code that may write any slot
+        if (!evaluated.count(eval->id))
+            Forget();
+        if (!failed)
+        {
+            auto found = constants.find(eval->id);
+            result = found != constants.end() ? found->second : nullptr;
+            resultId = eval->id;
+            evaluated.insert(eval->id);
+            cleared.erase(eval->id);
+        }
+    }
+    else if (ArgValueOp *arg = dynamic_cast<ArgValueOp *>(op))
+    {
+        // The result is only set if the argument was already bound
+        if (!evaluated.count(arg->id))
+            Write(arg->id);
+        evaluated.insert(arg->id);
+        result = nullptr;
+        resultId = NONE;
+    }
+    else if (TypeCheckOp *check = dynamic_cast<TypeCheckOp *>(op))
+    {
+        if (!failed)
+        {
+            checked.insert(Check(check->value, check->type, check->constant));
+            result = nullptr;
+            resultId = NONE;
+        }
+    }
+    else if (dynamic_cast<MatchOp<Natural> *>(op) ||
+             dynamic_cast<MatchOp<Real> *>(op)    ||
+             dynamic_cast<MatchOp<Text> *>(op)    ||
+             dynamic_cast<NameMatchOp *>(op)      ||
+             dynamic_cast<WhenClauseOp *>(op)     ||
+             dynamic_cast<SelfOp *>(op))
+    {
+        // Tests that do not change the data
+    }
+    else if (Opcode *opcode = dynamic_cast<Opcode *>(op))
+    {
+        ParmOrder reads;
+        if (opcode->Pure(reads))
+        {
+            result = nullptr;
+            resultId = NONE;
+        }
+        else
+        {
+            Forget();
+        }
+    }
+    else
+    {
+        Forget();
+    }
+}
 
-            Add(new FormErrorOp(what));
-            *lastOp = success;
 
-            lastOp = &success->success;
-            instrs.push_back(success);
+bool Optimizer::Owned(Op *op)
+// ----------------------------------------------------------------------------
+//   Check if an op belongs to the code being optimized
+// ----------------------------------------------------------------------------
+{
+    return op && owned.count(op);
+}
+
+
+void Optimizer::CountReferences(References &refs)
+// ----------------------------------------------------------------------------
+//   Count references to each op, evaluations count as entry points
+// ----------------------------------------------------------------------------
+{
+    refs[ops] += 2;
+    for (Op *op : instrs)
+    {
+        refs[op->success]++;
+        if (Op *fail = op->Fail())
+            refs[fail]++;
+        if (EvalOp *eval = dynamic_cast<EvalOp *>(op))
+            refs[eval->ops] += 2;
+        if (EvalMatchOp *match = dynamic_cast<EvalMatchOp *>(op))
+            refs[match->mismatch]++;
+    }
+}
+
+
+void Optimizer::Analyze(FactsMap &facts)
+// ----------------------------------------------------------------------------
+//   Compute the facts on entry of each op along straight-line paths
+// ----------------------------------------------------------------------------
+{
+    References refs;
+    CountReferences(refs);
+
+    // Propagate facts forward from each op with several predecessors
+    std::vector<std::pair<Op *, Facts>> work;
+    for (Op *op : instrs)
+        if (refs[op] != 1)
+            work.push_back(std::make_pair(op, Facts()));
+    while (!work.empty())
+    {
+        Op *op = work.back().first;
+        Facts known = work.back().second;
+        work.pop_back();
+        facts[op] = known;
+
+        Op *next = op->success;
+        if (next && refs[next] == 1 && Owned(next))
+        {
+            Facts after = known;
+            after.Transfer(op, false);
+            work.push_back(std::make_pair(next, after));
+        }
+        Op *fail = op->Fail();
+        if (fail && refs[fail] == 1 && Owned(fail))
+        {
+            Facts after = known;
+            after.Transfer(op, true);
+            work.push_back(std::make_pair(fail, after));
+        }
+    }
+}
+
+
+bool Optimizer::Live(Op *op, Liveness &live)
+// ----------------------------------------------------------------------------
+//   Check if the result on entry to the given op may be used later
+// ----------------------------------------------------------------------------
+{
+    // The result is returned at the end of the code
+    if (!op || !Owned(op))
+        return true;
+
+    auto found = live.find(op);
+    if (found != live.end())
+        return found->second;
+    live[op] = true;            // Conservative answer while recursing
+
+    bool reads = true;          // Op reads the result
+    bool killS = false;         // Success exit overwrites result
+    bool killF = false;         // Fail exit overwrites result
+    if (dynamic_cast<ConstOp *>(op) || dynamic_cast<ValueOp *>(op) ||
+        dynamic_cast<CallOp *>(op)  || dynamic_cast<TypeCheckOp *>(op))
+    {
+        reads = false;
+        killS = true;
+    }
+    else if (EvalOp *eval = dynamic_cast<EvalOp *>(op))
+    {
+        // Code::Run overwrites the result, but our own ops may read it
+        reads = Owned(eval->ops) ? Live(eval->ops, live)
+            : !eval->ops || !dynamic_cast<Code *>(eval->ops);
+        killS = true;
+    }
+    else if (dynamic_cast<ClearOp *>(op)        ||
+             dynamic_cast<ArgValueOp *>(op)     ||
+             dynamic_cast<SelfOp *>(op)         ||
+             dynamic_cast<NameMatchOp *>(op)    ||
+             dynamic_cast<WhenClauseOp *>(op)   ||
+             dynamic_cast<FormErrorOp *>(op))
+    {
+        reads = false;
+    }
+    else if (Opcode *opcode = dynamic_cast<Opcode *>(op))
+    {
+        ParmOrder parms;
+        if (opcode->Pure(parms))
+        {
+            reads = false;
+            killS = true;
+        }
+    }
+
+    bool result = reads
+        || (!killS && Live(op->success, live))
+        || (op->Fail() && !killF && Live(op->Fail(), live));
+    live[op] = result;
+    return result;
+}
+
+
+bool Optimizer::SlotReads(Op *op, std::set<int> &reads,
+                          std::set<Op *> &visited)
+// ----------------------------------------------------------------------------
+//   Collect data slots read by an op, return false if we can't tell
+// ----------------------------------------------------------------------------
+{
+    if (!op || visited.count(op))
+        return true;
+    visited.insert(op);
+
+    if (EvalOp *eval = dynamic_cast<EvalOp *>(op))
+    {
+        reads.insert(eval->id);
+
+        // Code evaluated in place runs on the same data
+        Op *sub = eval->ops;
+        if (!sub || Owned(sub))
+            return true;
+        if (dynamic_cast<Procedure *>(sub))
+            return false;
+        if (Code *subcode = dynamic_cast<Code *>(sub))
+        {
+            for (Op *subop : subcode->instrs)
+                if (!SlotReads(subop, reads, visited))
+                    return false;
+            return true;
+        }
+        return SlotReads(sub, reads, visited);
+    }
+    if (ValueOp *value = dynamic_cast<ValueOp *>(op))
+    {
+        reads.insert(value->id);
+        return true;
+    }
+    if (ArgEvalOp *arg = dynamic_cast<ArgEvalOp *>(op))
+    {
+        reads.insert(arg->argId);
+        reads.insert(arg->id);
+        return true;
+    }
+    if (ArgValueOp *arg = dynamic_cast<ArgValueOp *>(op))
+    {
+        reads.insert(arg->argId);
+        reads.insert(arg->id);
+        return true;
+    }
+    if (TypeCheckOp *check = dynamic_cast<TypeCheckOp *>(op))
+    {
+        reads.insert(check->value);
+        if (!check->constant)
+            reads.insert(check->type);
+        return true;
+    }
+    if (BinaryConstOp *fused = dynamic_cast<BinaryConstOp *>(op))
+    {
+        ParmOrder parms;
+        if (!fused->opcode->Pure(parms))
+            return false;
+        reads.insert(fused->id);
+        return true;
+    }
+    if (NameMatchOp *match = dynamic_cast<NameMatchOp *>(op))
+    {
+        reads.insert(match->testID);
+        reads.insert(match->nameID);
+        return true;
+    }
+    if (WhenClauseOp *when = dynamic_cast<WhenClauseOp *>(op))
+    {
+        reads.insert(when->whenID);
+        return true;
+    }
+    if (IndexOp *index = dynamic_cast<IndexOp *>(op))
+    {
+        reads.insert(index->left);
+        reads.insert(index->right);
+        return true;
+    }
+    if (CallOp *call = dynamic_cast<CallOp *>(op))
+    {
+        reads.insert(call->parms.begin(), call->parms.end());
+        return true;
+    }
+    if (Opcode *opcode = dynamic_cast<Opcode *>(op))
+    {
+        ParmOrder parms;
+        if (!opcode->Pure(parms))
+            return false;
+        reads.insert(parms.begin(), parms.end());
+        return true;
+    }
+    return (dynamic_cast<ConstOp *>(op)           ||
+            dynamic_cast<StoreOp *>(op)           ||
+            dynamic_cast<ClearOp *>(op)           ||
+            dynamic_cast<SelfOp *>(op)            ||
+            dynamic_cast<ClosureOp *>(op)         ||
+            dynamic_cast<FormErrorOp *>(op)       ||
+            dynamic_cast<InfixMatchOp *>(op)      ||
+            dynamic_cast<MatchOp<Natural> *>(op)  ||
+            dynamic_cast<MatchOp<Real> *>(op)     ||
+            dynamic_cast<MatchOp<Text> *>(op));
+}
+
+
+bool Optimizer::SlotWrites(Op *op, std::set<int> &writes)
+// ----------------------------------------------------------------------------
+//   Collect data slots written by an op, return false if we can't tell
+// ----------------------------------------------------------------------------
+{
+    if (EvalOp *eval = dynamic_cast<EvalOp *>(op))
+    {
+        // Code from another tree may use the same slots for other values
+        writes.insert(eval->id);
+        return !eval->ops || Owned(eval->ops);
+    }
+    if (StoreOp *store = dynamic_cast<StoreOp *>(op))
+    {
+        writes.insert(store->id);
+        return true;
+    }
+    if (ArgEvalOp *arg = dynamic_cast<ArgEvalOp *>(op))
+    {
+        writes.insert(arg->id);
+        return true;
+    }
+    if (ArgValueOp *arg = dynamic_cast<ArgValueOp *>(op))
+    {
+        writes.insert(arg->id);
+        return true;
+    }
+    if (ClearOp *clear = dynamic_cast<ClearOp *>(op))
+    {
+        for (int v = clear->lo; v <= clear->hi; v++)
+            writes.insert(v);
+        return true;
+    }
+    if (InfixMatchOp *match = dynamic_cast<InfixMatchOp *>(op))
+    {
+        writes.insert(match->lid);
+        writes.insert(match->rid);
+        return true;
+    }
+    if (CallOp *call = dynamic_cast<CallOp *>(op))
+    {
+        for (int p = 0; p <= (int) call->parms.size(); p++)
+            writes.insert(call->outId - p);
+        return true;
+    }
+    if (Opcode *opcode = dynamic_cast<Opcode *>(op))
+    {
+        ParmOrder parms;
+        return opcode->Pure(parms);
+    }
+    return (dynamic_cast<ConstOp *>(op)           ||
+            dynamic_cast<ValueOp *>(op)           ||
+            dynamic_cast<TypeCheckOp *>(op)       ||
+            dynamic_cast<SelfOp *>(op)            ||
+            dynamic_cast<LabelOp *>(op)           ||
+            dynamic_cast<ClosureOp *>(op)         ||
+            dynamic_cast<FormErrorOp *>(op)       ||
+            dynamic_cast<NameMatchOp *>(op)       ||
+            dynamic_cast<WhenClauseOp *>(op)      ||
+            dynamic_cast<MatchOp<Natural> *>(op)  ||
+            dynamic_cast<MatchOp<Real> *>(op)     ||
+            dynamic_cast<MatchOp<Text> *>(op));
+}
+
+
+bool Optimizer::LiveSlot(Op *op, int id, Liveness &live)
+// ----------------------------------------------------------------------------
+//   Check if a data slot may be read from the given op onwards
+// ----------------------------------------------------------------------------
+{
+    // Slots remain visible after our own code returns
+    if (!op || !Owned(op))
+        return true;
+
+    auto found = live.find(op);
+    if (found != live.end())
+        return found->second;
+    live[op] = true;            // Conservative answer while recursing
+
+    bool result = false;
+    std::set<int> reads;
+    std::set<Op *> visited;
+    StoreOp *store = dynamic_cast<StoreOp *>(op);
+    ClearOp *clear = dynamic_cast<ClearOp *>(op);
+    if (store && store->id == id)
+    {
+        result = false;
+    }
+    else if (clear && clear->lo <= id && id <= clear->hi)
+    {
+        result = false;
+    }
+    else if (!SlotReads(op, reads, visited) || reads.count(id))
+    {
+        result = true;
+    }
+    else
+    {
+        if (EvalOp *eval = dynamic_cast<EvalOp *>(op))
+            if (Owned(eval->ops))
+                result = LiveSlot(eval->ops, id, live);
+        result = result
+            || LiveSlot(op->success, id, live)
+            || (op->Fail() && LiveSlot(op->Fail(), id, live));
+    }
+    live[op] = result;
+    return result;
+}
+
+
+Tree *Optimizer::ConstantCode(Op *op)
+// ----------------------------------------------------------------------------
+//   If the code starting at op always returns a constant, return it
+// ----------------------------------------------------------------------------
+{
+    if (!Owned(op))
+        return nullptr;
+    ConstOp *cst = dynamic_cast<ConstOp *>(op);
+    if (!cst)
+        return nullptr;
+    for (op = cst->success; op; op = op->success)
+        if (!dynamic_cast<ClearOp *>(op))
+            return nullptr;
+    return cst->value;
+}
+
+
+void Optimizer::Redirect(Op *from, Op *to)
+// ----------------------------------------------------------------------------
+//   Make all references to 'from' point to 'to'
+// ----------------------------------------------------------------------------
+{
+    if (ops == from)
+        ops = to;
+    for (Op *op : instrs)
+    {
+        if (op->success == from)
+            op->success = to;
+        if (FailOp *fop = dynamic_cast<FailOp *>(op))
+            if (fop->fail == from)
+                fop->fail = to;
+        if (EvalOp *eval = dynamic_cast<EvalOp *>(op))
+            if (eval->ops == from)
+                eval->ops = to;
+        if (EvalMatchOp *match = dynamic_cast<EvalMatchOp *>(op))
+            if (match->mismatch == from)
+                match->mismatch = to;
+    }
+}
+
+
+void Optimizer::Replace(Op *op, Op *first, Op *last)
+// ----------------------------------------------------------------------------
+//   Replace an op with the sequence from 'first' to 'last'
+// ----------------------------------------------------------------------------
+{
+    last->success = op->success;
+    Redirect(op, first);
+    Ops::iterator pos = std::find(instrs.begin(), instrs.end(), op);
+    pos = instrs.erase(pos);
+    Ops inserted;
+    for (Op *o = first; o != last->success; o = o->success)
+        inserted.push_back(o);
+    instrs.insert(pos, inserted.begin(), inserted.end());
+    owned.insert(inserted.begin(), inserted.end());
+    owned.erase(op);
+    delete op;
+}
+
+
+void Optimizer::Remove(Op *op, Op *next)
+// ----------------------------------------------------------------------------
+//   Remove an op, branching directly to 'next' instead
+// ----------------------------------------------------------------------------
+{
+    Redirect(op, next);
+    instrs.erase(std::find(instrs.begin(), instrs.end(), op));
+    owned.erase(op);
+    delete op;
+}
+
+
+uint Optimizer::RemoveUnreachable()
+// ----------------------------------------------------------------------------
+//   Delete ops that can no longer be reached from the entry point
+// ----------------------------------------------------------------------------
+{
+    std::set<Op *> reached;
+    Ops work;
+    work.push_back(ops);
+    while (!work.empty())
+    {
+        Op *op = work.back();
+        work.pop_back();
+        if (!op || reached.count(op) || !Owned(op))
+            continue;
+        reached.insert(op);
+        work.push_back(op->success);
+        work.push_back(op->Fail());
+        if (EvalOp *eval = dynamic_cast<EvalOp *>(op))
+            work.push_back(eval->ops);
+        if (EvalMatchOp *match = dynamic_cast<EvalMatchOp *>(op))
+            work.push_back(match->mismatch);
+    }
+
+    uint removed = 0;
+    for (uint i = 0; i < instrs.size(); i++)
+    {
+        Op *op = instrs[i];
+        if (!reached.count(op))
+        {
+            instrs.erase(instrs.begin() + i--);
+            owned.erase(op);
+            delete op;
+            removed++;
+        }
+    }
+    return removed;
+}
+
 
-            InstructionsSuccess(saveEvals.saved.size());
-            return true;
-        }
+uint Optimizer::Fold()
+// ----------------------------------------------------------------------------
+//   Fold opcodes with constant inputs, and matches against constants
+// ----------------------------------------------------------------------------
+{
+    FactsMap facts;
+    Analyze(facts);
 
-        // In that case, the 'success' label was not used
-        delete success;
-        successOp = nullptr;
+    uint changes = 0;
+    Ops candidates = instrs;
+    for (Op *op : candidates)
+    {
+        Facts &known = facts[op];
 
-        // Forms that we recognize directly and deal with here
-        kind whatK = what->Kind();
-        switch (whatK)
+        if (Opcode *opcode = dynamic_cast<Opcode *>(op))
         {
-        case NATURAL:
-        case REAL:
-        case TEXT:
-        case NAME:
-            // If not looked up, return the original
-            Add(new ConstOp(what));
-            InstructionsSuccess(saveEvals.saved.size());
-            return true;
+            // Check if all inputs of a pure opcode are known
+            ParmOrder parms;
+            if (!opcode->Pure(parms))
+                continue;
+            int maxId = 1;
+            bool constant = true;
+            for (int id : parms)
+            {
+                if (!known.constants.count(id))
+                    constant = false;
+                else if (maxId < id)
+                    maxId = id;
+            }
+            if (!constant || !known.result)
+                continue;
 
-        case BLOCK:
-        {
-            // Evaluate child in a new context
-            ctx->CreateScope();
-            what = ((Block *) (Tree *) what)->child;
-            bool hasInstructions = ctx->ProcessDeclarations(what);
-            bool hasDecls = !ctx->IsEmpty();
-            if (!hasDecls)
-                ctx->PopScope();
-            if (hasInstructions)
+            // Run the opcode on a scratch frame, give up on any error.
+            // The incoming result is needed, since it gives the position.
+            TreeList frame(maxId + 1);
+            frame[0] = known.result;
+            frame[1] = code->context->Symbols();
+            for (int id : parms)
+                frame[id] = known.constants[id];
+            Errors errors;
+            Op *next = opcode->Run(&frame[0]);
+            Tree *value = frame[0];
+            if (errors.Swallowed() || next != opcode->success || !value)
                 continue;
-            if (hasDecls)
-                what = Interpreter::MakeClosure(ctx, what);
-            Add(new ConstOp(what));
-            if (hasDecls)
-                ctx->PopScope();
-            InstructionsSuccess(saveEvals.saved.size());
-            return true;
-        }
 
-        case PREFIX:
+            record(bytecode_optimize, "Fold %O into %t", op, value);
+            ConstOp *cst = new ConstOp(value);
+            Replace(op, cst, cst);
+            changes++;
+        }
+        else if (EvalOp *eval = dynamic_cast<EvalOp *>(op))
         {
-            // If we have a prefix on the left, check if it's a closure
-            if (Tree *closed = Interpreter::IsClosure(what, &gcContext))
+            auto found = known.constants.find(eval->id);
+            if (found != known.constants.end())
             {
-                ctx = gcContext;
-                what = closed;
-                continue;
+                // Evaluation of a slot holding a known constant
+                record(bytecode_optimize, "Fold cached %O", op);
+                ConstOp *cst = new ConstOp(found->second);
+                Replace(op, cst, cst);
+                changes++;
+            }
+            else if (known.cleared.count(eval->id))
+            {
+                // Evaluation of code that returns a constant, only when
+                // we know the slot is empty, since it could be cached
+                Tree *value = ConstantCode(eval->ops);
+                if (!value)
+                    continue;
+                record(bytecode_optimize, "Fold constant %O", op);
+                ConstOp *cst = new ConstOp(value);
+                StoreOp *store = new StoreOp(eval->id);
+                cst->success = store;
+                Replace(op, cst, store);
+                changes++;
             }
+        }
+        else if (dynamic_cast<MatchOp<Natural> *>(op) ||
+                 dynamic_cast<MatchOp<Real> *>(op)    ||
+                 dynamic_cast<MatchOp<Text> *>(op))
+        {
+            // Decide a match on a known result
+            if (!known.result)
+                continue;
+            Tree_p frame[2] = { known.result, nullptr };
+            Op *next = op->Run(frame);
+            record(bytecode_optimize, "Fold %O to %s",
+                   op, next == op->success ? "success" : "fail");
+            Remove(op, next);
+            changes++;
+        }
+    }
+    changes += RemoveUnreachable();
+    return changes;
+}
 
-            // If we have a name on the left, lookup name and start again
-            Prefix *pfx = (Prefix *) (Tree *) what;
-            Tree   *callee = pfx->left;
-            Tree   *arg = pfx->right;
 
-            while (Block *block = callee->AsBlock())
-                callee = block->child;
+uint Optimizer::Checks()
+// ----------------------------------------------------------------------------
+//   Remove type checks that already passed on the same path
+// ----------------------------------------------------------------------------
+//   A type check also sets the result to the cast value, so this is only
+//   done when the result of the redundant check is not used.
+{
+    FactsMap facts;
+    Analyze(facts);
+    Liveness live;
 
-            if (Name *name = callee->AsName())
-            {
-                // A few cases where we don't interpret the result
-                if (name->value == "type"   ||
-                    name->value == "extern" ||
-                    name->value == "data")
-                {
-                    InstructionsSuccess(saveEvals.saved.size());
-                    return true;
-                }
-            }
+    uint changes = 0;
+    Ops candidates = instrs;
+    for (Op *op : candidates)
+    {
+        TypeCheckOp *check = dynamic_cast<TypeCheckOp *>(op);
+        if (!check)
+            continue;
+        Facts &known = facts[op];
+        Check done(check->value, check->type, check->constant);
+        if (!known.checked.count(done))
+            continue;
+        if (Live(check->success, live))
+            continue;
+
+        record(bytecode_optimize, "Remove redundant %O", op);
+        live.clear();
+        Remove(op, op->success);
+        changes++;
+    }
+    changes += RemoveUnreachable();
+    return changes;
+}
 
-            // Create a call for forms like (X -> X+1) 31
-            if (Infix *lifx = callee->AsInfix())
-            {
-                if (IsDefinition(lifx))
-                {
-                    TreeIDs   outs;
-                    ParmOrder parms;
 
-                    // If we have a single name on the left, like (X->X+1)
-                    // interpret that as a lambda function
-                    int argID = Evaluate(ctx, arg);
-                    parms.push_back(argID);
+uint Optimizer::Jumps()
+// ----------------------------------------------------------------------------
+//   Thread jumps over ops that have no effect on the path
+// ----------------------------------------------------------------------------
+{
+    FactsMap facts;
+    Analyze(facts);
 
-                    // Context to declare the arguments of the lambda function
-                    ctx = new Context(ctx);
+    uint changes = 0;
+    for (Op *op : instrs)
+    {
+        FailOp *fop = dynamic_cast<FailOp *>(op);
+        for (uint exit = 0; exit < 2; exit++)
+        {
+            Op **target = exit ? (fop ? &fop->fail : nullptr) : &op->success;
+            if (!target)
+                continue;
 
-                    if (Name *lfname = lifx->left->AsName())
-                    {
-                        // Case like '(X->X+1) Arg':
-                        // Bind arg in new context and evaluate body
-                        Rewrite *rw = ctx->Define(lfname, arg);
-                        outs[rw->left] = -1;
-                        CallOp *call = Call(ctx, lifx->right, nullptr,
-                                            outs, parms);
-                        Add(call);
-                        return true;
-                    }
-                    else
-                    {
-                        // Otherwise, map argument to declaration, e.g.
-                        // '(X,Y->X+Y) (2,3)' should evaluate as 5
-                        success = new LabelOp("lambda_s");
-                        successOp = success;
-                        Save<uint> saveCand(candidates, 0);
-                        compileLookup(originalScope, originalScope,
-                                      arg, lifx, this);
-                        if (candidates)
-                        {
-                            Add(new FormErrorOp(what));
-                            *lastOp = success;
-                            lastOp = &success->success;
-                            instrs.push_back(success);
-                            InstructionsSuccess(saveEvals.saved.size());
-                            return true;
-                        }
-                        delete success;
-                        successOp = nullptr;
-                        Add(new FormErrorOp(what));
-                        return true;
-                    }
-                }
+            Facts known = facts[op];
+            known.Transfer(op, exit);
+            while (Op *next = *target)
+            {
+                // An evaluation that is cached and already in the result
+                if (EvalOp *eval = dynamic_cast<EvalOp *>(next))
+                    if (known.evaluated.count(eval->id) &&
+                        known.resultId == eval->id)
+                        next = eval->success;
+                if (ValueOp *value = dynamic_cast<ValueOp *>(next))
+                    if (known.resultId == value->id)
+                        next = value->success;
+                if (dynamic_cast<SelfOp *>(next))
+                    next = next->success;
+                if (next == *target)
+                    break;
+
+                record(bytecode_optimize, "Thread %O over %O", op, *target);
+                *target = next;
+                changes++;
             }
+        }
+    }
+    changes += RemoveUnreachable();
+    return changes;
+}
 
-            // Evaluate callee
-            int calleeID = Evaluate(ctx, callee);
-            int argID = Evaluate(ctx, arg);
 
-            // Lookup the argument in the callee's context
-            if (!failOp)
+uint Optimizer::DeadTemporaries()
+// ----------------------------------------------------------------------------
+//   Remove stores that are never read and results that are never used
+// ----------------------------------------------------------------------------
+{
+    uint changes = 0;
+
+    // Stores to slots that are overwritten or cleared before being read
+    Ops candidates = instrs;
+    for (Op *op : candidates)
+    {
+        if (StoreOp *store = dynamic_cast<StoreOp *>(op))
+        {
+            Liveness live;
+            if (!LiveSlot(store->success, store->id, live))
             {
-                failOp = new PrefixFormErrorOp(what);
-                instrs.push_back(failOp);
+                record(bytecode_optimize, "Remove dead %O", op);
+                Remove(op, op->success);
+                changes++;
             }
-            Add (new IndexOp(calleeID, argID, failOp));
-            InstructionsSuccess(saveEvals.saved.size());
-            return true;
         }
+    }
 
-        case POSTFIX:
+    // Constants and values overwritten before being used
+    Liveness live;
+    candidates = instrs;
+    for (Op *op : candidates)
+    {
+        if (dynamic_cast<ConstOp *>(op) || dynamic_cast<ValueOp *>(op))
         {
-            // Check if there is a pattern that matches
-            Ooops("No postfix matches $1", what);
-            return false;
+            if (!Live(op->success, live))
+            {
+                record(bytecode_optimize, "Remove unused %O", op);
+                live.clear();
+                Remove(op, op->success);
+                changes++;
+            }
         }
+    }
+    return changes;
+}
 
-        case INFIX:
+
+uint Optimizer::Fuse()
+// ----------------------------------------------------------------------------
+//   Build superinstructions, which have a compact encoding in bytecode.tbl
+// ----------------------------------------------------------------------------
+//   Opcodes first read their inputs directly, so that they can then take
+//   a constant operand, e.g. 'N-1' in a variant runs as one SUB_CONST.
+{
+    uint changes = FuseArguments();
+    changes += FuseConstants();
+    changes += FuseMatches();
+    return changes;
+}
+
+
+uint Optimizer::FuseArguments()
+// ----------------------------------------------------------------------------
+//   Let opcodes read input arguments instead of the locals bound to them
+// ----------------------------------------------------------------------------
+//   In variants, 'argval X=-1' binds local X to input -1, so an opcode that
+//   reads X can read -1 instead, if X is never bound to anything else.
+//   'X+Y' then loads its two natural arguments and adds them in a single
+//   ADD instruction. The 'argval' goes away if nothing reads X afterwards.
+{
+    // Locals that are only bound to one input or cleared, and slots written
+    std::map<int, int> boundTo;
+    std::set<int> written;
+    for (Op *op : instrs)
+    {
+        if (ArgValueOp *arg = dynamic_cast<ArgValueOp *>(op))
         {
-            Infix *infix = (Infix *) (Tree *) what;
-            text name = infix->name;
+            auto found = boundTo.find(arg->id);
+            if (found == boundTo.end())
+                boundTo[arg->id] = arg->argId;
+            else if (found->second != arg->argId)
+                found->second = NONE;
+        }
+        else if (!dynamic_cast<ClearOp *>(op) && !SlotWrites(op, written))
+        {
+            return 0;
+        }
+    }
 
-            // Check sequences
-            if (name == ";" || name == "\n")
-            {
-                // Sequences: evaluate left, then right
-                if (!Instructions(ctx, infix->left))
-                    return false;
-                what = infix->right;
+    // Read the inputs in the opcodes
+    uint changes = 0;
+    for (Op *op : instrs)
+    {
+        Opcode *opcode = dynamic_cast<Opcode *>(op);
+        ParmOrder reads, parms;
+        if (!opcode || !opcode->Pure(reads) || !opcode->GetParms(parms))
+            continue;
+        bool changed = false;
+        for (int &parm : parms)
+        {
+            auto found = boundTo.find(parm);
+            if (found == boundTo.end() || found->second == NONE ||
+                written.count(parm) || written.count(found->second))
                 continue;
-            }
+            parm = found->second;
+            changed = true;
+        }
+        if (!changed)
+            continue;
+        opcode->SetParms(parms);
+        record(bytecode_optimize, "Fuse arguments in %O", op);
+        changes++;
+    }
 
-            // Check declarations
-            if (name == "is")
-            {
-                // Declarations evaluate last non-declaration result, or self
-                InstructionsSuccess(saveEvals.saved.size());
-                return true;
-            }
+    // Remove bindings that are no longer used
+    Ops candidates = instrs;
+    for (Op *op : candidates)
+    {
+        ArgValueOp *arg = dynamic_cast<ArgValueOp *>(op);
+        if (!changes || !arg || !boundTo.count(arg->id))
+            continue;
+        Liveness live, liveSlot;
+        if (Live(arg->success, live) ||
+            LiveSlot(arg->success, arg->id, liveSlot))
+            continue;
+        record(bytecode_optimize, "Remove %O", op);
+        Remove(arg, arg->success);
+    }
+    return changes;
+}
 
-            // Check scoped reference
-            if (name == ".")
-            {
-                if (!Instructions(ctx, infix->left))
-                    return false;
-                what = infix->right;
-                continue;
-            }
 
-            // All other cases: return the input as is
-            Add(new ConstOp(what));
-            InstructionsSuccess(saveEvals.saved.size());
-            return true;
+uint Optimizer::FuseConstants()
+// ----------------------------------------------------------------------------
+//   Build superinstructions for binary opcodes with a constant operand
+// ----------------------------------------------------------------------------
+//   Evaluating a constant argument generates 'const K', 'store S', followed
+//   by the opcode reading S. The fused op passes K directly to the opcode.
+{
+    References refs;
+    CountReferences(refs);
+
+    uint changes = 0;
+    Ops candidates = instrs;
+    for (Op *op : candidates)
+    {
+        if (!Owned(op))
+            continue;
+        ConstOp *cst = dynamic_cast<ConstOp *>(op);
+        if (!cst || refs[cst->success] != 1 || !Owned(cst->success))
+            continue;
+        StoreOp *store = dynamic_cast<StoreOp *>(cst->success);
+        if (!store || refs[store->success] != 1 || !Owned(store->success))
+            continue;
+        InfixOpcode *opcode = dynamic_cast<InfixOpcode *>(store->success);
+        if (!opcode)
+            continue;
+
+        // The constant must be exactly one of the two operands
+        int left, right;
+        opcode->Operands(left, right);
+        bool constLeft = left == store->id;
+        if (constLeft == (right == store->id))
+            continue;
+
+        Liveness live;
+        Op *next = opcode->success;
+        int keep = LiveSlot(next, store->id, live) ? store->id : 0;
+        BinaryConstOp *fused = new BinaryConstOp(opcode, cst->value,
+                                                 constLeft ? right : left,
+                                                 constLeft, keep);
+        fused->success = next;
+        record(bytecode_optimize, "Fuse %O", (Op *) fused);
+
+        // The fused op takes the place of the constant, and owns the opcode
+        Redirect(cst, fused);
+        *std::find(instrs.begin(), instrs.end(), cst) = fused;
+        instrs.erase(std::find(instrs.begin(), instrs.end(), opcode));
+        instrs.erase(std::find(instrs.begin(), instrs.end(), store));
+        owned.insert(fused);
+        owned.erase(cst);
+        owned.erase(store);
+        owned.erase(opcode);
+        delete cst;
+        delete store;
+        changes++;
+    }
+    return changes;
+}
+
+
+uint Optimizer::FuseMatches()
+// ----------------------------------------------------------------------------
+//   Compare an evaluated natural with a constant and branch in one op
+// ----------------------------------------------------------------------------
+//   A pattern like 'fib 0' generates an 'eval' of the argument followed by
+//   a 'match' of the natural, which become a single EVAL_MATCH_NATURAL.
+{
+    References refs;
+    CountReferences(refs);
+
+    uint changes = 0;
+    Ops candidates = instrs;
+    for (Op *op : candidates)
+    {
+        if (!Owned(op) || dynamic_cast<EvalMatchOp *>(op))
+            continue;
+        EvalOp *eval = dynamic_cast<EvalOp *>(op);
+        if (!eval || refs[eval->success] != 1 || !Owned(eval->success))
+            continue;
+        NaturalMatchOp *match = dynamic_cast<NaturalMatchOp *>(eval->success);
+        if (!match)
+            continue;
+
+        EvalMatchOp *fused = new EvalMatchOp(eval->id, eval->ops, eval->fail,
+                                             match->pattern, match->fail);
+        fused->success = match->success;
+        record(bytecode_optimize, "Fuse %O", (Op *) fused);
+
+        // The fused op takes the place of the evaluation
+        Redirect(eval, fused);
+        *std::find(instrs.begin(), instrs.end(), eval) = fused;
+        instrs.erase(std::find(instrs.begin(), instrs.end(), match));
+        owned.insert(fused);
+        owned.erase(eval);
+        owned.erase(match);
+        delete eval;
+        delete match;
+        changes++;
+    }
+    return changes;
+}
+
+
+static int BuiltinKind(Tree *type)
+// ----------------------------------------------------------------------------
+//   Return the kind of values a builtin type accepts as is, -1 if none
+// ----------------------------------------------------------------------------
+{
+    if (type == natural_type)
+        return NATURAL;
+    if (type == real_type)
+        return REAL;
+    if (type == text_type)
+        return TEXT;
+    return -1;
+}
+
+
+uint Optimizer::Specialize(Kinds &kinds)
+// ----------------------------------------------------------------------------
+//   Use the input kinds that the guard of a variant checked
+// ----------------------------------------------------------------------------
+//   Naturals, reals and texts evaluate to themselves, so evaluating such
+//   an input cannot fail. A type check of such a value against 'natural',
+//   'real' or 'text' is then known statically, except natural as real.
+{
+    const int UNKNOWN = -1;
+    std::map<int, int> slotKinds;
+    for (uint p = 0; p < kinds.size(); p++)
+        slotKinds[~int(p)] = kinds[p] <= TEXT ? int(kinds[p]) : UNKNOWN;
+
+    // Bind constant inputs directly instead of evaluating them
+    uint changes = 0;
+    Ops candidates = instrs;
+    for (Op *op : candidates)
+    {
+        ArgEvalOp *arg = dynamic_cast<ArgEvalOp *>(op);
+        if (!arg || slotKinds.count(arg->argId) == 0)
+            continue;
+        int k = slotKinds[arg->argId];
+        if (k == UNKNOWN || arg->context->HasRewritesFor(kind(k)))
+            continue;
+        ArgValueOp *value = new ArgValueOp(arg->argId, arg->id);
+        record(bytecode_optimize, "Specialize %O as %O", op, (Op *) value);
+        Replace(arg, value, value);
+        changes++;
+    }
+
+    // Local slots only written from inputs of a single kind have that kind
+    std::set<int> written;
+    bool known = true;
+    for (Op *op : instrs)
+    {
+        if (ArgValueOp *arg = dynamic_cast<ArgValueOp *>(op))
+        {
+            int k = slotKinds[arg->argId];
+            auto found = slotKinds.find(arg->id);
+            if (found == slotKinds.end())
+                slotKinds[arg->id] = k;
+            else if (found->second != k)
+                found->second = UNKNOWN;
+        }
+        else if (dynamic_cast<ClearOp *>(op))
+        {
+            // Cleared slots are written again before being read
+        }
+        else if (!SlotWrites(op, written))
+        {
+            known = false;
+        }
+    }
+    for (auto &slot : slotKinds)
+        if (slot.first >= 0 && (!known || written.count(slot.first)))
+            slot.second = UNKNOWN;
+
+    // Resolve type checks against builtin types statically
+    candidates = instrs;
+    for (Op *op : candidates)
+    {
+        TypeCheckOp *check = dynamic_cast<TypeCheckOp *>(op);
+        if (!check || !check->constant || !slotKinds.count(check->value))
+            continue;
+        int k = slotKinds[check->value];
+        int expected = BuiltinKind(check->constant);
+        if (k == UNKNOWN || expected == UNKNOWN)
+            continue;
+        if (k == expected)
+        {
+            ValueOp *value = new ValueOp(check->value);
+            record(bytecode_optimize, "Check %O passes", op);
+            Replace(check, value, value);
+            changes++;
         }
+        else if (expected != REAL || k != NATURAL)
+        {
+            record(bytecode_optimize, "Check %O fails", op);
+            Remove(check, check->fail);
+            changes++;
         }
     }
-    return false;
+
+    if (changes)
+        changes += RemoveUnreachable();
+    return changes;
 }
 
 
-int CodeBuilder::ValueID(Tree *self)
+void Code::Optimize()
 // ----------------------------------------------------------------------------
-//    Return the evaluation ID for a given expression
+//   Run the optimization passes until they no longer change anything
 // ----------------------------------------------------------------------------
 {
-    int id;
+    Optimizer optimizer(this);
 
-    // For names, use the rewrite as a unique ID
-    Rewrite_p rw;
-    if (context)
-        if (Name *name = self->AsName())
-            if (context->Bound(name, true, &rw, nullptr))
-                self = rw;
+    // In a variant, first use the kinds of inputs checked by the guard
+    if (Kinds *kinds = InputKinds())
+        optimized[KINDS] += optimizer.Specialize(*kinds);
 
-    TreeIDs::iterator found = values.find(self);
-    if (found == values.end())
+    for (uint round = 0; round < 8; round++)
     {
-        id = values.size() + 2;
-        values[self] = id;
-    }
-    else
-    {
-        id = (*found).second;
+        uint changes[PASSES] = { 0 };
+        if (RECORDER_TWEAK(bytecode_opt_fold))
+            changes[FOLD] = optimizer.Fold();
+        if (RECORDER_TWEAK(bytecode_opt_checks))
+            changes[CHECKS] = optimizer.Checks();
+        if (RECORDER_TWEAK(bytecode_opt_jumps))
+            changes[JUMPS] = optimizer.Jumps();
+        if (RECORDER_TWEAK(bytecode_opt_dead))
+            changes[DEAD] = optimizer.DeadTemporaries();
+
+        uint total = 0;
+        for (uint p = 0; p < PASSES; p++)
+        {
+            optimized[p] += changes[p];
+            total += changes[p];
+        }
+        if (!total)
+            break;
     }
-    return id;
+
+    // Superinstructions last, since the other passes don't look into them
+    if (RECORDER_TWEAK(bytecode_opt_fuse))
+        optimized[FUSE] += optimizer.Fuse();
+
+    for (uint p = 0; p < PASSES; p++)
+        optimizations[p] += optimized[p];
+
+    record(bytecode_optimize,
+           "Optimized %t: fold %u checks %u jumps %u dead %u fuse %u kinds %u",
+           self, optimized[FOLD], optimized[CHECKS],
+           optimized[JUMPS], optimized[DEAD], optimized[FUSE],
+           optimized[KINDS]);
 }
 
 
-int CodeBuilder::CaptureID(Tree *self)
+
+// ============================================================================
+//
+//    Persistent cache of compiled bytecode
+//
+// ============================================================================
+//   A cache file holds the procedure compiled for a program, the procedures
+//   it calls and their variants. Trees and scopes that exist in the loaded
+//   source files are referenced by their index in a preorder walk of the
+//   files, opcodes by their index in the opcodes table. Other trees, i.e.
+//   trees built by the compiler, and the local scopes it created, are
+//   written in full. Procedures capturing values from the running program
+//   cannot be written, and neither can the program that contains them.
+//   A checksum at the end of the file detects damaged files.
+
+enum CacheTag
 // ----------------------------------------------------------------------------
-//    Return the capture ID for a given expression
+//   Tags in a cache file
 // ----------------------------------------------------------------------------
 {
-    int id;
-    TreeIDs::iterator found = inputs.find(self);
-    if (found == inputs.end())
-    {
-        id = ~inputs.size();
-        outputs[self] = id;
-    }
-    else
+    cacheNULL,
+
+    // Trees
+    cacheSOURCE, cacheBUILTIN, cacheSCOPE,
+    cacheNATURAL, cacheREAL, cacheTEXT, cacheNAME,
+    cacheBLOCK, cachePREFIX, cachePOSTFIX, cacheINFIX,
+
+    // Scopes and procedures
+    cacheKNOWN, cacheREF, cacheNEW,
+
+    // Operations
+    cacheOPCODE, cacheCONST, cacheSELF, cacheEVAL, cacheARG_EVAL,
+    cacheARG_VALUE, cacheCLEAR, cacheCLOSURE, cacheVALUE, cacheSTORE,
+    cacheCALL, cacheTYPECHECK, cacheINDEX, cacheFORM_ERROR,
+    cachePREFIX_FORM_ERROR, cacheNATURAL_MATCH, cacheREAL_MATCH,
+    cacheTEXT_MATCH, cacheBINARY_CONST, cacheNAME_MATCH, cacheWHEN,
+    cacheINFIX_MATCH, cacheEVAL_MATCH,
+
+    cacheVERSION = 0x0102,
+    cacheMAGIC   = 0x1ECAC4E
+};
+
+
+struct SourceIndex
+// ----------------------------------------------------------------------------
+//   Index of the trees, scopes and opcodes a cache file can refer to
+// ----------------------------------------------------------------------------
+{
+    SourceIndex();
+    static SourceIndex &        Current();
+
+    void                        Hash(const void *data, size_t size);
+    void                        Hash(text value);
+    void                        Hash(ulonglong value);
+
+    TreeList                    trees;
+    std::map<Tree *, uint>      treeIndex;
+    std::vector<Scope *>        scopes;
+    std::map<Scope *, uint>     scopeIndex;
+    std::map<Tree *, uint>      builtins;
+    std::map<text, uint>        opcodes;
+    std::map<Tree *, uint>      programs;
+    ulonglong                   version;        // Contents and context
+    ulonglong                   files;          // Paths of source files
+};
+
+
+static const ulonglong cacheHASH_SEED = 14695981039346656037ULL; // FNV-1a
+
+
+static void cacheHash(ulonglong &hash, const void *data, size_t size)
+// ----------------------------------------------------------------------------
+//   Add bytes to a hash value (FNV-1a)
+// ----------------------------------------------------------------------------
+{
+    const byte *bytes = (const byte *) data;
+    for (size_t i = 0; i < size; i++)
     {
-        id = (*found).second;
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
     }
-    return id;
 }
 
 
-int CodeBuilder::Evaluate(Context *ctx, Tree *self, bool deferEval)
+static text cacheOpcodeName(Opcode *opcode)
 // ----------------------------------------------------------------------------
-//   Evaluate the tree, and return its ID in the evals array
+//   The name identifying an opcode across runs of the same build
 // ----------------------------------------------------------------------------
 {
-    int id = 0;
+    return text(typeid(*opcode).name()) + ":" + opcode->OpID();
+}
 
-    // For constants, we can simply store it whenever we need it
-    if (self->IsConstant())
+
+SourceIndex::SourceIndex()
+// ----------------------------------------------------------------------------
+//   Walk all source files and opcodes, and compute the context version
+// ----------------------------------------------------------------------------
+    : version(cacheHASH_SEED), files(cacheHASH_SEED)
+{
+    Hash(cacheVERSION);
+    ulonglong cacheVersion = cacheVERSION;
+    cacheHash(files, &cacheVersion, sizeof(cacheVersion));
+
+    // Opcodes of this build
+    Opcode::Opcodes &all = *Opcode::opcodes;
+    for (uint i = 0; i < all.size(); i++)
     {
-        Instructions(ctx, self);
-        id = ValueID(self);
-        Add(new StoreOp(id));
-        return id;
+        Opcode *opcode = all[i];
+        text name = cacheOpcodeName(opcode);
+        opcodes[name] = i;
+        Hash(name);
+        if (NameOpcode *named = dynamic_cast<NameOpcode *>(opcode))
+            builtins[named->toDefine] = i;
     }
 
-    // For names, look them up to check if we have them somewhere
-    if (Name *name = self->AsName())
+    // Tweaks and options that change the generated code
+    Hash(RECORDER_TWEAK(bytecode_opt_fold));
+    Hash(RECORDER_TWEAK(bytecode_opt_checks));
+    Hash(RECORDER_TWEAK(bytecode_opt_jumps));
+    Hash(RECORDER_TWEAK(bytecode_opt_dead));
+    Hash(RECORDER_TWEAK(bytecode_opt_fuse));
+    Hash(RECORDER_TWEAK(bytecode_specialize));
+    Hash(RECORDER_TWEAK(bytecode_max_variants));
+    Hash(Opt::optimize.value);
+
+    // Source files in the order they were loaded, trees in preorder
+    for (text &name : MAIN->file_names)
     {
-        bool      evaluate = true;
-        Rewrite_p rw;
-        Scope_p   scope;
+        auto found = MAIN->files.find(name);
+        if (found == MAIN->files.end())
+            continue;
+        SourceFile &sf = found->second;
+        Hash(name);
+        text path = CodeCache::FullPath(name);
+        cacheHash(files, path.data(), path.size() + 1);
+        if (sf.tree)
+            programs[sf.tree] = programs.size();
+
+        for (Scope *scope = sf.scope; scope; scope = Enclosing(scope))
+        {
+            if (scopeIndex.count(scope))
+                break;
+            scopeIndex[scope] = scopes.size();
+            scopes.push_back(scope);
+        }
 
-        if (Tree *value = ctx->Bound(name, true, &rw, &scope))
+        TreeList stack;
+        if (sf.tree)
+            stack.push_back(sf.tree);
+        while (!stack.empty())
         {
-            // Check if this is one of the input parameters
-            depth d = ScopeDepth(scope);
-            switch (d)
-            {
-            case PARAMETER:
+            Tree_p tree = stack.back();
+            stack.pop_back();
+            if (treeIndex.count(tree))
             {
-                TreeIDs::iterator found = inputs.find(rw);
-                XL_ASSERT(found != inputs.end() && "Parameter not bound?");
-                int inputId = (*found).second;
+                Hash(cacheSOURCE);
+                Hash(treeIndex[tree]);
+                continue;
+            }
+            treeIndex[tree] = trees.size();
+            trees.push_back(tree);
 
-                // Don't evaluate if already evaluated during argument passing
-                Tree *type = AnnotatedType(rw->left);
-                evaluate = false;
-                if (!type || type == tree_type)
-                {
-                    id = ValueID(rw);
-                    Add(new ArgEvalOp(ctx, inputId, id, failOp));
-                }
-                else
-                {
-                    id = inputId;
-                }
+            kind k = tree->Kind();
+            Hash(k);
+            switch(k)
+            {
+            case NATURAL:
+                Hash(((Natural *) (Tree *) tree)->value);
+                break;
+            case REAL:
+            {
+                double value = ((Real *) (Tree *) tree)->value;
+                Hash(&value, sizeof(value));
                 break;
             }
-
-            // Check if this is a local variable or function
-            case LOCAL:
+            case TEXT:
             {
-                id = ValueID(rw);
-                Op *code = CompileInternal(context, value, false);
-                AddEval(id, code);
+                Text *t = (Text *) (Tree *) tree;
+                Hash(t->value);
+                Hash(t->opening);
+                Hash(t->closing);
                 break;
             }
-
-            // Global entities can be evaluated directly in place
-            case GLOBAL:
+            case NAME:
+                Hash(((Name *) (Tree *) tree)->value);
+                break;
+            case BLOCK:
             {
-                id = ValueID(rw);
+                Block *b = (Block *) (Tree *) tree;
+                Hash(b->opening);
+                Hash(b->closing);
+                stack.push_back(b->child);
                 break;
             }
-
-            // All other values are 'captured' from surrounding context
-            case ENCLOSING:
+            case PREFIX:
             {
-                id = CaptureID(rw);
-                if (count(captured.begin(), captured.end(), rw) == 0)
-                    captured.push_back(rw);
-                evaluate = false;
+                Prefix *p = (Prefix *) (Tree *) tree;
+                stack.push_back(p->right);
+                stack.push_back(p->left);
                 break;
             }
-            } // switch
-
-            // Evaluate code associated to name if we need to
-            if (evaluate)
+            case POSTFIX:
             {
-                if (Opcode *opcode = value->GetInfo<Opcode>())
-                {
-                    Op *code = opcode->Clone();
-                    AddEval(id, code);
-                }
-                else if (Code *code = value->GetInfo<Code>())
-                {
-                    AddEval(id, code);
-                }
-                else
-                {
-                    // No code yet: generate it
-                    ParmOrder noParms;
-                    TreeIDs   noParmIDs;
-                    Tree *type = AnnotatedType(rw->left);
-                    CallOp *call = Call(ctx, value, type, noParmIDs, noParms);
-                    instrs.push_back(call);
-                    AddEval(id, call);
-                }
+                Postfix *p = (Postfix *) (Tree *) tree;
+                stack.push_back(p->right);
+                stack.push_back(p->left);
+                break;
+            }
+            case INFIX:
+            {
+                Infix *i = (Infix *) (Tree *) tree;
+                Hash(i->name);
+                stack.push_back(i->right);
+                stack.push_back(i->left);
+                break;
+            }
             }
-
-            return id;
         }
     }
+}
 
-    // Other cases: generate code for the value, and evaluate it
-    id = ValueID(self);
-    Op *ops = CompileInternal(ctx, self, deferEval);
-    AddEval(id, ops);
 
-    // Return the allocated ID
-    return id;
+SourceIndex &SourceIndex::Current()
+// ----------------------------------------------------------------------------
+//   Build the index when first needed, once all source files were loaded
+// ----------------------------------------------------------------------------
+{
+    static SourceIndex index;
+    return index;
 }
 
 
-int CodeBuilder::EvaluationTemporary(Tree *self)
+void SourceIndex::Hash(const void *data, size_t size)
 // ----------------------------------------------------------------------------
-//    Create an evaluation temporary
+//   Add bytes to the context version
 // ----------------------------------------------------------------------------
 {
-    uint id = ValueID(self);
-    Code *code = new Code(context, self, new ValueOp(id));
-    self->SetInfo<Code>(code);
-    return id;
+    cacheHash(version, data, size);
 }
 
 
-CallOp *CodeBuilder::Call(Context *ctx, Tree *value, Tree *type,
-                          TreeIDs &parmIDs, ParmOrder &parms)
+void SourceIndex::Hash(text value)
 // ----------------------------------------------------------------------------
-//   Generate the code sequence for a call
+//   Add a text to the context version, including its size
 // ----------------------------------------------------------------------------
 {
-    TreeList captured;
-    Procedure *fn = Bytecode::Compile(ctx, value, type, parmIDs, captured);
+    Hash(ulonglong(value.size()));
+    Hash(value.data(), value.size());
+}
 
-    // Check if we captured values from the surrounding contexts
-    if (uint csize = captured.size())
+
+void SourceIndex::Hash(ulonglong value)
+// ----------------------------------------------------------------------------
+//   Add a number to the context version
+// ----------------------------------------------------------------------------
+{
+    Hash(&value, sizeof(value));
+}
+
+
+struct CacheWriter : Serializer
+// ----------------------------------------------------------------------------
+//   Write procedures to a cache file
+// ----------------------------------------------------------------------------
+{
+    CacheWriter(std::ostream &out, SourceIndex &source)
+        : Serializer(out), source(source), portable(true) {}
+
+    void        Write(Procedure *proc, ulonglong key, uint index);
+    void        WriteTree(Tree *tree);
+    void        WriteScope(Scope *scope);
+    void        WriteProc(Procedure *proc);
+    void        WriteOp(Op *op, std::map<Op *, uint> &index);
+    void        WriteOpRef(Op *op, std::map<Op *, uint> &index);
+    void        WriteOpcode(Opcode *opcode);
+    void        Reject(kstring what, kstring why);
+
+    SourceIndex &               source;
+    std::map<Scope *, uint>     scopes;
+    std::map<Procedure *, uint> procs;
+    bool                        portable;
+};
+
+
+void CacheWriter::Write(Procedure *proc, ulonglong key, uint index)
+// ----------------------------------------------------------------------------
+//   Write the header, the program procedure and a trailer
+// ----------------------------------------------------------------------------
+{
+    WriteUnsigned(cacheMAGIC);
+    WriteUnsigned(cacheVERSION);
+    WriteUnsigned(key);
+    WriteUnsigned(index);
+    WriteProc(proc);
+    WriteUnsigned(cacheMAGIC);
+}
+
+
+void CacheWriter::Reject(kstring what, kstring why)
+// ----------------------------------------------------------------------------
+//   Record why the code can't be cached
+// ----------------------------------------------------------------------------
+{
+    if (portable)
+        record(bytecode_cache, "Cannot cache %s: %s", what, why);
+    portable = false;
+}
+
+
+void CacheWriter::WriteTree(Tree *tree)
+// ----------------------------------------------------------------------------
+//   Write a reference to a source tree, or the tree itself
+// ----------------------------------------------------------------------------
+{
+    if (!portable)
+        return;
+    if (!tree)
     {
-        for (uint c = 0; c < csize; c++)
-        {
-            Tree *cap = captured[c];
-            int id = ValueID(cap);
-            parms.insert(parms.begin(), id);
-        }
+        WriteUnsigned(cacheNULL);
+        return;
     }
 
-    // Record the maximum parameter size
-    uint np = parms.size() + 2;
-    if (nParms < np)
-        nParms = np;
+    auto found = source.treeIndex.find(tree);
+    if (found != source.treeIndex.end())
+    {
+        WriteUnsigned(cacheSOURCE);
+        WriteUnsigned(found->second);
+        return;
+    }
+    auto builtin = source.builtins.find(tree);
+    if (builtin != source.builtins.end())
+    {
+        WriteUnsigned(cacheBUILTIN);
+        WriteUnsigned(builtin->second);
+        return;
+    }
+    if (Scope *scope = IsScope(tree))
+    {
+        WriteUnsigned(cacheSCOPE);
+        WriteScope(scope);
+        return;
+    }
 
-    // Output slot where we will pass paramters and generate call
-    CallOp *call = new CallOp(fn, ~0U, parms);
-    return call;
+    switch(tree->Kind())
+    {
+    case NATURAL:
+        WriteUnsigned(cacheNATURAL);
+        WriteUnsigned(tree->Position());
+        WriteUnsigned(((Natural *) tree)->value);
+        break;
+    case REAL:
+        WriteUnsigned(cacheREAL);
+        WriteUnsigned(tree->Position());
+        WriteReal(((Real *) tree)->value);
+        break;
+    case TEXT:
+    {
+        Text *t = (Text *) tree;
+        WriteUnsigned(cacheTEXT);
+        WriteUnsigned(tree->Position());
+        WriteText(t->value);
+        WriteText(t->opening);
+        WriteText(t->closing);
+        break;
+    }
+    case NAME:
+        WriteUnsigned(cacheNAME);
+        WriteUnsigned(tree->Position());
+        WriteText(((Name *) tree)->value);
+        break;
+    case BLOCK:
+    {
+        Block *b = (Block *) tree;
+        WriteUnsigned(cacheBLOCK);
+        WriteUnsigned(tree->Position());
+        WriteText(b->opening);
+        WriteText(b->closing);
+        WriteTree(b->child);
+        break;
+    }
+    case PREFIX:
+    {
+        Prefix *p = (Prefix *) tree;
+        WriteUnsigned(cachePREFIX);
+        WriteUnsigned(tree->Position());
+        WriteTree(p->left);
+        WriteTree(p->right);
+        break;
+    }
+    case POSTFIX:
+    {
+        Postfix *p = (Postfix *) tree;
+        WriteUnsigned(cachePOSTFIX);
+        WriteUnsigned(tree->Position());
+        WriteTree(p->left);
+        WriteTree(p->right);
+        break;
+    }
+    case INFIX:
+    {
+        Infix *i = (Infix *) tree;
+        WriteUnsigned(cacheINFIX);
+        WriteUnsigned(tree->Position());
+        WriteText(i->name);
+        WriteTree(i->left);
+        WriteTree(i->right);
+        break;
+    }
+    }
 }
 
 
+static void cacheDeclarations(Rewrite *rw, std::vector<Infix *> &decls)
+// ----------------------------------------------------------------------------
+//   List the declarations in a scope in preorder, which Enter replays
+// ----------------------------------------------------------------------------
+{
+    while (rw)
+    {
+        if (Infix *decl = RewriteDeclaration(rw))
+            decls.push_back(decl);
+        RewriteChildren *children = RewriteNext(rw);
+        if (!children)
+            break;
+        cacheDeclarations(children->left->AsInfix(), decls);
+        rw = children->right->AsInfix();
+    }
+}
 
-// ============================================================================
-//
-//     Ops used during argument / parameter binding
-//
-// ============================================================================
-
-template<class T>
-struct MatchOp : FailOp
+
+void CacheWriter::WriteScope(Scope *scope)
 // ----------------------------------------------------------------------------
-//   Check if the current result matches the natural/real/text value
+//   Write a reference to a known scope, or a local scope with its declarations
 // ----------------------------------------------------------------------------
 {
-    MatchOp(typename T::value_t ref, Op *fail): FailOp(fail), ref(ref) {}
-    typename T::value_t ref;
-
-    virtual Op *        Run(Data data)
+    if (!portable)
+        return;
+    if (!scope)
     {
-        Tree *test = DataResult(data);
-        if (T *tval = test->As<T>())
-            if (tval->value == ref)
-                return success;
-        return fail;
+        WriteUnsigned(cacheNULL);
+        return;
     }
 
-    virtual kstring     OpID()  { return "match"; }
-    virtual void        Dump(std::ostream &out)
+    auto known = source.scopeIndex.find(scope);
+    if (known != source.scopeIndex.end())
     {
-        out << OpID() << "\t" << ref;
+        WriteUnsigned(cacheKNOWN);
+        WriteUnsigned(known->second);
+        return;
+    }
+    auto local = scopes.find(scope);
+    if (local != scopes.end())
+    {
+        WriteUnsigned(cacheREF);
+        WriteUnsigned(local->second);
+        return;
     }
-};
 
-template<> kstring MatchOp<Natural>::OpID()     { return "match\tnatural"; }
-template<> kstring MatchOp<Real>   ::OpID()     { return "match\treal"; }
-template<> kstring MatchOp<Text>   ::OpID()     { return "match\ttext"; }
+    Scope *parent = Enclosing(scope);
+    if (!parent)
+        return Reject("scope", "unknown global scope");
+    WriteUnsigned(cacheNEW);
+    scopes[scope] = scopes.size();
+    WriteScope(parent);
+
+    std::vector<Infix *> decls;
+    cacheDeclarations(ScopeRewrites(scope), decls);
+    WriteUnsigned(decls.size());
+    for (Infix *decl : decls)
+        WriteTree(decl);
+}
 
 
-struct NameMatchOp : FailOp
+void CacheWriter::WriteProc(Procedure *proc)
 // ----------------------------------------------------------------------------
-//   Check if the current top of stack matches the name
+//   Write a reference to a procedure, or the procedure on first use
 // ----------------------------------------------------------------------------
 {
-    NameMatchOp(int testID, int nameID, Op *fail)
-        : FailOp(fail), testID(testID), nameID(nameID) {}
-    int testID;
-    int nameID;
-
-    virtual Op *        Run(Data data)
+    if (!portable)
+        return;
+    if (!proc)
     {
-        Tree *test = data[testID];
-        Tree *ref  = data[nameID];
-        if (Tree::Equal(ref, test))
-            return success;
-        return fail;
+        WriteUnsigned(cacheNULL);
+        return;
     }
-    virtual kstring     OpID()  { return "match\tname"; }
-    virtual void        Dump(std::ostream &out)
+    auto found = procs.find(proc);
+    if (found != procs.end())
     {
-        out << OpID() << "\t" << testID << "," << nameID;
+        WriteUnsigned(cacheREF);
+        WriteUnsigned(found->second);
+        return;
     }
-};
+    if (proc->Closures())
+        return Reject("procedure", "captures values");
+
+    WriteUnsigned(cacheNEW);
+    procs[proc] = procs.size();
+    WriteTree(proc->self);
+    WriteScope(proc->context->Symbols());
+    WriteUnsigned(proc->nInputs);
+    WriteUnsigned(proc->nLocals);
+    for (uint p = 0; p < Code::PASSES; p++)
+        WriteUnsigned(proc->optimized[p]);
+
+    WriteProc(proc->generic);
+    WriteUnsigned(proc->guard.size());
+    for (kind k : proc->guard)
+        WriteUnsigned(k);
+
+    std::map<Op *, uint> index;
+    Ops &instrs = proc->instrs;
+    for (uint i = 0; i < instrs.size(); i++)
+        index[instrs[i]] = i + 1;
+    WriteUnsigned(instrs.size());
+    for (Op *op : instrs)
+        WriteOp(op, index);
+    WriteOpRef(proc->ops, index);
+
+    WriteUnsigned(proc->variants.size());
+    for (Procedure *variant : proc->variants)
+        WriteProc(variant);
+}
 
 
-struct WhenClauseOp : FailOp
+void CacheWriter::WriteOpRef(Op *op, std::map<Op *, uint> &index)
 // ----------------------------------------------------------------------------
-//   Check if the condition in a when clause is verified
+//   Write the index of an operation in the instructions of a procedure
 // ----------------------------------------------------------------------------
 {
-    WhenClauseOp(int whenID, Op *fail): FailOp(fail), whenID(whenID) {}
-    int whenID;
-
-    virtual Op *        Run(Data data)
-    {
-        if (data[whenID] != xl_true)
-            return fail;
-        return success;
-    }
-    virtual kstring     OpID()  { return "when"; };
-    virtual void        Dump(std::ostream &out)
+    if (!op)
     {
-        out << OpID() << "\t" << whenID;
+        WriteUnsigned(0);
+        return;
     }
-};
+    auto found = index.find(op);
+    if (found == index.end())
+        return Reject(op->OpID(), "link outside of procedure");
+    WriteUnsigned(found->second);
+}
 
 
-struct InfixMatchOp : FailOp
+void CacheWriter::WriteOpcode(Opcode *opcode)
 // ----------------------------------------------------------------------------
-//   Check if the result is an infix
+//   Write a reference to the opcode and the parameters it was set up with
 // ----------------------------------------------------------------------------
 {
-    InfixMatchOp(text symbol, Op *fail, uint lid, uint rid)
-        : FailOp(fail), symbol(symbol),
-          lid(lid), rid(rid) {}
-    text        symbol;
-    uint        lid;
-    uint        rid;
+    auto found = source.opcodes.find(cacheOpcodeName(opcode));
+    if (found == source.opcodes.end())
+        return Reject(opcode->OpID(), "unregistered opcode");
+    WriteUnsigned(found->second);
+    WriteText(opcode->OpID());
+
+    ParmOrder parms;
+    bool hasParms = opcode->GetParms(parms);
+    WriteUnsigned(hasParms ? parms.size() + 1 : 0);
+    for (int parm : parms)
+        WriteSigned(parm);
+}
 
-    virtual Op *        Run(Data data)
+
+void CacheWriter::WriteOp(Op *op, std::map<Op *, uint> &index)
+// ----------------------------------------------------------------------------
+//   Write an operation and its success and failure links
+// ----------------------------------------------------------------------------
+{
+    if (!portable)
+        return;
+
+    if (Opcode *opcode = dynamic_cast<Opcode *>(op))
     {
-        Tree *test = DataResult(data);
-        Context_p ctx = nullptr;
-        if (Tree *inside = Interpreter::IsClosure(test, &ctx))
-            test = inside;
-        if (Infix *ifx = test->AsInfix())
+        WriteUnsigned(cacheOPCODE);
+        WriteOpcode(opcode);
+    }
+    else if (ConstOp *cst = dynamic_cast<ConstOp *>(op))
+    {
+        WriteUnsigned(cacheCONST);
+        WriteTree(cst->value);
+    }
+    else if (dynamic_cast<SelfOp *>(op))
+    {
+        WriteUnsigned(cacheSELF);
+    }
+    else if (EvalOp *eval = dynamic_cast<EvalOp *>(op))
+    {
+        EvalMatchOp *match = dynamic_cast<EvalMatchOp *>(op);
+        WriteUnsigned(match ? cacheEVAL_MATCH : cacheEVAL);
+        WriteSigned(eval->id);
+        Op *code = eval->ops;
+        if (!code)
         {
-            if (ifx->name == symbol)
-            {
-                if (ctx)
-                {
-                    data[lid] = Interpreter::MakeClosure(ctx, ifx->left);
-                    data[rid] = Interpreter::MakeClosure(ctx, ifx->right);
-                }
-                else
-                {
-                    data[lid] = ifx->left;
-                    data[rid] = ifx->right;
-                }
-                return success;
-            }
+            WriteUnsigned(cacheNULL);
+        }
+        else if (index.count(code))
+        {
+            WriteUnsigned(cacheEVAL);
+            WriteOpRef(code, index);
+        }
+        else if (Procedure *proc = dynamic_cast<Procedure *>(code))
+        {
+            WriteUnsigned(cacheCALL);
+            WriteProc(proc);
+        }
+        else if (Opcode *opcode = dynamic_cast<Opcode *>(code))
+        {
+            if (opcode->success)
+                return Reject(opcode->OpID(), "inline opcode with links");
+            WriteUnsigned(cacheOPCODE);
+            WriteOpcode(opcode);
+        }
+        else
+        {
+            return Reject(code->OpID(), "evaluated code");
+        }
+        if (match)
+        {
+            WriteTree(match->pattern);
+            WriteOpRef(match->mismatch, index);
         }
-        return fail;
     }
-
-    virtual kstring     OpID()  { return "infix"; }
-    virtual void        Dump(std::ostream &out)
+    else if (ArgEvalOp *arg = dynamic_cast<ArgEvalOp *>(op))
     {
-        out << OpID() << "\t" << lid << " " << symbol << " " << rid;
+        WriteUnsigned(cacheARG_EVAL);
+        WriteScope(arg->context->Symbols());
+        WriteSigned(arg->argId);
+        WriteSigned(arg->id);
+    }
+    else if (ArgValueOp *arg = dynamic_cast<ArgValueOp *>(op))
+    {
+        WriteUnsigned(cacheARG_VALUE);
+        WriteSigned(arg->argId);
+        WriteSigned(arg->id);
+    }
+    else if (ClearOp *clear = dynamic_cast<ClearOp *>(op))
+    {
+        WriteUnsigned(cacheCLEAR);
+        WriteSigned(clear->lo);
+        WriteSigned(clear->hi);
+    }
+    else if (ClosureOp *closure = dynamic_cast<ClosureOp *>(op))
+    {
+        WriteUnsigned(cacheCLOSURE);
+        WriteScope(closure->context->Symbols());
+    }
+    else if (ValueOp *value = dynamic_cast<ValueOp *>(op))
+    {
+        WriteUnsigned(cacheVALUE);
+        WriteSigned(value->id);
+    }
+    else if (StoreOp *store = dynamic_cast<StoreOp *>(op))
+    {
+        WriteUnsigned(cacheSTORE);
+        WriteSigned(store->id);
+    }
+    else if (CallOp *call = dynamic_cast<CallOp *>(op))
+    {
+        Procedure *target = dynamic_cast<Procedure *>(call->target);
+        if (!target)
+            return Reject(call->target->OpID(), "call target");
+        WriteUnsigned(cacheCALL);
+        WriteProc(target);
+        WriteSigned(call->outId);
+        WriteUnsigned(call->parms.size());
+        for (int parm : call->parms)
+            WriteSigned(parm);
+        WriteSigned(call->variant);
+        WriteUnsigned(call->calls);
+        WriteUnsigned(call->failures);
+    }
+    else if (TypeCheckOp *check = dynamic_cast<TypeCheckOp *>(op))
+    {
+        WriteUnsigned(cacheTYPECHECK);
+        WriteSigned(check->value);
+        WriteSigned(check->type);
+        WriteTree(check->constant);
+    }
+    else if (IndexOp *idx = dynamic_cast<IndexOp *>(op))
+    {
+        WriteUnsigned(cacheINDEX);
+        WriteSigned(idx->left);
+        WriteSigned(idx->right);
+    }
+    else if (PrefixFormErrorOp *error = dynamic_cast<PrefixFormErrorOp*>(op))
+    {
+        WriteUnsigned(cachePREFIX_FORM_ERROR);
+        WriteTree(error->self);
+    }
+    else if (FormErrorOp *error = dynamic_cast<FormErrorOp *>(op))
+    {
+        WriteUnsigned(cacheFORM_ERROR);
+        WriteTree(error->self);
+    }
+    else if (NaturalMatchOp *match = dynamic_cast<NaturalMatchOp *>(op))
+    {
+        WriteUnsigned(cacheNATURAL_MATCH);
+        WriteTree(match->pattern);
+    }
+    else if (MatchOp<Real> *match = dynamic_cast<MatchOp<Real> *>(op))
+    {
+        WriteUnsigned(cacheREAL_MATCH);
+        WriteReal(match->ref);
+    }
+    else if (MatchOp<Text> *match = dynamic_cast<MatchOp<Text> *>(op))
+    {
+        WriteUnsigned(cacheTEXT_MATCH);
+        WriteText(match->ref);
+    }
+    else if (BinaryConstOp *binary = dynamic_cast<BinaryConstOp *>(op))
+    {
+        WriteUnsigned(cacheBINARY_CONST);
+        WriteOpcode(binary->opcode);
+        WriteTree(binary->value);
+        WriteSigned(binary->id);
+        WriteUnsigned(binary->constLeft);
+        WriteSigned(binary->store);
+    }
+    else if (NameMatchOp *match = dynamic_cast<NameMatchOp *>(op))
+    {
+        WriteUnsigned(cacheNAME_MATCH);
+        WriteSigned(match->testID);
+        WriteSigned(match->nameID);
+    }
+    else if (WhenClauseOp *when = dynamic_cast<WhenClauseOp *>(op))
+    {
+        WriteUnsigned(cacheWHEN);
+        WriteSigned(when->whenID);
+    }
+    else if (InfixMatchOp *match = dynamic_cast<InfixMatchOp *>(op))
+    {
+        WriteUnsigned(cacheINFIX_MATCH);
+        WriteText(match->symbol);
+        WriteUnsigned(match->lid);
+        WriteUnsigned(match->rid);
+    }
+    else
+    {
+        return Reject(op->OpID(), "operation");
     }
-};
 
+    WriteOpRef(op->success, index);
+    if (FailOp *failOp = dynamic_cast<FailOp *>(op))
+        WriteOpRef(failOp->fail, index);
+}
 
 
-// ============================================================================
-//
-//    Argument match
-//
-// ============================================================================
+struct CacheReader : Deserializer
+// ----------------------------------------------------------------------------
+//   Read procedures back from a cache file
+// ----------------------------------------------------------------------------
+//   Any inconsistency makes the whole file invalid. The procedures read
+//   so far are then deleted, since nothing refers to them yet.
+{
+    CacheReader(std::istream &in, SourceIndex &source)
+        : Deserializer(in), source(source), valid(IsValid()) {}
+    ~CacheReader();
 
-CodeBuilder::strength CodeBuilder::Do(Natural *what)
+    struct Links
+    {
+        Links(): success(0), fail(0), code(0), mismatch(0) {}
+        uint            success, fail, code, mismatch;
+    };
+
+    Procedure * Read(ulonglong key, uint index);
+    Tree *      ReadTree();
+    Tree *      ReadChild();
+    Scope *     ReadScope();
+    Procedure * ReadProc();
+    Op *        ReadOp(Links &links);
+    Opcode *    ReadOpcode();
+    uint        ReadIndex(size_t size);
+    std::nullptr_t Fail(kstring why);
+
+    SourceIndex &               source;
+    std::vector<Scope_p>        scopes;
+    std::vector<Procedure *>    procs;
+    std::vector<CallOp *>       sites;  // Checked once variants are read
+    bool                        valid;
+};
+
+
+CacheReader::~CacheReader()
 // ----------------------------------------------------------------------------
-//   The pattern contains an natural: check we have the same
+//   Delete the procedures we read if the file was not valid
 // ----------------------------------------------------------------------------
 {
-    if (Natural *ival = test->AsNatural())
-        return ival->value == what->value ? ALWAYS : NEVER;
-    if (test->IsConstant())
-        return NEVER;
-    Evaluate(context, test);
-    Add(new MatchOp<Natural>(what->value, failOp));
-    return SOMETIMES;
+    if (valid)
+        return;
+    for (Procedure *proc : procs)
+        proc->variants.clear();
+    for (Procedure *proc : procs)
+        delete proc;
 }
 
 
-CodeBuilder::strength CodeBuilder::Do(Real *what)
+std::nullptr_t CacheReader::Fail(kstring why)
 // ----------------------------------------------------------------------------
-//   The pattern contains a real: check we have the same
+//   Mark the file as invalid
 // ----------------------------------------------------------------------------
 {
-    if (Real *rval = test->AsReal())
-        return rval->value != what->value ? ALWAYS : NEVER;
-    if (Natural *rval = test->AsNatural())
-        return rval->value != what->value ? ALWAYS : NEVER;
-    if (test->IsConstant())
-        return NEVER;
-    Evaluate(context, test);
-    Add(new MatchOp<Real>(what->value, failOp));
-    return SOMETIMES;
+    if (valid)
+        record(bytecode_cache, "Invalid cache file: %s", why);
+    valid = false;
+    return nullptr;
 }
 
 
-CodeBuilder::strength CodeBuilder::Do(Text *what)
+uint CacheReader::ReadIndex(size_t size)
 // ----------------------------------------------------------------------------
-//   The pattern contains a real: check we have the same
+//   Read an index and check it is below the given size
 // ----------------------------------------------------------------------------
 {
-    if (Text *tval = test->AsText())
-        return tval->value != what->value ? ALWAYS : NEVER;
-    if (test->IsConstant())
-        return NEVER;
-    Evaluate(context, test);
-    Add(new MatchOp<Text>(what->value, failOp));
-    return SOMETIMES;
+    ulonglong index = ReadUnsigned();
+    if (!IsValid() || index >= size)
+    {
+        Fail("index out of range");
+        return 0;
+    }
+    return index;
 }
 
 
-CodeBuilder::strength CodeBuilder::Do(Name *what)
+Procedure *CacheReader::Read(ulonglong key, uint index)
 // ----------------------------------------------------------------------------
-//   The pattern contains a name: bind it as a closure, no evaluation
+//   Check the header, then read the program procedure and the trailer
 // ----------------------------------------------------------------------------
 {
-    // If there is already a binding for that name, value must match
-    // This covers both a pattern with 'pi' in it and things like 'X+X'
-    if (Tree *bound = argsCtx->Bound(what))
+    if (!valid)
+        return Fail("bad serialization header");
+    if (ReadUnsigned() != cacheMAGIC || ReadUnsigned() != cacheVERSION)
+        return Fail("bad magic or version");
+    if (ReadUnsigned() != key || ReadUnsigned() != index)
+        return Fail("key mismatch");
+    Procedure *proc = ReadProc();
+    if (!proc || !valid)
+        return Fail("no program");
+    if (ReadUnsigned() != cacheMAGIC || !IsValid())
+        return Fail("truncated");
+    if (proc->Inputs() || proc->generic)
+        return Fail("program with inputs");
+    for (CallOp *call : sites)
     {
-        if (bound->GetInfo<Opcode>())
-        {
-            // If this is some built-in name, we can do a static test
-            if (Tree::Equal(bound, test))
-                return ALWAYS;
-            if (test->IsConstant())
-                return NEVER;
-        }
+        Procedure *target = (Procedure *) call->target;
+        if ((uint) call->variant >= target->variants.size())
+            return Fail("call to missing variant");
+    }
+    return proc;
+}
 
-        // Do a dynamic test to check if the name value is the same
-        int testID = Evaluate(context, test);
-        int nameID = Evaluate(argsCtx, bound);
-        Add(new NameMatchOp(testID, nameID, failOp));
-        return SOMETIMES;
+
+Tree *CacheReader::ReadChild()
+// ----------------------------------------------------------------------------
+//   Read a tree that can't be null
+// ----------------------------------------------------------------------------
+{
+    Tree *child = ReadTree();
+    if (!child)
+        return Fail("missing child");
+    return child;
+}
+
+
+Tree *CacheReader::ReadTree()
+// ----------------------------------------------------------------------------
+//   Read a reference to a source tree, or a tree written in full
+// ----------------------------------------------------------------------------
+{
+    if (!valid)
+        return nullptr;
+
+    ulonglong tag = ReadUnsigned();
+    switch(tag)
+    {
+    case cacheNULL:
+        return nullptr;
+    case cacheSOURCE:
+    {
+        uint index = ReadIndex(source.trees.size());
+        return valid ? (Tree *) source.trees[index] : nullptr;
+    }
+    case cacheBUILTIN:
+    {
+        uint index = ReadIndex(Opcode::opcodes->size());
+        if (!valid)
+            return nullptr;
+        Opcode *opcode = (*Opcode::opcodes)[index];
+        NameOpcode *named = dynamic_cast<NameOpcode *>(opcode);
+        if (!named)
+            return Fail("builtin is not a name");
+        return named->toDefine;
+    }
+    case cacheSCOPE:
+        return ReadScope();
     }
 
-    Evaluate(context, test, true);
-    Bind(what, test);
-    return ALWAYS;
+    TreePosition pos = ReadUnsigned();
+    switch(tag)
+    {
+    case cacheNATURAL:
+        return new Natural(ReadUnsigned(), pos);
+    case cacheREAL:
+        return new Real(ReadReal(), pos);
+    case cacheTEXT:
+    {
+        text value = ReadText();
+        text opening = ReadText();
+        text closing = ReadText();
+        return new Text(value, opening, closing, pos);
+    }
+    case cacheNAME:
+        return new Name(ReadText(), pos);
+    case cacheBLOCK:
+    {
+        text opening = ReadText();
+        text closing = ReadText();
+        Tree *child = ReadChild();
+        return valid ? new Block(child, opening, closing, pos) : nullptr;
+    }
+    case cachePREFIX:
+    {
+        Tree_p left = ReadChild();
+        Tree_p right = ReadChild();
+        return valid ? new Prefix(left, right, pos) : nullptr;
+    }
+    case cachePOSTFIX:
+    {
+        Tree_p left = ReadChild();
+        Tree_p right = ReadChild();
+        return valid ? new Postfix(left, right, pos) : nullptr;
+    }
+    case cacheINFIX:
+    {
+        text name = ReadText();
+        Tree_p left = ReadChild();
+        Tree_p right = ReadChild();
+        return valid ? new Infix(name, left, right, pos) : nullptr;
+    }
+    }
+    return Fail("bad tree tag");
 }
 
 
-CodeBuilder::strength CodeBuilder::Do(Block *what)
+Scope *CacheReader::ReadScope()
 // ----------------------------------------------------------------------------
-//   The pattern contains a block: look inside
+//   Read a reference to a scope, or rebuild a local scope
 // ----------------------------------------------------------------------------
 {
-    if (Block *testBlock = test->AsBlock())
-        if (testBlock->opening == what->opening &&
-            testBlock->closing == what->closing)
-            test = testBlock->child;
+    if (!valid)
+        return nullptr;
 
-    return what->child->Do(this);
+    switch(ReadUnsigned())
+    {
+    case cacheNULL:
+        return nullptr;
+    case cacheKNOWN:
+    {
+        uint index = ReadIndex(source.scopes.size());
+        return valid ? source.scopes[index] : nullptr;
+    }
+    case cacheREF:
+    {
+        uint index = ReadIndex(scopes.size());
+        if (!valid || !scopes[index])
+            return Fail("scope used before it is built");
+        return scopes[index];
+    }
+    case cacheNEW:
+    {
+        uint index = scopes.size();
+        scopes.push_back(nullptr);
+        Scope *parent = ReadScope();
+        if (!parent)
+            return Fail("local scope without parent");
+
+        Context_p context = new Context(parent);
+        Scope_p scope = context->CreateScope();
+        scopes[index] = scope;
+        ulonglong count = ReadUnsigned();
+        for (ulonglong d = 0; d < count && valid; d++)
+        {
+            Tree *decl = ReadChild();
+            Infix *infix = decl ? decl->AsInfix() : nullptr;
+            if (!infix)
+                return Fail("bad declaration");
+            context->Enter(infix);
+        }
+        return valid ? (Scope *) scope : nullptr;
+    }
+    }
+    return Fail("bad scope tag");
 }
 
 
-
-CodeBuilder::strength CodeBuilder::Do(Prefix *what)
+Procedure *CacheReader::ReadProc()
 // ----------------------------------------------------------------------------
-//   The pattern contains prefix: check that the left part matches
+//   Read a reference to a procedure, or rebuild it on first use
 // ----------------------------------------------------------------------------
 {
-    // The test itself should be a prefix
-    if (Prefix *pfx = test->AsPrefix())
+    if (!valid)
+        return nullptr;
+
+    switch(ReadUnsigned())
     {
-        // If we call 'sin X' and match 'sin 3', check if names match
-        if (Name *name = what->left->AsName())
-        {
-            if (Name *testName = pfx->left->AsName())
-            {
-                if (name->value == testName->value)
-                {
-                    test = pfx->right;
-                    return what->right->Do(this);
-                }
-                else
-                {
-                    Ooops("Prefix name $1 does not match $2", name, testName);
-                    return NEVER;
-                }
-            }
-        }
+    case cacheNULL:
+        return nullptr;
+    case cacheREF:
+    {
+        uint index = ReadIndex(procs.size());
+        return valid ? procs[index] : nullptr;
+    }
+    case cacheNEW:
+        break;
+    default:
+        return Fail("bad procedure tag");
+    }
 
-        // For other cases, we must go deep inside each prefix to check
-        return DoLeftRight(what->left, what->right, pfx->left, pfx->right);
+    Tree_p self = ReadChild();
+    Scope_p scope = ReadScope();
+    uint nInputs = ReadUnsigned();
+    uint nLocals = ReadUnsigned();
+    if (!valid || !scope)
+        return Fail("bad procedure header");
+
+    Procedure *proc = new Procedure(new Context(scope), self, nInputs, nLocals);
+    procs.push_back(proc);
+    for (uint p = 0; p < Code::PASSES; p++)
+        proc->optimized[p] = ReadUnsigned();
+
+    proc->generic = ReadProc();
+    ulonglong guards = ReadUnsigned();
+    if (guards > nInputs)
+        return Fail("bad guard");
+    for (ulonglong g = 0; g < guards; g++)
+    {
+        ulonglong k = ReadUnsigned();
+        if (k > KIND_LAST)
+            return Fail("bad guard kind");
+        proc->guard.push_back(kind(k));
     }
 
-    // All other cases are a mismatch
-    Ooops("Prefix $1 does not match $2", what, test);
-    return NEVER;
+    // Read operations with their links as indexes, then resolve them
+    ulonglong count = ReadUnsigned();
+    if (!valid || count > (1U << 24))
+        return Fail("bad operations count");
+    Ops &instrs = proc->instrs;
+    std::vector<Links> links(count);
+    for (ulonglong i = 0; i < count && valid; i++)
+        if (Op *op = ReadOp(links[i]))
+            instrs.push_back(op);
+    uint entry = ReadUnsigned();
+    if (!valid || !IsValid() || instrs.size() != count)
+        return Fail("bad operations");
+
+    auto resolve = [&](uint ref) -> Op *
+    {
+        if (ref > count)
+            return Fail("bad link");
+        return ref ? instrs[ref - 1] : nullptr;
+    };
+    for (uint i = 0; i < count; i++)
+    {
+        Op *op = instrs[i];
+        op->success = resolve(links[i].success);
+        if (FailOp *failOp = dynamic_cast<FailOp *>(op))
+            failOp->fail = resolve(links[i].fail);
+        if (links[i].code)
+            ((EvalOp *) op)->ops = resolve(links[i].code);
+        if (EvalMatchOp *match = dynamic_cast<EvalMatchOp *>(op))
+            match->mismatch = resolve(links[i].mismatch);
+    }
+    proc->ops = resolve(entry);
+    if (!valid)
+        return Fail("bad entry point");
+    proc->Encode();
+
+    ulonglong variants = ReadUnsigned();
+    for (ulonglong v = 0; v < variants && valid; v++)
+    {
+        Procedure *variant = ReadProc();
+        if (!variant || variant->generic != proc)
+            return Fail("bad variant");
+        proc->variants.push_back(variant);
+    }
+    return valid ? proc : nullptr;
 }
 
 
-CodeBuilder::strength CodeBuilder::Do(Postfix *what)
+Opcode *CacheReader::ReadOpcode()
 // ----------------------------------------------------------------------------
-//   The pattern contains posfix: check that the right part matches
+//   Clone an opcode from the opcodes table and set its parameters
 // ----------------------------------------------------------------------------
 {
-    // The test itself should be a postfix
-    if (Postfix *pfx = test->AsPostfix())
+    Opcode::Opcodes &all = *Opcode::opcodes;
+    uint index = ReadIndex(all.size());
+    text name = ReadText();
+    ulonglong count = ReadUnsigned();
+    if (!valid || count > 16)
+        return Fail("bad opcode");
+    ParmOrder parms;
+    for (ulonglong p = 1; p < count; p++)
+        parms.push_back(ReadSigned());
+    if (!valid || name != all[index]->OpID())
+        return Fail("opcode mismatch");
+
+    Opcode *opcode = all[index]->Clone();
+    if (count)
     {
-        // If we call 'X!' and match '3!', check if names match
-        if (Name *name = what->right->AsName())
+        ParmOrder expected;
+        if (!opcode->GetParms(expected) || expected.size() != parms.size())
         {
-            if (Name *testName = pfx->right->AsName())
-            {
-                if (name->value == testName->value)
-                {
-                    test = pfx->left;
-                    return what->left->Do(this);
-                }
-                else
-                {
-                    Ooops("Postfix name $1 does not match $2", name, testName);
-                    return NEVER;
-                }
-            }
+            delete opcode;
+            return Fail("opcode parameters mismatch");
         }
-
-        // For other cases, we must go deep inside each prefix to check
-        return DoLeftRight(what->right, what->left, pfx->right, pfx->left);
+        opcode->SetParms(parms);
     }
-
-    // All other cases are a mismatch
-    Ooops("Postfix $1 does not match $2", what, test);
-    return NEVER;
+    return opcode;
 }
 
 
-CodeBuilder::strength CodeBuilder::Do(Infix *what)
+Op *CacheReader::ReadOp(Links &links)
 // ----------------------------------------------------------------------------
-//   The complicated case: various declarations
+//   Read an operation, leaving its links as indexes
 // ----------------------------------------------------------------------------
 {
-    Save<Context_p> saveContext(context, context);
+    if (!valid)
+        return nullptr;
 
-    // Check if we have typed arguments, e.g. X:natural
-    if (what->name == ":")
+    Op *op = nullptr;
+    ulonglong tag = ReadUnsigned();
+    switch(tag)
     {
-        Name *name = what->left->AsName();
-        if (!name)
+    case cacheOPCODE:
+        op = ReadOpcode();
+        break;
+    case cacheCONST:
+        if (Tree *value = ReadChild())
+            op = new ConstOp(value);
+        break;
+    case cacheSELF:
+        op = new SelfOp;
+        break;
+    case cacheEVAL:
+    case cacheEVAL_MATCH:
+    {
+        bool match = tag == cacheEVAL_MATCH;
+        int id = ReadSigned();
+        Op *code = nullptr;
+        switch(ReadUnsigned())
         {
-            Ooops("Invalid declaration, $1 is not a name", what->left);
-            return NEVER;
+        case cacheNULL:                                 break;
+        case cacheEVAL:         links.code = ReadUnsigned(); break;
+        case cacheCALL:         code = ReadProc();      break;
+        case cacheOPCODE:       code = ReadOpcode();    break;
+        default:                Fail("bad evaluation"); break;
         }
-
-        // Typed name: evaluate type and check match
-        Tree *namedType = nullptr;
-        Tree *type = what->right;
-        if (Name *typeName = type->AsName())
-            if (Tree *found = context->Bound(typeName))
-                namedType = found;
-
-        if (namedType)
+        if (match)
         {
-            if (namedType == tree_type)
-            {
-                Evaluate(context, test, true);
-                Bind(name, test);
-                return ALWAYS;
-            }
-            Scope *scope = context->Symbols();
-            if (Tree *cast = xl_typecheck(scope, namedType, test))
-            {
-                test = cast;
-                Evaluate(context, test);
-                Bind(name, test, namedType);
-                return ALWAYS;
-            }
-
-            // Check if this is a builtin type vs. a constant
-            if (test->IsConstant())
-                return NEVER;
+            Tree *pattern = ReadChild();
+            Natural *natural = pattern ? pattern->AsNatural() : nullptr;
+            links.mismatch = ReadUnsigned();
+            if (natural && valid)
+                op = new EvalMatchOp(id, code, nullptr, natural, nullptr);
         }
-
-        // In all other cases, we need do perform dynamic evaluation to check
-        Evaluate(context, test);
-        AddTypeCheck(context, test, type);
-        Bind(name, test, type);
-        return SOMETIMES;
+        else if (valid)
+        {
+            op = new EvalOp(id, code, nullptr);
+        }
+        break;
     }
-
-    // Check if we have typed declarations, e.g. X+Y as natural
-    if (what->name == "as")
+    case cacheARG_EVAL:
     {
-        if (resultType)
+        Scope *scope = ReadScope();
+        int argId = ReadSigned();
+        int id = ReadSigned();
+        if (scope)
+            op = new ArgEvalOp(new Context(scope), argId, id, nullptr);
+        break;
+    }
+    case cacheARG_VALUE:
+    {
+        int argId = ReadSigned();
+        int id = ReadSigned();
+        op = new ArgValueOp(argId, id);
+        break;
+    }
+    case cacheCLEAR:
+    {
+        int lo = ReadSigned();
+        int hi = ReadSigned();
+        op = new ClearOp(lo, hi);
+        break;
+    }
+    case cacheCLOSURE:
+        if (Scope *scope = ReadScope())
+            op = new ClosureOp(new Context(scope));
+        break;
+    case cacheVALUE:
+        op = new ValueOp(ReadSigned());
+        break;
+    case cacheSTORE:
+        op = new StoreOp(ReadSigned());
+        break;
+    case cacheCALL:
+    {
+        Procedure *target = ReadProc();
+        int outId = ReadSigned();
+        ulonglong count = ReadUnsigned();
+        if (!target || count > target->Inputs())
+            return Fail("bad call");
+        ParmOrder parms;
+        for (ulonglong p = 0; p < count; p++)
+            parms.push_back(ReadSigned());
+        int variant = ReadSigned();
+        uint calls = ReadUnsigned();
+        uint failures = ReadUnsigned();
+        if (!valid)
+            return nullptr;
+        if (variant < -1)
+            return Fail("bad variant index");
+        CallOp *call = new CallOp(target, outId, parms);
+        call->variant = variant;
+        call->calls = calls;
+        call->failures = failures;
+        if (variant >= 0)
+            sites.push_back(call);
+        op = call;
+        break;
+    }
+    case cacheTYPECHECK:
+    {
+        int value = ReadSigned();
+        int type = ReadSigned();
+        Tree *constant = ReadTree();
+        if (constant)
+            op = new TypeCheckOp(value, constant, nullptr);
+        else if (valid)
+            op = new TypeCheckOp(value, type, nullptr);
+        break;
+    }
+    case cacheINDEX:
+    {
+        int left = ReadSigned();
+        int right = ReadSigned();
+        op = new IndexOp(left, right, nullptr);
+        break;
+    }
+    case cacheFORM_ERROR:
+        if (Tree *self = ReadChild())
+            op = new FormErrorOp(self);
+        break;
+    case cachePREFIX_FORM_ERROR:
+        if (Tree *self = ReadChild())
+            op = new PrefixFormErrorOp(self);
+        break;
+    case cacheNATURAL_MATCH:
+        if (Tree *pattern = ReadChild())
         {
-            Ooops("Duplicate return type declaration $1", what);
-            Ooops("Previously declared type was $1", resultType);
+            if (Natural *natural = pattern->AsNatural())
+                op = new NaturalMatchOp(natural, nullptr);
+            else
+                Fail("bad natural pattern");
         }
-        resultType = what->right;
-        return what->left->Do(this);
+        break;
+    case cacheREAL_MATCH:
+        op = new MatchOp<Real>(ReadReal(), nullptr);
+        break;
+    case cacheTEXT_MATCH:
+        op = new MatchOp<Text>(ReadText(), nullptr);
+        break;
+    case cacheBINARY_CONST:
+    {
+        Opcode *opcode = ReadOpcode();
+        Tree *value = ReadTree();
+        int id = ReadSigned();
+        bool constLeft = ReadUnsigned();
+        int store = ReadSigned();
+        InfixOpcode *infix = dynamic_cast<InfixOpcode *>(opcode);
+        if (!infix || !value || !valid)
+        {
+            delete opcode;
+            return Fail("bad binary constant");
+        }
+        op = new BinaryConstOp(infix, value, id, constLeft, store);
+        break;
     }
-
-    // Check if we have a guard clause
-    if (what->name == "when")
+    case cacheNAME_MATCH:
     {
-        // It must pass the rest (need to bind values first)
-        if (what->left->Do(this) == NEVER)
-            return NEVER;
-
-        // Here, we need to evaluate in the local context, not eval one
-        int whenID = Evaluate(argsCtx, what->right);
-        Add(new WhenClauseOp(whenID, failOp));
-        return SOMETIMES;
+        int testID = ReadSigned();
+        int nameID = ReadSigned();
+        op = new NameMatchOp(testID, nameID, nullptr);
+        break;
+    }
+    case cacheWHEN:
+        op = new WhenClauseOp(ReadSigned(), nullptr);
+        break;
+    case cacheINFIX_MATCH:
+    {
+        text symbol = ReadText();
+        uint lid = ReadUnsigned();
+        uint rid = ReadUnsigned();
+        op = new InfixMatchOp(symbol, nullptr, lid, rid);
+        break;
+    }
+    default:
+        return Fail("bad operation tag");
     }
 
-    // In all other cases, we need an infix with matching name
-    Infix_p ifx = test->AsInfix();
-    strength str = ALWAYS;
-    if (!ifx || ifx->name != what->name)
+    if (!op || !valid)
     {
-        if (test->IsConstant())
-            return NEVER;
-        TreePosition pos = test->Position();
-        Name *l = new Name("left", pos);
-        Name *r = new Name("right", pos);
-        ifx = new Infix(what->name, l, r, pos);
-        uint lid = EvaluationTemporary(l);
-        uint rid = EvaluationTemporary(r);
+        delete op;
+        return Fail("bad operation");
+    }
+    links.success = ReadUnsigned();
+    if (dynamic_cast<FailOp *>(op))
+        links.fail = ReadUnsigned();
+    return op;
+}
 
-        // Try to get an infix by evaluating what we have
-        Evaluate(context, test);
-        Add(new InfixMatchOp(what->name, failOp, lid, rid));
-        str = SOMETIMES;
+
+ulonglong CodeCache::loaded   = 0;
+ulonglong CodeCache::saved    = 0;
+ulonglong CodeCache::rejected = 0;
+ulonglong CodeCache::stale    = 0;
+
+
+CodeCache::CodeCache(Tree *program)
+// ----------------------------------------------------------------------------
+//   Compute the cache file for a program, leave it empty if we can't cache
+// ----------------------------------------------------------------------------
+    : program(program), index(0), key(0), path()
+{
+    if (!RECORDER_TWEAK(bytecode_persist) || program->GetInfo<Procedure>())
+        return;
+    text dir = Directory();
+    if (dir.empty())
+        return;
+
+    // Only the programs in source files, not trees built while running
+    SourceIndex &source = SourceIndex::Current();
+    auto found = source.programs.find(program);
+    if (found == source.programs.end())
+        return;
+    index = found->second;
+
+    key = source.version;
+    cacheHash(key, &index, sizeof(index));
+    ulonglong files = source.files;
+    cacheHash(files, &index, sizeof(index));
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.xlbc", files);
+    path = dir + "/bytecode/" + name;
+    record(bytecode_cache, "Cache for program %u is %s", index, path.c_str());
+}
+
+
+Procedure *CodeCache::Load(Context *context)
+// ----------------------------------------------------------------------------
+//   Load the procedure for the program from the cache file, if valid
+// ----------------------------------------------------------------------------
+{
+    if (path.empty())
+        return nullptr;
+    std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+    if (!file.good())
+        return nullptr;
+
+    // Check the checksum at the end of the file before reading anything
+    text data((std::istreambuf_iterator<char>(file)),
+              std::istreambuf_iterator<char>());
+    ulonglong sum = cacheHASH_SEED, expected = 0;
+    size_t size = data.size() - sizeof(expected);
+    if (data.size() < sizeof(expected))
+        size = 0;
+    else
+        memcpy(&expected, data.data() + size, sizeof(expected));
+    cacheHash(sum, data.data(), size);
+    if (!size || sum != expected)
+    {
+        record(bytecode_cache, "Bad checksum in %s", path.c_str());
+        stale++;
+        return nullptr;
     }
 
-    if (ifx && ifx->name == what->name)
+    std::istringstream input(data.substr(0, size));
+    CacheReader reader(input, SourceIndex::Current());
+    Procedure *proc = reader.Read(key, index);
+    if (!proc)
     {
-        strength st2 = DoLeftRight(what->left,what->right,ifx->left,ifx->right);
-        if (st2 < str)
-            return st2;
-        return str;
+        stale++;
+        return nullptr;
     }
 
-    // Mismatch
-    Ooops("Infix $1 does not match $2", what, test);
-    return NEVER;
+    // Enter the declarations of the program, as compiling it would do
+    context->ProcessDeclarations(program);
+    for (Procedure *code : reader.procs)
+        if (!code->generic && !code->self->GetInfo<Procedure>())
+            code->self->SetInfo<Code>(code);
+
+    record(bytecode_cache, "Loaded %u procedures from %s",
+           reader.procs.size(), path.c_str());
+    loaded++;
+    return proc;
 }
 
 
-CodeBuilder::strength CodeBuilder::DoLeftRight(Tree *wl, Tree *wr,
-                                               Tree *l, Tree *r)
+bool CodeCache::MakeDirectory(text dir)
 // ----------------------------------------------------------------------------
-//    Combine left and right to get best result
+//   Create a directory and its parents
 // ----------------------------------------------------------------------------
 {
-    test = l;
-    strength onLeft = wl->Do(this);
-    if (onLeft == NEVER)
-        return NEVER;
-    test = r;
-    strength onRight = wr->Do(this);
-    if (onRight < onLeft)
-        return onRight;
-    return onLeft;
+    struct stat st;
+    if (stat(dir.c_str(), &st) == 0)
+        return S_ISDIR(st.st_mode);
+    size_t slash = dir.rfind('/');
+    if (slash != text::npos && slash > 0)
+        if (!MakeDirectory(dir.substr(0, slash)))
+            return false;
+#ifndef CONFIG_MINGW
+    return mkdir(dir.c_str(), 0755) == 0 || errno == EEXIST;
+#else // CONFIG_MINGW
+    return _mkdir(dir.c_str()) == 0 || errno == EEXIST;
+#endif // CONFIG_MINGW
 }
 
 
-int CodeBuilder::Bind(Name *name, Tree *value, Tree *type)
+text CodeCache::FullPath(text file)
 // ----------------------------------------------------------------------------
-//   Enter a new binding in the current context
+//   The absolute path of a file, or the file name if it can't be resolved
 // ----------------------------------------------------------------------------
 {
-    XL_ASSERT(inputs.find(name) == inputs.end() && "Binding name twice");
+#ifndef CONFIG_MINGW
+    char *resolved = realpath(file.c_str(), nullptr);
+#else // CONFIG_MINGW
+    char *resolved = _fullpath(nullptr, file.c_str(), 0);
+#endif // CONFIG_MINGW
+    if (!resolved)
+        return file;
+    text result = resolved;
+    free(resolved);
+    return result;
+}
 
-    Tree *defined = name;
-    if (type)
-        defined = new Infix(":", defined, type, name->Position());
 
-    // Define the name in the parameters
-    Rewrite *rw = argsCtx->Define(defined, value);
+text CodeCache::TemporaryPath(text file)
+// ----------------------------------------------------------------------------
+//   A temporary file to write before renaming it as the given file
+// ----------------------------------------------------------------------------
+{
+#ifndef CONFIG_MINGW
+    return file + "." + std::to_string(getpid());
+#else // CONFIG_MINGW
+    return file + "." + std::to_string(_getpid());
+#endif // CONFIG_MINGW
+}
 
-    // Generate the (negative) parameter ID for the given parameter
-    int parmId = ~outputs.size();
-    outputs[rw->left] = parmId;
 
-    // Record parameter order for calls
-    uint id = ValueID(value);
-    parms.push_back(id);
+bool CodeCache::Save(Procedure *proc)
+// ----------------------------------------------------------------------------
+//   Save the procedure for the program and all code it uses
+// ----------------------------------------------------------------------------
+{
+    if (path.empty())
+        return false;
 
-    return parmId;
+    std::ostringstream buffer;
+    CacheWriter writer(buffer, SourceIndex::Current());
+    writer.Write(proc, key, index);
+    if (!writer.portable)
+    {
+        rejected++;
+        return false;
+    }
+
+    // Write a temporary file and rename it, so readers never see part of it
+    size_t slash = path.rfind('/');
+    if (!MakeDirectory(path.substr(0, slash)))
+    {
+        record(bytecode_cache, "Cannot create directory for %s: %s",
+               path.c_str(), strerror(errno));
+        return false;
+    }
+    text temp = TemporaryPath(path);
+    text data = buffer.str();
+    ulonglong sum = cacheHASH_SEED;
+    cacheHash(sum, data.data(), data.size());
+    data.append((const char *) &sum, sizeof(sum));
+    std::ofstream output(temp.c_str(), std::ios::out | std::ios::binary);
+    output << data;
+    output.close();
+    if (!output.good() || rename(temp.c_str(), path.c_str()) != 0)
+    {
+        record(bytecode_cache, "Cannot write %s: %s",
+               path.c_str(), strerror(errno));
+        unlink(temp.c_str());
+        return false;
+    }
+
+    record(bytecode_cache, "Saved %u procedures in %s",
+           writer.procs.size(), path.c_str());
+    saved++;
+    return true;
+}
+
+
+text CodeCache::Directory()
+// ----------------------------------------------------------------------------
+//   The per-user cache directory, empty to disable caching
+// ----------------------------------------------------------------------------
+{
+    if (kstring dir = getenv("XL_CACHE"))
+        return dir;
+    if (kstring dir = getenv("XDG_CACHE_HOME"))
+        if (*dir)
+            return text(dir) + "/xl";
+    if (kstring home = getenv("HOME"))
+        if (*home)
+            return text(home) + "/.cache/xl";
+    return "";
 }
 
 XL_END
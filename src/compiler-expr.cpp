@@ -190,11 +190,44 @@ JIT::Value_p CompilerExpression::Do(Infix *infix)
     if (IsDefinition(infix))
         return function.ConstantTree(infix);
 
+    // Fields of data forms, e.g. [P.X]
+    if (infix->name == ".")
+        if (JIT::Value_p field = DoField(infix))
+            return field;
+
     // General case: expression
     return DoCall(infix);
 }
 
 
+JIT::Value_p CompilerExpression::DoField(Infix *infix)
+// ----------------------------------------------------------------------------
+//   Load a field from the machine structure representing a data form
+// ----------------------------------------------------------------------------
+//   Type analysis gave [P.X] the type of the field under the same
+//   conditions, so the field must be read here if 'DataField' accepts it.
+{
+    CompilerTypes *types = function.types;
+    int index = types->DataField(infix);
+    if (index < 0)
+        return nullptr;
+
+    JIT::Value_p value = Value(infix->left);
+    JIT::Type_p mtype = JIT::Type(value);
+    XL_ASSERT(JIT::IsStructType(mtype) && "Data form is not a structure");
+
+    // Data forms are structure values, read the field through storage
+    JITBlock &code = function.code;
+    JIT::Value_p box = function.NeedStorage(infix->left, mtype);
+    code.Store(value, box);
+    JIT::Value_p ptr = code.StructGEP(box, index, "fieldp");
+    JIT::Value_p result = code.Load(ptr, "field");
+    record(compiler_expr, "Field %t index %d of %t: %v",
+           infix->right, index, infix->left, result);
+    return result;
+}
+
+
 JIT::Value_p CompilerExpression::Do(Prefix *what)
 // ----------------------------------------------------------------------------
 //   Compile prefix expressions
@@ -68,6 +68,7 @@ public:
     value_type  Do(Infix *what);
     value_type  Do(Block *what);
 
+    value_type  DoField(Infix *field);
     value_type  DoCall(Tree *call, bool mayfail = false);
     value_type  DoRewrite(Tree *call, CompilerRewriteCandidate *candidate);
     value_type  Value(Tree *expr);
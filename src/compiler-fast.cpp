@@ -49,6 +49,7 @@
 #include "tree-clone.h"
 #include "llvm-crap.h"
 #include <iostream>
+#include <chrono>
 #include <cstdlib>
 #include <sstream>
 #include <algorithm>
@@ -66,6 +67,13 @@ RECORDER(closure,               16, "Compilation of closures");
 RECORDER(closure_warning,       16, "Warnings during compilation of closures");
 RECORDER(rewrites,              16, "Compilation of rewrites (fast compiler)");
 RECORDER(labels,                16, "Show expressions for generated labels");
+RECORDER(recompile,             16, "Recompiling hot calls with a profile");
+RECORDER(lazy,                  16, "Lazy compilation of rewrites");
+RECORDER_TWEAK_DEFINE(jit_lazy, 1,
+                      "Compile rewrite bodies on their first call");
+RECORDER_TWEAK_DEFINE(jit_recompile, 0,
+                      "Native calls in tiered mode before recompiling "
+                      "with a branch profile, 0 to disable");
 
 XL_BEGIN
 // ============================================================================
@@ -77,12 +85,17 @@ XL_BEGIN
 //  The implementation is essentially the same as for the optimizing compiler,
 //  but with a different translation unit implementation
 
+ulonglong FastCompiler::recompiled = 0;
+ulonglong FastCompiler::switched = 0;
+
+
 FastCompiler::FastCompiler(kstring name, unsigned opts, int argc, char **argv)
 // ----------------------------------------------------------------------------
 //   Constructor for the fast compiler
 // ----------------------------------------------------------------------------
     : Compiler(name, opts, argc, argv),
       calls(),
+      pending(),
       adapters(),
       closures()
 {}
@@ -217,27 +230,27 @@ eval_fn FastCompiler::CompileAll(Scope *scope,
 }
 
 
-Tree *FastCompiler::CompileCall(Scope    *scope,
-                                text      callee,
-                                TreeList &argList,
-                                bool      callIt)
+static text callKey(Scope *scope, text callee, TreeList &argList)
 // ----------------------------------------------------------------------------
-//   Compile a top-level call, reusing calls if possible
+//   Build the key identifying the code for a call with these argument kinds
 // ----------------------------------------------------------------------------
-// bool nullIfBad=false, bool cached = true);
 {
     uint arity = argList.size();
-
-    // Build key for this call
-    text key = "";
     const char keychars[] = "IRTN.[]|";
     std::ostringstream keyBuilder;
     keyBuilder << callee << "@" << (void *) scope << ":";
     for (uint i = 0; i < arity; i++)
         keyBuilder << keychars[argList[i]->Kind()];
-    key = keyBuilder.str();
+    return keyBuilder.str();
+}
 
-    // Build the call tree
+
+static Tree *callSource(text callee, TreeList &argList)
+// ----------------------------------------------------------------------------
+//   Build the call tree for the given arguments
+// ----------------------------------------------------------------------------
+{
+    uint arity = argList.size();
     TreePosition pos = arity ? argList[0]->Position() : Tree::NOWHERE;
     Tree *source = new Name(callee, pos);
     if (arity)
@@ -250,10 +263,27 @@ Tree *FastCompiler::CompileCall(Scope    *scope,
         }
         source = new Prefix(source, args, pos);
     }
+    return source;
+}
+
+
+Tree *FastCompiler::CompileCall(Scope    *scope,
+                                text      callee,
+                                TreeList &argList,
+                                bool      callIt,
+                                bool      nullIfBad)
+// ----------------------------------------------------------------------------
+//   Compile a top-level call, reusing calls if possible
+// ----------------------------------------------------------------------------
+//   If the call does not compile, return null if 'nullIfBad' is set,
+//   otherwise return the source of the call
+{
+    uint arity = argList.size();
+    text key = callKey(scope, callee, argList);
+    Tree *source = callSource(callee, argList);
 
     // Check if we already had code for that
     call_map::iterator found = calls.find(key);
-    eval_fn code;
     if (found == calls.end())
     {
         // Not compiled yet, create machine code
@@ -261,26 +291,25 @@ Tree *FastCompiler::CompileCall(Scope    *scope,
         O1CompileUnit unit (*this, scope, source, argList, false);
         XL_ASSERT(!unit.IsForwardCall() && "A call is a forward call?");
 
-        bool nullIfBad = false;
         bool keepAlternatives = true;
         bool noData = false;
+        if (RECORDER_TWEAK(jit_recompile))
+            jit.Profile(key, unit.function, JIT::PROFILE_COLLECT);
         Tree *compiled = Compile(scope, source, unit,
                                  nullIfBad, keepAlternatives, noData);
+        jit.Profile(key, nullptr, JIT::PROFILE_NONE);
         if (!compiled)
-            return source;
+            return nullIfBad ? nullptr : source;
 
         // Remember what we had for this call
-        code = unit.Finalize(true);
-        calls[key] = code;
-    }
-    else
-    {
-        code = (*found).second;
+        eval_fn code = unit.Finalize(true);
+        found = calls.insert(std::make_pair(key, CompiledCall(code))).first;
     }
 
     Tree *result = source;
     if (callIt)
     {
+        eval_fn code = Recompile(scope, callee, argList, key, found->second);
         adapter_fn adapt = ArrayToArgsAdapter(arity);
         result = adapt(code, scope, source, (Tree **) &argList[0]);
     }
@@ -288,6 +317,113 @@ Tree *FastCompiler::CompileCall(Scope    *scope,
 }
 
 
+FastCompiler::call_status FastCompiler::CompileCallLater(Scope    *scope,
+                                                         text      callee,
+                                                         TreeList &argList)
+// ----------------------------------------------------------------------------
+//   Compile a top-level call, generating machine code in the background
+// ----------------------------------------------------------------------------
+//   The first request generates the LLVM IR for the call, and the JIT
+//   threads generate the machine code. Later requests check if it is ready.
+//   Once it is, 'CompileCall' finds it like any other compiled call.
+{
+    text key = callKey(scope, callee, argList);
+    if (calls.count(key))
+        return CALL_READY;
+
+    pending_map::iterator found = pending.find(key);
+    if (found == pending.end())
+    {
+        JITModule module(jit, "xl.call");
+        Tree *source = callSource(callee, argList);
+        O1CompileUnit unit (*this, scope, source, argList, false);
+        XL_ASSERT(!unit.IsForwardCall() && "A call is a forward call?");
+
+        bool nullIfBad = true;
+        bool keepAlternatives = true;
+        bool noData = false;
+        if (RECORDER_TWEAK(jit_recompile))
+            jit.Profile(key, unit.function, JIT::PROFILE_COLLECT);
+        Tree *compiled = Compile(scope, source, unit,
+                                 nullIfBad, keepAlternatives, noData);
+        jit.Profile(key, nullptr, JIT::PROFILE_NONE);
+        if (!compiled)
+            return CALL_FAILED;
+        found = pending.insert(std::make_pair(key, unit.FinalizeLater())).first;
+    }
+
+    JIT::Code_f &code = found->second;
+    if (code.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        return CALL_PENDING;
+    eval_fn fn = (eval_fn) code.get();
+    pending.erase(found);
+    if (!fn)
+        return CALL_FAILED;
+    calls[key] = fn;
+    return CALL_READY;
+}
+
+
+eval_fn FastCompiler::Recompile(Scope    *scope,
+                                text      callee,
+                                TreeList &argList,
+                                text      key,
+                                CompiledCall &call)
+// ----------------------------------------------------------------------------
+//   Count calls, and recompile hot ones using the branch profile
+// ----------------------------------------------------------------------------
+//   Past the 'jit_recompile' threshold, the call is built again using
+//   the branch counts collected by its first version as branch weights,
+//   and the JIT threads optimize it at level 3. Calls keep running the
+//   first version until the new one is ready, then switch to it.
+//   The count is kept with the code of the call, so that counting costs
+//   an increment, not a lookup.
+{
+    ulonglong threshold = RECORDER_TWEAK(jit_recompile);
+    if (!threshold)
+        return call.code;
+
+    if (call.later.valid())
+    {
+        if (call.later.wait_for(std::chrono::seconds(0)) !=
+            std::future_status::ready)
+            return call.code;
+        eval_fn fn = (eval_fn) call.later.get();
+        call.later = JIT::Code_f();
+        record(recompile, "Recompiled %s as %p", key.c_str(), (void *) fn);
+        if (fn)
+        {
+            call.code = fn;
+            switched++;
+        }
+        return call.code;
+    }
+
+    ulonglong count = ++call.count;
+    if (count != threshold)
+        return call.code;
+
+    JITModule module(jit, "xl.call.profile");
+    Tree *source = callSource(callee, argList);
+    O1CompileUnit unit (*this, scope, source, argList, false);
+    unit.function->setName("xl_eval_profile" + std::to_string(++recompiled));
+    unit.function->setEntryCount(count);
+
+    bool nullIfBad = true;
+    bool keepAlternatives = true;
+    bool noData = false;
+    jit.Profile(key, unit.function, JIT::PROFILE_APPLY);
+    Tree *compiled = Compile(scope, source, unit,
+                             nullIfBad, keepAlternatives, noData);
+    jit.Profile(key, nullptr, JIT::PROFILE_NONE);
+    record(recompile, "Recompiling %s after %llu calls: %t",
+           key.c_str(), count, compiled);
+    if (compiled)
+        call.later = unit.FinalizeLater();
+    return call.code;
+}
+
+
 adapter_fn FastCompiler::ArrayToArgsAdapter(uint numargs)
 // ----------------------------------------------------------------------------
 //   Generate code to call a function with N arguments
@@ -472,12 +608,19 @@ struct FastCompilerInfo : Info
 //   Information about compiler-related data structures
 // ----------------------------------------------------------------------------
 {
-    FastCompilerInfo(Tree *tree): function(0), closure(0), code(nullptr) {}
+    FastCompilerInfo(Tree *tree)
+        : function(0), closure(0), code(nullptr),
+          compiler(nullptr), scope(), parms() {}
     ~FastCompilerInfo() {}
     llvm::Function *            function;
     llvm::Function *            closure;
     eval_fn                     code;
 
+    // For a stub compiling a rewrite body lazily, what to compile it with
+    FastCompiler *              compiler;
+    Scope_p                     scope;
+    TreeList                    parms;
+
     // We must mark builtins in a special way, see bug #991
     bool        IsBuiltin()     { return function && function == closure; }
 };
@@ -2029,6 +2172,29 @@ Tree *CompileAction::CompileRewrite(Scope *scope,
         return body;              // We know how to invoke it anyway
     }
 
+    // Unless failing to compile must select another candidate, only
+    // generate a stub that compiles the body the first time it is called
+    if (RECORDER_TWEAK(jit_lazy) && !nullIfBad && !body->IsLeaf())
+    {
+        unit.Stub(scope, xparms);
+        return body;
+    }
+
+    if (!CompileBody(scope, body, unit))
+        return nullptr;
+
+    // Even if technically, this is not an 'eval_fn' (it has more args),
+    // we still record it to avoid recompiling multiple times
+    unit.Finalize(false);
+    return body;
+}
+
+
+bool CompileAction::CompileBody(Scope *scope, Tree *body, O1CompileUnit &unit)
+// ----------------------------------------------------------------------------
+//   Compile the body of a rewrite in the given unit
+// ----------------------------------------------------------------------------
+{
     // Record rewrites and data declarations in the current context
     DeclarationAction declaration(scope);
     Tree *toDecl = body->Do(declaration);
@@ -2041,13 +2207,45 @@ Tree *CompileAction::CompileRewrite(Scope *scope,
     if (!result)
     {
         Ooops("Error compiling rewrite $1", body);
-        return nullptr;
+        return false;
     }
+    return true;
+}
 
-    // Even if technically, this is not an 'eval_fn' (it has more args),
-    // we still record it to avoid recompiling multiple times
-    unit.Finalize(false);
-    return body;
+
+eval_fn FastCompiler::CompileLazy(Tree *body)
+// ----------------------------------------------------------------------------
+//   Compile the body of a rewrite the first time its stub is called
+// ----------------------------------------------------------------------------
+//   The body is compiled in its own module, as a new function. The stub
+//   remains the function for the body, so that code compiled later calls
+//   it, and it calls the code recorded here. If the body does not compile,
+//   the error is reported now, and the stub returns an error at each call.
+{
+    FastCompilerInfo *info = Info(body);
+    XL_ASSERT(info && info->function && "Lazy rewrite without a stub");
+    if (info->code)
+        return info->code;
+
+    record(lazy, "Compiling lazy rewrite %t", body);
+    JIT::Function_p stub = info->function;
+    info->function = nullptr;
+
+    eval_fn code = nullptr;
+    {
+        JITModule module(jit, "xl.lazy");
+        O1CompileUnit unit(*this, info->scope, body, info->parms, false);
+        if (CompileAction::CompileBody(info->scope, body, unit))
+            code = unit.Finalize(true);
+    }
+    record(lazy, "Compiled lazy rewrite %t as %p", body, (void *) code);
+
+    info->function = stub;
+    info->code = code;
+    info->compiler = nullptr;
+    info->scope = nullptr;
+    info->parms.clear();
+    return code;
 }
 
 
@@ -2233,6 +2431,66 @@ eval_fn O1CompileUnit::Finalize(bool topLevel)
 }
 
 
+void O1CompileUnit::Stub(Scope *scope, TreeList &parms)
+// ----------------------------------------------------------------------------
+//   Generate a stub for a rewrite body that compiles it on the first call
+// ----------------------------------------------------------------------------
+//   The stub calls the code recorded for the body, after calling
+//   'xl_lazy_rewrite' to compile it if there is none yet. The info for the
+//   body records the compiler, which may not be MAIN->evaluator, e.g. with
+//   the tiered evaluator. If compilation failed, the stub returns a form
+//   error, like code that fails to match arguments.
+{
+    JIT &jit = compiler.jit;
+    FastCompilerInfo *info = compiler.Info(source, true);
+    info->compiler = &compiler;
+    info->scope = scope;
+    info->parms = parms;
+    record(lazy, "Stub %v for %t", function, source);
+
+    JIT::PointerType_p fnPtrTy = jit.PointerType(function->getFunctionType());
+    JIT::Value_p slot = code.PointerConstant(jit.PointerType(fnPtrTy),
+                                             &info->code);
+    JIT::Value_p fn = code.Load(slot, "lazy");
+    JIT::Value_p none = code.PointerConstant(fnPtrTy, nullptr);
+    JIT::Value_p isNull = code.ICmpEQ(fn, none);
+    JITBlock compile(jit, function, "lazy_compile");
+    JITBlock failed(jit, function, "lazy_failed");
+    JITBlock call(jit, function, "lazy_call");
+    code.IfBranch(isNull, compile, call);
+
+    JIT::Value_p body = ConstantTree(source);
+    JIT::Value_p compiled = compile.Call(xl_lazy_rewrite, body);
+    JIT::Value_p noCode = compile.PointerConstant(compiler.evalFnTy, nullptr);
+    compile.IfBranch(compile.ICmpEQ(compiled, noCode), failed, call);
+
+    JIT::Value_p error = failed.Call(xl_form_error, scopePtr, body);
+    failed.Store(error, storage[source]);
+    failed.Branch(exitbb);
+
+    code.SwitchTo(call);
+    fn = code.Load(slot, "lazy");
+    JIT::Values argV;
+    JITArguments args(function);
+    for (size_t a = 0; a < parms.size() + 2; a++)
+        argV.push_back(*args++);
+    JIT::Value_p result = code.Call(fn, argV);
+    code.Store(result, storage[source]);
+    Finalize(false);
+}
+
+
+JIT::Code_f O1CompileUnit::FinalizeLater()
+// ----------------------------------------------------------------------------
+//   Finalize a top-level function, and generate its code in the background
+// ----------------------------------------------------------------------------
+{
+    Finalize(false);
+    record(llvm_functions, "Fast code for %v generated later", function);
+    return compiler.jit.ExecutableCodeLater(function);
+}
+
+
 JIT::Value_p O1CompileUnit::NeedStorage(Tree *tree, Tree *source)
 // ----------------------------------------------------------------------------
 //    Allocate storage for a given tree
@@ -3203,6 +3461,18 @@ Tree *xl_new_closure(eval_fn toCall, Tree *expr, uint ntrees, ...)
 }
 
 
+eval_fn xl_lazy_rewrite(Tree *body)
+// ----------------------------------------------------------------------------
+//   Compile a rewrite body on its first call
+// ----------------------------------------------------------------------------
+//   Returns nullptr if the body does not compile
+{
+    FastCompilerInfo *info = FastCompiler::Info(body);
+    XL_ASSERT(info && info->compiler && "Lazy rewrite without a compiler");
+    return info->compiler->CompileLazy(body);
+}
+
+
 eval_fn xl_closure_code(Tree *tree)
 // ----------------------------------------------------------------------------
 //   Return the code generated for closure code if any
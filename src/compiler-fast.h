@@ -52,7 +52,9 @@ typedef Tree * (*adapter_fn) (eval_fn, Scope *src, Tree *self, Tree **args);
 typedef std::map<Tree *, JIT::Value_p>  value_map;
 typedef std::set<Tree *>                data_set;
 typedef std::map<Name_p, Tree_p>        captures;       // Symbol capture table
-typedef std::map<text, eval_fn>         call_map;       // Pre-compiled calls
+struct CompiledCall;
+typedef std::map<text, CompiledCall>    call_map;       // Pre-compiled calls
+typedef std::map<text, JIT::Code_f>     pending_map;    // Calls being compiled
 typedef std::map<uint, adapter_fn>      adapter_map;    // Array adapters
 typedef std::map<uint, eval_fn>         closure_map;    // Closure adapters
 
@@ -60,6 +62,18 @@ struct FastCompilerInfo;
 struct CompileAction;
 
 
+struct CompiledCall
+// ----------------------------------------------------------------------------
+//   The machine code for a top-level call, and how often it ran
+// ----------------------------------------------------------------------------
+{
+    CompiledCall(eval_fn code = nullptr): code(code), count(0), later() {}
+    eval_fn                     code;   // Machine code for the call
+    ulonglong                   count;  // Executions, until recompiled
+    JIT::Code_f                 later;  // Code rebuilt with a branch profile
+};
+
+
 struct FastCompiler : Compiler
 // ----------------------------------------------------------------------------
 //   Interface for the fast compiler
@@ -89,7 +103,18 @@ struct FastCompiler : Compiler
     Tree *                      CompileCall(Scope *scope,
                                             text callee,
                                             TreeList &args,
-                                            bool call=true);
+                                            bool call=true,
+                                            bool nullIfBad=false);
+    enum call_status            { CALL_FAILED, CALL_PENDING, CALL_READY };
+    call_status                 CompileCallLater(Scope *scope,
+                                                 text callee,
+                                                 TreeList &args);
+    eval_fn                     Recompile(Scope *scope,
+                                          text callee,
+                                          TreeList &args,
+                                          text key,
+                                          CompiledCall &call);
+    eval_fn                     CompileLazy(Tree *body);
     adapter_fn                  ArrayToArgsAdapter(uint numtrees);
     eval_fn                     ClosureAdapter(uint numtrees);
 
@@ -103,8 +128,13 @@ struct FastCompiler : Compiler
     static eval_fn              TreeCode(Tree *tree);
     static void                 SetTreeCode(Tree *tree, eval_fn code);
 
+    // Statistics on calls recompiled with a branch profile
+    static ulonglong            recompiled;     // Recompilations started
+    static ulonglong            switched;       // Calls using the new code
+
 private:
     call_map                    calls;
+    pending_map                 pending;
     adapter_map                 adapters;
     closure_map                 closures;
 };
@@ -129,6 +159,8 @@ struct O1CompileUnit
 
     bool                IsForwardCall()         { return entrybb == nullptr; }
     eval_fn             Finalize(bool topLevel);
+    JIT::Code_f         FinalizeLater();
+    void                Stub(Scope *scope, TreeList &parms);
 
     enum { knowAll = -1, knowLocals = 1, knowValues = 2 };
 
@@ -337,6 +369,7 @@ struct CompileAction
     Tree *      RewriteChildren(Tree *what);
 
     // Compile a rewrite
+    static bool CompileBody(Scope *, Tree *body, O1CompileUnit &unit);
     Tree *      CompileRewrite(Scope *, Tree *what,
                                TreeList &parms, TreeList &args);
 
@@ -44,6 +44,7 @@
 
 RECORDER(compiler_function, 64, "Functions generated by the compiler");
 RECORDER(parameter_bindings, 64, "Looking up parameters in functions");
+RECORDER(compiler_escape, 64, "Boxed values that do not escape functions");
 
 XL_BEGIN
 
@@ -219,6 +220,23 @@ eval_fn CompilerFunction::Finalize(bool createCode)
         exit.Return(nullptr);
     }
 
+    // Only box values that escape the function
+    unsigned elided =
+        jit.ElideAllocations(function, "xl_new_natural",
+                             1, NATURAL_VALUE_INDEX) +
+        jit.ElideAllocations(function, "xl_new_real",
+                             1, REAL_VALUE_INDEX) +
+        jit.ElideAllocations(function, "xl_new_character",
+                             1, JIT::NoField) +
+        jit.ElideAllocations(function, "xl_new_text",
+                             1, JIT::NoField) +
+        jit.ElideAllocations(function, "xl_new_text_ptr",
+                             1, JIT::NoField) +
+        jit.ElideAllocations(function, "xl_new_ctext",
+                             1, JIT::NoField);
+    record(compiler_escape, "Function for %t: %u allocations elided",
+           pattern, elided);
+
     // Verify the function we built
     if (RECORDER_TRACE(llvm_code) & 1)
         jit.Print("LLVM IR before verification and optimizations:\n", function);
@@ -409,13 +427,21 @@ JIT::Value_p CompilerFunction::Data(Tree *expr,
             return result;
         }
 
-        // Arguments not bound here are returned as a constant
-        return ConstantTree(existing);
+        // Names bound elsewhere are stored with their value, like constants,
+        // since the unbox function loads every name from the structure
+        CompilerExpression subexpr(*this);
+        JIT::Value_p result = subexpr.Evaluate(expr);
+        result = Autobox(expr, result, ValueMachineType(existing));
+        JIT::Value_p ptr = code.StructGEP(box, index++, "resultp");
+        result = code.Store(result, ptr);
+        return result;
     }
 
     case INFIX:
     {
         Infix *infix = (Infix *) expr;
+        if (IsTypeAnnotation(infix) || IsPatternCondition(infix))
+            return Data(infix->left, box, index);
         left = Data(infix->left, box, index);
         right = Data(infix->right, box, index);
         return right;
@@ -674,6 +700,7 @@ JIT::Value_p CompilerFunction::Unbox(JIT::Value_p boxed,
     case TEXT:
     {
         // Constant values in the pattern can be returned as is
+        index++;
         return ConstantTree(pattern);
     }
 
@@ -719,11 +746,11 @@ JIT::Value_p CompilerFunction::Unbox(JIT::Value_p boxed,
         Postfix *postfix = (Postfix *) pattern;
         ref = ConstantTree(postfix);
         ref = code.BitCast(ref, compiler.postfixTreePtrTy);
-        left = Unbox(boxed, postfix->left, index);
         if (postfix->right->Kind() == NAME)
             right = ConstantTree(postfix->right);
         else
             right = Unbox(boxed, postfix->right, index);
+        left = Unbox(boxed, postfix->left, index);
         left = Autobox(postfix->left, left, ttp);
         right = Autobox(postfix->right, right, ttp);
         return code.Call(unit.xl_new_postfix, ref, left, right);
@@ -1132,36 +1159,24 @@ void CompilerFunction::BoxedTreeType(JIT::Signature &sig, Tree *what)
 //  Compute the signature for a boxed tree
 // ----------------------------------------------------------------------------
 {
-    switch(what->Kind())
+    TreeList fields;
+    CompilerTypes::DataLayout(what, fields);
+    for (Tree *field : fields)
     {
-    case NATURAL:
-    case REAL:
-    case TEXT:
-        sig.push_back(BoxedType(what));
-        break;
-
-    case NAME:
-        what = types->TypesContext()->DeclaredPattern(what);
-        sig.push_back(ValueMachineType(what));
-        break;
-
-    case BLOCK:
-        BoxedTreeType(sig, ((Block *) what)->child);
-        break;
-    case PREFIX:
-        if (((Prefix *) what)->left->Kind() != NAME)
-            BoxedTreeType(sig, ((Prefix *) what)->left);
-        BoxedTreeType(sig, ((Prefix *) what)->right);
-       break;
-    case POSTFIX:
-        if (((Postfix *) what)->right->Kind() != NAME)
-            BoxedTreeType(sig, ((Postfix *) what)->right);
-        BoxedTreeType(sig, ((Postfix *) what)->left);
-        break;
-    case INFIX:
-        BoxedTreeType(sig, ((Infix *) what)->left);
-        BoxedTreeType(sig, ((Infix *) what)->right);
-        break;
+        if (Infix *typed = IsTypeAnnotation(field))
+        {
+            // Typed fields like [X:real] are stored unboxed
+            sig.push_back(BoxedType(typed->right));
+        }
+        else if (Name *name = field->AsName())
+        {
+            Tree *declared = types->TypesContext()->DeclaredPattern(name);
+            sig.push_back(ValueMachineType(declared));
+        }
+        else
+        {
+            sig.push_back(BoxedType(field));
+        }
     }
 }
 
@@ -49,6 +49,10 @@
 
 #include <iostream>
 
+
+RECORDER_TWEAK_DEFINE(compiler_unboxed_fields, 1,
+                      "Read fields of data forms directly from their structure");
+
 XL_BEGIN
 
 // ============================================================================
@@ -117,6 +121,26 @@ Tree *CompilerTypes::TypeAnalysis(Tree *program)
 }
 
 
+Tree *CompilerTypes::Evaluate(Tree *what, bool mayFail)
+// ----------------------------------------------------------------------------
+//   Give fields of data forms, e.g. [P.X], the type declared for the field
+// ----------------------------------------------------------------------------
+//   This only applies when code generation reads the field directly, see
+//   'DataField'. Otherwise, [P.X] is looked up like any other rewrite.
+{
+    if (Infix *infix = what->AsInfix())
+    {
+        if (infix->name == "." && infix->right->AsName() && Type(infix->left))
+        {
+            Tree *fieldType = nullptr;
+            if (DataField(infix, &fieldType) >= 0)
+                return AssignType(what, fieldType ? fieldType : tree_type);
+        }
+    }
+    return Types::Evaluate(what, mayFail);
+}
+
+
 Tree *CompilerTypes::CodeGenerationType(Tree *expr)
 // ----------------------------------------------------------------------------
 //   Make sure that we have the type for the expression at code generation time
@@ -179,6 +203,130 @@ JIT::Type_p CompilerTypes::BoxedType(Tree *type)
 
 
 
+// ============================================================================
+//
+//   Layout of data forms
+//
+// ============================================================================
+//
+//   A data form like [point(X:real, Y:real)] is represented as a machine
+//   structure with one unboxed field per constant, name or typed name in
+//   the pattern, e.g. { double, double }. The order below is shared by the
+//   code that builds the structure, the code that reads fields, and the
+//   function that turns the structure back into a tree.
+
+void CompilerTypes::DataLayout(Tree *pattern, TreeList &fields)
+// ----------------------------------------------------------------------------
+//   Collect the trees stored as fields of the structure for a data pattern
+// ----------------------------------------------------------------------------
+{
+    switch(pattern->Kind())
+    {
+    case NATURAL:
+    case REAL:
+    case TEXT:
+    case NAME:
+        fields.push_back(pattern);
+        break;
+
+    case INFIX:
+    {
+        Infix *infix = (Infix *) pattern;
+        if (IsTypeAnnotation(infix))
+            fields.push_back(infix);
+        else if (IsPatternCondition(infix))
+            DataLayout(infix->left, fields);
+        else
+        {
+            DataLayout(infix->left, fields);
+            DataLayout(infix->right, fields);
+        }
+        break;
+    }
+
+    case PREFIX:
+    {
+        Prefix *prefix = (Prefix *) pattern;
+        if (prefix->left->Kind() != NAME)
+            DataLayout(prefix->left, fields);
+        DataLayout(prefix->right, fields);
+        break;
+    }
+
+    case POSTFIX:
+    {
+        Postfix *postfix = (Postfix *) pattern;
+        if (postfix->right->Kind() != NAME)
+            DataLayout(postfix->right, fields);
+        DataLayout(postfix->left, fields);
+        break;
+    }
+
+    case BLOCK:
+        DataLayout(((Block *) pattern)->child, fields);
+        break;
+    }
+}
+
+
+int CompilerTypes::DataField(Infix *field, Tree **fieldType)
+// ----------------------------------------------------------------------------
+//   Return the index of the field read by [P.X] in the structure for P
+// ----------------------------------------------------------------------------
+//   Returns -1 if the field is not read directly from the structure, e.g.
+//   if P is not a data form, or when 'compiler_unboxed_fields' is 0.
+//   Type analysis and code generation must agree on this.
+{
+    if (field->name != "." || !RECORDER_TWEAK(compiler_unboxed_fields))
+        return -1;
+    Name *name = field->right->AsName();
+    if (!name)
+        return -1;
+    Tree *type = KnownType(field->left);
+    if (!type)
+        return -1;
+    return FieldIndex(BaseType(type), name->value, fieldType);
+}
+
+
+int CompilerTypes::FieldIndex(Tree *type, text name, Tree **fieldType)
+// ----------------------------------------------------------------------------
+//   Return the index of the named field in a data type, or -1
+// ----------------------------------------------------------------------------
+//   If the field has a declared type, it is returned in 'fieldType'
+{
+    Tree *pattern = IsPatternType(type);
+    if (!pattern)
+        return -1;
+
+    TreeList fields;
+    DataLayout(pattern, fields);
+    for (unsigned index = 0; index < fields.size(); index++)
+    {
+        Tree *field = fields[index];
+        Tree *declared = nullptr;
+        if (Infix *typed = IsTypeAnnotation(field))
+        {
+            field = typed->left;
+            declared = typed->right;
+        }
+        if (Name *fname = field->AsName())
+        {
+            if (fname->value == name)
+            {
+                if (fieldType)
+                    *fieldType = declared;
+                record(types_boxing, "Field %s of %t is index %u type %t",
+                       name.c_str(), type, index, declared);
+                return index;
+            }
+        }
+    }
+    return -1;
+}
+
+
+
 // ============================================================================
 //
 //   Debug utilities
@@ -79,11 +79,17 @@ public:
 public:
     // Main entry point
     Tree *      TypeAnalysis(Tree *source) override;
+    Tree *      Evaluate(Tree *tree, bool mayFail = false) override;
 
     // Machine types management
     void        AddBoxedType(Tree *treeType, JIT::Type_p machineType);
     JIT::Type_p BoxedType(Tree *type);
 
+    // Layout of data forms as machine structures
+    static void DataLayout(Tree *pattern, TreeList &fields);
+    static int  FieldIndex(Tree *type, text name, Tree **fieldType = nullptr);
+    int         DataField(Infix *field, Tree **fieldType = nullptr);
+
 public:
     // Get type, used during code generation (checks that it is already known)
     Tree *      CodeGenerationType(Tree *expr);
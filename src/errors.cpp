@@ -218,7 +218,7 @@ Errors::Errors()
 // ----------------------------------------------------------------------------
 //   Save errors from the top-level error handler
 // ----------------------------------------------------------------------------
-    : parent(MAIN->errors), count(0), context(0)
+    : parent(MAIN->errors), count(0), context(0), current(true)
 {
     MAIN->errors = this;
 }
@@ -233,7 +233,7 @@ Errors::Errors (kstring m, ulong pos)
 // ----------------------------------------------------------------------------
 //   Save errors from the top-level error handler
 // ----------------------------------------------------------------------------
-    : parent(MAIN->errors), count(0), context(0)
+    : parent(MAIN->errors), count(0), context(0), current(true)
 {
     MAIN->errors = this;
     ERROR_OR_CONTEXT(Error(m, pos));
@@ -244,7 +244,7 @@ Errors::Errors (kstring m, Tree *a)
 // ----------------------------------------------------------------------------
 //   Save errors from the top-level error handler
 // ----------------------------------------------------------------------------
-    : parent(MAIN->errors), count(0), context(0)
+    : parent(MAIN->errors), count(0), context(0), current(true)
 {
     MAIN->errors = this;
     ERROR_OR_CONTEXT(Error(m, a));
@@ -255,7 +255,7 @@ Errors::Errors (kstring m, Tree *a, Tree *b)
 // ----------------------------------------------------------------------------
 //   Save errors from the top-level error handler
 // ----------------------------------------------------------------------------
-    : parent(MAIN->errors), count(0), context(0)
+    : parent(MAIN->errors), count(0), context(0), current(true)
 {
     MAIN->errors = this;
     ERROR_OR_CONTEXT(Error(m, a, b));
@@ -266,20 +266,33 @@ Errors::Errors (kstring m, Tree *a, Tree *b, Tree *c)
 // ----------------------------------------------------------------------------
 //   Save errors from the top-level error handler
 // ----------------------------------------------------------------------------
-    : parent(MAIN->errors), count(0), context(0)
+    : parent(MAIN->errors), count(0), context(0), current(true)
 {
     MAIN->errors = this;
     ERROR_OR_CONTEXT(Error(m, a, b, c));
 }
 
 
+Errors::Errors (Errors *parent)
+// ----------------------------------------------------------------------------
+//   Collect errors apart, e.g. in another thread, and display them later
+// ----------------------------------------------------------------------------
+//   The errors are not the current errors, i.e. MAIN->errors is unchanged.
+//   Calling Display() from the main thread merges them into the parent
+    : parent(parent), count(0), context(0), current(false)
+{}
+
+
 Errors::~Errors()
 // ----------------------------------------------------------------------------
 //   Display errors to top-level handler
 // ----------------------------------------------------------------------------
 {
-    assert (MAIN->errors == this);
-    MAIN->errors = parent;
+    if (current)
+    {
+        assert (MAIN->errors == this);
+        MAIN->errors = parent;
+    }
 
     if (HadErrors())
         Display();
@@ -48,6 +48,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <pthread.h>
+#include <mutex>
 
 // Windows/MinGW (ancient): When getting in the way becomes an art form...
 #if !defined(HAVE_POSIX_MEMALIGN) && defined(HAVE_MINGW_ALIGNED_MALLOC)
@@ -75,6 +76,28 @@ Atomic<uint> TypeAllocator::finalizing = 0;
 #define PTHREAD_NULL ((pthread_t) 0)
 static pthread_t collecting = PTHREAD_NULL;
 
+// Serialize allocations while several threads allocate, see Serialize
+static Atomic<uint> serializing = 0;
+static std::recursive_mutex serializeLock;
+
+struct SerializeAllocations
+// ----------------------------------------------------------------------------
+//   Hold the allocation lock if several threads may allocate or free
+// ----------------------------------------------------------------------------
+{
+    SerializeAllocations() : locked(serializing.Get() != 0)
+    {
+        if (locked)
+            serializeLock.lock();
+    }
+    ~SerializeAllocations()
+    {
+        if (locked)
+            serializeLock.unlock();
+    }
+    bool locked;
+};
+
 RECORDER_DEFINE(memory, 64, "Memory allocation and garbage collector");
 
 
@@ -139,6 +162,7 @@ void *TypeAllocator::Allocate()
 //   Allocate a chunk of the given size
 // ----------------------------------------------------------------------------
 {
+    SerializeAllocations serialize;
     record(memory, "Allocate in '%+s', free list %p",
            this->name, (void *) freeList.Get());
 
@@ -181,10 +205,12 @@ void *TypeAllocator::Allocate()
             chunks.push_back((Chunk *) allocated);
             available += chunkSize;
             if (lowestAddress > allocated)
-                lowestAddress = allocated;
+                __atomic_store_n(&lowestAddress, allocated,
+                                 __ATOMIC_RELAXED);
             char *highMark = (char *) allocated + (chunkSize+1) * itemSize;
             if (highestAddress < (void *) highMark)
-                highestAddress = highMark;
+                __atomic_store_n(&highestAddress, (void *) highMark,
+                                 __ATOMIC_RELAXED);
 
             // Update the freelist
             while (!freeList.SetQ(result, free))
@@ -224,6 +250,7 @@ void TypeAllocator::Delete(void *ptr)
 //   Free a chunk of the given size
 // ----------------------------------------------------------------------------
 {
+    SerializeAllocations serialize;
     record(memory, "Delete %p in '%+s'", ptr, this->name);
 
     if (!ptr)
@@ -274,6 +301,7 @@ void TypeAllocator::ScheduleDelete(TypeAllocator::Chunk_vp ptr)
 //   Delete now if possible, or record that we will need to delete it later
 // ----------------------------------------------------------------------------
 {
+    SerializeAllocations serialize;
     RECORD(memory, "Schedule delete %p (bits %lx)", (void *)(ptr+1), ptr->bits);
     if (ptr->bits & IN_USE)
     {
@@ -664,6 +692,24 @@ void GarbageCollector::Delete()
 }
 
 
+void GarbageCollector::Serialize(bool serialize)
+// ----------------------------------------------------------------------------
+//   Serialize allocations while other threads may allocate or free objects
+// ----------------------------------------------------------------------------
+//   The free lists are lock-free, but popping a chunk is subject to ABA:
+//   a thread reads the head X and X->next Y, while another thread pops X
+//   and Y, then frees X. The first thread then sets the head to Y, which
+//   is now in use by two objects. Statistics, the address range and the
+//   to-delete lists are not atomic either. This must be called with no
+//   other thread running, e.g. before starting and after joining them.
+{
+    if (serialize)
+        serializing++;
+    else
+        serializing--;
+}
+
+
 void *GarbageCollector::DebugPointer(void *ptr)
 // ----------------------------------------------------------------------------
 //   Show allocation information about the given pointer
@@ -35,6 +35,7 @@
 // *****************************************************************************
 
 #include "interpreter.h"
+#include "tiered.h"
 #include "gc.h"
 #include "info.h"
 #include "errors.h"
@@ -169,9 +170,10 @@ struct Bindings
     typedef bool value_type;
 
     Bindings(Context *context, Context *locals,
-             Tree *test, EvalCache &cache, TreeList &args)
+             Tree *test, EvalCache &cache, TreeList &args, TreeList &parms)
         : context(context), locals(locals),
-          test(test), cache(cache), resultType(nullptr), args(args) {}
+          test(test), cache(cache), resultType(nullptr),
+          args(args), parms(parms) {}
 
     // Tree::Do interface
     bool  Do(Natural *what);
@@ -198,6 +200,7 @@ private:
 public:
     Tree_p      resultType;
     TreeList   &args;
+    TreeList   &parms;
 };
 
 
@@ -537,7 +540,8 @@ void Bindings::Bind(Name *name, Tree *value)
 {
     record(bind, "Bind %t = %t", name, value);
     args.push_back(value);
-    locals->Define(name, value);
+    if (Rewrite *entry = locals->Define(name, value))
+        parms.push_back(entry->left);
 }
 
 
@@ -595,7 +599,7 @@ static Tree *evalLookup(Scope *evalScope, Scope *declScope,
     // If we lookup a name or a number, just return it
     Tree *defined = PatternBase(decl->left);
     Tree *resultType = tree_type;
-    TreeList args;
+    TreeList args, parms;
     if (defined->IsLeaf())
     {
         // Must match literally, or we don't have a candidate
@@ -617,7 +621,7 @@ static Tree *evalLookup(Scope *evalScope, Scope *declScope,
         locals->CreateScope();
 
         // Check bindings of arguments to declaration, exit if fails
-        Bindings  bindings(context, locals, self, *cache, args);
+        Bindings  bindings(context, locals, self, *cache, args, parms);
         if (!decl->left->Do(bindings))
         {
             record(interpreter_eval, "Eval%u %t from %t: mismatch",
@@ -652,6 +656,19 @@ static Tree *evalLookup(Scope *evalScope, Scope *declScope,
         return result;
     }
 
+    // In tiered mode, a hot rewrite may run as bytecode or machine code
+    if (Tiered::tiered && !defined->IsLeaf())
+    {
+        result = Tiered::tiered->Call(evalScope, declScope, self, decl,
+                                      locals, args, parms, resultType);
+        if (result)
+        {
+            record(interpreter_eval, "Eval%u %t tiered, result %t",
+                   depth, self, result);
+            return result;
+        }
+    }
+
     // Normal case: evaluate body of the declaration in the new context
     result = decl->right;
     if (resultType != tree_type)
@@ -978,8 +995,8 @@ static Tree *formTypeCheck(Scope *scope, Tree *shape, Tree *value)
     Context_p context = new Context(scope);
     Context_p locals = new Context(context);
     EvalCache cache;
-    TreeList  args;
-    Bindings  bindings(context, locals, value, cache, args);
+    TreeList  args, parms;
+    Bindings  bindings(context, locals, value, cache, args, parms);
     if (!shape->Do(bindings))
     {
         record(interpreter_typecheck, "Shape of tree %t does not match %t",
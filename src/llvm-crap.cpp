@@ -41,6 +41,8 @@
 #include "renderer.h"
 #include "errors.h"
 #include "main.h"               // For options
+#include "bytecode.h"           // For the cache directory
+#include "utf8_fileutils.h"     // For the dates of cached objects
 
 
 
@@ -191,6 +193,19 @@
 # include "llvm/ExecutionEngine/Orc/LLJIT.h"
 #endif
 
+// Caching the generated code, which has been there since MCJIT
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/xxhash.h>
+
+// Writing object files
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
 // Finally, link everything together.
 // That, apart for the warnings, has remained somewhat stable
 #include "llvm/LinkAllIR.h"
@@ -208,11 +223,19 @@
 // ============================================================================
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
 #include <cstdlib>
+#include <deque>
+#include <future>
+#include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 
@@ -239,6 +262,16 @@ RECORDER(llvm_stats,            16, "LLVM statistics");
 RECORDER(llvm_code,             16, "LLVM code generation");
 RECORDER(llvm_gc,               16, "LLVM garbage collection");
 RECORDER(llvm_ir,               16, "LLVM intermediate representation");
+RECORDER(llvm_background,       16, "LLVM code generation in the background");
+RECORDER(llvm_cache,            16, "LLVM object cache");
+RECORDER(llvm_cache_stats,      16, "LLVM object cache statistics");
+RECORDER(llvm_profile,          16, "LLVM branch profiles");
+RECORDER_TWEAK_DEFINE(jit_threads, 2,
+                      "Threads generating machine code in the background");
+RECORDER_TWEAK_DEFINE(jit_cache, 0,
+                      "Keep generated machine code in the cache directory");
+RECORDER_TWEAK_DEFINE(jit_cache_size, 64,
+                      "Maximum size of cached machine code, in megabytes");
 
 
 
@@ -355,6 +388,247 @@ JITInitializer::JITInitializer(int argc, char **argv)
 }
 
 
+class JITObjectCache : public ObjectCache
+// ----------------------------------------------------------------------------
+//   Keep the object code generated for modules in the cache directory
+// ----------------------------------------------------------------------------
+//   Objects are keyed by a hash of the module IR, of the target and of the
+//   optimization level, so a cached object is only used for identical IR.
+//   Modules that embed the address of a tree or of a counter are not
+//   cached, since their code is only valid in the run that generated it.
+//   The key of the modules we cache is then independent of addresses.
+//   The oldest objects are removed when the cache exceeds jit_cache_size.
+{
+public:
+    JITObjectCache(TargetMachine &target, unsigned &optLevel)
+        : target(target), optLevel(optLevel) {}
+
+    void notifyObjectCompiled(const llvm::Module *module,
+                              MemoryBufferRef object) override;
+    std::unique_ptr<MemoryBuffer> getObject(const llvm::Module *module) override;
+
+    static std::atomic<ulonglong> hits, misses, saved, uncacheable, evicted;
+
+private:
+    text                Path(const llvm::Module *module);
+    void                Evict(text dir);
+
+    TargetMachine &     target;
+    unsigned &          optLevel;
+};
+
+
+std::atomic<ulonglong> JITObjectCache::hits(0);
+std::atomic<ulonglong> JITObjectCache::misses(0);
+std::atomic<ulonglong> JITObjectCache::saved(0);
+std::atomic<ulonglong> JITObjectCache::uncacheable(0);
+std::atomic<ulonglong> JITObjectCache::evicted(0);
+
+
+static bool embedsAddress(const llvm::Constant *constant)
+// ----------------------------------------------------------------------------
+//   Check if a constant is, or is computed from, an integer cast to pointer
+// ----------------------------------------------------------------------------
+{
+    if (const ConstantExpr *expr = dyn_cast<ConstantExpr>(constant))
+        if (expr->getOpcode() == Instruction::IntToPtr)
+            return true;
+    for (const Use &operand : constant->operands())
+        if (const llvm::Constant *inner = dyn_cast<llvm::Constant>(operand))
+            if (!isa<GlobalValue>(inner) && embedsAddress(inner))
+                return true;
+    return false;
+}
+
+
+static bool embedsAddresses(const llvm::Module *module)
+// ----------------------------------------------------------------------------
+//   Check if the code of a module refers to addresses in this process
+// ----------------------------------------------------------------------------
+//   This is how PointerConstant and the branch profiles refer to trees and
+//   counters, so that object code for such a module can't be reused.
+{
+    for (const GlobalVariable &global : module->globals())
+        if (global.hasInitializer() && embedsAddress(global.getInitializer()))
+            return true;
+    for (const llvm::Function &function : *module)
+        for (const llvm::BasicBlock &block : function)
+            for (const Instruction &instruction : block)
+                for (const Use &operand : instruction.operands())
+                    if (const llvm::Constant *constant =
+                        dyn_cast<llvm::Constant>(operand))
+                        if (!isa<GlobalValue>(constant) &&
+                            embedsAddress(constant))
+                            return true;
+    return false;
+}
+
+
+text JITObjectCache::Path(const llvm::Module *module)
+// ----------------------------------------------------------------------------
+//   The path of the cached object for a module, empty if not caching
+// ----------------------------------------------------------------------------
+{
+    if (!RECORDER_TWEAK(jit_cache))
+        return "";
+    text dir = CodeCache::Directory();
+    if (dir.empty() || embedsAddresses(module))
+        return "";
+
+    text ir;
+    raw_string_ostream stream(ir);
+    stream << LLVM_VERSION << "\n"
+           << target.getTargetTriple().str() << "\n"
+           << target.getTargetCPU() << "\n"
+           << target.getTargetFeatureString() << "\n"
+           << optLevel << "\n";
+    module->print(stream, nullptr);
+    stream.flush();
+
+    MD5 md5;
+    MD5::MD5Result digest;
+    SmallString<32> key;
+    md5.update(ir);
+    md5.final(digest);
+    MD5::stringifyResult(digest, key);
+    return dir + "/objects/" + text(key.str()) + ".o";
+}
+
+
+std::unique_ptr<MemoryBuffer> JITObjectCache::getObject(const llvm::Module *module)
+// ----------------------------------------------------------------------------
+//   Return the cached object for the module if there is a valid one
+// ----------------------------------------------------------------------------
+{
+    text path = Path(module);
+    if (path.empty())
+    {
+        if (RECORDER_TWEAK(jit_cache))
+        {
+            record(llvm_cache, "Not caching %s, it embeds addresses",
+                   module->getModuleIdentifier().c_str());
+            uncacheable++;
+        }
+        return nullptr;
+    }
+
+    auto buffer = MemoryBuffer::getFile(path);
+    if (!buffer)
+    {
+        record(llvm_cache, "Miss for %s", path.c_str());
+        misses++;
+        return nullptr;
+    }
+
+    // Check the checksum at the end of the file
+    StringRef data = (*buffer)->getBuffer();
+    uint64_t expected = 0;
+    size_t size = data.size() - sizeof(expected);
+    if (data.size() <= sizeof(expected))
+        size = 0;
+    else
+        memcpy(&expected, data.data() + size, sizeof(expected));
+    data = data.substr(0, size);
+    if (!size || xxHash64(data) != expected)
+    {
+        record(llvm_cache, "Bad checksum in %s", path.c_str());
+        misses++;
+        return nullptr;
+    }
+
+    record(llvm_cache, "Hit for %s", path.c_str());
+    hits++;
+    return MemoryBuffer::getMemBufferCopy(data, path);
+}
+
+
+void JITObjectCache::notifyObjectCompiled(const llvm::Module *module,
+                                          MemoryBufferRef object)
+// ----------------------------------------------------------------------------
+//   Save the object generated for a module
+// ----------------------------------------------------------------------------
+{
+    text path = Path(module);
+    if (path.empty())
+        return;
+
+    // Write a temporary file and rename it, so readers never see part of it
+    SmallString<128> dir(path);
+    sys::path::remove_filename(dir);
+    int fd = -1;
+    SmallString<128> temp;
+    if (sys::fs::create_directories(dir) ||
+        sys::fs::createUniqueFile(path + ".%%%%%%", fd, temp))
+    {
+        record(llvm_cache, "Cannot create a file for %s", path.c_str());
+        return;
+    }
+
+    StringRef data = object.getBuffer();
+    uint64_t sum = xxHash64(data);
+    raw_fd_ostream output(fd, true);
+    output << data;
+    output.write((const char *) &sum, sizeof(sum));
+    output.close();
+    if (output.has_error() || sys::fs::rename(temp, path))
+    {
+        record(llvm_cache, "Cannot write %s", path.c_str());
+        output.clear_error();
+        sys::fs::remove(temp);
+        return;
+    }
+
+    record(llvm_cache, "Saved %s", path.c_str());
+    saved++;
+    Evict(dir.str().str());
+}
+
+
+void JITObjectCache::Evict(text dir)
+// ----------------------------------------------------------------------------
+//   Remove the oldest objects until the cache is below jit_cache_size
+// ----------------------------------------------------------------------------
+{
+    ulonglong limit = RECORDER_TWEAK(jit_cache_size);
+    limit <<= 20;
+
+    typedef std::pair<time_t, text> Entry;
+    std::vector<Entry> entries;
+    std::map<text, ulonglong> sizes;
+    ulonglong total = 0;
+    std::error_code ec;
+    for (sys::fs::directory_iterator it(dir, ec), end;
+         it != end && !ec;
+         it.increment(ec))
+    {
+        text path = it->path();
+        utf8_filestat_t st;
+        if (sys::path::extension(path) != ".o" ||
+            utf8_stat(path.c_str(), &st) < 0)
+            continue;
+        entries.push_back(Entry(st.st_mtime, path));
+        sizes[path] = st.st_size;
+        total += st.st_size;
+    }
+    if (total <= limit)
+        return;
+
+    // Another run may evict at the same time, ignore files already gone
+    std::sort(entries.begin(), entries.end());
+    for (Entry &entry : entries)
+    {
+        if (total <= limit)
+            break;
+        total -= sizes[entry.second];
+        if (!sys::fs::remove(entry.second))
+        {
+            record(llvm_cache, "Evicted %s", entry.second.c_str());
+            evicted++;
+        }
+    }
+}
+
+
 class JITPrivate
 // ----------------------------------------------------------------------------
 //   JIT private data (from Kaleidoscope)
@@ -371,6 +645,7 @@ class JITPrivate
 #endif
     TargetMachine_u     target;
     const DataLayout    layout;
+    JITObjectCache      objectCache;
 #if LLVM_VERSION < 900
 #if LLVM_VERSION >= 700
     ExecutionSession    session;
@@ -400,6 +675,26 @@ class JITPrivate
     Module_s            module;
     ModuleHandle        moduleHandle;
 
+    // Machine code generated in the background
+    typedef std::packaged_task<void *()> Task;
+    std::vector<std::thread> workers;
+    std::deque<Task>    tasks;
+    std::mutex          tasksLock;
+    std::condition_variable tasksReady;
+    bool                stopping;
+#if LLVM_VERSION >= 900
+    typedef std::unique_ptr<ThreadSafeContext::Lock> ContextLock_u;
+    ContextLock_u       contextLock;    // Held while building IR
+#endif // LLVM_VERSION >= 900
+
+    // Branch profiles, counters indexed by the branch condition
+    typedef std::deque<std::array<uint64_t, 2>> BranchProfile;
+    std::map<text, BranchProfile> profiles;
+    BranchProfile *     profile;        // Profile for the function being built
+    JIT::Function_p     profiled;       // Function being profiled
+    JIT::profile_t      profileMode;
+    size_t              profileIndex;   // Next branch in the profile
+
 public:
     JITPrivate(int argc, char **argv);
     ~JITPrivate();
@@ -409,10 +704,16 @@ private:
     JIT::ModuleID       CreateModule(text name);
     void                DeleteModule(JIT::ModuleID mod);
     Module_s            OptimizeModule(Module_s module);
+    void                Optimize(llvm::Module &module);
+    MDNode *            ProfileBranch(IRBuilder<> &builder, Value *cond);
     text                Mangle(text name);
     JITSymbol           Symbol(text name);
     JITTargetAddress    Address(text name);
+    JIT::Code_f         AddressLater(text name);
+    bool                AddModule(text name);
+    void                Work();
     void                PrintCode();
+    void                EmitObject(text prefix);
 };
 
 
@@ -492,7 +793,10 @@ static inline IndirectStubs_u createStubs(TargetMachine &target)
 #if LLVM_VERSION >= 900
 static ExitOnError exitOnError;
 static text llvmSymbolError = "";
+static std::mutex llvmSymbolErrorLock;
 static void logErrorsToStdErr(llvm::Error err) {
+    // Errors may come from the threads generating code in the background
+    std::lock_guard<std::mutex> lock(llvmSymbolErrorLock);
     if (llvmSymbolError.length())
         llvmSymbolError += "\n";
     llvmSymbolError += toString(std::move(err));
@@ -518,6 +822,7 @@ JITPrivate::JITPrivate(int argc, char **argv)
 #endif
       target(EngineBuilder().selectTarget()),
       layout(target->createDataLayout()),
+      objectCache(*target, optLevel),
 #if LLVM_VERSION < 900
 #if LLVM_VERSION < 500
       linker(),
@@ -555,7 +860,11 @@ JITPrivate::JITPrivate(int argc, char **argv)
                  };
              }),
 #endif // LLVM_VERSION >= 700
+#if LLVM_VERSION < 500
       compiler(linker, SimpleCompiler(*target)),
+#else // LLVM_VERSION >= 500
+      compiler(linker, SimpleCompiler(*target, &objectCache)),
+#endif // LLVM_VERSION 500
 #if LLVM_VERSION < 380
       memoryManager(),
       lazyEmitter(compiler),
@@ -582,7 +891,26 @@ JITPrivate::JITPrivate(int argc, char **argv)
       stubs(createStubs(*target)),
 #endif // LLVM_VERSION 380
 #else // LLVM_VERSION >= 900
-      magic(exitOnError(LLLazyJITBuilder().create())),
+      magic(exitOnError(LLLazyJITBuilder()
+                        .setCompileFunctionCreator(
+#if LLVM_VERSION < 1100
+                            [this](JITTargetMachineBuilder jtmb)
+                            -> Expected<IRCompileLayer::CompileFunction>
+                            {
+                                return IRCompileLayer::CompileFunction(
+                                    ConcurrentIRCompiler(std::move(jtmb),
+                                                         &objectCache));
+                            })
+#else // LLVM_VERSION >= 1100
+                            [this](JITTargetMachineBuilder jtmb)
+                            -> Expected<std::unique_ptr<
+                                            IRCompileLayer::IRCompiler>>
+                            {
+                                return std::make_unique<ConcurrentIRCompiler>(
+                                    std::move(jtmb), &objectCache);
+                            })
+#endif // LLVM_VERSION 1100
+                        .create())),
       session(magic->getExecutionSession()),
 #if LLVM_VERSION < 1000
       threadSafeContext(make_unique<LLVMContext>()),
@@ -593,7 +921,13 @@ JITPrivate::JITPrivate(int argc, char **argv)
       mangle(session, layout),
 #endif // LLVM_VERSION >= 900
       module(),
-      moduleHandle()
+      moduleHandle(),
+      stopping(false),
+      profiles(),
+      profile(nullptr),
+      profiled(nullptr),
+      profileMode(JIT::PROFILE_NONE),
+      profileIndex(0)
 {
     llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
 
@@ -637,6 +971,21 @@ JITPrivate::JITPrivate(int argc, char **argv)
 #endif
     }
     session.setErrorReporter(logErrorsToStdErr);
+
+#if LLVM_VERSION >= 1100
+    // Optimize the modules rebuilt with a branch profile
+    magic->getIRTransformLayer().setTransform(
+        [this](ThreadSafeModule tsm, const MaterializationResponsibility &)
+        -> Expected<ThreadSafeModule>
+        {
+            tsm.withModuleDo([this](llvm::Module &module)
+                             {
+                                 if (module.getModuleFlag("xl.profile"))
+                                     Optimize(module);
+                             });
+            return std::move(tsm);
+        });
+#endif // LLVM_VERSION >= 1100
 #endif // LLVM_VERSION >= 900
     record(llvm, "JITPrivate %p constructed", this);
 }
@@ -647,6 +996,14 @@ JITPrivate::~JITPrivate()
 //    Destructor for JIT private helper
 // ----------------------------------------------------------------------------
 {
+    // Let the background threads finish the code they were asked for
+    {
+        std::lock_guard<std::mutex> lock(tasksLock);
+        stopping = true;
+    }
+    tasksReady.notify_all();
+    for (std::thread &worker : workers)
+        worker.join();
     record(llvm, "JITPrivate %p destroyed", this);
 }
 
@@ -683,6 +1040,10 @@ JIT::ModuleID JITPrivate::CreateModule(text name)
 #if LLVM_VERSION >= 700
     moduleHandle = session.allocateVModule();
 #endif
+#if LLVM_VERSION >= 900
+    // Background threads lock the context while they generate code
+    contextLock.reset(new ThreadSafeContext::Lock(threadSafeContext.getLock()));
+#endif // LLVM_VERSION >= 900
     return (intptr_t) &moduleHandle;
 }
 
@@ -718,6 +1079,9 @@ void JITPrivate::DeleteModule(JIT::ModuleID modID)
 #endif // LLVM_VERSION >= 700
 
     module = nullptr;
+#if LLVM_VERSION >= 900
+    contextLock.reset();
+#endif // LLVM_VERSION >= 900
 }
 
 
@@ -735,12 +1099,35 @@ Module_s JITPrivate::OptimizeModule(Module_s module)
 // ----------------------------------------------------------------------------
 //   Run the optimization pass
 // ----------------------------------------------------------------------------
+{
+    Optimize(*module);
+    return module;
+}
+
+
+void JITPrivate::Optimize(llvm::Module &module)
+// ----------------------------------------------------------------------------
+//   Optimize the functions in a module
+// ----------------------------------------------------------------------------
+//   Modules rebuilt with a branch profile are optimized at the level given
+//   by their "xl.profile" flag, and their functions are inlined first
 {
     if (RECORDER_TRACE(llvm_code) & 0x10)
-        dumpModule(module.get(), "Dump of module before optimizations");
+        dumpModule(&module, "Dump of module before optimizations");
+
+    unsigned level = optLevel;
+    auto flag = mdconst::extract_or_null<ConstantInt>(
+        module.getModuleFlag("xl.profile"));
+    if (flag)
+    {
+        level = flag->getZExtValue();
+        legacy::PassManager mpm;
+        mpm.add(createFunctionInliningPass());
+        mpm.run(module);
+    }
 
     // Create a function pass manager.
-    legacy::FunctionPassManager fpm(module.get());
+    legacy::FunctionPassManager fpm(&module);
 
     // Add some optimizations.
     fpm.add(createInstructionCombiningPass());
@@ -748,7 +1135,7 @@ Module_s JITPrivate::OptimizeModule(Module_s module)
     fpm.add(createGVNPass());
     fpm.add(createCFGSimplificationPass());
 
-    if (optLevel >= 3)
+    if (level >= 3)
     {
         // Start of function pass.
         // Break up aggregate allocas, using SSAUpdater.
@@ -784,13 +1171,58 @@ Module_s JITPrivate::OptimizeModule(Module_s module)
 
     // Run the optimizations over all functions in the module being JITed
     fpm.doInitialization();
-    for (auto &f : *module)
+    for (auto &f : module)
         fpm.run(f);
 
     if (RECORDER_TRACE(llvm_code) & 0x20)
-        dumpModule(module.get(), "Dump of module after optimizations");
+        dumpModule(&module, "Dump of module after optimizations");
+}
 
-    return module;
+
+MDNode *JITPrivate::ProfileBranch(IRBuilder<> &builder, Value *cond)
+// ----------------------------------------------------------------------------
+//   Count a conditional branch, or return its weights from the profile
+// ----------------------------------------------------------------------------
+//   Branches are numbered in the order they are built, which is the same
+//   when the same source is built again for the same argument types
+{
+    if (!profile || builder.GetInsertBlock()->getParent() != profiled)
+        return nullptr;
+
+    size_t index = profileIndex++;
+    if (profileMode == JIT::PROFILE_COLLECT)
+    {
+        // Increment counts[cond] before branching
+        if (index >= profile->size())
+            profile->resize(index + 1);
+        uint64_t *counts = (*profile)[index].data();
+        llvm::Type *counterTy = builder.getInt64Ty();
+        APInt addr(JIT::BitsPerByte * sizeof(void *), (uintptr_t) counts);
+        Value *base = Constant::getIntegerValue(counterTy->getPointerTo(),
+                                                addr);
+        Value *slot = builder.CreateGEP(counterTy, base,
+                                        builder.CreateZExt(cond, counterTy));
+#if LLVM_VERSION < 800
+        Value *count = builder.CreateLoad(slot);
+#else // LLVM_VERSION >= 800
+        Value *count = builder.CreateLoad(counterTy, slot);
+#endif // LLVM_VERSION 800
+        builder.CreateStore(builder.CreateAdd(count,
+                                              builder.getInt64(1)), slot);
+        return nullptr;
+    }
+
+    if (index >= profile->size())
+        return nullptr;
+
+    // Branch weights are 32-bit, scale the counts down to fit
+    uint64_t taken = (*profile)[index][1];
+    uint64_t other = (*profile)[index][0];
+    uint64_t scale = std::max(taken, other) / UINT32_MAX + 1;
+    record(llvm_profile, "Branch %u weights %llu / %llu",
+           (unsigned) index, taken, other);
+    return MDBuilder(context).createBranchWeights(taken / scale,
+                                                  other / scale);
 }
 
 
@@ -918,23 +1350,8 @@ JITTargetAddress JITPrivate::Address(text name)
                          ? llvmSymbolError                              \
                          : toString((r).takeError()));                  \
                         llvmSymbolError = ""
-    if (module.get())
-    {
-        ThreadSafeModule tsm(std::move(module), threadSafeContext);
-        llvm::Error error = magic->addIRModule(std::move(tsm));
-        if (error)
-        {
-            record(llvm_modules, "Module error %s", llvmSymbolError);
-            text message = (llvmSymbolError.length()
-                            ? llvmSymbolError
-                            : toString(std::move(error)));
-            llvmSymbolError = "";
-            Ooops("Inserting module for $1 failed: $2")
-                .Arg(name, "'")
-                .Arg(message, "");
-            return 0;
-        }
-    }
+    if (!AddModule(name))
+        return 0;
 #endif
 #endif // LLVM_VERSION < 700
 
@@ -962,6 +1379,110 @@ JITTargetAddress JITPrivate::Address(text name)
 }
 
 
+bool JITPrivate::AddModule(text name)
+// ----------------------------------------------------------------------------
+//   Transfer the module being built to the JIT, return false on error
+// ----------------------------------------------------------------------------
+{
+#if LLVM_VERSION >= 900
+    if (module.get())
+    {
+        // Generating code locks the context, so we must release it
+        contextLock.reset();
+        ThreadSafeModule tsm(std::move(module), threadSafeContext);
+        llvm::Error error = magic->addIRModule(std::move(tsm));
+        if (error)
+        {
+            std::lock_guard<std::mutex> lock(llvmSymbolErrorLock);
+            record(llvm_modules, "Module error %s", llvmSymbolError);
+            text message = (llvmSymbolError.length()
+                            ? llvmSymbolError
+                            : toString(std::move(error)));
+            llvmSymbolError = "";
+            Ooops("Inserting module for $1 failed: $2")
+                .Arg(name, "'")
+                .Arg(message, "");
+            return false;
+        }
+    }
+#endif // LLVM_VERSION >= 900
+    return true;
+}
+
+
+JIT::Code_f JITPrivate::AddressLater(text name)
+// ----------------------------------------------------------------------------
+//   Return the address for the given symbol once it is generated
+// ----------------------------------------------------------------------------
+//   With LLVM 9 and later, ORC generates the code for a symbol when it is
+//   looked up, so the lookup is done by one of the 'jit_threads' threads.
+//   The older JIT layers are not thread safe, so we generate the code now.
+{
+#if LLVM_VERSION >= 900
+    uint threads = RECORDER_TWEAK(jit_threads);
+    if (threads)
+    {
+        if (!AddModule(name))
+        {
+            std::promise<void *> failed;
+            failed.set_value(nullptr);
+            return failed.get_future().share();
+        }
+
+        Task task([this, name]() -> void *
+        {
+            auto sym = magic->lookup(name);
+            if (!sym)
+            {
+                text message = toString(sym.takeError());
+                record(llvm_background, "Generating %s failed: %s",
+                       name, message);
+                return nullptr;
+            }
+            record(llvm_background, "Generated %s at %p",
+                   name, (void *) sym->getAddress());
+            return (void *) sym->getAddress();
+        });
+        JIT::Code_f result = task.get_future().share();
+        {
+            std::lock_guard<std::mutex> lock(tasksLock);
+            while (workers.size() < threads)
+                workers.push_back(std::thread(&JITPrivate::Work, this));
+            tasks.push_back(std::move(task));
+        }
+        tasksReady.notify_one();
+        record(llvm_background, "Queued %s", name);
+        return result;
+    }
+#endif // LLVM_VERSION >= 900
+
+    std::promise<void *> done;
+    done.set_value((void *) Address(name));
+    return done.get_future().share();
+}
+
+
+void JITPrivate::Work()
+// ----------------------------------------------------------------------------
+//   Body of the threads generating code in the background
+// ----------------------------------------------------------------------------
+{
+    for (;;)
+    {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lock(tasksLock);
+            tasksReady.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty())
+                return;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+
 void JITPrivate::PrintCode()
 // ----------------------------------------------------------------------------
 //   Print the code if this is requested
@@ -973,6 +1494,68 @@ void JITPrivate::PrintCode()
 }
 
 
+void JITPrivate::EmitObject(text prefix)
+// ----------------------------------------------------------------------------
+//   Write the machine code for the current module to an object file
+// ----------------------------------------------------------------------------
+//   The first module goes to 'prefix.o', the next ones to 'prefix.N.o'.
+//   Code generation runs on a copy, since the JIT still needs the module.
+//   This is only groundwork for ahead-of-time compilation: the code refers
+//   to trees in the compiler's heap by address, so the objects are only
+//   useful for inspection, e.g. with objdump, and cannot be linked.
+{
+    static uint count = 0;
+    if (!module)
+        return;
+    text file = prefix;
+    if (count)
+        file += "." + std::to_string(count);
+    file += ".o";
+    count++;
+
+    std::error_code error;
+#if LLVM_VERSION < 900
+    raw_fd_ostream output(file, error, sys::fs::F_None);
+#else // LLVM_VERSION >= 900
+    raw_fd_ostream output(file, error, sys::fs::OF_None);
+#endif // LLVM_VERSION 900
+    if (error)
+    {
+        Ooops("Unable to write object file $1: $2")
+            .Arg(file, "'")
+            .Arg(error.message(), "");
+        return;
+    }
+
+#if LLVM_VERSION < 700
+    std::unique_ptr<llvm::Module> copy = CloneModule(module.get());
+#else // LLVM_VERSION >= 700
+    std::unique_ptr<llvm::Module> copy = CloneModule(*module);
+#endif // LLVM_VERSION 700
+    legacy::PassManager passes;
+#if LLVM_VERSION < 700
+    bool failed = target->addPassesToEmitFile(passes, output,
+                                              TargetMachine::CGFT_ObjectFile);
+#elif LLVM_VERSION < 1000
+    bool failed = target->addPassesToEmitFile(passes, output, nullptr,
+                                              TargetMachine::CGFT_ObjectFile);
+#elif LLVM_VERSION < 1800
+    bool failed = target->addPassesToEmitFile(passes, output, nullptr,
+                                              CGFT_ObjectFile);
+#else // LLVM_VERSION >= 1800
+    bool failed = target->addPassesToEmitFile(passes, output, nullptr,
+                                              CodeGenFileType::ObjectFile);
+#endif // LLVM_VERSION
+    if (failed)
+    {
+        Ooops("The target cannot write object file $1").Arg(file, "'");
+        return;
+    }
+    passes.run(*copy);
+    record(llvm_code, "Wrote object file %s", file.c_str());
+}
+
+
 
 // ============================================================================
 //
@@ -1004,6 +1587,13 @@ JIT::~JIT()
     if (p.Module())
         Ooops("Internal: Deleting JIT while a module is active");
     delete &p;
+    IFTRACE(llvm_cache_stats)
+        std::cerr << "JIT object cache: "
+                  << JITObjectCache::hits << " hits, "
+                  << JITObjectCache::misses << " misses, "
+                  << JITObjectCache::uncacheable << " not cacheable, "
+                  << JITObjectCache::evicted << " evicted, "
+                  << JITObjectCache::saved << " saved\n";
 }
 
 
@@ -1076,6 +1666,107 @@ bool JIT::VerifyFunction(Function_p function)
 }
 
 
+static bool isFieldAddress(GetElementPtrInst *gep, unsigned field,
+                           llvm::Type *type)
+// ----------------------------------------------------------------------------
+//   Check if a GEP computes the address of the given field of a structure
+// ----------------------------------------------------------------------------
+//   The field must also have the given type, so that a box cast to some
+//   other kind of tree does not pass for the field we know the value of
+{
+    if (gep->getNumIndices() != 2 || !gep->hasAllConstantIndices())
+        return false;
+    StructType *strt = dyn_cast<StructType>(gep->getSourceElementType());
+    if (!strt || field >= strt->getNumElements() ||
+        strt->getElementType(field) != type)
+        return false;
+    ConstantInt *base = cast<ConstantInt>(gep->getOperand(1));
+    ConstantInt *index = cast<ConstantInt>(gep->getOperand(2));
+    return base->isZero() && index->getZExtValue() == field;
+}
+
+
+unsigned JIT::ElideAllocations(Function_p function, text allocator,
+                               unsigned arg, unsigned field)
+// ----------------------------------------------------------------------------
+//   Remove calls to 'allocator' whose result does not escape the function
+// ----------------------------------------------------------------------------
+//   An allocation does not escape if its result is unused, or only used to
+//   load 'field', which the allocator initializes from its argument 'arg'.
+//   Bit casts of the result or of the field address are followed, since
+//   the compiler casts boxes to the generic tree type and back.
+//   The loads are replaced with that argument, and the allocation removed.
+{
+    std::vector<CallInst *> calls;
+    for (auto &block : *function)
+        for (auto &inst : block)
+            if (CallInst *call = dyn_cast<CallInst>(&inst))
+                if (llvm::Function *callee = call->getCalledFunction())
+                    if (callee->getName() == allocator)
+                        calls.push_back(call);
+
+    unsigned elided = 0;
+    for (CallInst *call : calls)
+    {
+        // Pointers derived from the box, and whether they address 'field'
+        typedef std::pair<Instruction *, bool> Derived;
+        std::vector<Derived> work { Derived(call, false) };
+        std::vector<Instruction *> uses;
+        std::vector<LoadInst *> loads;
+        llvm::Value *value = field == NoField ? nullptr : call->getOperand(arg);
+        bool escapes = false;
+        while (!work.empty() && !escapes)
+        {
+            Derived derived = work.back();
+            work.pop_back();
+            for (User *user : derived.first->users())
+            {
+                Instruction *inst = cast<Instruction>(user);
+                if (isa<BitCastInst>(inst))
+                {
+                    uses.push_back(inst);
+                    work.push_back(Derived(inst, derived.second));
+                    continue;
+                }
+                GetElementPtrInst *gep = dyn_cast<GetElementPtrInst>(inst);
+                if (gep && value && !derived.second &&
+                    isFieldAddress(gep, field, value->getType()))
+                {
+                    uses.push_back(gep);
+                    work.push_back(Derived(gep, true));
+                    continue;
+                }
+                LoadInst *load = dyn_cast<LoadInst>(inst);
+                if (load && derived.second && !load->isVolatile() &&
+                    load->getType() == value->getType())
+                {
+                    loads.push_back(load);
+                    continue;
+                }
+                escapes = true;
+                break;
+            }
+        }
+        if (escapes)
+            continue;
+
+        record(llvm_ir, "Elide allocation %v in %v", call, function);
+        for (LoadInst *load : loads)
+        {
+            load->replaceAllUsesWith(value);
+            load->eraseFromParent();
+        }
+
+        // Erase casts and addresses after the instructions using them
+        for (auto u = uses.rbegin(); u != uses.rend(); u++)
+            (*u)->eraseFromParent();
+        call->eraseFromParent();
+        elided++;
+    }
+    return elided;
+}
+
+
 void JIT::Print(kstring label, Value_p value)
 // ----------------------------------------------------------------------------
 //   Print the tree on the error output
@@ -1136,6 +1827,8 @@ void JIT::PrintCode()
         Comment("LLVM IR for XL program\n");
         p.PrintCode();
     }
+    if (!Opt::emitObject.value.empty())
+        p.EmitObject(Opt::emitObject.value);
 }
 
 
@@ -1292,6 +1985,39 @@ void *JIT::ExecutableCode(JIT::Function_p f)
 }
 
 
+JIT::Code_f JIT::ExecutableCodeLater(JIT::Function_p f)
+// ----------------------------------------------------------------------------
+//   Return the executable code for the function once it is generated
+// ----------------------------------------------------------------------------
+{
+    PrintCode();
+#if LLVM_VERSION < 1100
+    return p.AddressLater(f->getName());
+#else // LLVM_VERSION >= 1100
+    return p.AddressLater(f->getName().str());
+#endif // LLVM_VERSION
+}
+
+
+void JIT::Profile(text key, JIT::Function_p f, profile_t mode)
+// ----------------------------------------------------------------------------
+//   Count the branches in function 'f', or use the counts for 'key'
+// ----------------------------------------------------------------------------
+//   With PROFILE_COLLECT, the branches built in 'f' count how they go.
+//   With PROFILE_APPLY, they get the counts collected with the same key
+//   as branch weights, and the module is optimized at level 3.
+{
+    record(llvm_profile, "Profile %s function %v mode %u",
+           key.c_str(), f, (unsigned) mode);
+    p.profileMode = mode;
+    p.profiled = f;
+    p.profileIndex = 0;
+    p.profile = mode == PROFILE_NONE ? nullptr : &p.profiles[key];
+    if (mode == PROFILE_APPLY && p.module)
+        p.module->addModuleFlag(llvm::Module::Warning, "xl.profile", 3);
+}
+
+
 JIT::Function_p JIT::ExternFunction(JIT::FunctionType_p type, text name)
 // ----------------------------------------------------------------------------
 //    Create an extern function with the given name and type
@@ -1746,7 +2472,8 @@ JIT::Value_p JITBlock::IfBranch(JIT::Value_p cond,
 //  Create a conditional branch
 // ----------------------------------------------------------------------------
 {
-    auto inst = b->CreateCondBr(cond, t.b.block, f.b.block);
+    MDNode *weights = p.ProfileBranch(*b.builder, cond);
+    auto inst = b->CreateCondBr(cond, t.b.block, f.b.block, weights);
     record(llvm_ir, "Conditional branch(%v, %v, %v) = %v",
            cond, t.b.block, f.b.block, inst);
     return inst;
@@ -1760,7 +2487,8 @@ JIT::Value_p JITBlock::IfBranch(JIT::Value_p cond,
 //  Create a conditional branch
 // ----------------------------------------------------------------------------
 {
-    auto inst = b->CreateCondBr(cond, t, f);
+    MDNode *weights = p.ProfileBranch(*b.builder, cond);
+    auto inst = b->CreateCondBr(cond, t, f, weights);
     record(llvm_ir, "Conditional lock branch(%v, %v, %v) = %v",
            cond, t, f, inst);
     return inst;
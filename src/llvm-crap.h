@@ -81,6 +81,7 @@ typedef struct Interpreter_Value *      Value_p;
 #include <llvm/IR/Function.h>
 
 #include <recorder/recorder.h>
+#include <future>
 #include <string>
 
 #define LLVM_CRAP_DIAPER_CLOSE
@@ -154,6 +155,10 @@ class JIT
 //  The LLVM C++ interface keeps changing
 //  This interface attempts to abstract away all these changes
 //  This version is for ORC, the latest iteration of the LLVM JIT
+//  With ORC, 'ExecutableCodeLater' generates the machine code on a pool
+//  of background threads, so that the caller can keep running meanwhile.
+//  'Profile' counts how conditional branches go in the code being built,
+//  and uses the counts as branch weights when the code is built again.
 {
     friend class JITBlock;
     friend class JITBlockPrivate;
@@ -180,9 +185,12 @@ public:
     typedef std::vector<Value_p>        Values;
 
     typedef intptr_t                    ModuleID;
+    typedef std::shared_future<void *>  Code_f;     // Code being generated
 
 public:
     enum { BitsPerByte = 8 };
+    enum : unsigned { NoField = ~0U };
+    enum profile_t { PROFILE_NONE, PROFILE_COLLECT, PROFILE_APPLY };
 
 public:
     JIT(int argc, char **argv);
@@ -198,6 +206,8 @@ public:
     static void         EraseFromParent(Function_p f);
 
     static bool         VerifyFunction(Function_p function);
+    static unsigned     ElideAllocations(Function_p function, text allocator,
+                                         unsigned arg, unsigned field);
     static void         Print(kstring label, Value_p value);
     static void         Print(kstring label, Type_p type);
     static void         Comment(kstring comment);
@@ -229,6 +239,8 @@ public:
     Function_p          Function(FunctionType_p type, text name);
     void                Finalize(Function_p function);
     void *              ExecutableCode(Function_p f);
+    Code_f              ExecutableCodeLater(Function_p f);
+    void                Profile(text key, Function_p f, profile_t mode);
 
     // Prototypes and external functions
     Function_p          ExternFunction(FunctionType_p fty, text name);
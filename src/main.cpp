@@ -52,6 +52,8 @@
 #include "opcodes.h"
 #include "remote.h"
 #include "interpreter.h"
+#include "bytecode.h"
+#include "tiered.h"
 #ifndef INTERPRETER_ONLY
 #include "compiler.h"
 #include "compiler-fast.h"
@@ -64,17 +66,34 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <chrono>
 #include <stdio.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif // HAVE_SYS_INOTIFY_H
 
 
 RECORDER(fileload,                      16, "Files being loaded");
 RECORDER(main,                          16, "Compiler main entry point");
 RECORDER(run_results,                   16, "Show run results");
+RECORDER(refresh,                       32, "Reloading changed source files");
+RECORDER(parse_cache,                   32, "Cache of parsed source files");
 RECORDER(fault_injection,                4, "Fault injection");
 RECORDER_TWEAK_DEFINE(gc_statistics,     0, "Display garbage collector stats");
+RECORDER_TWEAK_DEFINE(parse_threads,     4, "Threads parsing source files");
+RECORDER_TWEAK_DEFINE(parse_persist,     0, "Cache parsed source files in "
+                      "$XL_CACHE or the user cache directory");
 RECORDER_TWEAK_DEFINE(dump_on_exit,  false, "Dump the recorder on exit");
+RECORDER_TWEAK_DEFINE(refresh_interval, 0, "Milliseconds between checks "
+                      "for changed source files (0 disables)");
 RECORDER_TWEAK_DEFINE(inject_fault,  false, "Test fault handler "
                       "(1 pre-LLVM, 2 post-LLVM 3 stack overflow)");
 
@@ -110,6 +129,10 @@ CodeOption      interpreted("interpreted",
                             {
                                 optimize.value = 0;
                             });
+BooleanOption   bytecode("bytecode",
+                         "Evaluate with the bytecode engine (with -O0)");
+BooleanOption   tiered("tiered",
+                       "Promote hot code to bytecode and machine code");
 
 
 BooleanOption   parse("parse",
@@ -129,6 +152,9 @@ NaturalOption   remoteForks("remote_forks",
 BooleanOption   showSource("show",
                            "Show the source code");
 
+BooleanOption   stream("stream",
+                       "Evaluate standard input one statement at a time");
+
 TextOption      stylesheet("stylesheet",
                            "Select the style sheet for rendering XL code",
                            "xl.stylesheet");
@@ -150,6 +176,8 @@ BooleanOption   writePacked("packed_writes",
 
 BooleanOption   emitIR("emit_ir", "Generate LLVM IR suitable for llvmc");
 AliasOption     emitIRAlias("B", emitIR);
+TextOption      emitObject("emit_object",
+                           "Dump JIT modules to object files (not linkable yet)");
 }
 
 
@@ -192,6 +220,236 @@ SourceFile::~SourceFile()
 {}
 
 
+struct ParseCache
+// ----------------------------------------------------------------------------
+//   On-disk cache of the tree parsed from a source file
+// ----------------------------------------------------------------------------
+//   The cache file is named after the path of the source file, so that it
+//   is overwritten when the file changes. It starts with a header giving
+//   the size and modification time of the file and the syntax it was parsed
+//   with, followed by the serialized tree, with positions relative to the
+//   start of the file. Loading it reserves positions for the file as
+//   scanning it would do, so that error messages still show the source line.
+{
+    ParseCache(text file, Syntax &syntax);
+
+    Tree *      Load(Positions &positions);
+    bool        Save(Tree *tree, TreePosition base);
+
+    enum { VERSION, MTIME, CTIME, INODE, SIZE, SYNTAX, HEADER_SIZE };
+
+    text        file;
+    text        path;                   // Cache file, empty if disabled
+    Syntax &    syntax;
+    ulonglong   header[HEADER_SIZE];    // Identifies the version of the file
+};
+
+
+static void parseCacheHash(ulonglong &hash, const void *data, size_t size)
+// ----------------------------------------------------------------------------
+//   FNV-1a hash used for cache keys and checksums
+// ----------------------------------------------------------------------------
+{
+    const byte *bytes = (const byte *) data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+}
+
+
+ParseCache::ParseCache(text file, Syntax &syntax)
+// ----------------------------------------------------------------------------
+//   Compute the cache file for a source file, leave it empty if not caching
+// ----------------------------------------------------------------------------
+//   Comments are not serialized, so the cache is not used when showing
+//   the source code. Packed and encrypted files are already serialized.
+    : file(file), path(), syntax(syntax), header()
+{
+    if (!RECORDER_TWEAK(parse_persist) || file == "-" ||
+        Opt::parse || Opt::showSource ||
+        Opt::writePacked || Opt::writeEncrypted)
+        return;
+    text dir = CodeCache::Directory();
+    utf8_filestat_t st;
+    if (dir.empty() || utf8_stat(file.c_str(), &st) < 0 || !st.st_size)
+        return;
+
+    // Replacing a file changes its inode, and writing it changes its ctime
+    header[VERSION] = serialPOSITIONS;
+    header[MTIME]   = st.st_mtime;
+    header[CTIME]   = st.st_ctime;
+    header[INODE]   = st.st_ino;
+    header[SIZE]    = st.st_size;
+    header[SYNTAX]  = syntax.Fingerprint();
+
+    text where = CodeCache::FullPath(file);
+    ulonglong key = 14695981039346656037ULL;
+    parseCacheHash(key, where.data(), where.length() + 1);
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.xlp", key);
+    path = dir + "/parse/" + name;
+    record(parse_cache, "Cache for %s is %s", file.c_str(), path.c_str());
+}
+
+
+Tree *ParseCache::Load(Positions &positions)
+// ----------------------------------------------------------------------------
+//   Read the tree back from the cache file, if it is valid
+// ----------------------------------------------------------------------------
+{
+    if (path.empty())
+        return nullptr;
+    std::ifstream input(path.c_str(), std::ios::in | std::ios::binary);
+    if (!input.good())
+        return nullptr;
+
+    // Check the checksum at the end of the file before reading anything
+    text data((std::istreambuf_iterator<char>(input)),
+              std::istreambuf_iterator<char>());
+    ulonglong sum = 14695981039346656037ULL, expected = 0;
+    size_t length = data.size() - sizeof(expected);
+    if (data.size() < sizeof(expected))
+        length = 0;
+    else
+        memcpy(&expected, data.data() + length, sizeof(expected));
+    parseCacheHash(sum, data.data(), length);
+    if (!length || sum != expected)
+    {
+        record(parse_cache, "Bad checksum in %s", path.c_str());
+        return nullptr;
+    }
+
+    // Check that the cache is for this version of the file
+    if (length < sizeof(header) || memcmp(data.data(), header, sizeof(header)))
+    {
+        record(parse_cache, "Stale %s for %s", path.c_str(), file.c_str());
+        return nullptr;
+    }
+
+    data.resize(length);
+    std::istringstream stream(data.substr(sizeof(header)));
+    TreePosition base = positions.OpenFile(file, header[SIZE]);
+    Deserializer deserializer(stream, base);
+    Tree *tree = deserializer.ReadTree();
+    if (!tree || !deserializer.IsValid())
+    {
+        record(parse_cache, "Invalid tree in %s", path.c_str());
+        return nullptr;
+    }
+    record(parse_cache, "Loaded %s from %s", file.c_str(), path.c_str());
+    return tree;
+}
+
+
+bool ParseCache::Save(Tree *tree, TreePosition base)
+// ----------------------------------------------------------------------------
+//   Write the tree parsed from the file, unless the file changed the syntax
+// ----------------------------------------------------------------------------
+//   A file with 'syntax' statements changes how the following files are
+//   parsed, so it must be parsed again each time.
+{
+    if (path.empty() || !tree)
+        return false;
+    if (syntax.Fingerprint() != header[SYNTAX])
+    {
+        record(parse_cache, "Not caching %s, it changes the syntax",
+               file.c_str());
+        return false;
+    }
+
+    std::ostringstream buffer;
+    buffer.write((const char *) header, sizeof(header));
+    Serializer serializer(buffer, base);
+    tree->Do(serializer);
+
+    // Write a temporary file and rename it, so readers never see part of it
+    size_t slash = path.rfind('/');
+    if (!CodeCache::MakeDirectory(path.substr(0, slash)))
+    {
+        record(parse_cache, "Cannot create directory for %s: %s",
+               path.c_str(), strerror(errno));
+        return false;
+    }
+    text temp = CodeCache::TemporaryPath(path);
+    text data = buffer.str();
+    ulonglong sum = 14695981039346656037ULL;
+    parseCacheHash(sum, data.data(), data.size());
+    data.append((const char *) &sum, sizeof(sum));
+    std::ofstream output(temp.c_str(), std::ios::out | std::ios::binary);
+    output << data;
+    output.close();
+    if (!output.good() || rename(temp.c_str(), path.c_str()) != 0)
+    {
+        record(parse_cache, "Cannot write %s: %s",
+               path.c_str(), strerror(errno));
+        unlink(temp.c_str());
+        return false;
+    }
+    record(parse_cache, "Saved %s in %s", file.c_str(), path.c_str());
+    return true;
+}
+
+
+struct ParsedFile
+// ----------------------------------------------------------------------------
+//   A source file parsed ahead of time, see Main::ParseFiles
+// ----------------------------------------------------------------------------
+//   Each file has its own copy of the syntax and its own errors, so that
+//   it can be parsed in any thread. The errors are merged when loading.
+{
+    ParsedFile(text name, Main &main)
+        : name(name), source(), syntax(main.syntax),
+          errors(&main.topLevelErrors), cache(name, syntax), parser(),
+          tree(nullptr), base(0), syntaxChanged(false) {}
+    ~ParsedFile()
+    {
+        parser.reset();
+        errors.Clear();
+    }
+
+    bool Open(Positions &positions)
+    {
+        tree = cache.Load(positions);
+        if (tree)
+            return true;
+        if (!source.Map(name.c_str()))
+            return false;
+        parser.reset(new Parser(source, syntax, positions, errors,
+                                name.c_str()));
+        parser->FixedSyntax(true);
+        base = parser->ParserScanner()->Position();
+        return true;
+    }
+
+    void Parse()
+    {
+        if (!parser)
+            return;
+        tree = parser->Parse();
+        syntaxChanged = parser->SyntaxChanged();
+    }
+
+    void Save()
+    {
+        if (parser && !errors.Count())
+            cache.Save(tree, base);
+    }
+
+    text                        name;
+    SourceBuffer                source;
+    Syntax                      syntax;
+    Errors                      errors;
+    ParseCache                  cache;
+    std::unique_ptr<Parser>     parser;
+    Tree_p                      tree;
+    TreePosition                base;
+    bool                        syntaxChanged;
+};
+
+
 
 // ============================================================================
 //
@@ -221,6 +479,8 @@ Main::Main(int inArgc,
       options(inArgc, inArgv),
       context(),
       renderer(std::cout, SearchLibFile(styleSheetName), syntax),
+      watcher(-1),
+      refreshed(0.0),
       reader(nullptr),
       writer(nullptr),
       evaluator(nullptr)
@@ -248,14 +508,20 @@ Main::Main(int inArgc,
     // Once all options have been read, enter symbols and setup compiler
 #ifndef INTERPRETER_ONLY
     compilerName = SearchFile(compilerName, bin_paths);
-    kstring cname = compilerName.c_str();
     uint opt = Opt::optimize.value;
-    if (opt == 1)
+#endif // INTERPRETER_ONLY
+    kstring cname = compilerName.c_str();
+    if (Opt::tiered)
+        evaluator = new Tiered(cname, inArgc, inArgv);
+#ifndef INTERPRETER_ONLY
+    else if (opt == 1)
         evaluator = new FastCompiler(cname, opt, inArgc, inArgv);
     else if (opt >= 2)
         evaluator = new Compiler(cname, opt, inArgc, inArgv);
-    else
 #endif // INTERPRETER_ONLY
+    else if (Opt::bytecode)
+        evaluator = new Bytecode;
+    else
         evaluator = new Interpreter;
 
     // Force a crash if this is requested
@@ -274,6 +540,10 @@ Main::~Main()
         topLevelErrors.Clear();
     }
 
+#ifdef HAVE_SYS_INOTIFY_H
+    if (watcher >= 0)
+        close(watcher);
+#endif // HAVE_SYS_INOTIFY_H
     delete reader;
     delete writer;
     delete evaluator;
@@ -389,6 +659,9 @@ int Main::LoadFiles()
 {
     bool hadError = false;
 
+    // Parse the files in parallel, then load them in order
+    ParseFiles();
+
     // Loop over files we will process
     for (auto &file : file_names)
     {
@@ -398,10 +671,89 @@ int Main::LoadFiles()
                "Load file %s code %d, errors %d", file.c_str(), rc, hadError);
     }
 
+    // Release files that were parsed but not loaded
+    for (auto &p : parsed)
+        delete p.second;
+    parsed.clear();
+
     return hadError;
 }
 
 
+int Main::ParseFiles()
+// ----------------------------------------------------------------------------
+//   Parse the files given on the command line in parallel
+// ----------------------------------------------------------------------------
+//   Files are opened in command-line order, so that positions do not depend
+//   on the threads, and the largest files are parsed first. LoadFile takes
+//   the resulting trees in order, so declarations are processed as before.
+//   A file that changes the syntax stops parsing at the 'syntax' statement,
+//   and LoadFile parses it and the following files again, one at a time.
+{
+    uint threads = RECORDER_TWEAK(parse_threads);
+    uint cpus = std::thread::hardware_concurrency();
+    if (cpus && threads > cpus)
+        threads = cpus;
+    if (threads < 2 || file_names.size() < 2 ||
+        Opt::writeEncrypted || Opt::writePacked)
+        return 0;
+
+    // Open files that can be parsed ahead of time
+    std::vector<ParsedFile *> work;
+    for (auto &file : file_names)
+    {
+        if (file == "-" || parsed.count(file))
+            continue;
+        ParsedFile *pf = new ParsedFile(file, *this);
+        if (!pf->Open(positions))
+        {
+            delete pf;
+            continue;
+        }
+        parsed[file] = pf;
+        work.push_back(pf);
+    }
+    std::stable_sort(work.begin(), work.end(),
+                     [](ParsedFile *a, ParsedFile *b)
+                     {
+                         return a->source.Size() > b->source.Size();
+                     });
+
+    // Parse them with the main thread and the worker threads
+    std::atomic<size_t> next(0);
+    auto parse = [&work, &next]()
+    {
+        for (size_t i = next++; i < work.size(); i = next++)
+            work[i]->Parse();
+    };
+    if (threads > work.size())
+        threads = work.size();
+    std::vector<std::thread> workers;
+    GarbageCollector::Serialize(true);
+    for (uint t = 1; t < threads; t++)
+        workers.push_back(std::thread(parse));
+    parse();
+    for (std::thread &worker : workers)
+        worker.join();
+    GarbageCollector::Serialize(false);
+
+    record(fileload, "Parsed %u files with %u threads",
+           (uint) work.size(), threads);
+    return work.size();
+}
+
+
+static bool isStreamed(text file)
+// ----------------------------------------------------------------------------
+//   Check if a file is evaluated while it is parsed, see Main::Stream
+// ----------------------------------------------------------------------------
+{
+    return file == "-" && Opt::stream &&
+        !Opt::parse && !Opt::compile &&
+        !Opt::writePacked && !Opt::writeEncrypted;
+}
+
+
 int Main::LoadFile(text file, text modname)
 // ----------------------------------------------------------------------------
 //   Load an individual file
@@ -413,6 +765,7 @@ int Main::LoadFile(text file, text modname)
     Tree_p              tree     = nullptr;
     utf8_ifstream       inputFile(file.c_str(), std::ios::in|std::ios::binary);
     std::stringstream   inputStream;
+    SourceBuffer        mapped;
 
 
     // See if we read from standard input
@@ -451,6 +804,38 @@ int Main::LoadFile(text file, text modname)
         }
     }
 
+    // Take the tree if the file was parsed ahead of time
+    auto found = parsed.find(file);
+    if (!tree && found != parsed.end())
+    {
+        ParsedFile *pf = found->second;
+        parsed.erase(found);
+        if (pf->tree && !pf->syntaxChanged)
+        {
+            record(fileload, "Input was parsed ahead of time");
+            tree = pf->tree;
+            pf->Save();
+            pf->errors.Display();
+        }
+        else if (pf->syntaxChanged)
+        {
+            // The following files were parsed with an outdated syntax
+            record(fileload, "Input changes the syntax");
+            for (auto &p : parsed)
+                delete p.second;
+            parsed.clear();
+        }
+        delete pf;
+    }
+
+    // Standard input may be parsed and evaluated statement by statement
+    bool streaming = isStreamed(file);
+    if (streaming)
+    {
+        record(fileload, "Input will be streamed");
+        tree = xl_nil;
+    }
+
     // Read in standard format if we could not read it from packed format
     if (!tree)
     {
@@ -458,8 +843,29 @@ int Main::LoadFile(text file, text modname)
         kstring errName = file.c_str();
         if (file == "-")
             errName = "<stdin>";
-        Parser parser (*input, syntax, positions, topLevelErrors, errName);
-        tree = parser.Parse();
+        ParseCache cache(file, syntax);
+        if (input == &inputFile)
+            tree = cache.Load(positions);
+        if (tree)
+        {
+            record(fileload, "Input was parsed in a previous run");
+        }
+        else if (input == &inputFile && !Opt::writePacked &&
+                 inputFile.good() && mapped.Map(file.c_str()))
+        {
+            // Scan the memory-mapped file directly, cache the result
+            uint errors = topLevelErrors.Count();
+            Parser parser (mapped, syntax, positions, topLevelErrors, errName);
+            TreePosition base = parser.ParserScanner()->Position();
+            tree = parser.Parse();
+            if (topLevelErrors.Count() == errors)
+                cache.Save(tree, base);
+        }
+        else
+        {
+            Parser parser (*input, syntax, positions, topLevelErrors, errName);
+            tree = parser.Parse();
+        }
     }
 
     // If at this stage we don't have a tree, this is an error
@@ -498,10 +904,11 @@ int Main::LoadFile(text file, text modname)
     }
 
     // Normalize if necessary
-    tree = Normalize(tree);
+    if (!streaming)
+        tree = Normalize(tree);
 
     // Show source if requested
-    if (Opt::showSource)
+    if (Opt::showSource && !streaming)
         std::cout << tree << "\n";
 
     // Create new symbol table for the file
@@ -558,9 +965,14 @@ int Main::Run()
     {
         SourceFile &sf = files[*file];
 
-        // Evaluate the given tree
+        // Evaluate the given tree, which a refresh may replace meanwhile
         Errors errors;
-        if (Tree *tree = sf.tree)
+        Tree_p tree = sf.tree;
+        if (isStreamed(sf.name))
+        {
+            result = Stream(sf);
+        }
+        else if (tree)
         {
             result = Evaluate(sf.scope, tree);
             if (errors.HadErrors())
@@ -585,6 +997,39 @@ int Main::Run()
 }
 
 
+Tree *Main::Stream(SourceFile &sf)
+// ----------------------------------------------------------------------------
+//   Parse and evaluate standard input one top-level statement at a time
+// ----------------------------------------------------------------------------
+//   Each statement is released once evaluated, so that memory use does not
+//   grow with the input, except for the declarations it contains.
+//   Statements cannot refer to declarations that come later in the input.
+//   Return the last result, or nullptr if some statement failed.
+{
+    Parser parser(std::cin, syntax, positions, topLevelErrors, "<stdin>");
+    Tree_p result = xl_nil;
+    bool hadError = false;
+    while (Tree_p statement = parser.NextStatement())
+    {
+        statement = Normalize(statement);
+        if (Opt::showSource)
+            std::cout << statement << "\n";
+
+        Errors errors;
+        result = Evaluate(sf.scope, statement);
+        if (errors.HadErrors())
+        {
+            errors.Display();
+            errors.Clear();
+        }
+        if (!result)
+            hadError = true;
+        record(run_results, "Streamed %t result %t", statement, result);
+    }
+    return hadError ? nullptr : (Tree *) result;
+}
+
+
 
 // ============================================================================
 //
@@ -724,9 +1169,331 @@ bool Main::Refresh(double delay)
 // ----------------------------------------------------------------------------
 //   Tell that the program won't execute again after the given delay
 // ----------------------------------------------------------------------------
+//   Time functions call this regularly, so this is where long-running
+//   programs pick up the changes made to their source files.
+//   This is only enabled with refresh_interval, and with evaluators that
+//   look up rewrites again or drop the code compiled for them.
+//   Return true if some declarations were reloaded.
 {
     (void) delay;
-    return false;
+    uint interval = RECORDER_TWEAK(refresh_interval);
+    if (!interval || Opt::writePacked || Opt::writeEncrypted)
+        return false;
+    if (!evaluator->Reloadable())
+        return false;
+
+    // Do not check for changes too often
+    using namespace std::chrono;
+    double now = duration<double>(steady_clock::now().time_since_epoch())
+        .count();
+    if (now < refreshed + interval * 1e-3)
+        return false;
+    refreshed = now;
+
+    // Find which files changed, using inotify if possible, file dates if not
+    Watch();
+#ifdef HAVE_SYS_INOTIFY_H
+    if (watcher >= 0)
+    {
+        alignas(inotify_event) char buffer[4096];
+        ssize_t size;
+        while ((size = read(watcher, buffer, sizeof(buffer))) > 0)
+        {
+            char *next = nullptr;
+            for (char *p = buffer; p < buffer + size; p = next)
+            {
+                inotify_event *event = (inotify_event *) p;
+                next = p + sizeof(inotify_event) + event->len;
+                auto dir = watched.find(event->wd);
+                if (dir == watched.end() || !event->len)
+                    continue;
+                text name = event->name;
+                for (auto &f : files)
+                    if (ModuleBaseName(f.first) == name &&
+                        ModuleDirectory(f.first) == dir->second)
+                        f.second.changed = true;
+            }
+        }
+    }
+    else
+#endif // HAVE_SYS_INOTIFY_H
+    {
+        utf8_filestat_t st;
+        for (auto &f : files)
+            if (f.second.tree && utf8_stat(f.first.c_str(), &st) == 0)
+                if (st.st_mtime != f.second.modified)
+                    f.second.changed = true;
+    }
+
+    // Reload the files that changed
+    bool reloaded = false;
+    for (auto &f : files)
+        if (f.second.changed && f.second.tree && f.second.scope)
+            if (Reload(f.second))
+                reloaded = true;
+    return reloaded;
+}
+
+
+void Main::Watch()
+// ----------------------------------------------------------------------------
+//   Watch the directories of loaded source files for changes
+// ----------------------------------------------------------------------------
+//   Directories are watched rather than files, because many editors save
+//   by writing a new file and renaming it over the old one.
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    if (watcher == -1)
+    {
+        watcher = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (watcher < 0)
+        {
+            record(refresh, "No inotify (%s), checking file dates",
+                   strerror(errno));
+            watcher = -2;
+        }
+    }
+    if (watcher < 0)
+        return;
+
+    for (auto &f : files)
+    {
+        if (f.first == "-" || !f.second.tree)
+            continue;
+        text dir = ModuleDirectory(f.first);
+        bool found = false;
+        for (auto &w : watched)
+            if ((found = w.second == dir))
+                break;
+        if (found)
+            continue;
+        int wd = inotify_add_watch(watcher, dir.c_str(),
+                                   IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd < 0)
+        {
+            record(refresh, "Cannot watch %s: %s",
+                   dir.c_str(), strerror(errno));
+            continue;
+        }
+        record(refresh, "Watching %s for %s", dir.c_str(), f.first.c_str());
+        watched[wd] = dir;
+    }
+#endif // HAVE_SYS_INOTIFY_H
+}
+
+
+static void Statements(Tree_p &tree, std::vector<Tree_p *> &slots)
+// ----------------------------------------------------------------------------
+//   Collect the top-level statements of a program
+// ----------------------------------------------------------------------------
+{
+    Tree_p *slot = &tree;
+    while (Infix *infix = (*slot)->AsInfix())
+    {
+        if (!IsSequence(infix))
+            break;
+        Statements(infix->left, slots);
+        slot = &infix->right;
+    }
+    slots.push_back(slot);
+}
+
+
+static ulong StructuralHash(Tree *tree)
+// ----------------------------------------------------------------------------
+//   Hash the whole structure of a tree, used to find unchanged statements
+// ----------------------------------------------------------------------------
+{
+    ulong h = Context::Hash(tree);
+    switch(tree->Kind())
+    {
+    case BLOCK:
+        h = Context::Rehash(h) ^ StructuralHash(((Block *) tree)->child);
+        break;
+    case PREFIX:
+        h = Context::Rehash(h) ^ StructuralHash(((Prefix *) tree)->left);
+        h = Context::Rehash(h) ^ StructuralHash(((Prefix *) tree)->right);
+        break;
+    case POSTFIX:
+        h = Context::Rehash(h) ^ StructuralHash(((Postfix *) tree)->left);
+        h = Context::Rehash(h) ^ StructuralHash(((Postfix *) tree)->right);
+        break;
+    case INFIX:
+        h = Context::Rehash(h) ^ StructuralHash(((Infix *) tree)->left);
+        h = Context::Rehash(h) ^ StructuralHash(((Infix *) tree)->right);
+        break;
+    default:
+        break;
+    }
+    return h;
+}
+
+
+static ulong PatternHash(Infix *decl)
+// ----------------------------------------------------------------------------
+//   Hash what a declaration defines, see SamePattern
+// ----------------------------------------------------------------------------
+{
+    Tree *base = PatternBase(decl->left);
+    if (base->AsName())
+        return Context::Hash(base);
+    return StructuralHash(decl->left);
+}
+
+
+static bool SamePattern(Infix *old, Infix *decl)
+// ----------------------------------------------------------------------------
+//   Check if a new declaration replaces an old one
+// ----------------------------------------------------------------------------
+//   Names are only defined once in a scope, whatever their type, so
+//   'X as integer is 0' replaces 'X is 0'
+{
+    if (Tree::Equal(old->left, decl->left))
+        return true;
+    Name *oldName = PatternBase(old->left)->AsName();
+    Name *newName = PatternBase(decl->left)->AsName();
+    return oldName && newName && oldName->value == newName->value;
+}
+
+
+bool Main::Reload(SourceFile &sf)
+// ----------------------------------------------------------------------------
+//   Parse a source file again, and update the declarations that changed
+// ----------------------------------------------------------------------------
+//   Top-level statements identical to the previous version are kept.
+//   A declaration with the same pattern as a previous one gets its new body
+//   in place, so that the scope and the callers see it immediately.
+//   New declarations are entered in the scope of the file.
+//   Other statements already ran, and only take effect on the next load.
+{
+    text file = sf.name;
+    sf.changed = false;
+    utf8_filestat_t st;
+    if (utf8_stat(file.c_str(), &st) == 0)
+        sf.modified = st.st_mtime;
+
+    // Parse the new version, keep the old one if it has errors
+    Errors errors;
+    Tree_p tree;
+    SourceBuffer mapped;
+    if (mapped.Map(file.c_str()))
+    {
+        Parser parser(mapped, syntax, positions, errors, file.c_str());
+        tree = parser.Parse();
+    }
+    else
+    {
+        utf8_ifstream input(file.c_str(), std::ios::in|std::ios::binary);
+        Parser parser(input, syntax, positions, errors, file.c_str());
+        tree = parser.Parse();
+    }
+    if (!tree || errors.HadErrors())
+    {
+        record(refresh, "Keeping previous version of %s", file.c_str());
+        return false;
+    }
+    tree = Normalize(tree);
+
+    // Index the previous statements by structure, declarations by pattern
+    std::vector<Tree_p *> before, after;
+    Statements(sf.tree, before);
+    Statements(tree, after);
+    std::multimap<ulong, uint> byTree, byPattern;
+    std::vector<bool> used(before.size(), false);
+    for (uint i = 0; i < before.size(); i++)
+    {
+        Tree *old = *before[i];
+        byTree.emplace(StructuralHash(old), i);
+        if (Infix *decl = IsDeclaration(old))
+            byPattern.emplace(PatternHash(decl), i);
+    }
+
+    // Reuse what did not change, update or enter what did
+    Context context(sf.scope);
+    uint kept = 0, updated = 0, added = 0, instructions = 0;
+    for (Tree_p *slot : after)
+    {
+        Tree *stmt = *slot;
+        Tree *reused = nullptr;
+        auto same = byTree.equal_range(StructuralHash(stmt));
+        for (auto i = same.first; i != same.second && !reused; i++)
+        {
+            if (!used[i->second] && Tree::Equal(*before[i->second], stmt))
+            {
+                used[i->second] = true;
+                reused = *before[i->second];
+            }
+        }
+        if (reused)
+        {
+            *slot = reused;
+            kept++;
+            continue;
+        }
+
+        Infix *decl = IsDeclaration(stmt);
+        Infix *old = nullptr;
+        if (decl)
+        {
+            auto same = byPattern.equal_range(PatternHash(decl));
+            for (auto i = same.first; i != same.second && !old; i++)
+            {
+                Infix *candidate = (*before[i->second])->AsInfix();
+                if (!used[i->second] && SamePattern(candidate, decl))
+                {
+                    used[i->second] = true;
+                    old = candidate;
+                }
+            }
+        }
+        if (old)
+        {
+            // Code compiled for the old body may still run, keep it alive
+            record(refresh, "Updating %t", decl->left);
+            sf.retired.push_back(old->left);
+            sf.retired.push_back(old->right);
+            old->left = decl->left;
+            old->right = decl->right;
+            Tiered::Invalidate(old);
+            *slot = old;
+            updated++;
+        }
+        else if (decl)
+        {
+            // A name removed earlier is still in the scope, reuse its entry
+            record(refresh, "Adding %t", decl->left);
+            if (Rewrite *entry = context.Enter(decl, true))
+            {
+                Infix *entered = RewriteDeclaration(entry);
+                if (entered != decl)
+                {
+                    entered->left = decl->left;
+                    *slot = entered;
+                }
+            }
+            added++;
+        }
+        else if (!context.ProcessDeclarations(stmt))
+        {
+            record(refresh, "Adding %t", stmt);
+            added++;
+        }
+        else
+        {
+            instructions++;
+        }
+    }
+
+    uint removed = 0;
+    for (uint i = 0; i < before.size(); i++)
+        if (!used[i] && IsDeclaration(*before[i]))
+            removed++;
+
+    record(refresh, "Reloaded %s: %u kept, %u updated, %u added, "
+           "%u removed, %u instructions changed",
+           file.c_str(), kept, updated, added, removed, instructions);
+    sf.tree = tree;
+    return updated + added > 0;
 }
 
 
@@ -669,7 +669,7 @@ kstring Options::ParseNext()
     while (arg < args.size())
     {
         kstring input = Input();
-        if (*input != '-')
+        if (*input != '-' || !input[1])     // '-' alone is standard input
         {
             ++arg;
             return input;
@@ -44,8 +44,13 @@
 #include "tree.h"
 #include "parser.h"
 #include "options.h"
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif // HAVE_SYS_RESOURCE_H
 
 
+RECORDER_TWEAK_DEFINE(parser_stats, 0, "Show the parsing speed");
+
 
 XL_BEGIN
 // ============================================================================
@@ -88,6 +93,8 @@ token_t Parser::NextToken()
 // ----------------------------------------------------------------------------
 {
     text opening, closing;
+    if (syntaxChanged)
+        return tokEOF;
     while (true)
     {
         token_t pend = pending;
@@ -114,6 +121,13 @@ token_t Parser::NextToken()
             opening = scanner.NameValue();
             if (opening == "syntax")
             {
+                if (fixedSyntax)
+                {
+                    // The caller must parse again with the actual syntax
+                    record(parser, "Special syntax with fixed syntax");
+                    syntaxChanged = true;
+                    return tokEOF;
+                }
                 record(parser, "Reading special syntax");
                 syntax.ReadSyntaxFile(scanner, 0);
                 record(parser, "End of special syntax");
@@ -297,6 +311,84 @@ static inline Tree *CreatePrefix(Tree *left, Tree *right, TreePosition pos)
 }
 
 
+static ulong CountNodes(Tree *tree)
+// ----------------------------------------------------------------------------
+//   Count the nodes in a parse tree, without recursing on long statements
+// ----------------------------------------------------------------------------
+{
+    ulong count = 0;
+    std::vector<Tree *> stack;
+    if (tree)
+        stack.push_back(tree);
+    while (!stack.empty())
+    {
+        Tree *what = stack.back();
+        stack.pop_back();
+        count++;
+        switch(what->Kind())
+        {
+        case BLOCK:
+            stack.push_back(((Block *) what)->child);
+            break;
+        case PREFIX:
+            stack.push_back(((Prefix *) what)->left);
+            stack.push_back(((Prefix *) what)->right);
+            break;
+        case POSTFIX:
+            stack.push_back(((Postfix *) what)->left);
+            stack.push_back(((Postfix *) what)->right);
+            break;
+        case INFIX:
+            stack.push_back(((Infix *) what)->left);
+            stack.push_back(((Infix *) what)->right);
+            break;
+        default:
+            break;
+        }
+    }
+    return count;
+}
+
+
+Parser::~Parser()
+// ----------------------------------------------------------------------------
+//   Report parsing statistics if requested
+// ----------------------------------------------------------------------------
+{
+    if (nodes && RECORDER_TWEAK(parser_stats))
+        Statistics();
+}
+
+
+void Parser::Statistics()
+// ----------------------------------------------------------------------------
+//   Report how fast the input was parsed and the peak memory usage
+// ----------------------------------------------------------------------------
+//   The peak memory is the maximum resident set size of the process so far,
+//   in kilobytes, or 0 if the platform does not report it
+{
+    text  file;
+    ulong offset = 0;
+    scanner.InputPositions().GetFile(scanner.Position(), &file, &offset);
+    ulong rate = parsing > 0 ? nodes / parsing : 0;
+    ulong peak = 0;
+#ifdef HAVE_SYS_RESOURCE_H
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        peak = usage.ru_maxrss;
+#ifdef __APPLE__
+    peak /= 1024;               // macOS reports bytes, not kilobytes
+#endif // __APPLE__
+#endif // HAVE_SYS_RESOURCE_H
+    std::cerr << "Parsed " << file
+              << ", nodes parsed: " << nodes
+              << ", tokens scanned: " << scanner.Tokens()
+              << " in " << parsing << "s, "
+              << rate << " nodes/s, "
+              << "peak memory: " << peak << " KB\n";
+}
+
+
 Tree *Parser::Parse(text closing, text opening, ulong opening_pos)
 // ----------------------------------------------------------------------------
 //   Parse input
@@ -316,6 +408,9 @@ Tree *Parser::Parse(text closing, text opening, ulong opening_pos)
        We hope that semantic will catch such a case later and let us know...
  */
 {
+    bool                 measure            = closing.empty() &&
+                                              RECORDER_TWEAK(parser_stats);
+    double               started            = measure ? Scanner::Now() : 0;
     Tree *               result             = nullptr;
     Tree *               left               = nullptr;
     Tree *               right              = nullptr;
@@ -370,6 +465,7 @@ Tree *Parser::Parse(text closing, text opening, ulong opening_pos)
         case tokEOF:
         case tokERROR:
             done = true;
+            ended = true;
             if (closing != "" && closing != Block::unindent)
                 errors.Log(Error("Unexpected end of text, expected $1",
                                  scanner.Position()).Arg(closing));
@@ -503,6 +599,13 @@ Tree *Parser::Parse(text closing, text opening, ulong opening_pos)
             }
             break;
         case tokNEWLINE:
+            // When streaming, a top-level new-line ends the statement
+            if (streaming && closing == "" && (result || stack.size()))
+            {
+                done = true;
+                break;
+            }
+
             // Consider new-line as an infix operator
             infix = "\n";
             name = infix;
@@ -727,9 +830,29 @@ Tree *Parser::Parse(text closing, text opening, ulong opening_pos)
         }
     }
 
+    if (measure)
+    {
+        parsing += Scanner::Now() - started;
+        nodes += CountNodes(result);
+    }
     return result;
 }
 
+
+Tree *Parser::NextStatement()
+// ----------------------------------------------------------------------------
+//   Parse the next top-level statement, return nullptr at end of input
+// ----------------------------------------------------------------------------
+//   A statement is returned once the first token of the next one is read,
+//   since a line beginning with an infix like 'else' continues it.
+{
+    streaming = true;
+    while (!ended)
+        if (Tree *statement = Parse())
+            return statement;
+    return nullptr;
+}
+
 XL_END
 
 RECORDER(parser, 64, "Parser");
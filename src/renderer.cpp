@@ -107,11 +107,143 @@ struct EnterFormatsAction
 };
 
 
+StyleSheet::StyleSheet(formats_table &formats)
+// ----------------------------------------------------------------------------
+//   Compile the formats read from a style sheet
+// ----------------------------------------------------------------------------
+{
+    // Number all formats first, so that they can refer to one another
+    for (auto &format : formats)
+    {
+        all[format.first] = programs.size();
+        programs.push_back(Program());
+    }
+    for (auto &format : formats)
+        Compile(format.second, programs[all[format.first]]);
+
+    // Index the formats for each kind of node by what follows the kind
+    for (auto &format : all)
+    {
+        const text &key = format.first;
+        if (key.compare(0, 6, "infix ") == 0)
+            infix[key.substr(6)] = format.second;
+        else if (key.compare(0, 7, "prefix ") == 0)
+            prefix[key.substr(7)] = format.second;
+        else if (key.compare(0, 8, "postfix ") == 0)
+            postfix[key.substr(8)] = format.second;
+        else if (key.compare(0, 6, "block ") == 0)
+            block[key.substr(6)] = format.second;
+        else if (key.compare(0, 5, "text ") == 0)
+            texts[0][key.substr(5)] = format.second;
+        else if (key.compare(0, 9, "longtext ") == 0)
+            texts[1][key.substr(9)] = format.second;
+    }
+
+    // Formats for individual characters and fixed names
+    for (uint c = 0; c < 256; c++)
+    {
+        text t = text(1, char(c));
+        chars[c] = Find(t);
+        quoted[c] = Find(t + " quoted");
+    }
+    cr             = Find("\n");
+    space          = Find(" ");
+    indents        = Find("indents ");
+    infixDefault   = Find("infix ");
+    prefixDefault  = Find("prefix ");
+    postfixDefault = Find("postfix ");
+    blockDefault   = Find("block ");
+    textDefault[0] = Find("text ");
+    textDefault[1] = Find("longtext ");
+}
+
+
+int StyleSheet::Find(const text &key) const
+// ----------------------------------------------------------------------------
+//   Find a format by name, NONE if there is none
+// ----------------------------------------------------------------------------
+{
+    return Find(all, key);
+}
+
+
+int StyleSheet::Find(const Index &index, const text &key) const
+// ----------------------------------------------------------------------------
+//   Find a format in an index, NONE if there is none
+// ----------------------------------------------------------------------------
+{
+    auto found = index.find(key);
+    return found != index.end() ? found->second : NONE;
+}
+
+
+void StyleSheet::Compile(Tree *format, Program &program)
+// ----------------------------------------------------------------------------
+//   Compile a format from the style sheet into a program
+// ----------------------------------------------------------------------------
+{
+    if (Text *tf = format->AsText())
+    {
+        if (tf->opening == Text::textQuote)
+            program.push_back(Op(opVERBATIM, tf->value));
+        else
+            program.push_back(Op(opTEXT, tf->value));
+    }
+    else if (Name *nf = format->AsName())
+    {
+        text n = nf->value;
+        if (n == "indent")
+            program.push_back(Op(opINDENT));
+        else if (n == "unindent")
+            program.push_back(Op(opUNINDENT));
+        else if (n == "indents")
+            program.push_back(Op(opINDENTS));
+        else if (n == "self")
+            program.push_back(Op(opSELF));
+        else if (n == "quoted_self")
+            program.push_back(Op(opQUOTED_SELF));
+        else if (n == "unindented_self")
+            program.push_back(Op(opUNINDENTED_SELF));
+        else if (n ==  "left" || n == "child")
+            program.push_back(Op(opLEFT));
+        else if (n == "right")
+            program.push_back(Op(opRIGHT));
+        else if (n == "opening")
+            program.push_back(Op(opOPENING));
+        else if (n == "closing")
+            program.push_back(Op(opCLOSING));
+        else if (n == "space")
+            program.push_back(Op(opSPACE));
+        else if (n == "separator")
+            program.push_back(Op(opSEPARATOR));
+        else if (n == "newline" || n == "cr")
+            program.push_back(Op(opNEWLINE));
+        else if (Find(n + " ") != NONE)
+            program.push_back(Op(opCALL, n, Find(n + " ")));
+        else
+            program.push_back(Op(opUNDECLARED, n));
+    }
+    else if (Prefix *pf = format->AsPrefix())
+    {
+        Compile(pf->left, program);
+        Compile(pf->right, program);
+    }
+    else if (Block *bf = format->AsBlock())
+    {
+        Compile(bf->child, program);
+    }
+    else
+    {
+        program.push_back(Op(opUNKNOWN));
+    }
+}
+
+
 Renderer::Renderer(std::ostream &out, text styleFile, Syntax &stx)
 // ----------------------------------------------------------------------------
 //   Renderer constructor
 // ----------------------------------------------------------------------------
-    : output(out), syntax(stx), formats(),
+    : output(out), syntax(stx), style(),
       indent(0), self(""), left(nullptr), right(nullptr), current_quote("\""),
       priority(0),
       had_space(true), had_newline(false), had_punctuation(false),
@@ -125,7 +257,7 @@ Renderer::Renderer(std::ostream &out, Renderer *from)
 // ----------------------------------------------------------------------------
 //   Clone a renderer from some existing one
 // ----------------------------------------------------------------------------
-    : output(out), syntax(from->syntax), formats(from->formats),
+    : output(out), syntax(from->syntax), style(from->style),
       indent(from->indent), self(from->self),
       left(from->left), right(from->right),
       current_quote(from->current_quote), priority(from->priority),
@@ -150,7 +282,7 @@ void Renderer::SelectStyleSheet(text styleFile)
     Parser p(styleFile.c_str(), defaultSyntax, positions, errors);
 
     // Some defaults
-    formats.clear();
+    formats_table formats;
     formats[Block::indent]   = new Name("indent");
     formats[Block::unindent] = new Name("unindent");
 
@@ -160,6 +292,7 @@ void Renderer::SelectStyleSheet(text styleFile)
         EnterFormatsAction action(formats);
         fmts->Do(action);
     }
+    style = std::make_shared<StyleSheet>(formats);
 }
 
 
@@ -180,11 +313,10 @@ void Renderer::RenderSeparators(char c)
         had_newline = true;
         need_newline = false;
 
-        text cr = "\n";
-        if (formats.count(cr) > 0)
-            RenderFormat(formats[cr]);
+        if (style->cr != StyleSheet::NONE)
+            RenderFormat(style->cr);
         else
-            output << cr;
+            output << "\n";
     }
 
     if (c != '\n')
@@ -204,9 +336,8 @@ void Renderer::RenderSeparators(char c)
             {
                 if (had_punctuation == ispunct(c))
                 {
-                    text space = " ";
-                    if (formats.count(space) > 0)
-                        RenderFormat(formats[space]);
+                    if (style->space != StyleSheet::NONE)
+                        RenderFormat(style->space);
                     else
                         output << ' ';
                 }
@@ -225,6 +356,7 @@ void Renderer::RenderText(text format)
     uint i;
     uint length   = format.length();
     bool quoted   = false;
+    int  quote    = current_quote.length() == 1 ? byte(current_quote[0]) : -1;
 
     for (i = 0; i < length; i++)
     {
@@ -243,12 +375,11 @@ void Renderer::RenderText(text format)
         }
         else
         {
-            text t = text(1, c);
-            quoted = i > 0 && i < length-1 && t == current_quote;
-            if (quoted)
-                t += " quoted";
-            if (formats.count(t) > 0)
-                RenderFormat(formats[t]);
+            byte b = c;
+            quoted = i > 0 && i < length-1 && b == quote;
+            int f = quoted ? style->quoted[b] : style->chars[b];
+            if (f != StyleSheet::NONE)
+                RenderFormat(f);
             else if (!quoted)
                 output << c;
             else
@@ -265,12 +396,10 @@ void Renderer::RenderIndents()
 //   Render the indents at the beginning of a line
 // ----------------------------------------------------------------------------
 {
-    text k0 = "indents ";
-    if (formats.count(k0) > 0)
+    if (style->indents != StyleSheet::NONE)
     {
-        Tree *fmt = formats[k0];
         for (uint i = 0; i < indent; i++)
-            RenderFormat(fmt);
+            RenderFormat(style->indents);
     }
     else
     {
@@ -285,45 +414,51 @@ void Renderer::RenderFormat(Tree *format)
 //   Render a format read from the style sheet
 // ----------------------------------------------------------------------------
 {
-    if (Text *tf = format->AsText())
-    {
-        text t = tf->value;
-        if (tf->opening == Text::textQuote)
-        {
-            if (need_newline && t != "")
-                RenderSeparators(t[0]);
-            output << t;                        // As is, no formatting
-        }
-        else
-            RenderText(t);                      // Format contents
-    }
-    else if (Name *nf = format->AsName())
-    {
-        text n = nf->value;
-        text m = n + " ";
-        if (n == "cr")
-        {
-            m = "\n";
-            need_newline = true;
-        }
+    StyleSheet::Program program;
+    style->Compile(format, program);
+    RenderFormat(program);
+}
 
-        if (n == "indent")
+
+void Renderer::RenderFormat(int format)
+// ----------------------------------------------------------------------------
+//   Render a format of the style sheet given its index
+// ----------------------------------------------------------------------------
+{
+    RenderFormat(style->programs[format]);
+}
+
+
+void Renderer::RenderFormat(const StyleSheet::Program &program)
+// ----------------------------------------------------------------------------
+//   Run a compiled format
+// ----------------------------------------------------------------------------
+{
+    for (const StyleSheet::Op &op : program)
+    {
+        switch(op.opcode)
         {
+        case StyleSheet::opVERBATIM:
+            if (need_newline && op.value != "")
+                RenderSeparators(op.value[0]);
+            output << op.value;                 // As is, no formatting
+            break;
+        case StyleSheet::opTEXT:
+            RenderText(op.value);               // Format contents
+            break;
+        case StyleSheet::opINDENT:
             indent += 1;
-        }
-        else if (n == "unindent")
-        {
+            break;
+        case StyleSheet::opUNINDENT:
             indent -= 1;
-        }
-        else if (n == "indents")
-        {
+            break;
+        case StyleSheet::opINDENTS:
             RenderIndents();
-        }
-        else if (n == "self")
-        {
+            break;
+        case StyleSheet::opSELF:
             RenderText(self);
-        }
-        else if (n == "quoted_self")
+            break;
+        case StyleSheet::opQUOTED_SELF:
         {
             text escaped;
             uint i;
@@ -336,66 +471,48 @@ void Renderer::RenderFormat(Tree *format)
                     escaped += t;
             }
             RenderText(escaped);
+            break;
         }
-        else if (n == "unindented_self")
+        case StyleSheet::opUNINDENTED_SELF:
         {
             Save<bool> saveNoIndents(no_indents, true);
             RenderText(self);
+            break;
         }
-        else if (n ==  "left" || n == "child")
-        {
+        case StyleSheet::opLEFT:
             Render(left);
-        }
-        else if (n == "right")
-        {
+            break;
+        case StyleSheet::opRIGHT:
             Render(right);
-        }
-        else if (n == "opening")
-        {
-            Block *b = right->AsBlock();
-            if (b)
+            break;
+        case StyleSheet::opOPENING:
+            if (Block *b = right->AsBlock())
                 RenderText(b->opening);
-        }
-        else if (n == "closing")
-        {
-            Block *b = right->AsBlock();
-            if (b)
+            break;
+        case StyleSheet::opCLOSING:
+            if (Block *b = right->AsBlock())
                 RenderText(b->closing);
-        }
-        else if (n == "space")
-        {
+            break;
+        case StyleSheet::opSPACE:
             if (!had_space)
                 RenderText(" ");
-        }
-        else if (n == "separator")
-        {
+            break;
+        case StyleSheet::opSEPARATOR:
             need_separator = true;
-        }
-        else if (n == "newline" || n == "cr")
-        {
+            break;
+        case StyleSheet::opNEWLINE:
             need_newline = true;
+            break;
+        case StyleSheet::opCALL:
+            RenderFormat(op.format);
+            break;
+        case StyleSheet::opUNDECLARED:
+            output << "** Undeclared format directive " << op.value << "**\n";
+            break;
+        case StyleSheet::opUNKNOWN:
+            output << "** Unkown kind of format directive **\n";
+            break;
         }
-        else if (formats.count(m) > 0)
-        {
-            RenderFormat (formats[m]);
-        }
-        else
-        {
-            output << "** Undeclared format directive " << n << "**\n";
-        }
-    }
-    else if (Prefix *pf = format->AsPrefix())
-    {
-        RenderFormat (pf->left);
-        RenderFormat (pf->right);
-    }
-    else if (Block *bf = format->AsBlock())
-    {
-        RenderFormat(bf->child);
-    }
-    else
-    {
-        output << "** Unkown kind of format directive **\n";
     }
 }
 
@@ -406,8 +523,9 @@ void Renderer::RenderFormat(text self, text format)
 // ----------------------------------------------------------------------------
 {
     this->self = self;
-    if (formats.count(format) > 0)
-        RenderFormat (formats[format]);
+    int f = style->Find(format);
+    if (f != StyleSheet::NONE)
+        RenderFormat(f);
     else
         RenderText(self);
 }
@@ -419,10 +537,11 @@ void Renderer::RenderFormat(text self, text format, text generic)
 // ----------------------------------------------------------------------------
 {
     this->self = self;
-    if (formats.count(format) > 0)
-        RenderFormat (formats[format]);
-    else if (formats.count(generic) > 0)
-        RenderFormat (formats[generic]);
+    int f = style->Find(format);
+    if (f == StyleSheet::NONE)
+        f = style->Find(generic);
+    if (f != StyleSheet::NONE)
+        RenderFormat(f);
     else
         RenderText(self);
 }
@@ -435,12 +554,13 @@ void Renderer::RenderFormat(text self, text format,
 // ----------------------------------------------------------------------------
 {
     this->self = self;
-    if (formats.count(format) > 0)
-        RenderFormat (formats[format]);
-    else if (formats.count(generic1) > 0)
-        RenderFormat (formats[generic1]);
-    else if (formats.count(generic2) > 0)
-        RenderFormat (formats[generic2]);
+    int f = style->Find(format);
+    if (f == StyleSheet::NONE)
+        f = style->Find(generic1);
+    if (f == StyleSheet::NONE)
+        f = style->Find(generic2);
+    if (f != StyleSheet::NONE)
+        RenderFormat(f);
     else
         RenderText(self);
 }
@@ -619,26 +739,20 @@ void Renderer::RenderBody(Tree *what)
              case TEXT: {
                  Text *w = what->AsText();
                  t = w->value;
-                 text q0 = t.find("\n") != t.npos ? "longtext " : "text ";
-                 text q1 = q0 + w->opening;
-                 text q2 = q1 + " " + w->closing;
+                 bool longText = t.find("\n") != t.npos;
+                 const StyleSheet::Index &texts = style->texts[longText];
                  text saveq = this->current_quote;
                  this->current_quote = w->opening;
 
-                 if (formats.count(q2) > 0)
-                 {
-                     this->self = t;
-                     RenderFormat(formats[q2]);
-                 }
-                 else if (formats.count(q1) > 0)
-                 {
-                     this->self = t;
-                     RenderFormat(formats[q1]);
-                 }
-                 else if (formats.count(q0) > 0)
+                 int f = style->Find(texts, w->opening + " " + w->closing);
+                 if (f == StyleSheet::NONE)
+                     f = style->Find(texts, w->opening);
+                 if (f == StyleSheet::NONE)
+                     f = style->textDefault[longText];
+                 if (f != StyleSheet::NONE)
                  {
                      this->self = t;
-                     RenderFormat(formats[q0]);
+                     RenderFormat(f);
                  }
                  else
                  {
@@ -675,19 +789,18 @@ void Renderer::RenderBody(Tree *what)
                  left = l;
                  right = r;
 
-                 text n0 = "prefix ";
                  if (Name *lf = left->AsName())
                  {
-                     text n = n0 + lf->value;
-                     if (formats.count(n) > 0)
+                     int f = style->Find(style->prefix, lf->value);
+                     if (f != StyleSheet::NONE)
                      {
-                         RenderFormat (formats[n]);
+                         RenderFormat (f);
                          break;
                      }
                  }
-                 if (formats.count(n0) > 0)
+                 if (style->prefixDefault != StyleSheet::NONE)
                  {
-                     RenderFormat (formats[n0]);
+                     RenderFormat (style->prefixDefault);
                  }
                  else
                  {
@@ -711,23 +824,23 @@ void Renderer::RenderBody(Tree *what)
                  left = l;
                  right = r;
 
-                 text n0 = "postfix ";
+                 int n0 = style->postfixDefault;
                  if (Name *rf = right->AsName())
                  {
-                     text n = n0 + rf->value;
-                     if (formats.count(n) > 0)
-                         RenderFormat (formats[n]);
-                     else if (formats.count(n0) > 0)
-                         RenderFormat (formats[n0]);
+                     int n = style->Find(style->postfix, rf->value);
+                     if (n != StyleSheet::NONE)
+                         RenderFormat (n);
+                     else if (n0 != StyleSheet::NONE)
+                         RenderFormat (n0);
                      else
                      {
                          Render (l);
                          Render (r);
                      }
                  }
-                 else if (formats.count(n0) > 0)
+                 else if (n0 != StyleSheet::NONE)
                  {
-                     RenderFormat (formats[n0]);
+                     RenderFormat (n0);
                  }
                  else
                  {
@@ -737,11 +850,9 @@ void Renderer::RenderBody(Tree *what)
              }   break;
              case INFIX: {
                  Infix *w = what->AsInfix();
-                 text in = w->name;
-                 if (in == "\n")
-                     in = "cr";
-                 text n0 = "infix ";
-                 text n = n0 + in;
+                 int n = style->Find(style->infix,
+                                     w->name == "\n" ? text("cr") : w->name);
+                 int n0 = style->infixDefault;
                  Tree *l = w->left;
                  Tree *r = w->right;
 
@@ -764,10 +875,10 @@ void Renderer::RenderBody(Tree *what)
                  this->right = r;
                  this->self = w->name;
 
-                 if (formats.count(n) > 0)
-                     RenderFormat(formats[n]);
-                 else if (formats.count(n0) > 0)
-                     RenderFormat(formats[n0]);
+                 if (n != StyleSheet::NONE)
+                     RenderFormat(n);
+                 else if (n0 != StyleSheet::NONE)
+                     RenderFormat(n0);
                  else
                  {
                      Render (l);
@@ -777,17 +888,18 @@ void Renderer::RenderBody(Tree *what)
              }   break;
              case BLOCK: {
                  Block *w  = what->AsBlock();
-                 text   n0 = "block ";
-                 text   n  = n0 + w->opening + " " + w->closing;
+                 int    n0 = style->blockDefault;
+                 int    n  = style->Find(style->block,
+                                         w->opening + " " + w->closing);
                  Tree *l  = w->child;
                  this->left = l;
                  this->right = w;
                  this->self = w->opening + w->closing;
                  this->priority = syntax.InfixPriority(w->opening);
-                 if (formats.count(n) > 0)
-                     RenderFormat(formats[n]);
-                 else if (formats.count(n0) > 0)
-                     RenderFormat (formats[n0]);
+                 if (n != StyleSheet::NONE)
+                     RenderFormat(n);
+                 else if (n0 != StyleSheet::NONE)
+                     RenderFormat (n0);
                  else
                  {
                      RenderFormat (w->opening, w->opening, "opening ");
@@ -389,7 +389,7 @@ Tree *xl_parse_text(text source)
 //   Generate a tree from text
 // ----------------------------------------------------------------------------
 {
-    std::istringstream input(source);
+    SourceBuffer input(source.data(), source.size());
     Parser parser(input, MAIN->syntax,MAIN->positions,*MAIN->errors, "<text>");
     return parser.Parse();
 }
@@ -46,7 +46,26 @@
 #include <ctype.h>
 #include <errno.h>
 #include <stdint.h>
+#include <string.h>
 #include <sstream>
+#include <chrono>
+#include <algorithm>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#ifndef CONFIG_MINGW
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif // CONFIG_MINGW
+
+
+RECORDER_TWEAK_DEFINE(scanner_mmap, 1, "Memory-map source files");
+RECORDER_TWEAK_DEFINE(scanner_stats, 0, "Show the scanning speed");
+RECORDER_TWEAK_DEFINE(scanner_simd, 1, "Use vector instructions to scan");
 
 
 XL_BEGIN
@@ -126,7 +145,162 @@ private:
     uint based_value[SIZE];
     uint base64_value[SIZE];
     const uint *value;
-} digits;
+};
+static thread_local DigitValue digits;
+
+
+
+// ============================================================================
+//
+//    Vectorized scanning kernels
+//
+// ============================================================================
+//   These kernels find the end of runs of characters in a source buffer.
+//   They process a vector of bytes at a time with AVX2 or SSE2, depending
+//   on the target the compiler generates code for, and finish byte by byte.
+
+#if defined(__AVX2__)
+struct Bytes
+// ----------------------------------------------------------------------------
+//   A vector of 32 bytes using AVX2
+// ----------------------------------------------------------------------------
+{
+    enum { SIZE = 32 };
+    enum : uint32_t { ALL = 0xFFFFFFFF };
+    __m256i v;
+
+    Bytes(__m256i v): v(v) {}
+    static Bytes Load(const char *p)
+    {
+        return _mm256_loadu_si256((const __m256i *) p);
+    }
+    static Bytes Splat(uchar c)         { return _mm256_set1_epi8(c); }
+    Bytes operator==(Bytes o) const     { return _mm256_cmpeq_epi8(v, o.v); }
+    Bytes operator|(Bytes o) const      { return _mm256_or_si256(v, o.v); }
+    Bytes Min(Bytes o) const            { return _mm256_min_epu8(v, o.v); }
+    Bytes operator-(Bytes o) const      { return _mm256_sub_epi8(v, o.v); }
+    uint32_t Mask() const      { return (uint32_t) _mm256_movemask_epi8(v); }
+};
+
+#elif defined(__SSE2__)
+struct Bytes
+// ----------------------------------------------------------------------------
+//   A vector of 16 bytes using SSE2
+// ----------------------------------------------------------------------------
+{
+    enum { SIZE = 16 };
+    enum : uint32_t { ALL = 0xFFFF };
+    __m128i v;
+
+    Bytes(__m128i v): v(v) {}
+    static Bytes Load(const char *p)
+    {
+        return _mm_loadu_si128((const __m128i *) p);
+    }
+    static Bytes Splat(uchar c)         { return _mm_set1_epi8(c); }
+    Bytes operator==(Bytes o) const     { return _mm_cmpeq_epi8(v, o.v); }
+    Bytes operator|(Bytes o) const      { return _mm_or_si128(v, o.v); }
+    Bytes Min(Bytes o) const            { return _mm_min_epu8(v, o.v); }
+    Bytes operator-(Bytes o) const      { return _mm_sub_epi8(v, o.v); }
+    uint32_t Mask() const      { return (uint32_t) _mm_movemask_epi8(v); }
+};
+#endif // __AVX2__ / __SSE2__
+
+
+#ifdef __SSE2__
+static inline Bytes InRange(Bytes x, uchar low, uchar high)
+// ----------------------------------------------------------------------------
+//   Select bytes between low and high included, as unsigned values
+// ----------------------------------------------------------------------------
+{
+    Bytes offset = x - Bytes::Splat(low);
+    return offset.Min(Bytes::Splat(high - low)) == offset;
+}
+#endif // __SSE2__
+
+
+static inline bool IsNameChar(char c)
+// ----------------------------------------------------------------------------
+//   Check if a character can continue a name
+// ----------------------------------------------------------------------------
+{
+    return isalnum(uchar(c)) || c == '_' || IS_UTF8_FIRST(c) || IS_UTF8_NEXT(c);
+}
+
+
+static const char *FindNameEnd(const char *p, const char *end)
+// ----------------------------------------------------------------------------
+//   Return the first character after a name (letters, digits, _ or UTF-8)
+// ----------------------------------------------------------------------------
+{
+#ifdef __SSE2__
+    if (RECORDER_TWEAK(scanner_simd))
+    {
+        while (end - p >= Bytes::SIZE)
+        {
+            Bytes x = Bytes::Load(p);
+            Bytes name = InRange(x | Bytes::Splat(0x20), 'a', 'z')
+                | InRange(x, '0', '9')
+                | (x == Bytes::Splat('_'))
+                | InRange(x, 0x80, 0xFD);
+            if (uint32_t mask = name.Mask() ^ Bytes::ALL)
+                return p + __builtin_ctz(mask);
+            p += Bytes::SIZE;
+        }
+    }
+#endif // __SSE2__
+    while (p < end && IsNameChar(*p))
+        p++;
+    return p;
+}
+
+
+static const char *SkipChar(const char *p, const char *end, char c)
+// ----------------------------------------------------------------------------
+//   Return the first character that is not c, e.g. at the end of spaces
+// ----------------------------------------------------------------------------
+{
+#ifdef __SSE2__
+    if (RECORDER_TWEAK(scanner_simd))
+    {
+        Bytes cv = Bytes::Splat(c);
+        while (end - p >= Bytes::SIZE)
+        {
+            if (uint32_t mask = (Bytes::Load(p) == cv).Mask() ^ Bytes::ALL)
+                return p + __builtin_ctz(mask);
+            p += Bytes::SIZE;
+        }
+    }
+#endif // __SSE2__
+    while (p < end && *p == c)
+        p++;
+    return p;
+}
+
+
+static const char *FindEither(const char *p, const char *end, char a, char b)
+// ----------------------------------------------------------------------------
+//   Return the first a or b character, e.g. closing quote or end of line
+// ----------------------------------------------------------------------------
+{
+#ifdef __SSE2__
+    if (RECORDER_TWEAK(scanner_simd))
+    {
+        Bytes av = Bytes::Splat(a);
+        Bytes bv = Bytes::Splat(b);
+        while (end - p >= Bytes::SIZE)
+        {
+            Bytes x = Bytes::Load(p);
+            if (uint32_t mask = ((x == av) | (x == bv)).Mask())
+                return p + __builtin_ctz(mask);
+            p += Bytes::SIZE;
+        }
+    }
+#endif // __SSE2__
+    while (p < end && *p != a && *p != b)
+        p++;
+    return p;
+}
 
 
 
@@ -136,12 +310,45 @@ private:
 //
 // ============================================================================
 
+double Scanner::Now()
+// ----------------------------------------------------------------------------
+//   Current time in seconds, used for scanning and parsing statistics
+// ----------------------------------------------------------------------------
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+
+static ulong StreamSize(std::istream &input)
+// ----------------------------------------------------------------------------
+//   Return the number of bytes left in a stream, 0 if it cannot seek
+// ----------------------------------------------------------------------------
+//   This lets the scanner reserve positions for a stream like for a buffer
+{
+    if (input.fail())
+        return 0;
+    std::streampos here = input.tellg();
+    if (here == std::streampos(-1))
+    {
+        input.clear();
+        return 0;
+    }
+    input.seekg(0, std::ios::end);
+    std::streampos end = input.tellg();
+    input.clear();
+    input.seekg(here);
+    return end > here ? ulong(end - here) : 0;
+}
+
+
 Scanner::Scanner(kstring name, Syntax &stx, Positions &pos, Errors &err)
 // ----------------------------------------------------------------------------
 //   Open the file and make sure it's readable
 // ----------------------------------------------------------------------------
     : syntax(stx),
-      input(*new utf8_ifstream(name)),
+      input(nullptr),
+      source(new SourceBuffer),
       tokenText(""),
       textValue(""), realValue(0.0), intValue(0), base(10),
       indents(), indent(0), indentChar(0),
@@ -149,21 +356,35 @@ Scanner::Scanner(kstring name, Syntax &stx, Positions &pos, Errors &err)
       positions(pos), errors(err),
       checkingIndent(false), settingIndent(false),
       hadSpaceBefore(false), hadSpaceAfter(false),
-      mustDeleteInput(true)
+      mustDeleteInput(true),
+      started(Now()), tokens(0)
 {
     indents.push_back(0);       // We start with an indent of 0
-    position = positions.OpenFile(name);
-    if (input.fail())
-        err.Log(Error("File $1 cannot be read: $2", position).
-                Arg(name).Arg(strerror(errno), ""));
+
+    // If we cannot map the file, read it as a stream
+    if (source->Map(name))
+    {
+        position = positions.OpenFile(name, source->Size());
+    }
+    else
+    {
+        delete source;
+        source = nullptr;
+        input = new utf8_ifstream(name);
+        int error = errno;
+        position = positions.OpenFile(name, StreamSize(*input));
+        if (input->fail())
+            err.Log(Error("File $1 cannot be read: $2", position).
+                    Arg(name).Arg(strerror(error), ""));
+    }
 
     // Skip UTF-8 BOM if present
-    if (input.get() != 0xEF)
-        input.unget();
-    else if (input.get() != 0xBB)
-        input.unget(), input.unget();
-    else if(input.get() != 0xBF)
-        input.unget(), input.unget(), input.unget();
+    if (Get() != 0xEF)
+        Unget();
+    else if (Get() != 0xBB)
+        Unget(), Unget();
+    else if(Get() != 0xBF)
+        Unget(), Unget(), Unget();
 }
 
 
@@ -174,7 +395,8 @@ Scanner::Scanner(std::istream &input,
 //   Open the file and make sure it's readable
 // ----------------------------------------------------------------------------
     : syntax(stx),
-      input(input),
+      input(&input),
+      source(nullptr),
       tokenText(""),
       textValue(""), realValue(0.0), intValue(0), base(10),
       indents(), indent(0), indentChar(0),
@@ -182,14 +404,40 @@ Scanner::Scanner(std::istream &input,
       positions(pos), errors(err),
       checkingIndent(false), settingIndent(false),
       hadSpaceBefore(false), hadSpaceAfter(false),
-      mustDeleteInput(false)
+      mustDeleteInput(false),
+      started(Now()), tokens(0)
 {
     indents.push_back(0);       // We start with an indent of 0
-    position = positions.OpenFile(fileName);
+    int error = errno;
+    position = positions.OpenFile(fileName, StreamSize(input));
     if (input.fail())
         err.Log(Error("Input stream $1 cannot be read: $2", position)
                 .Arg(fileName)
-                .Arg(strerror(errno)));
+                .Arg(strerror(error)));
+}
+
+
+Scanner::Scanner(SourceBuffer &source,
+                 Syntax &stx, Positions &pos, Errors &err,
+                 kstring fileName)
+// ----------------------------------------------------------------------------
+//   Scan a buffer given by the caller
+// ----------------------------------------------------------------------------
+    : syntax(stx),
+      input(nullptr),
+      source(&source),
+      tokenText(""),
+      textValue(""), realValue(0.0), intValue(0), base(10),
+      indents(), indent(0), indentChar(0),
+      position(0), lineStart(0),
+      positions(pos), errors(err),
+      checkingIndent(false), settingIndent(false),
+      hadSpaceBefore(false), hadSpaceAfter(false),
+      mustDeleteInput(false),
+      started(Now()), tokens(0)
+{
+    indents.push_back(0);       // We start with an indent of 0
+    position = positions.OpenFile(fileName, source.Size());
 }
 
 
@@ -199,6 +447,7 @@ Scanner::Scanner(const Scanner &parent)
 // ----------------------------------------------------------------------------
     : syntax(parent.syntax),
       input(parent.input),
+      source(parent.source),
       tokenText(""),
       textValue(""), realValue(0.0), intValue(0), base(10),
       indents(parent.indents),
@@ -209,7 +458,8 @@ Scanner::Scanner(const Scanner &parent)
       checkingIndent(false), settingIndent(false),
       hadSpaceBefore(parent.hadSpaceBefore),
       hadSpaceAfter(parent.hadSpaceAfter),
-      mustDeleteInput(false)
+      mustDeleteInput(false),
+      started(0.0), tokens(0)
 {}
 
 
@@ -218,12 +468,37 @@ Scanner::~Scanner()
 //   Scanner destructor closes the file
 // ----------------------------------------------------------------------------
 {
+    if (started && RECORDER_TWEAK(scanner_stats))
+        Statistics();
     if (mustDeleteInput)
-        delete &input;
+    {
+        delete input;
+        delete source;
+    }
     positions.CloseFile(position);
 }
 
 
+void Scanner::Statistics()
+// ----------------------------------------------------------------------------
+//   Report how fast the input was scanned
+// ----------------------------------------------------------------------------
+{
+    text  file;
+    ulong bytes = 0;
+    positions.GetFile(position, &file, &bytes);
+    double duration = Now() - started;
+    double speed = duration > 0 ? bytes / duration / 1e6 : 0.0;
+    ulong  rate = duration > 0 ? tokens / duration : 0;
+    std::cerr << "Scanned " << file << " from " << (source ? "memory":"stream")
+              << ", bytes scanned: " << bytes
+              << ", tokens scanned: " << tokens
+              << " in " << duration << "s, "
+              << speed << " MB/s, "
+              << rate << " tokens/s\n";
+}
+
+
 static inline char xlcase(char c)
 // ----------------------------------------------------------------------------
 //   Change the case following XL rules
@@ -241,7 +516,7 @@ static inline char xlcase(char c)
     do {                                        \
         tokenText += c;                         \
         textValue += c;                         \
-        c = input.get();                        \
+        c = Get();                        \
         position++;                             \
     } while(0)
 
@@ -250,7 +525,7 @@ static inline char xlcase(char c)
     do {                                        \
         tokenText += xlcase(c);                 \
         textValue += c;                         \
-        c = input.get();                        \
+        c = Get();                        \
         position++;                             \
     } while(0)
 
@@ -258,7 +533,7 @@ static inline char xlcase(char c)
 #define IGNORE_CHAR(c)                          \
     do {                                        \
         textValue += c;                         \
-        c = input.get();                        \
+        c = Get();                        \
         position++;                             \
     } while (0)
 
@@ -276,9 +551,10 @@ token_t Scanner::NextToken(bool hungry, bool binary)
     intValue = 0;
     realValue = 0.0;
     base = 0;
+    tokens++;
 
     // Check if input was opened correctly
-    if (!input.good())
+    if (!Good())
     {
         record(scanner, "End of file at position %lu", position);
         return tokEOF;
@@ -294,7 +570,7 @@ token_t Scanner::NextToken(bool hungry, bool binary)
     }
 
     // Read next character
-    int c = input.get();
+    int c = Get();
     position++;
 
     // Skip spaces and check indendation
@@ -321,17 +597,26 @@ token_t Scanner::NextToken(bool hungry, bool binary)
             }
         }
 
+        // Skip runs of spaces at once in a source buffer
+        if (source && c == ' ' && (!checkingIndent || indentChar == ' '))
+        {
+            const char *p = source->Cursor();
+            const char *q = SkipChar(p, source->End(), ' ');
+            position += q - p;
+            source->Seek(q);
+        }
+
         // Keep looking for more spaces
         if (c == '\n')
             textValue += c;
-        c = input.get();
+        c = Get();
         position++;
     } // End of space testing
 
     // Stop counting indentation
     if (checkingIndent)
     {
-        input.unget();
+        Unget();
         position--;
         checkingIndent = false;
         ulong column = position - lineStart;
@@ -390,7 +675,7 @@ token_t Scanner::NextToken(bool hungry, bool binary)
     }
 
     // Report end of input if that's what we've got
-    if (input.eof())
+    if (Eof())
     {
         record(scanner, "End of file after skipping at position %lu", position);
 	return tokEOF;
@@ -402,6 +687,14 @@ token_t Scanner::NextToken(bool hungry, bool binary)
     // Look for numbers
     if (isdigit(c))
     {
+        // Simple naturals can be taken directly from the source
+        if (source && ScanNumberSlice(c))
+        {
+            hadSpaceAfter = isspace(c);
+            record(scanner, "Natural %ld at position %lu", intValue, position);
+            return tokNATURAL;
+        }
+
         bool floating_point = false;
         bool basedNumber = false;
 
@@ -494,11 +787,11 @@ token_t Scanner::NextToken(bool hungry, bool binary)
         realValue = intValue;
         if (c == '.')
         {
-            int nextDigit = input.peek();
+            int nextDigit = Peek();
             if (digits[nextDigit] >= base)
             {
                 // This is something else following an natural: 1..3, 1.(3)
-                input.unget();
+                Unget();
                 position--;
                 hadSpaceAfter = false;
                 record(scanner, "Natural %ld ending in '.' at position %lu",
@@ -581,7 +874,7 @@ token_t Scanner::NextToken(bool hungry, bool binary)
         }
 
         // Return the token
-        input.unget();
+        Unget();
         position--;
         hadSpaceAfter = isspace(c);
         if (floating_point)
@@ -596,15 +889,22 @@ token_t Scanner::NextToken(bool hungry, bool binary)
     // Look for names
     else if (IS_UTF8_OR_ALPHA(c))
     {
-        while (isalnum(c) || c == '_' || IS_UTF8_FIRST(c) || IS_UTF8_NEXT(c))
+        if (source)
         {
-            if (c == '_')
-                IGNORE_CHAR(c);
-            else
-                NEXT_LOWER_CHAR(c);
+            ScanNameSlice(c);
+        }
+        else
+        {
+            while (isalnum(c) || c == '_' || IS_UTF8_FIRST(c) || IS_UTF8_NEXT(c))
+            {
+                if (c == '_')
+                    IGNORE_CHAR(c);
+                else
+                    NEXT_LOWER_CHAR(c);
+            }
+            Unget();
+            position--;
         }
-        input.unget();
-        position--;
         hadSpaceAfter = isspace(c);
         if (syntax.IsBlock(textValue, endMarker))
         {
@@ -630,8 +930,15 @@ token_t Scanner::NextToken(bool hungry, bool binary)
     else if (c == '"' || c == '\'')
     {
         char eos = c;
+        if (source && !binary && ScanTextSlice(c))
+        {
+            hadSpaceAfter = isspace(c);
+            record(scanner, "Text %s at position %lu",
+                   tokenText.c_str(), position);
+            return eos == '"' ? tokTEXT : tokQUOTE;
+        }
         tokenText = c;
-        c = input.get();
+        c = Get();
         position++;
         for(;;)
         {
@@ -639,11 +946,11 @@ token_t Scanner::NextToken(bool hungry, bool binary)
             if (c == eos)
             {
                 tokenText += c;
-                c = input.get();
+                c = Get();
                 position++;
                 if (c != eos)
                 {
-                    input.unget();
+                    Unget();
                     position--;
                     hadSpaceAfter = isspace(c);
                     record(scanner, "Text %s at position %lu",
@@ -677,7 +984,7 @@ token_t Scanner::NextToken(bool hungry, bool binary)
                 hadSpaceAfter = false;
                 if (c == '\n')
                 {
-                    input.unget();
+                    Unget();
                     position--;
                 }
                 record(scanner, "Truncated text %s at position %lu",
@@ -713,7 +1020,7 @@ token_t Scanner::NextToken(bool hungry, bool binary)
     }
     if (hadChar)
     {
-        input.unget();
+        Unget();
         position--;
     }
     else
@@ -727,7 +1034,7 @@ token_t Scanner::NextToken(bool hungry, bool binary)
         {
             tokenText.erase(tokenText.length() - 1, 1);
             textValue.erase(textValue.length() - 1, 1);
-            input.unget();
+            Unget();
             position--;
         }
     }
@@ -745,6 +1052,83 @@ token_t Scanner::NextToken(bool hungry, bool binary)
 }
 
 
+void Scanner::ScanNameSlice(int &c)
+// ----------------------------------------------------------------------------
+//   Scan a name directly in the source buffer
+// ----------------------------------------------------------------------------
+//   On entry, c is the first character of the name, which was already read.
+//   This is equivalent to the NEXT_LOWER_CHAR / IGNORE_CHAR loop: the name
+//   is copied only once, and only stripped or lowered if necessary
+{
+    const char *first = source->Cursor() - 1;
+    const char *p = FindNameEnd(first, source->End());
+
+    textValue.assign(first, p - first);
+    if (Opt::caseSensitive && !memchr(first, '_', p - first))
+    {
+        tokenText = textValue;
+    }
+    else
+    {
+        tokenText.reserve(p - first);
+        for (const char *q = first; q < p; q++)
+            if (*q != '_')
+                tokenText += xlcase(*q);
+    }
+    position += p - first - 1;
+    c = source->Skip(p);
+}
+
+
+bool Scanner::ScanNumberSlice(int &c)
+// ----------------------------------------------------------------------------
+//   Scan a decimal natural directly in the source buffer
+// ----------------------------------------------------------------------------
+//   Return false and leave the input untouched for anything that is not
+//   a sequence of decimal digits, e.g. 16#FF, 1_000, 1.5 or 1E3
+{
+    const char *first = source->Cursor() - 1;
+    const char *last = source->End();
+    const char *p = first;
+    ulong value = 0;
+    while (p < last && isdigit(uchar(*p)))
+        value = 10 * value + (*p++ - '0');
+    if (p < last && (*p == '_' || *p == '#' || *p == '.' ||
+                     *p == 'e' || *p == 'E'))
+        return false;
+
+    base = 10;
+    intValue = value;
+    realValue = value;
+    textValue.assign(first, p - first);
+    tokenText = textValue;
+    position += p - first - 1;
+    c = source->Skip(p);
+    return true;
+}
+
+
+bool Scanner::ScanTextSlice(int &c)
+// ----------------------------------------------------------------------------
+//   Scan a text without doubled quotes directly in the source buffer
+// ----------------------------------------------------------------------------
+//   On entry, c is the opening quote. Return false and leave the input
+//   untouched for texts with embedded quotes and for truncated texts
+{
+    const char *first = source->Cursor();
+    const char *last = source->End();
+    const char *p = FindEither(first, last, c, '\n');
+    if (p >= last || *p != c || (p + 1 < last && p[1] == c))
+        return false;
+
+    textValue.assign(first, p - first);
+    tokenText.assign(first - 1, p - first + 2);
+    position += p - first + 1;
+    c = source->Skip(p + 1);
+    return true;
+}
+
+
 text Scanner::Comment(text EOC, bool stripIndent)
 // ----------------------------------------------------------------------------
 //   Keep adding characters until end of comment is found (and consumed)
@@ -759,7 +1143,17 @@ text Scanner::Comment(text EOC, bool stripIndent)
 
     while (*match && c != EOF)
     {
-        c = input.get();
+        // In a source buffer, copy what cannot end the comment at once
+        if (source && match == eoc && !checkingIndent)
+        {
+            const char *p = source->Cursor();
+            const char *q = FindEither(p, source->End(), *eoc, '\n');
+            comment.append(p, q - p);
+            position += q - p;
+            source->Seek(q);
+        }
+
+        c = Get();
         position++;
         skip = false;
 
@@ -837,19 +1231,114 @@ void Scanner::CloseParen(uint oldIndent)
 
 
 
+// ============================================================================
+//
+//    Class SourceBuffer
+//
+// ============================================================================
+
+SourceBuffer::SourceBuffer()
+// ----------------------------------------------------------------------------
+//   Create an empty source, to be filled by Map()
+// ----------------------------------------------------------------------------
+    : start(""), end(start), cursor(start), state(GOOD), mapped(0)
+{}
+
+
+SourceBuffer::SourceBuffer(const char *data, size_t size)
+// ----------------------------------------------------------------------------
+//   Scan memory owned by the caller, which must outlive the scanner
+// ----------------------------------------------------------------------------
+    : start(data), end(data + size), cursor(data), state(GOOD), mapped(0)
+{}
+
+
+SourceBuffer::~SourceBuffer()
+// ----------------------------------------------------------------------------
+//   Release the mapping if there is one
+// ----------------------------------------------------------------------------
+{
+    Unmap();
+}
+
+
+bool SourceBuffer::Map(kstring fileName)
+// ----------------------------------------------------------------------------
+//   Memory-map a regular file, return false if it must be read as a stream
+// ----------------------------------------------------------------------------
+{
+    Unmap();
+    if (!RECORDER_TWEAK(scanner_mmap))
+        return false;
+
+#ifndef CONFIG_MINGW
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    if (ok && st.st_size > 0)
+    {
+        void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            ok = false;
+        }
+        else
+        {
+            mapped = st.st_size;
+            start = cursor = (const char *) data;
+            end = start + mapped;
+            madvise(data, mapped, MADV_SEQUENTIAL);
+        }
+    }
+    close(fd);
+    record(scanner, "Mapped %s size %lu: %+s",
+           fileName, (ulong) mapped, ok ? "ok" : "failed");
+    return ok;
+#else // CONFIG_MINGW
+    return false;
+#endif // CONFIG_MINGW
+}
+
+
+void SourceBuffer::Unmap()
+// ----------------------------------------------------------------------------
+//   Release a mapped file
+// ----------------------------------------------------------------------------
+{
+#ifndef CONFIG_MINGW
+    if (mapped)
+        munmap((void *) start, mapped);
+#endif // CONFIG_MINGW
+    start = end = cursor = "";
+    state = GOOD;
+    mapped = 0;
+}
+
+
+
 // ============================================================================
 //
 //    Class Positions
 //
 // ============================================================================
 
-ulong Positions::OpenFile(text name)
+ulong Positions::OpenFile(text name, ulong size)
 // ----------------------------------------------------------------------------
-//    Open a new file
+//    Open a new file, reserving its positions if its size is known
 // ----------------------------------------------------------------------------
+//    Reserving positions lets other files be opened while this one is
+//    scanned, e.g. when parsing files in parallel. The scanner may count
+//    one position past the end of input, hence the extra room.
 {
-    positions.push_back(Range(current_position, name));
-    return current_position;
+    std::lock_guard<std::mutex> guard(lock);
+    ulong start = current_position;
+    positions.push_back(Range(start, name));
+    if (size)
+        current_position = start + size + 2;
+    return start;
 }
 
 
@@ -858,7 +1347,26 @@ void Positions::CloseFile (ulong pos)
 //    Remember the end position for a file
 // ----------------------------------------------------------------------------
 {
-    current_position = pos;
+    std::lock_guard<std::mutex> guard(lock);
+    if (current_position < pos)
+        current_position = pos;
+}
+
+
+Positions::Range *Positions::Find(ulong pos)
+// ----------------------------------------------------------------------------
+//    Find the file containing a position, called with the lock held
+// ----------------------------------------------------------------------------
+//    Files are opened in increasing position order, so we can bisect
+{
+    auto after = std::upper_bound(positions.begin(), positions.end(), pos,
+                                  [](ulong pos, const Range &range)
+                                  {
+                                      return pos < range.start;
+                                  });
+    if (after == positions.begin())
+        return nullptr;
+    return &*--after;
 }
 
 
@@ -867,17 +1375,13 @@ void Positions::GetFile(ulong pos, text *file, ulong *offset)
 //    Return the file and the offset in the file
 // ----------------------------------------------------------------------------
 {
-    std::vector<Range>::iterator i;
-    for (i = positions.begin(); i != positions.end(); i++)
-        if (pos < (*i).start)
-            break;
-    if (i != positions.begin())
+    std::lock_guard<std::mutex> guard(lock);
+    if (Range *range = Find(pos))
     {
-        i--;
         if (file)
-            *file = (*i).file;
+            *file = range->file;
         if (offset)
-            *offset = pos - (*i).start;
+            *offset = pos - range->start;
     }
     else
     {
@@ -889,56 +1393,72 @@ void Positions::GetFile(ulong pos, text *file, ulong *offset)
 }
 
 
+void Positions::Range::Load()
+// ----------------------------------------------------------------------------
+//    Read the file once, and record where its lines start
+// ----------------------------------------------------------------------------
+{
+    loaded = true;
+    lines.push_back(0);
+    if (FILE *f = fopen(file.c_str(), "r"))
+    {
+        char buffer[16384];
+        size_t size;
+        while ((size = fread(buffer, 1, sizeof(buffer), f)) > 0)
+            source.append(buffer, size);
+        fclose(f);
+    }
+
+    const char *base = source.data();
+    const char *end = base + source.size();
+    for (const char *p = base; p < end; p++)
+    {
+        p = (const char *) memchr(p, '\n', end - p);
+        if (!p)
+            break;
+        lines.push_back(p + 1 - base);
+    }
+}
+
+
 void Positions::GetInfo(ulong pos, text *out_file, ulong *out_line,
                         ulong *out_column, text *out_source)
 // ----------------------------------------------------------------------------
-//   Scan the input files to find the location of the error
+//   Find the file, line, column and source line for a position
 // ----------------------------------------------------------------------------
+//   The first query for a file reads it and indexes the start of its lines.
+//   Other queries for the same file bisect that index.
 {
-    ulong  offset = 0;
     ulong  line   = 1;
     ulong  column = 0;
     text   source = "";
-    text   name = "";
-    FILE  *file;
-    char   c;
+    text   name   = "";
 
-    GetFile (pos, &name, &offset);
-    if (name != "")
+    std::lock_guard<std::mutex> guard(lock);
+    Range *range = Find(pos);
+    if (range)
+        name = range->file;
+    if (range && name != "")
     {
-        file = fopen(name.c_str(), "r");
-        if (file)
-        {
-            while (!feof(file))
-            {
-                c = fgetc(file);
-                if (c == EOF)
-                    break;
-                if (c == '\n')
-                {
-                    line++;
-                    column = 0;
-                    source = "";
-                }
-                else
-                {
-                    column++;
-                    source += c;
-                }
-                offset--;
-                if (offset <= 1)
-                    break;
-            }
+        if (!range->loaded)
+            range->Load();
 
-            // Read rest of line
-            while(!feof(file))
-            {
-                c = fgetc(file);
-                if (c == '\n' || c == EOF)
-                    break;
-                source += c;
-            }
-            fclose(file);
+        // Count characters before the position the way the scanner does
+        ulong offset = pos - range->start;
+        ulong size = range->source.size();
+        ulong scanned = offset > 1 ? offset - 1 : offset ? 1 : size;
+        if (scanned > size)
+            scanned = size;
+
+        if (size)
+        {
+            std::vector<ulong> &lines = range->lines;
+            auto next = std::upper_bound(lines.begin(), lines.end(), scanned);
+            line = next - lines.begin();
+            ulong start = lines[line - 1];
+            ulong end = next == lines.end() ? size : *next - 1;
+            column = scanned - start;
+            source = range->source.substr(start, end - start);
         }
     }
 
@@ -89,14 +89,18 @@ union ieee754_double
 //
 // ============================================================================
 
-Serializer::Serializer(std::ostream &out)
+Serializer::Serializer(std::ostream &out, TreePosition base)
 // ----------------------------------------------------------------------------
 //   Constructor sends the magic and version number
 // ----------------------------------------------------------------------------
-    : out (out)
+//   If a base position is given, the position of each tree relative to it
+//   is written after its tag, so that a file parsed once can be read back
+//   with its positions, e.g. for error messages. Positions are written as
+//   a difference from the previous one, which is usually small
+    : out (out), base(base), last(0)
 {
     WriteUnsigned(serialMAGIC);
-    WriteUnsigned(serialVERSION);
+    WriteUnsigned(base == Tree::NOWHERE ? serialVERSION : serialPOSITIONS);
 }
 
 
@@ -117,6 +121,7 @@ Tree *Serializer::Do(Natural *what)
 // ----------------------------------------------------------------------------
 {
     WriteUnsigned(serialNATURAL);
+    WritePosition(what);
     WriteSigned(what->value);
     return what;
 }
@@ -128,6 +133,7 @@ Tree *Serializer::Do(Real *what)
 // ----------------------------------------------------------------------------
 {
     WriteUnsigned(serialREAL);
+    WritePosition(what);
     WriteReal(what->value);
     return what;
 }
@@ -139,6 +145,7 @@ Tree *Serializer::Do(Text *what)
 // ----------------------------------------------------------------------------
 {
     WriteUnsigned(serialTEXT);
+    WritePosition(what);
     WriteText(what->opening);
     WriteText(what->value);
     WriteText(what->closing);
@@ -152,6 +159,7 @@ Tree *Serializer::Do(Name *what)
 // ----------------------------------------------------------------------------
 {
     WriteUnsigned(serialNAME);
+    WritePosition(what);
     WriteText(what->value);
     return what;
 }
@@ -163,6 +171,7 @@ Tree *Serializer::Do(Prefix *what)
 // ----------------------------------------------------------------------------
 {
     WriteUnsigned(serialPREFIX);
+    WritePosition(what);
     WriteChild(what->left);
     WriteChild(what->right);
     return what;
@@ -175,6 +184,7 @@ Tree *Serializer::Do(Postfix *what)
 // ----------------------------------------------------------------------------
 {
     WriteUnsigned(serialPOSTFIX);
+    WritePosition(what);
     WriteChild(what->left);
     WriteChild(what->right);
     return what;
@@ -185,11 +195,21 @@ Tree *Serializer::Do(Infix *what)
 // ----------------------------------------------------------------------------
 //   Serialize an infix tree
 // ----------------------------------------------------------------------------
+//   Long sequences of statements are right-recursive infix trees,
+//   so we loop on the right child instead of recursing
 {
-    WriteUnsigned(serialINFIX);
-    WriteChild(what->left);
-    WriteText(what->name);
-    WriteChild(what->right);
+    Infix *infix = what;
+    Tree  *right = infix;
+    while (infix)
+    {
+        WriteUnsigned(serialINFIX);
+        WritePosition(infix);
+        WriteChild(infix->left);
+        WriteText(infix->name);
+        right = infix->right;
+        infix = right ? right->AsInfix() : nullptr;
+    }
+    WriteChild(right);
     return what;
 }
 
@@ -200,6 +220,7 @@ Tree *Serializer::Do(Block *what)
 // ----------------------------------------------------------------------------
 {
     WriteUnsigned(serialBLOCK);
+    WritePosition(what);
     WriteText(what->opening);
     WriteChild(what->child);
     WriteText(what->closing);
@@ -219,7 +240,7 @@ void Serializer::WriteSigned(longlong value)
         value >>= 7;
         if ((value != 0 && value != -1) || (value & 0x40) != (b & 0x40))
             b |= 0x80;
-        out << b;
+        out.put(b);
     } while (b & 0x80);
 }
 
@@ -236,7 +257,7 @@ void Serializer::WriteUnsigned(ulonglong value)
         value >>= 7;
         if (value != 0)
             b |= 0x80;
-        out << b;
+        out.put(b);
     } while (b & 0x80);
 }
 
@@ -258,14 +279,14 @@ void Serializer::WriteReal(double value)
 }
 
 
-void Serializer::WriteText(text value)
+void Serializer::WriteText(const text &value)
 // ----------------------------------------------------------------------------
 //   Write the length followed by data bytes
 // ----------------------------------------------------------------------------
 {
     // texts[value] is created with value 0 if not existing,
     // and then it increases texts.size by 1.
-    longlong exists = texts[value];
+    longlong &exists = texts[value];
     if (exists)
     {
         WriteSigned(-exists);
@@ -274,11 +295,27 @@ void Serializer::WriteText(text value)
     {
         WriteSigned(value.length());
         out.write(value.data(), value.length());
-        texts[value] = texts.size();
+        exists = texts.size();
     }
 }
 
 
+void Serializer::WritePosition(Tree *what)
+// ----------------------------------------------------------------------------
+//   Write the position of a tree relative to the base, 0 if unknown
+// ----------------------------------------------------------------------------
+{
+    if (base == Tree::NOWHERE)
+        return;
+    TreePosition pos = what->Position();
+    longlong offset = 0;
+    if (pos != Tree::NOWHERE && pos >= base)
+        offset = pos - base + 1;
+    WriteSigned(offset - last);
+    last = offset;
+}
+
+
 void Serializer::WriteChild(Tree *child)
 // ----------------------------------------------------------------------------
 //   Serialie a child, either NULL or actual child
@@ -302,10 +339,13 @@ Deserializer::Deserializer(std::istream &in, TreePosition pos)
 // ----------------------------------------------------------------------------
 //   Read a few bytes from the stream, check version and magic value
 // ----------------------------------------------------------------------------
-    : in(in), pos(pos)
+    : in(in), pos(pos), positions(false), last(0)
 {
-    if (ReadUnsigned() != serialMAGIC ||
-        ReadUnsigned() != serialVERSION)
+    ulonglong version = 0;
+    if (ReadUnsigned() == serialMAGIC)
+        version = ReadUnsigned();
+    positions = version == serialPOSITIONS;
+    if (version != serialVERSION && !positions)
     {
         // Error on input: close the stream
         in.setstate(in.failbit);
@@ -324,12 +364,8 @@ Tree *Deserializer::ReadTree()
 // ----------------------------------------------------------------------------
 //   Read back data from input stream and build tree from it
 // ----------------------------------------------------------------------------
+//   The right child of an infix is read in the same loop, see Serializer
 {
-    // If it's bad to start with, stop reading further...
-    if (!in.good())
-        return nullptr;
-
-    SerializationTag tag = SerializationTag(ReadUnsigned());
     text             tvalue, opening, closing;
     longlong         ivalue;
     double           rvalue;
@@ -337,60 +373,81 @@ Tree *Deserializer::ReadTree()
     Tree *           right;
     Tree *           child;
     Tree *           result = nullptr;
+    Infix *          first = nullptr;
+    Infix *          last = nullptr;
 
-    switch(tag)
+    // If it's bad to start with, stop reading further...
+    while (in.good())
     {
-    case serialNULL:
-        result = nullptr;
-        break;
-
-    case serialNATURAL:
-        ivalue = ReadSigned();
-        result = new Natural(ivalue, pos);
-        break;
-    case serialREAL:
-        rvalue = ReadReal();
-        result = new Real(rvalue, pos);
-        break;
-    case serialTEXT:
-        opening = ReadText();
-        tvalue = ReadText();
-        closing = ReadText();
-        result = new Text(tvalue, opening, closing, pos);
-        break;
-    case serialNAME:
-        tvalue = ReadText();
-        result = new Name(tvalue, pos);
-        break;
-
-    case serialBLOCK:
-        opening = ReadText();
-        child = ReadTree();
-        closing = ReadText();
-        result = new Block(child, opening, closing, pos);
-        break;
-    case serialINFIX:
-        left = ReadTree();
-        tvalue = ReadText();
-        right = ReadTree();
-        result = new Infix(tvalue, left, right, pos);
-        break;
-    case serialPREFIX:
-        left = ReadTree();
-        right = ReadTree();
-        result = new Prefix(left, right, pos);
-        break;
-    case serialPOSTFIX:
-        left = ReadTree();
-        right = ReadTree();
-        result = new Postfix(left, right, pos);
+        SerializationTag tag = SerializationTag(ReadUnsigned());
+        TreePosition     at = pos;
+        if (positions && tag > serialNULL && tag < serialINVALID)
+            at = ReadPosition();
+
+        switch(tag)
+        {
+        case serialNULL:
+            result = nullptr;
+            break;
+
+        case serialNATURAL:
+            ivalue = ReadSigned();
+            result = new Natural(ivalue, at);
+            break;
+        case serialREAL:
+            rvalue = ReadReal();
+            result = new Real(rvalue, at);
+            break;
+        case serialTEXT:
+            opening = ReadText();
+            tvalue = ReadText();
+            closing = ReadText();
+            result = new Text(tvalue, opening, closing, at);
+            break;
+        case serialNAME:
+            tvalue = ReadText();
+            result = new Name(tvalue, at);
+            break;
+
+        case serialBLOCK:
+            opening = ReadText();
+            child = ReadTree();
+            closing = ReadText();
+            result = new Block(child, opening, closing, at);
+            break;
+        case serialINFIX:
+        {
+            left = ReadTree();
+            tvalue = ReadText();
+            Infix *infix = new Infix(tvalue, left, nullptr, at);
+            if (last)
+                last->right = infix;
+            else
+                first = infix;
+            last = infix;
+            continue;
+        }
+        case serialPREFIX:
+            left = ReadTree();
+            right = ReadTree();
+            result = new Prefix(left, right, at);
+            break;
+        case serialPOSTFIX:
+            left = ReadTree();
+            right = ReadTree();
+            result = new Postfix(left, right, at);
+            break;
+
+        default:
+            in.setstate(in.failbit);
+        }
         break;
-
-    default:
-        in.setstate(in.failbit);
     }
 
-    return result;
+    if (!last)
+        return result;
+    last->right = result;
+    return first;
 }
 
 
@@ -479,6 +536,19 @@ double Deserializer::ReadReal()
 }
 
 
+TreePosition Deserializer::ReadPosition()
+// ----------------------------------------------------------------------------
+//   Read a position relative to the base position, NOWHERE if unknown
+// ----------------------------------------------------------------------------
+{
+    longlong offset = last + ReadSigned();
+    last = offset;
+    if (offset <= 0 || pos == Tree::NOWHERE)
+        return Tree::NOWHERE;
+    return pos + offset - 1;
+}
+
+
 text Deserializer::ReadText()
 // ----------------------------------------------------------------------------
 //   Read a text from the input stream
@@ -492,16 +562,25 @@ text Deserializer::ReadText()
 
     if (length < 0)
     {
-        result = texts[-length];
+        if (ulonglong(-length) <= texts.size())
+            result = texts[-length - 1];
+        else
+            in.setstate(in.failbit);
     }
     else
     {
-        char *    buffer = new char[length];
-        in.read(buffer, length);
-        result.insert(0, buffer, length);
-        delete[] buffer;
-
-        texts[texts.size()+1] = result;
+        // Read in chunks, so that a bad length fails on end of input
+        // rather than while allocating the text
+        char buffer[4096];
+        while (length > 0 && in.good())
+        {
+            size_t chunk = length < longlong(sizeof(buffer))
+                ? size_t(length) : sizeof(buffer);
+            in.read(buffer, chunk);
+            result.append(buffer, in.gcount());
+            length -= chunk;
+        }
+        texts.push_back(result);
     }
 
     return result;
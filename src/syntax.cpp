@@ -70,7 +70,8 @@ Syntax::Syntax(const Syntax &other)
       priority(other.priority),
       default_priority(other.default_priority),
       statement_priority(other.statement_priority),
-      function_priority(other.function_priority)
+      function_priority(other.function_priority),
+      entries(), mask(0), compiled(false)
 {
     for (subsyntax_table::iterator i=subsyntax.begin();i!=subsyntax.end();i++)
         (*i).second = new ChildSyntax(*(*i).second);
@@ -87,17 +88,118 @@ Syntax::~Syntax()
 }
 
 
-int Syntax::InfixPriority(text n)
+static inline uint hashName(const text &n)
 // ----------------------------------------------------------------------------
-//   Return infix priority, which is either this or parent's
+//   FNV-1a hash of a token for the compiled syntax table
+// ----------------------------------------------------------------------------
+{
+    uint h = 2166136261U;
+    for (char c : n)
+        h = (h ^ (unsigned char) c) * 16777619U;
+    return h;
+}
+
+
+Syntax::Entry *Syntax::Insert(const text &n)
+// ----------------------------------------------------------------------------
+//   Find or create the entry for a token in the compiled table
+// ----------------------------------------------------------------------------
+{
+    uint h = hashName(n) & mask;
+    while (entries[h].used && entries[h].name != n)
+        h = (h + 1) & mask;
+    Entry &entry = entries[h];
+    if (!entry.used)
+    {
+        entry.used = true;
+        entry.name = n;
+    }
+    return &entry;
+}
+
+
+void Syntax::Compile()
 // ----------------------------------------------------------------------------
+//   Compile all the syntax tables in a single open-addressing hash table
+// ----------------------------------------------------------------------------
+//   The parser and scanner look up nearly every token they see, and one
+//   probe is much faster than several lookups in maps.
+//   The table is rebuilt on the first lookup after the syntax changes.
 {
-    if (infix_priority.count(n))
+    size_t count = infix_priority.size() + prefix_priority.size()
+        + postfix_priority.size() + comment_delimiters.size()
+        + text_delimiters.size() + block_delimiters.size()
+        + subsyntax_file.size() + known_tokens.size()
+        + known_prefixes.size() + known_binary_prefixes.size();
+    uint size = 16;
+    while (size < 2 * count)
+        size <<= 1;
+    entries.assign(size, Entry());
+    mask = size - 1;
+
+    for (auto &i : infix_priority)
+        Insert(i.first)->infix = i.second;
+    for (auto &p : prefix_priority)
+        Insert(p.first)->prefix = p.second;
+    for (auto &p : postfix_priority)
+        Insert(p.first)->postfix = p.second;
+    for (auto &t : known_tokens)
+        Insert(t)->flags |= KNOWN_TOKEN;
+    for (auto &t : known_prefixes)
+        Insert(t)->flags |= KNOWN_PREFIX;
+    for (auto &t : known_binary_prefixes)
+        Insert(t)->flags |= KNOWN_BINARY;
+    for (auto &d : comment_delimiters)
+    {
+        Entry *entry = Insert(d.first);
+        entry->flags |= COMMENT;
+        entry->comment = d.second;
+    }
+    for (auto &d : text_delimiters)
     {
-        int p = infix_priority[n];
-        if (p)
-            return p;
+        Entry *entry = Insert(d.first);
+        entry->flags |= TEXT_DELIMITER;
+        entry->textEnd = d.second;
     }
+    for (auto &d : block_delimiters)
+    {
+        Entry *entry = Insert(d.first);
+        entry->flags |= BLOCK;
+        entry->block = d.second;
+    }
+    for (auto &d : subsyntax_file)
+        Insert(d.first)->flags |= SPECIAL;
+
+    compiled = true;
+}
+
+
+const Syntax::Entry *Syntax::Find(const text &n)
+// ----------------------------------------------------------------------------
+//   Find the compiled entry for a token, compiling the table if needed
+// ----------------------------------------------------------------------------
+{
+    if (!compiled)
+        Compile();
+    uint h = hashName(n) & mask;
+    while (entries[h].used)
+    {
+        if (entries[h].name == n)
+            return &entries[h];
+        h = (h + 1) & mask;
+    }
+    return nullptr;
+}
+
+
+int Syntax::InfixPriority(const text &n)
+// ----------------------------------------------------------------------------
+//   Return infix priority, which is either this or parent's
+// ----------------------------------------------------------------------------
+{
+    const Entry *entry = Find(n);
+    if (entry && entry->infix)
+        return entry->infix;
     return default_priority;
 }
 
@@ -108,21 +210,21 @@ void Syntax::SetInfixPriority(text n, int p)
 // ----------------------------------------------------------------------------
 {
     if (p)
+    {
         infix_priority[n] = p;
+        compiled = false;
+    }
 }
 
 
-int Syntax::PrefixPriority(text n)
+int Syntax::PrefixPriority(const text &n)
 // ----------------------------------------------------------------------------
 //   Return prefix priority, which is either this or parent's
 // ----------------------------------------------------------------------------
 {
-    if (prefix_priority.count(n))
-    {
-        int p = prefix_priority[n];
-        if (p)
-            return p;
-    }
+    const Entry *entry = Find(n);
+    if (entry && entry->prefix)
+        return entry->prefix;
     return default_priority;
 }
 
@@ -133,21 +235,21 @@ void Syntax::SetPrefixPriority(text n, int p)
 // ----------------------------------------------------------------------------
 {
     if (p)
+    {
         prefix_priority[n] = p;
+        compiled = false;
+    }
 }
 
 
-int Syntax::PostfixPriority(text n)
+int Syntax::PostfixPriority(const text &n)
 // ----------------------------------------------------------------------------
 //   Return postfix priority, which is either this or parent's
 // ----------------------------------------------------------------------------
 {
-    if (postfix_priority.count(n))
-    {
-        int p = postfix_priority[n];
-        if (p)
-            return p;
-    }
+    const Entry *entry = Find(n);
+    if (entry && entry->postfix)
+        return entry->postfix;
     return default_priority;
 }
 
@@ -158,34 +260,40 @@ void Syntax::SetPostfixPriority(text n, int p)
 // ----------------------------------------------------------------------------
 {
     if (p)
+    {
         postfix_priority[n] = p;
+        compiled = false;
+    }
 }
 
 
-bool Syntax::KnownToken(text n)
+bool Syntax::KnownToken(const text &n)
 // ----------------------------------------------------------------------------
 //   Check if the given symbol is known in any of the priority tables
 // ----------------------------------------------------------------------------
 {
-    return known_tokens.count(n) > 0;
+    const Entry *entry = Find(n);
+    return entry && (entry->flags & KNOWN_TOKEN);
 }
 
 
-bool Syntax::KnownPrefix(text n)
+bool Syntax::KnownPrefix(const text &n)
 // ----------------------------------------------------------------------------
 //   Check if the given symbol is a known prefix to a possible token
 // ----------------------------------------------------------------------------
 {
-    return known_prefixes.count(n) > 0;
+    const Entry *entry = Find(n);
+    return entry && (entry->flags & KNOWN_PREFIX);
 }
 
 
-bool Syntax::KnownBinary(text n)
+bool Syntax::KnownBinary(const text &n)
 // ----------------------------------------------------------------------------
 //   Check if the given symbol is a known binary prefix (e.g. "bits")
 // ----------------------------------------------------------------------------
 {
-    return known_binary_prefixes.count(n) > 0;
+    const Entry *entry = Find(n);
+    return entry && (entry->flags & KNOWN_BINARY);
 }
 
 
@@ -195,6 +303,7 @@ void Syntax::CommentDelimiter(text Begin, text End)
 // ----------------------------------------------------------------------------
 {
     comment_delimiters[Begin] = End;
+    compiled = false;
 }
 
 
@@ -204,6 +313,7 @@ void Syntax::TextDelimiter(text Begin, text End)
 // ----------------------------------------------------------------------------
 {
     text_delimiters[Begin] = End;
+    compiled = false;
 }
 
 
@@ -213,48 +323,49 @@ void Syntax::BlockDelimiter(text Begin, text End)
 // ----------------------------------------------------------------------------
 {
     block_delimiters[Begin] = End;
+    compiled = false;
 }
 
 
-bool Syntax::IsComment(text Begin, text &End)
+bool Syntax::IsComment(const text &Begin, text &End)
 // ----------------------------------------------------------------------------
 //   Check if something is in the comments table
 // ----------------------------------------------------------------------------
 {
-    delimiter_table::iterator found = comment_delimiters.find(Begin);
-    if (found != comment_delimiters.end())
+    const Entry *entry = Find(Begin);
+    if (entry && (entry->flags & COMMENT))
     {
-        End = found->second;
+        End = entry->comment;
         return true;
     }
     return false;
 }
 
 
-bool Syntax::IsTextDelimiter(text Begin, text &End)
+bool Syntax::IsTextDelimiter(const text &Begin, text &End)
 // ----------------------------------------------------------------------------
 //    Check if something is in the text delimiters table
 // ----------------------------------------------------------------------------
 {
-    delimiter_table::iterator found = text_delimiters.find(Begin);
-    if (found != text_delimiters.end())
+    const Entry *entry = Find(Begin);
+    if (entry && (entry->flags & TEXT_DELIMITER))
     {
-        End = found->second;
+        End = entry->textEnd;
         return true;
     }
     return false;
 }
 
 
-bool Syntax::IsBlock(text Begin, text &End)
+bool Syntax::IsBlock(const text &Begin, text &End)
 // ----------------------------------------------------------------------------
 //   Return true if we are looking at a block
 // ----------------------------------------------------------------------------
 {
-    delimiter_table::iterator found = block_delimiters.find(Begin);
-    if (found != block_delimiters.end())
+    const Entry *entry = Find(Begin);
+    if (entry && (entry->flags & BLOCK))
     {
-        End = found->second;
+        End = entry->block;
         return true;
     }
     return false;
@@ -270,11 +381,16 @@ bool Syntax::IsBlock(char Begin, text &End)
 }
 
 
-Syntax *Syntax::HasSpecialSyntax(text Begin, text &End)
+Syntax *Syntax::HasSpecialSyntax(const text &Begin, text &End)
 // ----------------------------------------------------------------------------
 //   Returns a child syntax if any is applicable
 // ----------------------------------------------------------------------------
 {
+    // Most tokens do not begin a child syntax
+    const Entry *entry = Find(Begin);
+    if (!entry || !(entry->flags & SPECIAL))
+        return nullptr;
+
     // Find associated syntax file
     delimiter_table::iterator found = subsyntax_file.find(Begin);
     if (found == subsyntax_file.end())
@@ -296,6 +412,88 @@ Syntax *Syntax::HasSpecialSyntax(text Begin, text &End)
 }
 
 
+static void hashSyntax(ulonglong &h, const text &t)
+// ----------------------------------------------------------------------------
+//   FNV-1a hash of a text and its terminator for syntax fingerprints
+// ----------------------------------------------------------------------------
+{
+    for (char c : t)
+        h = (h ^ (unsigned char) c) * 1099511628211ULL;
+    h = (h ^ 0xFF) * 1099511628211ULL;
+}
+
+
+static void hashSyntax(ulonglong &h, const priority_table &table)
+// ----------------------------------------------------------------------------
+//   Hash the entries of a priority table
+// ----------------------------------------------------------------------------
+{
+    for (auto &entry : table)
+    {
+        hashSyntax(h, entry.first);
+        hashSyntax(h, std::to_string(entry.second));
+    }
+    hashSyntax(h, "");
+}
+
+
+static void hashSyntax(ulonglong &h, const delimiter_table &table)
+// ----------------------------------------------------------------------------
+//   Hash the entries of a delimiter table
+// ----------------------------------------------------------------------------
+{
+    for (auto &entry : table)
+    {
+        hashSyntax(h, entry.first);
+        hashSyntax(h, entry.second);
+    }
+    hashSyntax(h, "");
+}
+
+
+static void hashSyntax(ulonglong &h, const token_set &tokens)
+// ----------------------------------------------------------------------------
+//   Hash the entries of a token set
+// ----------------------------------------------------------------------------
+{
+    for (auto &token : tokens)
+        hashSyntax(h, token);
+    hashSyntax(h, "");
+}
+
+
+ulonglong Syntax::Fingerprint()
+// ----------------------------------------------------------------------------
+//   Hash all the tables, so that the same syntax gives the same fingerprint
+// ----------------------------------------------------------------------------
+{
+    ulonglong h = 14695981039346656037ULL;
+    hashSyntax(h, infix_priority);
+    hashSyntax(h, prefix_priority);
+    hashSyntax(h, postfix_priority);
+    hashSyntax(h, comment_delimiters);
+    hashSyntax(h, text_delimiters);
+    hashSyntax(h, block_delimiters);
+    hashSyntax(h, subsyntax_file);
+    hashSyntax(h, known_tokens);
+    hashSyntax(h, known_prefixes);
+    hashSyntax(h, known_binary_prefixes);
+    hashSyntax(h, std::to_string(default_priority));
+    hashSyntax(h, std::to_string(statement_priority));
+    hashSyntax(h, std::to_string(function_priority));
+    for (auto &child : subsyntax)
+    {
+        hashSyntax(h, child.first);
+        if (child.second)
+        {
+            hashSyntax(h, std::to_string(child.second->Fingerprint()));
+            hashSyntax(h, child.second->delimiters);
+        }
+    }
+    return h;
+}
+
+
 void Syntax::ReadSyntaxFile(Scanner &scanner, uint indents)
 // ----------------------------------------------------------------------------
 //   Parse the syntax description table
@@ -458,6 +656,9 @@ void Syntax::ReadSyntaxFile(Scanner &scanner, uint indents)
         default:
             break;
         }
+
+        // The scanner reading this may use the entries we just added
+        compiled = false;
     }
 }
 
@@ -469,8 +670,9 @@ void Syntax::ReadSyntaxFile (text filename, uint indents)
 {
     Syntax    baseSyntax;
     Positions basePositions;
+    Positions &positions = MAIN ? MAIN->positions : basePositions;
     Errors    errors;
-    Scanner   scanner(filename.c_str(), baseSyntax, basePositions, errors);
+    Scanner   scanner(filename.c_str(), baseSyntax, positions, errors);
     ReadSyntaxFile(scanner, indents);
 }
 
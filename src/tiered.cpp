@@ -0,0 +1,579 @@
+// *****************************************************************************
+// tiered.cpp                                                         XL project
+// *****************************************************************************
+//
+// File description:
+//
+//     Tiered evaluation, where rewrites start in the interpreter and
+//     are promoted to bytecode, then to machine code, as they get hot
+//
+//
+//
+//
+//
+//
+//
+// *****************************************************************************
+// This software is licensed under the GNU General Public License v3+
+// (C) 2020, Christophe de Dinechin <christophe@dinechin.org>
+// *****************************************************************************
+// This file is part of XL
+//
+// XL is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License,
+// or (at your option) any later version.
+//
+// XL is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with XL, in a file named COPYING.
+// If not, see <https://www.gnu.org/licenses/>.
+// *****************************************************************************
+
+#include "tiered.h"
+#include "errors.h"
+#include "runtime.h"
+#ifndef INTERPRETER_ONLY
+#include "compiler-fast.h"
+#endif // INTERPRETER_ONLY
+
+#include <iostream>
+#include <set>
+
+
+RECORDER(tiered, 64, "Tier transitions of hot rewrites");
+RECORDER(tiered_stats, 16, "Tiered evaluation statistics");
+RECORDER_TWEAK_DEFINE(tier_bytecode, 100,
+                      "Calls to a rewrite before bytecode, 0 to disable");
+RECORDER_TWEAK_DEFINE(tier_loops, 20,
+                      "Loop iterations in a rewrite before bytecode");
+RECORDER_TWEAK_DEFINE(tier_native, 10000,
+                      "Calls to a rewrite before machine code, 0 to disable");
+
+
+XL_BEGIN
+
+// ============================================================================
+//
+//    Hotness information attached to rewrites
+//
+// ============================================================================
+
+struct TierInfo : Info
+// ----------------------------------------------------------------------------
+//   Counters and current tier for a rewrite declaration
+// ----------------------------------------------------------------------------
+{
+    TierInfo(Infix *decl);
+    ~TierInfo();
+
+    Infix *             decl;           // Declaration this applies to
+    uint                calls;          // Calls from outside the body
+    uint                loops;          // Calls from the body (loop heads)
+    Tiered::tier_t      tier;           // Tier currently used for calls
+    bool                stuck;          // Failed to compile at next tier
+    bool                pending;        // Machine code not generated yet
+    Procedure *         code;           // Bytecode for the body
+    text                callee;         // Name for native calls, if any
+    std::set<Tree *>    body;           // Calls in the body of the rewrite
+
+    static std::set<TierInfo *> all;    // To invalidate compiled callers
+};
+
+
+static void loopHeads(Tree *tree, std::set<Tree *> &heads)
+// ----------------------------------------------------------------------------
+//   Collect the calls in a rewrite body, which may call the rewrite again
+// ----------------------------------------------------------------------------
+{
+    switch(tree->Kind())
+    {
+    case BLOCK:
+        loopHeads(((Block *) tree)->child, heads);
+        break;
+    case PREFIX:
+        heads.insert(tree);
+        loopHeads(((Prefix *) tree)->left, heads);
+        loopHeads(((Prefix *) tree)->right, heads);
+        break;
+    case POSTFIX:
+        heads.insert(tree);
+        loopHeads(((Postfix *) tree)->left, heads);
+        loopHeads(((Postfix *) tree)->right, heads);
+        break;
+    case INFIX:
+        heads.insert(tree);
+        loopHeads(((Infix *) tree)->left, heads);
+        loopHeads(((Infix *) tree)->right, heads);
+        break;
+    default:
+        break;
+    }
+}
+
+
+static bool naturalArgs(TreeList &args)
+// ----------------------------------------------------------------------------
+//   Check if the interpreter evaluated all arguments as naturals
+// ----------------------------------------------------------------------------
+//   Lazy arguments, e.g. the body of a loop, are passed as closures, which
+//   the bytecode does not evaluate with the same rules as the interpreter.
+//   The bytecode also does not select overloads for reals and texts yet.
+{
+    for (Tree *arg : args)
+        if (arg->Kind() != NATURAL)
+            return false;
+    return true;
+}
+
+
+static bool staysInterpreted(Context *locals, Tree *tree)
+// ----------------------------------------------------------------------------
+//   Check if code reads variables or declares local rewrites
+// ----------------------------------------------------------------------------
+//   The bytecode compiles the value that names bound outside of the
+//   parameters have at compile time, which is not valid once a variable
+//   was assigned. Local rewrites are not captured like in the interpreter.
+{
+    switch(tree->Kind())
+    {
+    case NAME:
+    {
+        Rewrite_p rw;
+        Scope_p   scope;
+        Tree     *value = locals->Bound(tree, true, &rw, &scope);
+        if (!value || scope == locals->Symbols())
+            return false;
+        if (!PatternBase(rw->left)->IsLeaf())
+            return false;
+        return !value->GetInfo<Opcode>();
+    }
+    case BLOCK:
+        return staysInterpreted(locals, ((Block *) tree)->child);
+    case PREFIX:
+        return staysInterpreted(locals, ((Prefix *) tree)->left) ||
+               staysInterpreted(locals, ((Prefix *) tree)->right);
+    case POSTFIX:
+        return staysInterpreted(locals, ((Postfix *) tree)->left) ||
+               staysInterpreted(locals, ((Postfix *) tree)->right);
+    case INFIX:
+        if (IsDefinition(tree))
+            return true;
+        return staysInterpreted(locals, ((Infix *) tree)->left) ||
+               staysInterpreted(locals, ((Infix *) tree)->right);
+    default:
+        return false;
+    }
+}
+
+
+TierInfo::TierInfo(Infix *decl)
+// ----------------------------------------------------------------------------
+//   Start interpreted, and record where the loop heads are
+// ----------------------------------------------------------------------------
+    : decl(decl), calls(0), loops(0), tier(Tiered::INTERPRETED),
+      stuck(false), pending(false), code(nullptr), callee(), body()
+{
+    loopHeads(decl->right, body);
+    all.insert(this);
+}
+
+
+TierInfo::~TierInfo()
+// ----------------------------------------------------------------------------
+//   Forget the info when the declaration goes away
+// ----------------------------------------------------------------------------
+{
+    all.erase(this);
+}
+
+
+std::set<TierInfo *> TierInfo::all;
+
+
+
+// ============================================================================
+//
+//    Tiered evaluator
+//
+// ============================================================================
+
+Tiered *  Tiered::tiered = nullptr;
+ulonglong Tiered::promoted[NATIVE+1] = { 0 };
+ulonglong Tiered::replaced = 0;
+ulonglong Tiered::failed = 0;
+ulonglong Tiered::background = 0;
+
+
+Tiered::Tiered(kstring compilerName, int argc, char **argv)
+// ----------------------------------------------------------------------------
+//   Constructor for the tiered evaluator
+// ----------------------------------------------------------------------------
+#ifndef INTERPRETER_ONLY
+    : compilerName(compilerName), argc(argc), argv(argv), compiler(nullptr)
+#endif // INTERPRETER_ONLY
+{
+    record(tiered, "Created tiered evaluator %p", this);
+    tiered = this;
+}
+
+
+Tiered::~Tiered()
+// ----------------------------------------------------------------------------
+//   Destructor for the tiered evaluator, show statistics if requested
+// ----------------------------------------------------------------------------
+{
+    IFTRACE(tiered_stats)
+        std::cerr << "Tiered promotions: "
+                  << promoted[BYTECODE] << " to bytecode, "
+                  << promoted[NATIVE] << " to native, "
+                  << replaced << " at loop heads, "
+                  << failed << " failed, "
+                  << background << " generated in background\n";
+#ifndef INTERPRETER_ONLY
+    IFTRACE(tiered_stats)
+        std::cerr << "Tiered recompilations: "
+                  << FastCompiler::recompiled << " with a branch profile, "
+                  << FastCompiler::switched << " switched to new code\n";
+    delete compiler;
+#endif // INTERPRETER_ONLY
+    if (tiered == this)
+        tiered = nullptr;
+    record(tiered, "Destroyed tiered evaluator %p", this);
+}
+
+
+Tree *Tiered::Evaluate(Scope *scope, Tree *source)
+// ----------------------------------------------------------------------------
+//   Everything starts in the interpreter
+// ----------------------------------------------------------------------------
+{
+    return interpreter.Evaluate(scope, source);
+}
+
+
+Tree *Tiered::TypeCheck(Scope *scope, Tree *type, Tree *value)
+// ----------------------------------------------------------------------------
+//   Type checks are done by the interpreter
+// ----------------------------------------------------------------------------
+{
+    return interpreter.TypeCheck(scope, type, value);
+}
+
+
+kstring Tiered::TierName(tier_t tier)
+// ----------------------------------------------------------------------------
+//   Name of a tier for the recorder
+// ----------------------------------------------------------------------------
+{
+    switch(tier)
+    {
+    case INTERPRETED:   return "interpreter";
+    case BYTECODE:      return "bytecode";
+    case NATIVE:        return "native";
+    }
+    return "unknown";
+}
+
+
+Tree *Tiered::Call(Scope *evalScope, Scope *declScope,
+                   Tree *self, Infix *decl, Context *locals,
+                   TreeList &args, TreeList &parms, Tree *type)
+// ----------------------------------------------------------------------------
+//   Count a call to a rewrite, and run it in the tier it reached
+// ----------------------------------------------------------------------------
+//   Returns nullptr to let the interpreter evaluate the body
+{
+    TierInfo *info = decl->GetInfo<TierInfo>();
+    if (!info)
+    {
+        info = new TierInfo(decl);
+        decl->SetInfo<TierInfo>(info);
+    }
+    bool loop = info->body.count(self);
+    if (loop)
+        info->loops++;
+    else
+        info->calls++;
+
+    // Only calls with evaluated arguments leave the interpreter
+    if (info->tier == INTERPRETED && !naturalArgs(args))
+        return nullptr;
+
+#ifndef INTERPRETER_ONLY
+    // Switch to the machine code once it was generated
+    if (info->pending && naturalArgs(args))
+        Patch(info, declScope, args, loop);
+#endif // INTERPRETER_ONLY
+
+    // Check if we reached the threshold for the next tier
+    if (!info->stuck && !info->pending)
+    {
+        uint hot = info->calls + info->loops;
+        uint toBytecode = RECORDER_TWEAK(tier_bytecode);
+        uint toNative = RECORDER_TWEAK(tier_native);
+        bool promote = false;
+        if (info->tier == INTERPRETED)
+            promote = toBytecode && (hot >= toBytecode ||
+                                     info->loops >= RECORDER_TWEAK(tier_loops));
+        else if (info->tier == BYTECODE)
+            promote = toNative && hot >= toNative && naturalArgs(args) &&
+                info->callee.empty();
+        if (promote)
+        {
+            tier_t from = info->tier;
+            if (!Promote(info, declScope, locals, args, parms, type))
+            {
+                failed++;
+                info->stuck = true;
+                record(tiered, "Failed to promote %t from %+s",
+                       decl->left, TierName(from));
+            }
+            else if (info->pending)
+            {
+                record(tiered, "Generating machine code for %t "
+                       "after %u calls and %u loops",
+                       decl->left, info->calls, info->loops);
+            }
+            else
+            {
+                promoted[info->tier]++;
+                if (loop)
+                    replaced++;
+                record(tiered, "Promoted %t from %+s to %+s "
+                       "after %u calls and %u loops%+s",
+                       decl->left, TierName(from), TierName(info->tier),
+                       info->calls, info->loops,
+                       loop ? " at loop head" : "");
+            }
+        }
+    }
+
+    switch(info->tier)
+    {
+    case INTERPRETED:
+        break;
+    case NATIVE:
+#ifndef INTERPRETER_ONLY
+        if (Tree *result = RunNative(info, declScope, args))
+            return result;
+#endif // INTERPRETER_ONLY
+        // Fall through if the arguments do not suit machine code
+    case BYTECODE:
+        if (naturalArgs(args))
+            return RunBytecode(info, evalScope, self, args);
+        break;
+    }
+    return nullptr;
+}
+
+
+void Tiered::Invalidate(Infix *decl)
+// ----------------------------------------------------------------------------
+//   Drop the code compiled for the previous body of a declaration
+// ----------------------------------------------------------------------------
+//   Bytecode resolves the rewrites it calls when it is compiled, so the
+//   code of every promoted declaration may still call the previous body,
+//   and all of them start again from the interpreter.
+//   The infos are reset rather than deleted, since a caller may use them.
+//   The fast compiler caches machine code by callee name, so a declaration
+//   that was already sent to the native tier stays in bytecode from now on.
+{
+    for (TierInfo *info : TierInfo::all)
+    {
+        if (info->decl != decl && info->tier == INTERPRETED && !info->pending)
+            continue;
+        record(tiered, "Invalidated %t in %+s for %t",
+               info->decl->left, TierName(info->tier), decl->left);
+        info->calls = 0;
+        info->loops = 0;
+        info->tier = INTERPRETED;
+        info->stuck = false;
+        info->pending = false;
+        info->code = nullptr;
+        if (info->decl == decl)
+        {
+            info->body.clear();
+            loopHeads(decl->right, info->body);
+        }
+    }
+}
+
+
+bool Tiered::Promote(TierInfo *info, Scope *declScope, Context *locals,
+                     TreeList &args, TreeList &parms, Tree *type)
+// ----------------------------------------------------------------------------
+//   Compile the rewrite for the next tier
+// ----------------------------------------------------------------------------
+{
+    Infix *decl = info->decl;
+    if (args.size() != parms.size())
+        return false;
+
+    if (info->tier == INTERPRETED)
+    {
+        if (staysInterpreted(locals, decl->right))
+            return false;
+
+        // Compile the body with the bound parameters as inputs
+        TreeIDs parmIDs;
+        uint count = parms.size();
+        for (uint p = 0; p < count; p++)
+            parmIDs[parms[p]] = ~int(p);
+        if (type == tree_type)
+            type = nullptr;
+
+        // Compilation errors are reported by the interpreter if we stay there
+        Errors     errors;
+        TreeList   captured;
+        Procedure *proc = Bytecode::Compile(locals, decl->right, type,
+                                            parmIDs, captured);
+        if (errors.Swallowed() || !proc)
+            return false;
+
+        // Values captured from the first caller would not be valid later
+        if (captured.size() || proc->Inputs() != count)
+            return false;
+
+        info->code = proc;
+        info->tier = BYTECODE;
+        return true;
+    }
+
+#ifndef INTERPRETER_ONLY
+    if (info->tier == BYTECODE)
+    {
+        // We can only rebuild calls like 'foo X, Y' for the fast compiler
+        Prefix *pattern = PatternBase(decl->left)->AsPrefix();
+        if (!pattern)
+            return false;
+        Name *name = pattern->left->AsName();
+        if (!name)
+            return false;
+        uint count = 0;
+        Tree *list = pattern->right;
+        while (Block *block = list->AsBlock())
+            list = block->child;
+        while (list)
+        {
+            Tree *item = list;
+            Infix *comma = list->AsInfix();
+            if (comma && comma->name == ",")
+            {
+                item = comma->left;
+                list = comma->right;
+            }
+            else
+            {
+                list = nullptr;
+            }
+            if (Infix *typed = item->AsInfix())
+                if (typed->name == ":")
+                    item = typed->left;
+            if (!item->AsName())
+                return false;
+            count++;
+        }
+        if (count != args.size())
+            return false;
+
+        // Create the compiler only when something gets that hot
+        if (!compiler)
+            compiler = new FastCompiler(compilerName.c_str(), 1, argc, argv);
+        info->callee = name->value;
+
+        // Keep running the bytecode while the machine code is generated
+        switch(compiler->CompileCallLater(declScope, info->callee, args))
+        {
+        case FastCompiler::CALL_FAILED:
+            return false;
+        case FastCompiler::CALL_PENDING:
+            info->pending = true;
+            background++;
+            return true;
+        case FastCompiler::CALL_READY:
+            info->tier = NATIVE;
+            return true;
+        }
+    }
+#endif // INTERPRETER_ONLY
+
+    return false;
+}
+
+
+Tree *Tiered::RunBytecode(TierInfo *info, Scope *evalScope,
+                          Tree *self, TreeList &args)
+// ----------------------------------------------------------------------------
+//   Run the bytecode for the body with the arguments bound by interpreter
+// ----------------------------------------------------------------------------
+{
+    TreeList frame(args.rbegin(), args.rend());
+    uint size = frame.size();
+    frame.push_back(self);
+    frame.push_back(evalScope);
+    Data data = &frame[size];
+    info->code->Run(data);
+    return DataResult(data);
+}
+
+
+#ifndef INTERPRETER_ONLY
+Tree *Tiered::RunNative(TierInfo *info, Scope *declScope, TreeList &args)
+// ----------------------------------------------------------------------------
+//   Run a compiled call if all arguments are constants
+// ----------------------------------------------------------------------------
+//   The fast compiler caches the code for each kind of arguments
+{
+    if (!naturalArgs(args))
+        return nullptr;
+
+    Tree *result = compiler->CompileCall(declScope, info->callee, args,
+                                         true, true);
+    if (!result)
+    {
+        // Stay with the bytecode for these arguments from now on
+        record(tiered, "Native call to %t failed, back to bytecode",
+               info->decl->left);
+        info->tier = BYTECODE;
+        info->stuck = true;
+        failed++;
+    }
+    return result;
+}
+
+
+void Tiered::Patch(TierInfo *info, Scope *declScope, TreeList &args, bool loop)
+// ----------------------------------------------------------------------------
+//   Switch calls to the machine code once it was generated in the background
+// ----------------------------------------------------------------------------
+{
+    switch(compiler->CompileCallLater(declScope, info->callee, args))
+    {
+    case FastCompiler::CALL_PENDING:
+        return;
+    case FastCompiler::CALL_FAILED:
+        failed++;
+        info->stuck = true;
+        record(tiered, "Failed to generate machine code for %t",
+               info->decl->left);
+        break;
+    case FastCompiler::CALL_READY:
+        info->tier = NATIVE;
+        promoted[NATIVE]++;
+        if (loop)
+            replaced++;
+        record(tiered, "Promoted %t to native after %u calls and %u loops%+s",
+               info->decl->left, info->calls, info->loops,
+               loop ? " at loop head" : "");
+        break;
+    }
+    info->pending = false;
+}
+#endif // INTERPRETER_ONLY
+
+XL_END